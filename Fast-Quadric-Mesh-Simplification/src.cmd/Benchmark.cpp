@@ -0,0 +1,511 @@
+// Benchmark and quality harness for Simplify.h
+//
+// Simplifies a fixed corpus - test_out.obj of this repository plus generated
+// meshes - and reports per phase timings, collapse rate, peak RSS and the
+// symmetric Hausdorff distance to the input as JSON, for regression tracking.
+// A mesh without UV seams has to stay without, else the benchmark fails.
+// Every mesh is simplified in a child process of its own ( the benchmark
+// runs itself with -mesh= ), so the peak RSS belongs to that mesh alone.
+//
+//To compile for Linux/OSX (GCC/LLVM)
+//  g++ Benchmark.cpp -O3 -o benchmark
+//To compile for Windows (Visual Studio)
+// cl /EHsc /O2 Benchmark.cpp /obenchmark
+// or build Simplify.Benchmark of solution.sln ( benchmark_project.vcxproj )
+//To execute ( from src.cmd )
+//  ./benchmark -ratio=0.1 -json=results.json
+//  ./benchmark -ratio=0.1 a.obj b.obj      ( a.obj, b.obj replace test_out.obj )
+//
+
+#include "Simplify.h"
+#include <stdio.h>
+#include <string>
+#include <limits.h>
+#if defined(_WIN64) || defined(_WIN32)
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#endif
+
+struct BenchMesh
+{
+	std::vector<vec3f> p;
+	std::vector<int> t; // 3 per triangle
+	std::vector<double> uv; // 2 per vertex, optional
+};
+
+// Peak resident set size of the process in KB, since it started
+
+long peak_rss_kb()
+{
+#if defined(_WIN64) || defined(_WIN32)
+	PROCESS_MEMORY_COUNTERS pmc;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+		return (long)(pmc.PeakWorkingSetSize / 1024);
+	return 0;
+#else
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+	return usage.ru_maxrss / 1024; // bytes on OSX
+#else
+	return usage.ru_maxrss;
+#endif
+#endif
+}
+
+//
+// Generated corpus
+//
+
+void add_quad(BenchMesh &m, int a, int b, int c, int d)
+{
+	int q[6] = { a, b, c, a, c, d };
+	m.t.insert(m.t.end(), q, q + 6);
+}
+
+// Parametric (u,v) patch, wrap_u / wrap_v close the surface in that direction
+
+template<class F> BenchMesh make_patch(int nu, int nv, bool wrap_u, bool wrap_v, F f)
+{
+	BenchMesh m;
+	int cu = wrap_u ? nu : nu + 1, cv = wrap_v ? nv : nv + 1;
+	loopj(0, cv) loopi(0, cu) m.p.push_back(f(double(i) / nu, double(j) / nv));
+	loopj(0, nv) loopi(0, nu)
+	{
+		int i1 = (i + 1) % cu, j1 = (j + 1) % cv;
+		add_quad(m, j*cu + i, j*cu + i1, j1*cu + i1, j1*cu + i);
+	}
+	return m;
+}
+
+BenchMesh make_sphere(int n)
+{
+	// cube projected to the sphere, 6 welded faces of n x n quads
+	BenchMesh m;
+	loopk(0, 6)
+	{
+		int ax = k % 3;
+		double s = k < 3 ? 1 : -1;
+		int base = m.p.size();
+		loopj(0, n + 1) loopi(0, n + 1)
+		{
+			double c[3];
+			c[ax] = s;
+			c[(ax + 1) % 3] = (2.0*i / n - 1) * s;
+			c[(ax + 2) % 3] = 2.0*j / n - 1;
+			vec3f p(c[0], c[1], c[2]);
+			p.normalize();
+			m.p.push_back(p);
+		}
+		loopj(0, n) loopi(0, n)
+			add_quad(m, base + j*(n + 1) + i, base + j*(n + 1) + i + 1, base + (j + 1)*(n + 1) + i + 1, base + (j + 1)*(n + 1) + i);
+	}
+	return m;
+}
+
+// Texture coordinates of a patch that does not wrap : the (u,v) grid itself
+
+BenchMesh with_uv(BenchMesh m, int nu, int nv)
+{
+	loopi(0, m.p.size())
+	{
+		m.uv.push_back(double(i % (nu + 1)) / nu);
+		m.uv.push_back(double(i / (nu + 1)) / nv);
+	}
+	return m;
+}
+
+struct Torus
+{
+	vec3f operator()(double u, double v) const
+	{
+		double a = u * 6.28318530717959, b = v * 6.28318530717959;
+		double r = 1 + 0.35*cos(b) + 0.05*sin(9 * a);
+		return vec3f(r*cos(a), r*sin(a), 0.35*sin(b));
+	}
+};
+
+struct Terrain
+{
+	vec3f operator()(double u, double v) const
+	{
+		double h = 0.15*sin(u * 13)*cos(v * 11) + 0.05*sin(u * 57 + v * 31) + 0.01*sin(u * 231)*sin(v * 197);
+		return vec3f(u, v, h);
+	}
+};
+
+bool write_bench_obj(const char *filename, const BenchMesh &m)
+{
+	FILE *file = fopen(filename, "w");
+	if (!file) return false;
+	loopi(0, m.p.size()) fprintf(file, "v %.9g %.9g %.9g\n", m.p[i].x, m.p[i].y, m.p[i].z);
+	for (size_t i = 0; i < m.uv.size(); i += 2) fprintf(file, "vt %.9g %.9g\n", m.uv[i], m.uv[i + 1]);
+	for (size_t i = 0; i < m.t.size(); i += 3)
+		if (m.uv.empty()) fprintf(file, "f %d %d %d\n", m.t[i] + 1, m.t[i + 1] + 1, m.t[i + 2] + 1);
+		else fprintf(file, "f %d/%d %d/%d %d/%d\n", m.t[i] + 1, m.t[i] + 1, m.t[i + 1] + 1, m.t[i + 1] + 1, m.t[i + 2] + 1, m.t[i + 2] + 1);
+	fclose(file);
+	return true;
+}
+
+//
+// Symmetric Hausdorff distance, sampled at vertices and triangle centers
+//
+
+vec3f closest_on_triangle(const vec3f &p, const vec3f &a, const vec3f &b, const vec3f &c)
+{
+	vec3f ab = b - a, ac = c - a, ap = p - a;
+	double d1 = ab.dot(ap), d2 = ac.dot(ap);
+	if (d1 <= 0 && d2 <= 0) return a;
+	vec3f bp = p - b;
+	double d3 = ab.dot(bp), d4 = ac.dot(bp);
+	if (d3 >= 0 && d4 <= d3) return b;
+	double vc = d1*d4 - d3*d2;
+	if (vc <= 0 && d1 >= 0 && d3 <= 0) return a + ab*(d1 / (d1 - d3));
+	vec3f cp = p - c;
+	double d5 = ab.dot(cp), d6 = ac.dot(cp);
+	if (d6 >= 0 && d5 <= d6) return c;
+	double vb = d5*d2 - d1*d6;
+	if (vb <= 0 && d2 >= 0 && d6 <= 0) return a + ac*(d2 / (d2 - d6));
+	double va = d3*d6 - d5*d4;
+	if (va <= 0 && (d4 - d3) >= 0 && (d5 - d6) >= 0) return b + (c - b)*((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+	double denom = 1.0 / (va + vb + vc);
+	return a + ab*(vb*denom) + ac*(vc*denom);
+}
+
+// Uniform grid of triangles for nearest surface point queries
+
+class SurfaceGrid
+{
+public:
+	SurfaceGrid(const BenchMesh &mesh, vec3f bmin, vec3f bmax) : m(mesh), lo(bmin)
+	{
+		int count = m.t.size() / 3;
+		vec3f e = bmax - bmin;
+		double extent = fmax(fmax(e.x, e.y), fmax(e.z, 1e-12));
+		cell = extent / fmax(1.0, cbrt(double(count)) * 2);
+		n[0] = int(e.x / cell) + 1; n[1] = int(e.y / cell) + 1; n[2] = int(e.z / cell) + 1;
+		start.assign(n[0] * n[1] * n[2] + 1, 0);
+		stamp.assign(count, -1);
+		query = 0;
+		// two passes : count, then fill
+		loopk(0, 2)
+		{
+			std::vector<int> fill(start.begin(), start.end() - 1);
+			loopi(0, count)
+			{
+				int c0[3], c1[3];
+				bounds(i, c0, c1);
+				for (int z = c0[2]; z <= c1[2]; z++) for (int y = c0[1]; y <= c1[1]; y++) for (int x = c0[0]; x <= c1[0]; x++)
+				{
+					int id = (z*n[1] + y)*n[0] + x;
+					if (k == 0) start[id + 1]++; else items[fill[id]++] = i;
+				}
+			}
+			if (k == 0)
+			{
+				loopi(0, start.size() - 1) start[i + 1] += start[i];
+				items.resize(start.back());
+			}
+		}
+	}
+
+	// squared distance from p to the surface
+	double distance2(const vec3f &p)
+	{
+		int c[3];
+		cell_of(p, c);
+		double best = DBL_MAX;
+		query++;
+		for (int r = 0; r < n[0] + n[1] + n[2]; r++)
+		{
+			for (int z = c[2] - r; z <= c[2] + r; z++) for (int y = c[1] - r; y <= c[1] + r; y++) for (int x = c[0] - r; x <= c[0] + r; x++)
+			{
+				if (abs(z - c[2]) != r && abs(y - c[1]) != r && abs(x - c[0]) != r) continue; // shell only
+				if (x < 0 || y < 0 || z < 0 || x >= n[0] || y >= n[1] || z >= n[2]) continue;
+				int id = (z*n[1] + y)*n[0] + x;
+				for (int i = start[id]; i < start[id + 1]; i++)
+				{
+					int tri = items[i];
+					if (stamp[tri] == query) continue;
+					stamp[tri] = query;
+					vec3f q = closest_on_triangle(p, m.p[m.t[tri * 3]], m.p[m.t[tri * 3 + 1]], m.p[m.t[tri * 3 + 2]]) - p;
+					best = fmin(best, q.dot(q));
+				}
+			}
+			// cells beyond shell r are at least r cells away
+			if (best <= (r*cell)*(r*cell)) break;
+		}
+		return best;
+	}
+
+private:
+	const BenchMesh &m;
+	vec3f lo;
+	double cell;
+	int n[3], query;
+	std::vector<int> start, items, stamp;
+
+	void cell_of(const vec3f &p, int c[3])
+	{
+		double v[3] = { (p.x - lo.x) / cell, (p.y - lo.y) / cell, (p.z - lo.z) / cell };
+		loopi(0, 3) c[i] = v[i] < 0 ? 0 : v[i] >= n[i] ? n[i] - 1 : int(v[i]);
+	}
+
+	void bounds(int tri, int c0[3], int c1[3])
+	{
+		loopi(0, 3) { c0[i] = INT_MAX; c1[i] = -1; }
+		loopj(0, 3)
+		{
+			int c[3];
+			cell_of(m.p[m.t[tri * 3 + j]], c);
+			loopi(0, 3) { c0[i] = std::min(c0[i], c[i]); c1[i] = std::max(c1[i], c[i]); }
+		}
+	}
+};
+
+// one sided : max and sum of squared distances of the samples of a to b
+void sample_distance(const BenchMesh &a, SurfaceGrid &b, double &max2, double &sum2, int &samples)
+{
+	loopi(0, a.p.size())
+	{
+		double d = b.distance2(a.p[i]);
+		max2 = fmax(max2, d); sum2 += d; samples++;
+	}
+	for (size_t i = 0; i < a.t.size(); i += 3)
+	{
+		vec3f c = (a.p[a.t[i]] + a.p[a.t[i + 1]] + a.p[a.t[i + 2]]) / 3.0;
+		double d = b.distance2(c);
+		max2 = fmax(max2, d); sum2 += d; samples++;
+	}
+}
+
+void hausdorff(const BenchMesh &a, const BenchMesh &b, double &max_distance, double &rms_distance)
+{
+	vec3f lo = a.p[0], hi = a.p[0];
+	loopk(0, 2)
+	{
+		const BenchMesh &m = k ? b : a;
+		loopi(0, m.p.size())
+		{
+			lo = vec3f(fmin(lo.x, m.p[i].x), fmin(lo.y, m.p[i].y), fmin(lo.z, m.p[i].z));
+			hi = vec3f(fmax(hi.x, m.p[i].x), fmax(hi.y, m.p[i].y), fmax(hi.z, m.p[i].z));
+		}
+	}
+	SurfaceGrid ga(a, lo, hi), gb(b, lo, hi);
+	double max2 = 0, sum2 = 0;
+	int samples = 0;
+	sample_distance(a, gb, max2, sum2, samples);
+	sample_distance(b, ga, max2, sum2, samples);
+	max_distance = sqrt(max2);
+	rms_distance = samples ? sqrt(sum2 / samples) : 0;
+}
+
+//
+// One corpus entry
+//
+
+BenchMesh current_mesh()
+{
+	BenchMesh m;
+	loopi(0, Simplify::vertices.size()) m.p.push_back(Simplify::vertices[i].p);
+	loopi(0, Simplify::triangles.size()) if (!Simplify::triangles[i].deleted)
+		loopj(0, 3) m.t.push_back(Simplify::triangles[i].v[j]);
+	return m;
+}
+
+// Vertices whose corners do not all have the same attributes
+
+int seam_vertices()
+{
+	if (Simplify::corner_wedges.empty()) return 0;
+	std::vector<int> wedge(Simplify::vertices.size(), -1);
+	int seams = 0;
+	loopi(0, Simplify::triangles.size()) if (!Simplify::triangles[i].deleted) loopj(0, 3)
+	{
+		Simplify::Triangle &t = Simplify::triangles[i];
+		int &w = wedge[t.v[j]], c = Simplify::corner_wedges[t.id * 3 + j];
+		if (w == -1) w = c;
+		else if (w >= 0 && memcmp(&Simplify::wedges[w], &Simplify::wedges[c], sizeof(Simplify::Wedge)) != 0)
+		{
+			w = -2; // counted
+			seams++;
+		}
+	}
+	return seams;
+}
+
+bool run(const char *name, const char *filename, double ratio, double agressiveness, FILE *json)
+{
+	double start = Simplify::seconds();
+	Simplify::load_obj(filename);
+	double load = Simplify::seconds() - start;
+	if (Simplify::triangles.size() < 4)
+	{
+		printf("%s: unable to load %s\n", name, filename);
+		return false;
+	}
+	start = Simplify::seconds();
+	int welded = Simplify::weld_vertices(0);
+	double weld = Simplify::seconds() - start;
+	BenchMesh input = current_mesh();
+	int input_seams = seam_vertices();
+	int input_triangles = Simplify::triangles.size();
+	int target_count = round(input_triangles * ratio);
+
+	start = Simplify::seconds();
+	Simplify::simplify_mesh(target_count, agressiveness, false);
+	double simplify = Simplify::seconds() - start;
+
+	std::string output = std::string(filename) + ".bench.obj";
+	start = Simplify::seconds();
+	Simplify::write_obj(output.c_str());
+	double write = Simplify::seconds() - start;
+	remove(output.c_str());
+
+	BenchMesh result = current_mesh();
+	double max_distance = 0, rms_distance = 0;
+	start = Simplify::seconds();
+	hausdorff(input, result, max_distance, rms_distance);
+	double measure = Simplify::seconds() - start;
+	vec3f lo = input.p[0], hi = input.p[0];
+	loopi(0, input.p.size())
+	{
+		lo = vec3f(fmin(lo.x, input.p[i].x), fmin(lo.y, input.p[i].y), fmin(lo.z, input.p[i].z));
+		hi = vec3f(fmax(hi.x, input.p[i].x), fmax(hi.y, input.p[i].y), fmax(hi.z, input.p[i].z));
+	}
+	double diagonal = (hi - lo).length();
+	int collapsed = input_triangles - (int)Simplify::triangles.size();
+	int output_seams = seam_vertices();
+	long rss = peak_rss_kb();
+
+	printf("%-10s %8d -> %8zu tris  load %.3fs  simplify %.3fs  %.0f tris/s  hausdorff %.3g (%.3g%% of diagonal)  rss %ld KB\n",
+		name, input_triangles, Simplify::triangles.size(), load, simplify, simplify > 0 ? collapsed / simplify : 0.0,
+		max_distance, diagonal > 0 ? 100 * max_distance / diagonal : 0.0, rss);
+	bool torn = input_seams == 0 && output_seams > 0;
+	if (torn) printf("%s: %d seam vertices in a seamless input\n", name, output_seams);
+
+	if (!json) return !torn;
+	fprintf(json, "    {\n");
+	fprintf(json, "      \"name\": \"%s\",\n", name);
+	fprintf(json, "      \"input_vertices\": %zu, \"input_triangles\": %d, \"welded_vertices\": %d,\n", input.p.size(), input_triangles, welded);
+	fprintf(json, "      \"seam_vertices\": %d, \"output_seam_vertices\": %d,\n", input_seams, output_seams);
+	fprintf(json, "      \"target_triangles\": %d, \"output_vertices\": %zu, \"output_triangles\": %zu,\n", target_count, Simplify::vertices.size(), Simplify::triangles.size());
+	fprintf(json, "      \"load_s\": %.6f, \"weld_s\": %.6f, \"init_s\": %.6f, \"compact_s\": %.6f, \"write_s\": %.6f,\n",
+		load, weld, Simplify::stats.init, Simplify::stats.compact, write);
+	fprintf(json, "      \"iterations\": [");
+	loopi(0, Simplify::stats.iteration_time.size())
+		fprintf(json, "%s{\"time_s\": %.6f, \"triangles\": %d}", i ? ", " : "", Simplify::stats.iteration_time[i], Simplify::stats.iteration_triangles[i]);
+	fprintf(json, "],\n");
+	fprintf(json, "      \"simplify_s\": %.6f, \"collapsed_triangles_per_s\": %.1f, \"peak_rss_kb\": %ld,\n",
+		simplify, simplify > 0 ? collapsed / simplify : 0.0, rss);
+	fprintf(json, "      \"hausdorff\": %.9g, \"rms_distance\": %.9g, \"bbox_diagonal\": %.9g, \"measure_s\": %.6f\n",
+		max_distance, rms_distance, diagonal, measure);
+	fprintf(json, "    }");
+	return !torn;
+}
+
+// Run one mesh in a child process, which writes its JSON entry to fragment
+
+bool run_child(const char *self, const std::string &name, const std::string &filename, double ratio, double agressiveness, const std::string &fragment)
+{
+	char options[256];
+	snprintf(options, sizeof(options), " -ratio=%.17g -agressiveness=%.17g", ratio, agressiveness);
+	std::string command = "\"" + std::string(self) + "\"" + options + " \"-mesh=" + name + "\" \"-json=" + fragment + "\" \"" + filename + "\"";
+#if defined(_WIN64) || defined(_WIN32)
+	command = "\"" + command + "\""; // cmd strips the outer quotes
+#endif
+	fflush(stdout);
+	return system(command.c_str()) == 0;
+}
+
+// Append the contents of a file to json
+
+bool append_file(FILE *json, const std::string &filename)
+{
+	FILE *file = fopen(filename.c_str(), "r");
+	if (!file) return false;
+	char buffer[4096];
+	size_t count;
+	while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0) fwrite(buffer, 1, count, json);
+	fclose(file);
+	return true;
+}
+
+int main(int argc, const char * argv[]) {
+	double ratio = 0.1, agressiveness = 7.0;
+	const char *json_name = NULL, *mesh_name = NULL;
+	std::vector<std::string> names, files;
+	for (int i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "-ratio=", 7) == 0) ratio = atof(argv[i] + 7);
+		else if (strncmp(argv[i], "-agressiveness=", 15) == 0) agressiveness = atof(argv[i] + 15);
+		else if (strncmp(argv[i], "-json=", 6) == 0) json_name = argv[i] + 6;
+		else if (strncmp(argv[i], "-mesh=", 6) == 0) mesh_name = argv[i] + 6;
+		else { names.push_back(argv[i]); files.push_back(argv[i]); }
+	}
+	if ((ratio <= 0.0) || (ratio >= 1.0)) {
+		printf("Ratio must be BETWEEN zero and one.\n");
+		return EXIT_FAILURE;
+	}
+	if (mesh_name) {
+		// child : one mesh, its JSON entry only
+		if (files.size() != 1) return EXIT_FAILURE;
+		FILE *json = json_name ? fopen(json_name, "w") : NULL;
+		bool ok = run(mesh_name, files[0].c_str(), ratio, agressiveness, json);
+		if (json) fclose(json);
+		return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+	if (files.empty()) {
+		names.push_back("test_out");
+		files.push_back("../test_out.obj");
+	}
+
+	// generated corpus, written to disk so loading is timed as well
+	std::vector<std::string> generated;
+	struct { const char *name; BenchMesh mesh; } corpus[] = {
+		{ "sphere", make_sphere(128) },
+		{ "torus", make_patch(512, 128, true, true, Torus()) },
+		{ "terrain", make_patch(400, 400, false, false, Terrain()) },
+		{ "uvgrid", with_uv(make_patch(200, 200, false, false, Terrain()), 200, 200) },
+	};
+	loopi(0, sizeof(corpus) / sizeof(corpus[0])) {
+		std::string filename = std::string("bench_") + corpus[i].name + ".obj";
+		if (!write_bench_obj(filename.c_str(), corpus[i].mesh)) {
+			printf("benchmark: can't write data file \"%s\".\n", filename.c_str());
+			return EXIT_FAILURE;
+		}
+		names.push_back(corpus[i].name);
+		files.push_back(filename);
+		generated.push_back(filename);
+		corpus[i].mesh = BenchMesh();
+	}
+
+	FILE *json = NULL;
+	if (json_name) {
+		json = fopen(json_name, "w");
+		if (!json) {
+			printf("benchmark: can't write data file \"%s\".\n", json_name);
+			return EXIT_FAILURE;
+		}
+		fprintf(json, "{\n  \"ratio\": %g, \"agressiveness\": %g, \"qfloat_bytes\": %zu,\n  \"meshes\": [", ratio, agressiveness, sizeof(qfloat));
+	}
+	bool ok = true, first = true;
+	std::string fragment = std::string("bench_fragment.json");
+	loopi(0, files.size()) {
+		remove(fragment.c_str());
+		if (!run_child(argv[0], names[i], files[i], ratio, agressiveness, fragment)) { ok = false; continue; }
+		if (!json) continue;
+		fprintf(json, "%s\n", first ? "" : ",");
+		append_file(json, fragment);
+		first = false;
+	}
+	remove(fragment.c_str());
+	if (json) {
+		fprintf(json, "\n  ]\n}\n");
+		fclose(json);
+	}
+	loopi(0, generated.size()) remove(generated[i].c_str());
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
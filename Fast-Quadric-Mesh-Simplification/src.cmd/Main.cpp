@@ -5,6 +5,7 @@
 // https://github.com/sp4cerat/Fast-Quadric-Mesh-Simplification
 //To compile for Linux/OSX (GCC/LLVM)
 //  g++ Main.cpp -O3 -o simplify
+//  optional: -DSIMPLIFY_FLOAT for float quadrics, -fopenmp for parallel vertex welding
 //To compile for Windows (Visual Studio)
 // vcvarsall amd64
 // cl /EHsc Main.cpp /osimplify
@@ -15,17 +16,30 @@
 // https://github.com/neurolabusc/Fast-Quadric-Mesh-Simplification-Pascal-
 //
 
-#include "Simplify.h"
+#include "OutOfCore.h"
+#include "MeshOptimize.h"
 #include <stdio.h>
 #include <time.h>  // clock_t, clock, CLOCKS_PER_SEC
 
 void showHelp(const char * argv[]) {
     const char *cstr = (argv[0]);
-    printf("Usage: %s <input> <output> <ratio> <agressiveness)\n", cstr);
+    printf("Usage: %s <input> <output> <ratio> <agressiveness> <memoryMB>\n", cstr);
     printf(" Input: name of existing OBJ format mesh\n");
     printf(" Output: name for decimated OBJ format mesh\n");
     printf(" Ratio: (default = 0.5) for example 0.2 will decimate 80%% of triangles\n");
+    printf("        a comma separated list (e.g. 0.5,0.25,0.1) writes one LOD per ratio\n");
+    printf("        to <output>_lod0.obj, <output>_lod1.obj, ... in a single run\n");
     printf(" Agressiveness: (default = 7.0) faster or better decimation\n");
+    printf(" MemoryMB: (optional) simplify out-of-core, streaming the input in blocks\n");
+    printf("        that fit this budget, for meshes larger than main memory\n");
+    printf(" An output name ending in .pm stores a progressive mesh: the decimated\n");
+    printf(" base mesh plus the vertex splits to refine it back to the input\n");
+    printf(" An output name ending in .meshlets stores 64 vertex / 124 triangle clusters\n");
+    printf(" with bounding spheres and normal cones, ready to be memory mapped\n");
+    printf(" -weld=<epsilon>: (default = off) merge vertices closer than epsilon after\n");
+    printf("        loading, -weld=0 merges exact duplicates\n");
+    printf(" -optimize: reorder the output for the vertex cache and vertex fetch\n");
+    printf(" -overdraw: as -optimize, also sort triangle clusters to reduce overdraw\n");
     printf("Examples :\n");
 #if defined(_WIN64) || defined(_WIN32)
     printf("  %s c:\\dir\\in.obj c:\\dir\\out.obj 0.2\n", cstr);
@@ -34,15 +48,93 @@ void showHelp(const char * argv[]) {
 #endif
 } //showHelp()
 
+// Reorder for rendering, report cache efficiency before and after
+void optimizeMesh(std::vector<Simplify::Triangle> &triangles, std::vector<Simplify::Vertex> &vertices, bool overdraw) {
+	double acmr = Simplify::acmr(triangles, vertices), atvr = Simplify::atvr(triangles, vertices);
+	Simplify::optimize_mesh(triangles, vertices, overdraw);
+	printf("Vertex cache: ACMR %.3f -> %.3f, ATVR %.3f -> %.3f%s\n", acmr, Simplify::acmr(triangles, vertices),
+		atvr, Simplify::atvr(triangles, vertices), overdraw ? " (overdraw sorted)" : "");
+}
+
+// LOD chain : "0.5,0.25,0.1" -> simplify once, write <output>_lod<n>.obj per ratio
+int simplifyLods(const char * ratioList, const char * output, double agressiveness, bool optimize, bool overdraw) {
+	std::vector<double> ratios;
+	const char *str = ratioList;
+	while (*str) {
+		double ratio = atof(str);
+		if ((ratio <= 0.0) || (ratio > 1.0)) {
+			printf("Ratios must be BETWEEN zero and one.\n");
+			return EXIT_FAILURE;
+		}
+		ratios.push_back(ratio);
+		str = strchr(str, ',');
+		if (!str) break;
+		str++;
+	}
+	char pattern[1024];
+	int len = strlen(output);
+	if ((len > 4) && (strcmp(output + len - 4, ".obj") == 0)) len -= 4;
+	snprintf(pattern, sizeof(pattern), "%.*s_lod%%d.obj", len, output);
+	clock_t start = clock();
+	printf("Input: %zu vertices, %zu triangles (%zu LODs)\n", Simplify::vertices.size(), Simplify::triangles.size(), ratios.size());
+	Simplify::simplify_mesh_lods(ratios, agressiveness, true);
+	if (optimize)
+		for (size_t i = 0; i < Simplify::lods.size(); i++)
+			optimizeMesh(Simplify::lods[i].triangles, Simplify::lods[i].vertices, overdraw);
+	Simplify::write_lods(pattern);
+	for (size_t i = 0; i < Simplify::lods.size(); i++)
+		printf("LOD%zu: %zu vertices, %zu triangles\n", i, Simplify::lods[i].vertices.size(), Simplify::lods[i].triangles.size());
+	printf("Output: %s (%.4f sec)\n", pattern, ((float)(clock()-start))/CLOCKS_PER_SEC);
+	return EXIT_SUCCESS;
+}
+
 int main(int argc, const char * argv[]) {
     printf("Mesh Simplification (C)2014 by Sven Forstmann in 2014, MIT License (%zu-bit)\n", sizeof(size_t)*8);
+	// strip options, the remaining arguments are positional
+	double weldEpsilon = -1.0; // welding is off unless -weld= is given
+	bool optimize = false, overdraw = false;
+	const char *args[16];
+	int nargs = 0;
+	for (int i = 0; i < argc; i++) {
+		if (strncmp(argv[i], "-weld=", 6) == 0)
+			weldEpsilon = atof(argv[i] + 6);
+		else if (strcmp(argv[i], "-optimize") == 0)
+			optimize = true;
+		else if (strcmp(argv[i], "-overdraw") == 0)
+			optimize = overdraw = true;
+		else if (nargs < 16)
+			args[nargs++] = argv[i];
+	}
+	argc = nargs;
+	argv = args;
     if (argc < 3) {
         showHelp(argv);
         return EXIT_SUCCESS;
     }
+	if (argc > 5) {
+		double ratio = atof(argv[3]);
+		double budget = atof(argv[5]);
+		if ((ratio <= 0.0) || (ratio > 1.0) || (budget <= 0.0)) {
+			printf("Ratio must be BETWEEN zero and one, memory budget above zero.\n");
+			return EXIT_FAILURE;
+		}
+		clock_t start = clock();
+		if (!Simplify::simplify_out_of_core(argv[1], argv[2], ratio, (size_t)(budget * 1024 * 1024), atof(argv[4]), true))
+			return EXIT_FAILURE;
+		printf("Output: %s (%.4f sec)\n", argv[2], ((float)(clock()-start))/CLOCKS_PER_SEC);
+		return EXIT_SUCCESS;
+	}
 	Simplify::load_obj(argv[1]);
+	if (weldEpsilon >= 0.0) {
+		int welded = Simplify::weld_vertices(weldEpsilon);
+		if (welded) printf("Welded %d vertices\n", welded);
+	}
 	if ((Simplify::triangles.size() < 3) || (Simplify::vertices.size() < 3))
 		return EXIT_FAILURE;
+	if ((argc > 3) && strchr(argv[3], ',')) {
+		double agressiveness = (argc > 4) ? atof(argv[4]) : 7.0;
+		return simplifyLods(argv[3], argv[2], agressiveness, optimize, overdraw);
+	}
 	int target_count =  Simplify::triangles.size() >> 1;
     if (argc > 3) {
     	float reduceFraction = atof(argv[3]);
@@ -61,6 +153,9 @@ int main(int argc, const char * argv[]) {
     if (argc > 4) {
     	agressiveness = atof(argv[4]);
     }
+	int len = strlen(argv[2]);
+	bool progressive = (len > 3) && (strcmp(argv[2] + len - 3, ".pm") == 0);
+	Simplify::record_collapses = progressive;
 	clock_t start = clock();
 	printf("Input: %zu vertices, %zu triangles (target %d)\n", Simplify::vertices.size(), Simplify::triangles.size(), target_count);
 	int startSize = Simplify::triangles.size();
@@ -70,7 +165,17 @@ int main(int argc, const char * argv[]) {
 		printf("Unable to reduce mesh.\n");
     	return EXIT_FAILURE;
 	}
-	Simplify::write_obj(argv[2]);
+	if (progressive) {
+		Simplify::write_progressive(argv[2]);
+		printf("Progressive: %zu vertex splits\n", Simplify::progressive.splits.size());
+	} else {
+		if (optimize)
+			optimizeMesh(Simplify::triangles, Simplify::vertices, overdraw);
+		if ((len > 9) && (strcmp(argv[2] + len - 9, ".meshlets") == 0))
+			Simplify::write_meshlets(argv[2]);
+		else
+			Simplify::write_obj(argv[2]);
+	}
 	printf("Output: %zu vertices, %zu triangles (%f reduction; %.4f sec)\n",Simplify::vertices.size(), Simplify::triangles.size()
 		, (float)Simplify::triangles.size()/ (float) startSize  , ((float)(clock()-start))/CLOCKS_PER_SEC );
 	return EXIT_SUCCESS;
@@ -0,0 +1,243 @@
+#pragma once
+/////////////////////////////////////////////
+//
+// Post-simplification Optimization
+//
+// License : MIT
+// http://opensource.org/licenses/MIT
+//
+// Reorders a compacted mesh for rendering, without changing its geometry:
+//
+//  optimize_vertex_cache : Tipsify triangle order for the post-transform cache
+//                          (Sander, Nehab, Barczak 2007, "Fast Triangle
+//                          Reordering for Vertex Locality and Reduced Overdraw")
+//  optimize_overdraw     : sorts the Tipsify clusters so outward facing
+//                          clusters are drawn first
+//  optimize_vertex_fetch : vertices in order of first use
+//
+// acmr / atvr report the average cache miss ratio per triangle and per
+// vertex of a FIFO cache, 0.5 / 1.0 are the ideal values.
+
+#include "Simplify.h"
+
+namespace Simplify
+{
+	// Simulate a FIFO vertex cache, returns the number of cache misses
+
+	int cache_misses(std::vector<Triangle> &triangles,int vertex_count,int cache_size=32)
+	{
+		std::vector<int> timestamp(vertex_count,-cache_size-1);
+		int misses=0;
+		loopi(0,triangles.size()) loopj(0,3)
+		{
+			int v=triangles[i].v[j];
+			if(misses-timestamp[v]>cache_size)
+			{
+				timestamp[v]=misses;
+				misses++;
+			}
+		}
+		return misses;
+	}
+
+	double acmr(std::vector<Triangle> &triangles,std::vector<Vertex> &vertices,int cache_size=32)
+	{
+		if(triangles.empty()) return 0;
+		return double(cache_misses(triangles,vertices.size(),cache_size))/triangles.size();
+	}
+
+	double atvr(std::vector<Triangle> &triangles,std::vector<Vertex> &vertices,int cache_size=32)
+	{
+		if(vertices.empty()) return 0;
+		return double(cache_misses(triangles,vertices.size(),cache_size))/vertices.size();
+	}
+
+	double acmr(int cache_size=32) { return acmr(triangles,vertices,cache_size); }
+	double atvr(int cache_size=32) { return atvr(triangles,vertices,cache_size); }
+
+	//
+	// Tipsify : fan around the current vertex, then continue with the
+	// neighbour that stays longest in the cache, dead ends start a new
+	// cluster. clusters receives the first triangle of every cluster.
+	//
+
+	void optimize_vertex_cache(std::vector<Triangle> &triangles,std::vector<Vertex> &vertices,
+		std::vector<int> &clusters,int cache_size=32)
+	{
+		int vertex_count=vertices.size(), triangle_count=triangles.size();
+		clusters.clear();
+		if(!triangle_count) return;
+
+		// vertex -> triangle adjacency, live = triangles not yet emitted
+		std::vector<int> live(vertex_count,0),start(vertex_count+1,0),adjacency(triangle_count*3);
+		loopi(0,triangle_count) loopj(0,3) live[triangles[i].v[j]]++;
+		loopi(0,vertex_count) start[i+1]=start[i]+live[i];
+		{
+			std::vector<int> fill(start.begin(),start.end()-1);
+			loopi(0,triangle_count) loopj(0,3) adjacency[fill[triangles[i].v[j]]++]=i;
+		}
+
+		std::vector<int> timestamp(vertex_count,0),dead_end,candidates,order;
+		std::vector<char> emitted(triangle_count,0);
+		order.reserve(triangle_count);
+		int fan=0,time=cache_size+1,cursor=0;
+		clusters.push_back(0);
+		while(fan>=0)
+		{
+			candidates.clear();
+			for(int k=start[fan];k<start[fan+1];k++)
+			{
+				int t=adjacency[k];
+				if(emitted[t]) continue;
+				emitted[t]=1;
+				order.push_back(t);
+				loopj(0,3)
+				{
+					int v=triangles[t].v[j];
+					dead_end.push_back(v);
+					candidates.push_back(v);
+					live[v]--;
+					if(time-timestamp[v]>cache_size)
+					{
+						timestamp[v]=time;
+						time++;
+					}
+				}
+			}
+
+			// next fan : the candidate with live triangles that is
+			// still in the cache after fanning around it
+			int best=-1,priority=-1;
+			loopi(0,candidates.size())
+			{
+				int v=candidates[i];
+				if(live[v]<=0) continue;
+				int p=0;
+				if(time-timestamp[v]+2*live[v]<=cache_size) p=time-timestamp[v];
+				if(p>priority) { priority=p; best=v; }
+			}
+			if(best<0)
+			{
+				// dead end : recently used vertices first, then input order
+				while(!dead_end.empty() && best<0)
+				{
+					int v=dead_end.back();
+					dead_end.pop_back();
+					if(live[v]>0) best=v;
+				}
+				while(best<0 && cursor<vertex_count)
+				{
+					if(live[cursor]>0) best=cursor;
+					cursor++;
+				}
+				if(best>=0) clusters.push_back(order.size());
+			}
+			fan=best;
+		}
+
+		std::vector<Triangle> reordered(triangle_count);
+		loopi(0,triangle_count) reordered[i]=triangles[order[i]];
+		triangles.swap(reordered);
+	}
+
+	//
+	// Overdraw : draw the clusters facing away from the mesh center first,
+	// they are the most likely to occlude the rest. Keeps the triangle
+	// order within each cluster and so the cache efficiency.
+	//
+
+	void optimize_overdraw(std::vector<Triangle> &triangles,std::vector<Vertex> &vertices,
+		std::vector<int> &clusters)
+	{
+		if(clusters.size()<2) return;
+		int count=clusters.size();
+
+		// area weighted mesh centroid
+		vec3f center(0,0,0);
+		double area=0;
+		loopi(0,triangles.size())
+		{
+			Triangle &t=triangles[i];
+			vec3f &p0=vertices[t.v[0]].p, &p1=vertices[t.v[1]].p, &p2=vertices[t.v[2]].p;
+			vec3f n;
+			n.cross(p1-p0,p2-p0);
+			double a=n.length();
+			center=center+(p0+p1+p2)*(a/3);
+			area+=a;
+		}
+		if(area>0) center=center/area;
+
+		// per cluster : dot(centroid - center, normal), both area weighted
+		std::vector<std::pair<double,int> > sort_key(count);
+		loopk(0,count)
+		{
+			int end=k+1<count ? clusters[k+1] : triangles.size();
+			vec3f c(0,0,0),normal(0,0,0);
+			double a=0;
+			for(int i=clusters[k];i<end;i++)
+			{
+				Triangle &t=triangles[i];
+				vec3f &p0=vertices[t.v[0]].p, &p1=vertices[t.v[1]].p, &p2=vertices[t.v[2]].p;
+				vec3f n;
+				n.cross(p1-p0,p2-p0);
+				double l=n.length();
+				c=c+(p0+p1+p2)*(l/3);
+				normal=normal+n;
+				a+=l;
+			}
+			if(a>0) c=c/a;
+			sort_key[k]=std::make_pair(-(c-center).dot(normal),k);
+		}
+		std::stable_sort(sort_key.begin(),sort_key.end());
+
+		std::vector<Triangle> reordered;
+		std::vector<int> reordered_clusters;
+		reordered.reserve(triangles.size());
+		loopi(0,count)
+		{
+			int k=sort_key[i].second;
+			int end=k+1<count ? clusters[k+1] : triangles.size();
+			reordered_clusters.push_back(reordered.size());
+			reordered.insert(reordered.end(),triangles.begin()+clusters[k],triangles.begin()+end);
+		}
+		triangles.swap(reordered);
+		clusters.swap(reordered_clusters);
+	}
+
+	// Vertex fetch : renumber vertices in order of first use
+
+	void optimize_vertex_fetch(std::vector<Triangle> &triangles,std::vector<Vertex> &vertices)
+	{
+		std::vector<int> remap(vertices.size(),-1);
+		std::vector<Vertex> reordered;
+		reordered.reserve(vertices.size());
+		loopi(0,triangles.size()) loopj(0,3)
+		{
+			int &v=triangles[i].v[j];
+			if(remap[v]<0)
+			{
+				remap[v]=reordered.size();
+				reordered.push_back(vertices[v]);
+			}
+			v=remap[v];
+		}
+		vertices.swap(reordered);
+	}
+
+	// All passes on a compacted mesh, overdraw sorting is optional
+
+	void optimize_mesh(std::vector<Triangle> &triangles,std::vector<Vertex> &vertices,
+		bool overdraw=false,int cache_size=32)
+	{
+		std::vector<int> clusters;
+		optimize_vertex_cache(triangles,vertices,clusters,cache_size);
+		if(overdraw) optimize_overdraw(triangles,vertices,clusters);
+		optimize_vertex_fetch(triangles,vertices);
+	}
+
+	void optimize_mesh(bool overdraw=false,int cache_size=32)
+	{
+		optimize_mesh(triangles,vertices,overdraw,cache_size);
+	}
+};
+///////////////////////////////////////////
@@ -0,0 +1,385 @@
+#pragma once
+/////////////////////////////////////////////
+//
+// Meshlet Builder
+//
+// Partitions an indexed triangle mesh into small clusters for cluster
+// based culling, each with a bounding sphere and a normal cone. Like
+// ProgressiveMesh.h it only depends on the standard library, so loaders
+// can include it for the file layout alone.
+//
+// License : MIT
+// http://opensource.org/licenses/MIT
+//
+// File layout (little endian, every section 16 byte aligned, offsets are
+// relative to the file start so the file can be mapped and used in place)
+//
+//   FileHeader
+//   float[3]       positions
+//   Meshlet[]      meshlets
+//   unsigned int[] meshlet vertices   : indices into positions
+//   unsigned char[]meshlet triangles  : 3 local indices per triangle
+//
+// Normal cone test, cull the meshlet if
+//   dot(normalize(cone_apex - camera_position), cone_axis) >= cone_cutoff
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+namespace Meshlets
+{
+	struct Meshlet
+	{
+		unsigned int vertex_offset;    // first entry in the meshlet vertices
+		unsigned int triangle_offset;  // first byte in the meshlet triangles
+		unsigned int vertex_count;
+		unsigned int triangle_count;
+		float center[3],radius;        // bounding sphere
+		float cone_apex[3];
+		float cone_axis[3],cone_cutoff;// cutoff 1 = never culled
+		unsigned int pad;
+	};
+
+	struct FileHeader
+	{
+		char tag[4];                   // "MLT1"
+		unsigned int max_vertices,max_triangles;
+		unsigned int position_count,meshlet_count;
+		unsigned int vertex_count,triangle_bytes;
+		unsigned int position_offset,meshlet_offset;
+		unsigned int vertex_offset,triangle_offset;
+		unsigned int file_size;
+	};
+
+	struct Mesh
+	{
+		std::vector<float> positions;
+		std::vector<Meshlet> meshlets;
+		std::vector<unsigned int> vertices;
+		std::vector<unsigned char> triangles;
+		int max_vertices,max_triangles;
+
+		Mesh() { max_vertices=64; max_triangles=124; }
+	};
+
+	// Bounding sphere and normal cone of one meshlet
+
+	void compute_bounds(Mesh &mesh,Meshlet &m)
+	{
+		const float *p=&mesh.positions[0];
+		const unsigned int *v=&mesh.vertices[m.vertex_offset];
+		const unsigned char *t=&mesh.triangles[m.triangle_offset];
+
+		// sphere : bounding box center, farthest vertex
+		float lo[3]={1e30f,1e30f,1e30f},hi[3]={-1e30f,-1e30f,-1e30f};
+		for(unsigned int i=0;i<m.vertex_count;i++) for(int k=0;k<3;k++)
+		{
+			lo[k]=std::min(lo[k],p[v[i]*3+k]);
+			hi[k]=std::max(hi[k],p[v[i]*3+k]);
+		}
+		float r2=0;
+		for(int k=0;k<3;k++) m.center[k]=(lo[k]+hi[k])*0.5f;
+		for(unsigned int i=0;i<m.vertex_count;i++)
+		{
+			float d2=0;
+			for(int k=0;k<3;k++) d2+=(p[v[i]*3+k]-m.center[k])*(p[v[i]*3+k]-m.center[k]);
+			r2=std::max(r2,d2);
+		}
+		m.radius=sqrtf(r2);
+
+		// cone : average unit normal, widest deviation from it
+		std::vector<float> normals(m.triangle_count*3);
+		float axis[3]={0,0,0};
+		for(unsigned int i=0;i<m.triangle_count;i++)
+		{
+			const float *a=&p[v[t[i*3]]*3], *b=&p[v[t[i*3+1]]*3], *c=&p[v[t[i*3+2]]*3];
+			float e0[3]={b[0]-a[0],b[1]-a[1],b[2]-a[2]}, e1[3]={c[0]-a[0],c[1]-a[1],c[2]-a[2]};
+			float *n=&normals[i*3];
+			n[0]=e0[1]*e1[2]-e0[2]*e1[1];
+			n[1]=e0[2]*e1[0]-e0[0]*e1[2];
+			n[2]=e0[0]*e1[1]-e0[1]*e1[0];
+			float l=sqrtf(n[0]*n[0]+n[1]*n[1]+n[2]*n[2]);
+			if(l>0) for(int k=0;k<3;k++) n[k]/=l;
+			for(int k=0;k<3;k++) axis[k]+=n[k];
+		}
+		float l=sqrtf(axis[0]*axis[0]+axis[1]*axis[1]+axis[2]*axis[2]);
+		float min_dot=-1;
+		if(l>0)
+		{
+			min_dot=1;
+			for(int k=0;k<3;k++) axis[k]/=l;
+			for(unsigned int i=0;i<m.triangle_count;i++)
+			{
+				const float *n=&normals[i*3];
+				min_dot=std::min(min_dot,n[0]*axis[0]+n[1]*axis[1]+n[2]*axis[2]);
+			}
+		}
+		for(int k=0;k<3;k++) { m.cone_axis[k]=axis[k]; m.cone_apex[k]=m.center[k]; }
+		m.cone_cutoff=1;
+		m.pad=0;
+		if(min_dot<=0.1f) return; // normals spread over more than a hemisphere
+
+		// apex : move back along the axis until it is behind every triangle plane
+		float max_t=0;
+		for(unsigned int i=0;i<m.triangle_count;i++)
+		{
+			const float *n=&normals[i*3], *a=&p[v[t[i*3]]*3];
+			float dc=(m.center[0]-a[0])*n[0]+(m.center[1]-a[1])*n[1]+(m.center[2]-a[2])*n[2];
+			float dn=axis[0]*n[0]+axis[1]*n[1]+axis[2]*n[2];
+			max_t=std::max(max_t,dc/dn);
+		}
+		for(int k=0;k<3;k++) m.cone_apex[k]=m.center[k]-axis[k]*max_t;
+		m.cone_cutoff=sqrtf(1-min_dot*min_dot);
+	}
+
+	//
+	// Build meshlets from an indexed triangle list
+	//
+	// Triangles are sorted along a Morton curve of their centers and cut into
+	// ranges that are clustered independently ( in parallel with -fopenmp ).
+	// Within a range a meshlet grows greedily by the adjacent triangle that
+	// adds the fewest new vertices, ties go to the earlier triangle, so the
+	// result does not depend on the thread count.
+	//
+
+	void build(const float *positions,int vertex_count,const int *indices,int triangle_count,
+		Mesh &mesh,int max_vertices=64,int max_triangles=124)
+	{
+		mesh=Mesh();
+		mesh.max_vertices=max_vertices=std::min(std::max(max_vertices,3),256);
+		mesh.max_triangles=max_triangles=std::max(max_triangles,1);
+		mesh.positions.assign(positions,positions+vertex_count*3);
+		if(triangle_count<=0) return;
+
+		// Morton order of the triangle centers
+		float lo[3]={1e30f,1e30f,1e30f},hi[3]={-1e30f,-1e30f,-1e30f};
+		for(int i=0;i<vertex_count;i++) for(int k=0;k<3;k++)
+		{
+			lo[k]=std::min(lo[k],positions[i*3+k]);
+			hi[k]=std::max(hi[k],positions[i*3+k]);
+		}
+		float extent=std::max(std::max(hi[0]-lo[0],hi[1]-lo[1]),std::max(hi[2]-lo[2],1e-30f));
+		std::vector<std::pair<unsigned long long,int> > order(triangle_count);
+		#ifdef _OPENMP
+		#pragma omp parallel for
+		#endif
+		for(int i=0;i<triangle_count;i++)
+		{
+			unsigned long long code=0;
+			unsigned int c[3];
+			for(int k=0;k<3;k++)
+			{
+				float x=(positions[indices[i*3]*3+k]+positions[indices[i*3+1]*3+k]+positions[indices[i*3+2]*3+k])/3;
+				c[k]=(unsigned int)std::min(std::max((x-lo[k])/extent*1048575.0f,0.0f),1048575.0f);
+			}
+			for(int b=19;b>=0;b--) for(int k=0;k<3;k++) code=(code<<1)|((c[k]>>b)&1);
+			order[i]=std::make_pair(code,i);
+		}
+		std::sort(order.begin(),order.end());
+
+		// vertex -> triangle adjacency
+		std::vector<int> start(vertex_count+1,0),adjacency(triangle_count*3);
+		for(int i=0;i<triangle_count*3;i++) start[indices[i]+1]++;
+		for(int i=0;i<vertex_count;i++) start[i+1]+=start[i];
+		{
+			std::vector<int> fill(start.begin(),start.end()-1);
+			for(int i=0;i<triangle_count*3;i++) adjacency[fill[indices[i]]++]=i/3;
+		}
+
+		// ranges of consecutive triangles in Morton order
+		int range_size=max_triangles*64;
+		int ranges=(triangle_count+range_size-1)/range_size;
+		std::vector<int> rank(triangle_count);
+		for(int i=0;i<triangle_count;i++) rank[order[i].second]=i;
+		std::vector<Mesh> parts(ranges);
+
+		#ifdef _OPENMP
+		#pragma omp parallel
+		#endif
+		{
+			std::vector<int> stamp(vertex_count,-1),local(vertex_count),live(vertex_count,0),candidates,tris;
+			std::vector<char> used(range_size,0);
+			#ifdef _OPENMP
+			#pragma omp for schedule(dynamic,1)
+			#endif
+			for(int r=0;r<ranges;r++)
+			{
+				int first=r*range_size, last=std::min(first+range_size,triangle_count);
+				Mesh &part=parts[r];
+				std::fill(used.begin(),used.end(),0);
+				for(int i=first;i<last;i++) for(int k=0;k<3;k++) live[indices[order[i].second*3+k]]++;
+				std::vector<int> verts;
+				int id=r*range_size; // unique meshlet stamp per range
+				int cursor=first;
+				while(true)
+				{
+					while(cursor<last && used[cursor-first]) cursor++;
+					if(cursor>=last) break;
+
+					// new meshlet seeded by the next unused triangle
+					verts.clear();
+					tris.clear();
+					candidates.clear();
+					id++;
+					int seed=cursor;
+					float sum[3]={0,0,0};
+					while(seed>=0)
+					{
+						int t=order[seed].second;
+						used[seed-first]=1;
+						tris.push_back(t);
+						for(int k=0;k<3;k++) live[indices[t*3+k]]--;
+						for(int k=0;k<3;k++)
+						{
+							int v=indices[t*3+k];
+							if(stamp[v]==id) continue;
+							stamp[v]=id;
+							local[v]=verts.size();
+							verts.push_back(v);
+							for(int a=0;a<3;a++) sum[a]+=positions[v*3+a];
+							for(int a=start[v];a<start[v+1];a++)
+							{
+								int n=rank[adjacency[a]];
+								if(n>=first && n<last && !used[n-first]) candidates.push_back(n);
+							}
+						}
+						if((int)tris.size()>=max_triangles) break;
+
+						// best candidate : fewest new vertices, then fewest unused
+						// neighbours ( avoids leaving isolated triangles behind ),
+						// then closest to the meshlet center, then Morton order
+						seed=-1;
+						int best_new=4,best_live=0;
+						float best_d2=0,center[3];
+						for(int a=0;a<3;a++) center[a]=sum[a]/verts.size();
+						for(int c=0;c<(int)candidates.size();c++)
+						{
+							int n=candidates[c];
+							if(used[n-first]) { candidates[c--]=candidates.back(); candidates.pop_back(); continue; }
+							int tn=order[n].second, add=0;
+							for(int k=0;k<3;k++) add+=stamp[indices[tn*3+k]]!=id;
+							if((int)verts.size()+add>max_vertices) continue;
+							if(add>best_new) continue;
+							int l=live[indices[tn*3]]+live[indices[tn*3+1]]+live[indices[tn*3+2]];
+							if(add==best_new && l>best_live) continue;
+							float d2=0;
+							for(int a=0;a<3;a++)
+							{
+								float x=(positions[indices[tn*3]*3+a]+positions[indices[tn*3+1]*3+a]+positions[indices[tn*3+2]*3+a])/3-center[a];
+								d2+=x*x;
+							}
+							if(add<best_new || l<best_live || d2<best_d2 || (d2==best_d2 && n<seed)) { best_new=add; best_live=l; best_d2=d2; seed=n; }
+						}
+
+						// no connected triangle fits : continue with the next unused one
+						// in Morton order, it is close by ( disconnected pieces )
+						if(seed<0)
+						{
+							while(cursor<last && used[cursor-first]) cursor++;
+							if(cursor<last)
+							{
+								int tn=order[cursor].second, add=0;
+								for(int k=0;k<3;k++) add+=stamp[indices[tn*3+k]]!=id;
+								if((int)verts.size()+add<=max_vertices) seed=cursor;
+							}
+						}
+					}
+
+					Meshlet m;
+					m.vertex_offset=part.vertices.size();
+					m.triangle_offset=part.triangles.size();
+					m.vertex_count=verts.size();
+					m.triangle_count=tris.size();
+					part.vertices.insert(part.vertices.end(),verts.begin(),verts.end());
+					for(size_t i=0;i<tris.size();i++) for(int k=0;k<3;k++)
+						part.triangles.push_back((unsigned char)local[indices[tris[i]*3+k]]);
+					part.meshlets.push_back(m);
+				}
+			}
+		}
+
+		// concatenate the ranges, then bounds
+		for(int r=0;r<ranges;r++)
+		{
+			Mesh &part=parts[r];
+			for(size_t i=0;i<part.meshlets.size();i++)
+			{
+				Meshlet m=part.meshlets[i];
+				m.vertex_offset+=mesh.vertices.size();
+				m.triangle_offset+=mesh.triangles.size();
+				mesh.meshlets.push_back(m);
+			}
+			mesh.vertices.insert(mesh.vertices.end(),part.vertices.begin(),part.vertices.end());
+			mesh.triangles.insert(mesh.triangles.end(),part.triangles.begin(),part.triangles.end());
+			part=Mesh();
+		}
+		#ifdef _OPENMP
+		#pragma omp parallel for
+		#endif
+		for(int i=0;i<(int)mesh.meshlets.size();i++) compute_bounds(mesh,mesh.meshlets[i]);
+	}
+
+	inline unsigned int align16(unsigned int x) { return (x+15)&~15u; }
+
+	bool save(const char* filename,const Mesh &mesh)
+	{
+		FILE *file=fopen(filename,"wb");
+		if(!file)
+		{
+			printf("Meshlets::save: can't write data file \"%s\".\n",filename);
+			return false;
+		}
+		FileHeader h;
+		memset(&h,0,sizeof(h));
+		memcpy(h.tag,"MLT1",4);
+		h.max_vertices=mesh.max_vertices;
+		h.max_triangles=mesh.max_triangles;
+		h.position_count=mesh.positions.size()/3;
+		h.meshlet_count=mesh.meshlets.size();
+		h.vertex_count=mesh.vertices.size();
+		h.triangle_bytes=mesh.triangles.size();
+		h.position_offset=align16(sizeof(FileHeader));
+		h.meshlet_offset=align16(h.position_offset+h.position_count*3*sizeof(float));
+		h.vertex_offset=align16(h.meshlet_offset+h.meshlet_count*sizeof(Meshlet));
+		h.triangle_offset=align16(h.vertex_offset+h.vertex_count*sizeof(unsigned int));
+		h.file_size=align16(h.triangle_offset+h.triangle_bytes);
+
+		std::vector<char> data(h.file_size,0);
+		memcpy(&data[0],&h,sizeof(h));
+		if(h.position_count) memcpy(&data[h.position_offset],&mesh.positions[0],h.position_count*3*sizeof(float));
+		if(h.meshlet_count) memcpy(&data[h.meshlet_offset],&mesh.meshlets[0],h.meshlet_count*sizeof(Meshlet));
+		if(h.vertex_count) memcpy(&data[h.vertex_offset],&mesh.vertices[0],h.vertex_count*sizeof(unsigned int));
+		if(h.triangle_bytes) memcpy(&data[h.triangle_offset],&mesh.triangles[0],h.triangle_bytes);
+		bool ok=fwrite(&data[0],1,data.size(),file)==data.size();
+		fclose(file);
+		return ok;
+	}
+
+	// Pointers into a mapped ( or loaded ) meshlet file, no copies
+
+	struct View
+	{
+		const FileHeader *header;
+		const float *positions;
+		const Meshlet *meshlets;
+		const unsigned int *vertices;
+		const unsigned char *triangles;
+
+		bool set(const void *data,size_t size)
+		{
+			header=(const FileHeader*)data;
+			if(size<sizeof(FileHeader) || memcmp(header->tag,"MLT1",4)!=0 || header->file_size>size) return false;
+			const char *base=(const char*)data;
+			positions=(const float*)(base+header->position_offset);
+			meshlets=(const Meshlet*)(base+header->meshlet_offset);
+			vertices=(const unsigned int*)(base+header->vertex_offset);
+			triangles=(const unsigned char*)(base+header->triangle_offset);
+			return true;
+		}
+	};
+};
+///////////////////////////////////////////
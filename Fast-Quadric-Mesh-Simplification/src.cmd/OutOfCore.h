@@ -0,0 +1,644 @@
+#pragma once
+/////////////////////////////////////////////
+//
+// Out-of-core Mesh Simplification
+//
+// License : MIT
+// http://opensource.org/licenses/MIT
+//
+// For OBJ files that do not fit in memory. The input is streamed twice:
+// first the vertices are spilled to a binary file, then every face is
+// sorted into a block of a uniform grid. Blocks with more triangles than
+// the budget are split further in space. Each block is simplified on its
+// own with the vertices it shares with other blocks locked. Afterwards
+// 2x2x2 blocks are merged and re-simplified level by level, unlocking the
+// seams between them, until a single block is left and written as OBJ.
+// The children of a block are merged one at a time; when the next one
+// would not fit the budget, the merged part is simplified first, and only
+// if that does not make room it is streamed to the OBJ instead.
+//
+// Vertices are identified across blocks by their (float) position, the
+// locked seam vertices never move so they weld exactly when merged.
+//
+// In memory at any time : one block, a page cache of input vertices and
+// the seam vertex positions of the current and the previous level.
+
+#include "Simplify.h"
+#include <unordered_map>
+#include <unordered_set>
+#include <string>
+
+namespace Simplify
+{
+	struct OocPosition
+	{
+		float x,y,z;
+		bool operator==(const OocPosition &a) const { return x==a.x && y==a.y && z==a.z; }
+	};
+	struct OocPositionHash
+	{
+		size_t operator()(const OocPosition &a) const
+		{
+			unsigned int h[3];
+			memcpy(h,&a,sizeof(h));
+			return (h[0]*73856093u) ^ (h[1]*19349663u) ^ (h[2]*83492791u);
+		}
+	};
+	typedef std::unordered_set<OocPosition,OocPositionHash> OocSeams;
+
+	// Block of a seam vertex at the previous level, -1 when shared by several,
+	// and the children of that block holding it, one bit each
+
+	struct OocOwner { int block; unsigned char children; };
+	typedef std::unordered_map<OocPosition,OocOwner,OocPositionHash> OocOwners;
+
+	OocPosition ooc_position(const vec3f &p)
+	{
+		OocPosition q={(float)p.x,(float)p.y,(float)p.z};
+		return q;
+	}
+
+	// Approximate in-core bytes per triangle : triangle with its errors and
+	// normal, refs (they grow during simplification), about half a vertex
+	// with its quadric and the weld hash map
+
+	const size_t ooc_bytes_per_triangle = sizeof(Triangle)+4*sizeof(qfloat)+sizeof(vec3f)+6*sizeof(Ref)+
+		(sizeof(Vertex)+sizeof(SymetricMatrix))/2+64;
+
+	// Read access to the spilled input vertices through a small page cache
+
+	class OocVertexPages
+	{
+	public:
+		enum { PAGE = 1<<14 };
+
+		OocVertexPages(FILE *file,int vertex_count,size_t budget)
+		{
+			fn=file;
+			count=vertex_count;
+			int pages=budget/(PAGE*sizeof(OocPosition));
+			if(pages<4) pages=4;
+			data.resize((size_t)pages*PAGE);
+			tags.assign(pages,-1);
+		}
+
+		const OocPosition* get(int id)
+		{
+			if(id<0 || id>=count) return NULL;
+			int page=id/PAGE, slot=page%tags.size();
+			OocPosition *p=&data[(size_t)slot*PAGE];
+			if(tags[slot]!=page)
+			{
+				fseek(fn,(long)page*PAGE*sizeof(OocPosition),SEEK_SET);
+				if(fread(p,sizeof(OocPosition),PAGE,fn)==0) return NULL;
+				tags[slot]=page;
+			}
+			return p+id%PAGE;
+		}
+
+	private:
+		FILE *fn;
+		int count;
+		std::vector<OocPosition> data;
+		std::vector<int> tags;
+	};
+
+	// Uniform grid over the input bounds, level l merges 2^l cells per axis
+
+	struct OocGrid
+	{
+		vec3f min,cell;
+		int size,levels;
+
+		int blocks(int level) const { int n=size>>level; return n*n*n; }
+
+		int block(const OocPosition &p,int level) const
+		{
+			int c[3]; double v[3]={p.x,p.y,p.z}, o[3]={min.x,min.y,min.z}, s[3]={cell.x,cell.y,cell.z};
+			loopi(0,3)
+			{
+				c[i]=int((v[i]-o[i])/s[i]);
+				if(c[i]<0) c[i]=0;
+				if(c[i]>=size) c[i]=size-1;
+				c[i]>>=level;
+			}
+			int n=size>>level;
+			return (c[2]*n+c[1])*n+c[0];
+		}
+
+		// block at level+1 containing block b of level
+
+		int parent(int b,int level) const
+		{
+			int n=size>>level;
+			int x=b%n, y=(b/n)%n, z=b/(n*n);
+			return ((z/2)*(n/2)+y/2)*(n/2)+x/2;
+		}
+	};
+
+	std::string ooc_file(const char* output,int level,int block)
+	{
+		char name[64];
+		snprintf(name,sizeof(name),".ooc.%d.%d",level,block);
+		return std::string(output)+name;
+	}
+
+	// Append a triangle soup to a spill file
+
+	bool ooc_append(const std::string &filename,const std::vector<OocPosition> &soup)
+	{
+		if(soup.empty()) return true;
+		FILE *file=fopen(filename.c_str(),"ab");
+		if(!file)
+		{
+			printf("simplify_out_of_core: can't write spill file \"%s\".\n",filename.c_str());
+			return false;
+		}
+		bool ok = fwrite(&soup[0],sizeof(OocPosition),soup.size(),file)==soup.size();
+		fclose(file);
+		return ok;
+	}
+
+	// Load a spilled triangle soup into the in-core mesh, welding by position
+
+	void ooc_load(const std::string &filename,std::unordered_map<OocPosition,int,OocPositionHash> &weld)
+	{
+		FILE *file=fopen(filename.c_str(),"rb");
+		if(!file) return;
+		OocPosition p[3];
+		while(fread(p,sizeof(OocPosition),3,file)==3)
+		{
+			Triangle t;
+			t.deleted=0;
+			t.dirty=0;
+			t.id=triangles.size();
+			loopj(0,3)
+			{
+				std::pair<std::unordered_map<OocPosition,int,OocPositionHash>::iterator,bool> it=
+					weld.insert(std::make_pair(p[j],(int)vertices.size()));
+				if(it.second)
+				{
+					Vertex v;
+					v.p=vec3f(p[j].x,p[j].y,p[j].z);
+					v.border=0;
+					v.locked=0;
+					vertices.push_back(v);
+				}
+				t.v[j]=it.first->second;
+			}
+			if(t.v[0]==t.v[1] || t.v[1]==t.v[2] || t.v[2]==t.v[0]) continue;
+			triangles.push_back(t);
+		}
+		fclose(file);
+		remove(filename.c_str());
+	}
+
+	// Store the in-core mesh as triangle soup, returns false on write error
+
+	bool ooc_store(const std::string &filename)
+	{
+		std::vector<OocPosition> soup;
+		soup.reserve(triangles.size()*3);
+		loopi(0,triangles.size()) loopj(0,3)
+		{
+			soup.push_back(ooc_position(vertices[triangles[i].v[j]].p));
+		}
+		return ooc_append(filename,soup);
+	}
+
+	// Remove the spill files of all levels, before a run and after an error
+
+	void ooc_remove_files(const char* output,const OocGrid &grid)
+	{
+		loopk(0,grid.levels+1) loopi(0,grid.blocks(k>0?k-1:0))
+			remove(ooc_file(output,k,i).c_str());
+	}
+
+	// Split a level 0 spill file with more than max_triangles triangles into
+	// octants of its bounds, recursively. The vertices of faces spanning
+	// several pieces become seams. Returns false on write error.
+
+	bool ooc_split(const std::string &filename,int triangle_count,int max_triangles,
+		OocSeams &seams,std::vector<std::string> &pieces,std::vector<int> &piece_triangles,int depth=0)
+	{
+		if(triangle_count<=max_triangles || depth>=16)
+		{
+			pieces.push_back(filename);
+			piece_triangles.push_back(triangle_count);
+			return true;
+		}
+		FILE *file=fopen(filename.c_str(),"rb");
+		if(!file) return true;
+		OocPosition p[3];
+		vec3f bmin(DBL_MAX,DBL_MAX,DBL_MAX),bmax(-DBL_MAX,-DBL_MAX,-DBL_MAX);
+		while(fread(p,sizeof(OocPosition),3,file)==3) loopj(0,3)
+		{
+			bmin=vec3f(fmin(bmin.x,p[j].x),fmin(bmin.y,p[j].y),fmin(bmin.z,p[j].z));
+			bmax=vec3f(fmax(bmax.x,p[j].x),fmax(bmax.y,p[j].y),fmax(bmax.z,p[j].z));
+		}
+		vec3f mid=(bmin+bmax)/2;
+
+		// faces go to the octant of their first vertex, as in pass 2
+		std::string names[8];
+		std::vector<OocPosition> buffers[8];
+		int counts[8]={0,0,0,0,0,0,0,0};
+		loopk(0,8)
+		{
+			char name[8];
+			snprintf(name,sizeof(name),".%d",k);
+			names[k]=filename+name;
+			remove(names[k].c_str());
+		}
+		bool ok=true;
+		rewind(file);
+		while(ok && fread(p,sizeof(OocPosition),3,file)==3)
+		{
+			int o[3];
+			loopj(0,3) o[j]=(p[j].x>mid.x)|((p[j].y>mid.y)<<1)|((p[j].z>mid.z)<<2);
+			if(o[0]!=o[1] || o[1]!=o[2]) loopj(0,3) seams.insert(p[j]);
+			buffers[o[0]].insert(buffers[o[0]].end(),p,p+3);
+			counts[o[0]]++;
+			if(buffers[o[0]].size()>=4096*3)
+			{
+				ok=ooc_append(names[o[0]],buffers[o[0]]);
+				buffers[o[0]].clear();
+			}
+		}
+		fclose(file);
+		loopk(0,8) if(ok) ok=ooc_append(names[k],buffers[k]);
+		if(!ok)
+		{
+			loopk(0,8) remove(names[k].c_str());
+			return false;
+		}
+		remove(filename.c_str());
+
+		// all faces in one octant : the bounds do not shrink any further
+		loopk(0,8) if(counts[k]==triangle_count) depth=16;
+		loopk(0,8) if(ok && counts[k])
+			ok=ooc_split(names[k],counts[k],max_triangles,seams,pieces,piece_triangles,depth+1);
+		return ok;
+	}
+
+	// Output OBJ written one block at a time. The locked vertices of a block
+	// are written once and shared with the blocks written after it, they
+	// stay locked from then on. compact_mesh() does not keep Vertex::locked,
+	// so lock again before writing.
+
+	struct OocWriter
+	{
+		FILE *file;
+		int written;
+		std::unordered_map<OocPosition,int,OocPositionHash> fixed;
+
+		bool open(const char* filename)
+		{
+			written=0;
+			fixed.clear();
+			file=fopen(filename,"w");
+			if(!file) printf("write_obj: can't write data file \"%s\".\n", filename);
+			return file!=NULL;
+		}
+
+		bool locked(const OocPosition &p) const { return fixed.find(p)!=fixed.end(); }
+
+		// Append the in-core mesh
+		void write()
+		{
+			std::vector<int> ids(vertices.size());
+			loopi(0,vertices.size())
+			{
+				vec3f &v=vertices[i].p;
+				if(vertices[i].locked)
+				{
+					std::pair<std::unordered_map<OocPosition,int,OocPositionHash>::iterator,bool> it=
+						fixed.insert(std::make_pair(ooc_position(v),written));
+					ids[i]=it.first->second;
+					if(!it.second) continue;
+				}
+				else
+					ids[i]=written;
+				fprintf(file, "v %g %g %g\n", v.x,v.y,v.z);
+				written++;
+			}
+			loopi(0,triangles.size())
+			{
+				Triangle &t=triangles[i];
+				fprintf(file, "f %d %d %d\n", ids[t.v[0]]+1, ids[t.v[1]]+1, ids[t.v[2]]+1);
+			}
+		}
+
+		bool close()
+		{
+			bool ok=!ferror(file);
+			fclose(file);
+			return ok;
+		}
+	};
+
+	// Lock the in-core vertices on a seam, already in the output, or shared
+	// with a child of the block that is not loaded yet
+
+	void ooc_lock(const OocSeams &seams,const OocOwners &owners,unsigned char loaded,const OocWriter &out)
+	{
+		loopi(0,vertices.size())
+		{
+			OocPosition p=ooc_position(vertices[i].p);
+			OocOwners::const_iterator it=owners.find(p);
+			vertices[i].locked=seams.find(p)!=seams.end() || out.locked(p) ||
+				(it!=owners.end() && (it->second.children&~loaded));
+		}
+	}
+
+	//
+	// Out-of-core simplification function
+	//
+	// input, output : OBJ file names, spill files are created next to output
+	// ratio         : fraction of the input triangles to keep
+	// memory_budget : approximate bytes for one in-core block
+	//
+	// The in-core mesh holds about memory_budget/ooc_bytes_per_triangle
+	// triangles at most : oversized grid cells are split, and a block is only
+	// merged into its parent while that fits, else the part merged so far is
+	// simplified or written to the output as it is. The output keeps more
+	// triangles than ratio asks for only when it does not fit the budget.
+	//
+
+	bool simplify_out_of_core(const char* input, const char* output, double ratio,
+		size_t memory_budget, double agressiveness=7, bool verbose=false)
+	{
+		// position only, see README
+		wedges.clear();
+		corner_wedges.clear();
+		attributes=NONE;
+		FILE *fn=fopen(input,"rb");
+		if(!fn)
+		{
+			printf ( "File %s not found!\n" ,input );
+			return false;
+		}
+		std::string vertex_file=std::string(output)+".ooc.v";
+		FILE *vfile=fopen(vertex_file.c_str(),"w+b");
+		if(!vfile)
+		{
+			printf("simplify_out_of_core: can't write spill file \"%s\".\n",vertex_file.c_str());
+			fclose(fn);
+			return false;
+		}
+
+		// pass 1 : spill vertices, bounds and triangle count
+		char line[1000];
+		int vertex_count=0,triangle_count=0;
+		vec3f bmin(DBL_MAX,DBL_MAX,DBL_MAX),bmax(-DBL_MAX,-DBL_MAX,-DBL_MAX);
+		while(fgets(line,1000,fn)!=NULL)
+		{
+			vec3f p;
+			if(line[0]=='v' && line[1]==' ' && sscanf(line,"v %lf %lf %lf",&p.x,&p.y,&p.z)==3)
+			{
+				OocPosition q={(float)p.x,(float)p.y,(float)p.z};
+				fwrite(&q,sizeof(q),1,vfile);
+				bmin=vec3f(fmin(bmin.x,q.x),fmin(bmin.y,q.y),fmin(bmin.z,q.z));
+				bmax=vec3f(fmax(bmax.x,q.x),fmax(bmax.y,q.y),fmax(bmax.z,q.z));
+				vertex_count++;
+			}
+			if(line[0]=='f') triangle_count++;
+		}
+		fflush(vfile);
+		if(vertex_count<3 || triangle_count<1)
+		{
+			fclose(fn);
+			fclose(vfile);
+			remove(vertex_file.c_str());
+			return false;
+		}
+
+		// grid : power of two cells per axis so that one cell fits the budget
+		OocGrid grid;
+		grid.size=1;
+		grid.levels=0;
+		double cells=double(triangle_count)*ooc_bytes_per_triangle/double(memory_budget);
+		while(double(grid.size)*grid.size*grid.size<cells) { grid.size*=2; grid.levels++; }
+		grid.min=bmin;
+		grid.cell=(bmax-bmin)/double(grid.size);
+		if(grid.cell.x<=0) grid.cell.x=1;
+		if(grid.cell.y<=0) grid.cell.y=1;
+		if(grid.cell.z<=0) grid.cell.z=1;
+		int budget_triangles=memory_budget/ooc_bytes_per_triangle;
+		if(budget_triangles<64) budget_triangles=64;
+		if (verbose) {
+			printf("out-of-core: %d vertices, %d triangles, %d^3 blocks, %d levels, %d triangles per block\n",
+				vertex_count,triangle_count,grid.size,grid.levels+1,budget_triangles);
+		}
+
+		// spill files are appended to, drop those of an earlier run
+		ooc_remove_files(output,grid);
+
+		// pass 2 : sort faces into level 0 blocks, vertices of faces spanning
+		// several blocks are seams
+		int nblocks=grid.blocks(0);
+		std::vector<int> block_triangles(nblocks,0);
+		std::vector<std::vector<OocPosition> > buffers(nblocks);
+		size_t flush=memory_budget/(4*nblocks*3*sizeof(OocPosition));
+		if(flush<64) flush=64;
+		if(flush>4096) flush=4096;
+		OocVertexPages pages(vfile,vertex_count,memory_budget/4);
+		OocSeams seams;
+		bool ok=true;
+		rewind(fn);
+		while(ok && fgets(line,1000,fn)!=NULL)
+		{
+			int integers[9];
+			if(line[0]!='f' || !read_obj_face(line,integers)) continue;
+			OocPosition p[3];
+			int b[3];
+			bool valid=true;
+			loopj(0,3)
+			{
+				const OocPosition *q=pages.get(integers[j]-1);
+				if(!q) { valid=false; break; }
+				p[j]=*q;
+				b[j]=grid.block(p[j],0);
+			}
+			if(!valid) continue;
+			if(b[0]!=b[1] || b[1]!=b[2]) loopj(0,3) seams.insert(p[j]);
+			std::vector<OocPosition> &buffer=buffers[b[0]];
+			buffer.insert(buffer.end(),p,p+3);
+			block_triangles[b[0]]++;
+			if(buffer.size()>=flush*3)
+			{
+				ok=ooc_append(ooc_file(output,0,b[0]),buffer);
+				buffer.clear();
+			}
+		}
+		loopi(0,nblocks) if(ok)
+		{
+			ok=ooc_append(ooc_file(output,0,i),buffers[i]);
+			std::vector<OocPosition>().swap(buffers[i]);
+		}
+		fclose(fn);
+		fclose(vfile);
+		remove(vertex_file.c_str());
+
+		// simplify level by level, block files of level l+1 hold the results of level l
+		OocWriter out;
+		if(ok) ok=out.open(output);
+		std::vector<int> stored;        // triangles spilled per block for the next level
+		OocOwners owners;               // previous seam vertices and the merged blocks holding them
+		for(int level=0; ok && level<=grid.levels; level++)
+		{
+			int n=grid.size>>level;
+			nblocks=grid.blocks(level);
+			std::vector<int> child_triangles,child_stored;
+			owners.clear();
+			if(level>0)
+			{
+				// seams of this level : previous seams shared by several merged blocks
+				loopi(0,grid.blocks(level-1)) if(stored[i])
+				{
+					FILE *file=fopen(ooc_file(output,level,i).c_str(),"rb");
+					if(!file) continue;
+					int b=grid.parent(i,level-1), m=n*2;
+					unsigned char child=1<<((i%m&1)|((i/m%m&1)<<1)|((i/(m*m)&1)<<2));
+					OocPosition p;
+					while(fread(&p,sizeof(p),1,file)==1)
+					{
+						if(seams.find(p)==seams.end()) continue;
+						OocOwner o={b,0};
+						std::pair<OocOwners::iterator,bool> it=owners.insert(std::make_pair(p,o));
+						if(it.first->second.block!=b) it.first->second.block=-1;
+						it.first->second.children|=child;
+					}
+					fclose(file);
+				}
+				seams.clear();
+				for(OocOwners::iterator it=owners.begin();it!=owners.end();++it)
+					if(it->second.block<0) seams.insert(it->first);
+
+				// input triangles of the merged blocks
+				std::vector<int> merged(nblocks,0);
+				loopi(0,block_triangles.size()) merged[grid.parent(i,level-1)]+=block_triangles[i];
+				child_triangles.swap(block_triangles);
+				block_triangles.swap(merged);
+				child_stored.swap(stored);
+			}
+			bool active=false;
+			loopi(0,nblocks) if(block_triangles[i]) active=true;
+			if(!active) break;
+			if (verbose) {
+				printf("out-of-core level %d: %d^3 blocks, %zu seam vertices\n",level,n,seams.size());
+			}
+			size_t largest=0;
+			int written=0;
+			stored.assign(nblocks,0);
+			loopi(0,nblocks) if(ok && block_triangles[i])
+			{
+				if(level==0)
+				{
+					// the block or the pieces it was split into. Pieces that
+					// would overflow the budget of the block go to the output
+					// directly, so every block of the next level fits
+					std::vector<std::string> pieces;
+					std::vector<int> piece_triangles;
+					ok=ooc_split(ooc_file(output,0,i),block_triangles[i],budget_triangles,seams,pieces,piece_triangles);
+					bool direct=false;
+					block_triangles[i]=0;
+					loopk(0,pieces.size()) if(ok)
+					{
+						vertices.clear();
+						triangles.clear();
+						{
+							std::unordered_map<OocPosition,int,OocPositionHash> weld;
+							ooc_load(pieces[k],weld);
+						}
+						if(triangles.size()>largest) largest=triangles.size();
+						ooc_lock(seams,owners,0,out);
+						int target_count=round(piece_triangles[k]*ratio);
+						if(triangles.size()>target_count)
+							simplify_mesh(target_count,agressiveness,false);
+						if(grid.levels==0 || stored[i]+triangles.size()>budget_triangles)
+						{
+							ooc_lock(seams,owners,0,out);
+							out.write();
+							direct=true;
+						}
+						else
+						{
+							stored[i]+=triangles.size();
+							block_triangles[i]+=piece_triangles[k];
+							ok=ooc_store(ooc_file(output,1,i));
+						}
+					}
+					if(direct && grid.levels) written++;
+					continue;
+				}
+
+				// the 2x2x2 children of the previous level, merged one at a time.
+				// When the next child would overflow the budget, those loaded
+				// so far are simplified to their target first, with the seams to
+				// the children still on disk locked. If that does not make room
+				// they are written to the output as they are.
+				vertices.clear();
+				triangles.clear();
+				int x=i%n, y=(i/n)%n, z=i/(n*n), input=0;
+				unsigned char loaded=0;
+				loopj(0,8)
+				{
+					int c=(((z*2+(j>>2))*n*2)+(y*2+((j>>1)&1)))*n*2+(x*2+(j&1));
+					if(!child_stored[c]) continue;
+					if(!triangles.empty() && triangles.size()+child_stored[c]>budget_triangles)
+					{
+						ooc_lock(seams,owners,loaded,out);
+						int target_count=round(input*ratio);
+						if(triangles.size()>target_count)
+							simplify_mesh(target_count,agressiveness,false);
+						if(triangles.size()+child_stored[c]>budget_triangles)
+						{
+							ooc_lock(seams,owners,loaded,out);
+							out.write();
+							written++;
+							vertices.clear();
+							triangles.clear();
+							input=0;
+						}
+					}
+					{
+						std::unordered_map<OocPosition,int,OocPositionHash> weld;
+						loopk(0,vertices.size()) weld[ooc_position(vertices[k].p)]=k;
+						ooc_load(ooc_file(output,level,c),weld);
+					}
+					loaded|=1<<j;
+					input+=child_triangles[c];
+					if(triangles.size()>largest) largest=triangles.size();
+				}
+				block_triangles[i]=input;
+				if(triangles.empty()) continue;
+				ooc_lock(seams,owners,loaded,out);
+				int target_count=round(input*ratio);
+				if(triangles.size()>target_count)
+					simplify_mesh(target_count,agressiveness,false);
+				if(level==grid.levels)
+				{
+					ooc_lock(seams,owners,loaded,out);
+					out.write();
+				}
+				else
+				{
+					stored[i]=triangles.size();
+					ok=ooc_store(ooc_file(output,level+1,i));
+				}
+			}
+			if (verbose) {
+				printf("out-of-core level %d: largest block %zu triangles\n",level,largest);
+				if(written) printf("out-of-core level %d: %d blocks written, they do not fit the budget\n",level,written);
+			}
+		}
+		vertices.clear();
+		triangles.clear();
+		if(out.file && !out.close()) ok=false;
+
+		// remove leftover spill files after an error
+		if(!ok) ooc_remove_files(output,grid);
+		return ok;
+	}
+};
+///////////////////////////////////////////
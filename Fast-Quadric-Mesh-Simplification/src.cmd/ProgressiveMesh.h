@@ -0,0 +1,201 @@
+#pragma once
+/////////////////////////////////////////////
+//
+// Progressive Mesh Stream
+//
+// Base mesh plus the ordered vertex splits that undo the edge collapses
+// of Simplify::simplify_mesh. The reader only needs this header, so it
+// can refine a mesh to any triangle count at runtime without running
+// the simplifier again.
+//
+// License : MIT
+// http://opensource.org/licenses/MIT
+//
+// File layout (little endian, written by Simplify::write_progressive)
+//
+//   char[4]  "PM01"
+//   int      base vertex count, base triangle count
+//   int      total vertex count, total triangle count
+//   int      split count, corner count
+//   float[3] positions  : base vertices first, then one new vertex per split
+//   int[3]   indices    : base triangles first, then the restored triangles
+//   VertexSplit[]       : in refinement order
+//   int[]    corners    : triangle*3+corner entries moved to the new vertex
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+namespace Progressive
+{
+	// One vertex split, the inverse of one edge collapse
+
+	struct VertexSplit
+	{
+		int v;             // vertex that is split
+		int tri_count;     // triangles appended to the active list by this split
+		int corner_count;  // triangle corners moved from v to the new vertex
+		float p[3];        // position of v before the split
+		float p0[3];       // position of v after the split
+	};
+
+	struct Mesh
+	{
+		int base_vertices,base_triangles;
+		std::vector<float> positions;     // 3 floats per vertex
+		std::vector<int> indices;         // 3 ints per triangle
+		std::vector<VertexSplit> splits;
+		std::vector<int> corners;
+		std::vector<int> corner_start;    // first corner of every split
+
+		// active part of positions[] and indices[]
+		int num_vertices,num_triangles,num_splits;
+
+		Mesh() { clear(); }
+
+		void clear()
+		{
+			base_vertices=base_triangles=0;
+			positions.clear();
+			indices.clear();
+			splits.clear();
+			corners.clear();
+			corner_start.clear();
+			num_vertices=num_triangles=num_splits=0;
+		}
+
+		// Reset to the base mesh and compute the per split corner offsets
+
+		void reset()
+		{
+			corner_start.resize(splits.size());
+			int start=0;
+			for(int i=0;i<(int)splits.size();i++)
+			{
+				corner_start[i]=start;
+				start+=splits[i].corner_count;
+			}
+			while(num_splits>0) coarsen_one();
+			num_vertices=base_vertices;
+			num_triangles=base_triangles;
+		}
+
+		// Apply the next vertex split
+
+		bool refine_one()
+		{
+			if(num_splits>=(int)splits.size()) return false;
+			VertexSplit &s=splits[num_splits];
+			int vnew=base_vertices+num_splits;
+			memcpy(&positions[s.v*3],s.p0,sizeof(s.p0));
+			const int *c=&corners[corner_start[num_splits]];
+			for(int i=0;i<s.corner_count;i++) indices[c[i]]=vnew;
+			num_triangles+=s.tri_count;
+			num_vertices++;
+			num_splits++;
+			return true;
+		}
+
+		// Undo the last vertex split
+
+		bool coarsen_one()
+		{
+			if(num_splits<=0) return false;
+			num_splits--;
+			VertexSplit &s=splits[num_splits];
+			memcpy(&positions[s.v*3],s.p,sizeof(s.p));
+			const int *c=&corners[corner_start[num_splits]];
+			for(int i=0;i<s.corner_count;i++) indices[c[i]]=s.v;
+			num_triangles-=s.tri_count;
+			num_vertices--;
+			return true;
+		}
+
+		// Refine or coarsen incrementally until target_count triangles are active
+
+		void set_triangle_count(int target_count)
+		{
+			while(num_triangles<target_count && refine_one());
+			while(num_splits>0 && num_triangles-splits[num_splits-1].tri_count>=target_count)
+				coarsen_one();
+		}
+
+		bool save(const char* filename) const
+		{
+			FILE *file=fopen(filename,"wb");
+			if(!file)
+			{
+				printf("Progressive::save: can't write data file \"%s\".\n",filename);
+				return false;
+			}
+			int header[6]={ base_vertices,base_triangles,
+				int(positions.size()/3),int(indices.size()/3),
+				int(splits.size()),int(corners.size()) };
+			fwrite("PM01",1,4,file);
+			fwrite(header,sizeof(int),6,file);
+			if(!positions.empty()) fwrite(&positions[0],sizeof(float),positions.size(),file);
+			if(!indices.empty()) fwrite(&indices[0],sizeof(int),indices.size(),file);
+			if(!splits.empty()) fwrite(&splits[0],sizeof(VertexSplit),splits.size(),file);
+			if(!corners.empty()) fwrite(&corners[0],sizeof(int),corners.size(),file);
+			fclose(file);
+			return true;
+		}
+
+		bool load(const char* filename)
+		{
+			clear();
+			FILE *file=fopen(filename,"rb");
+			if(!file)
+			{
+				printf("File %s not found!\n",filename);
+				return false;
+			}
+			char tag[4];
+			int header[6];
+			bool ok = fread(tag,1,4,file)==4 && memcmp(tag,"PM01",4)==0
+				&& fread(header,sizeof(int),6,file)==6;
+			if(ok)
+			{
+				base_vertices=header[0];
+				base_triangles=header[1];
+				positions.resize(header[2]*3);
+				indices.resize(header[3]*3);
+				splits.resize(header[4]);
+				corners.resize(header[5]);
+				ok = fread(positions.empty()?0:&positions[0],sizeof(float),positions.size(),file)==positions.size()
+					&& fread(indices.empty()?0:&indices[0],sizeof(int),indices.size(),file)==indices.size()
+					&& fread(splits.empty()?0:&splits[0],sizeof(VertexSplit),splits.size(),file)==splits.size()
+					&& fread(corners.empty()?0:&corners[0],sizeof(int),corners.size(),file)==corners.size();
+			}
+			fclose(file);
+			if(!ok)
+			{
+				printf("Progressive::load: \"%s\" is not a progressive mesh\n",filename);
+				clear();
+				return false;
+			}
+			reset();
+			return true;
+		}
+
+		// Store the active mesh as OBJ
+
+		bool write_obj(const char* filename) const
+		{
+			FILE *file=fopen(filename,"w");
+			if(!file)
+			{
+				printf("Progressive::write_obj: can't write data file \"%s\".\n",filename);
+				return false;
+			}
+			for(int i=0;i<num_vertices;i++)
+				fprintf(file,"v %g %g %g\n",positions[i*3],positions[i*3+1],positions[i*3+2]);
+			for(int i=0;i<num_triangles;i++)
+				fprintf(file,"f %d %d %d\n",indices[i*3]+1,indices[i*3+1]+1,indices[i*3+2]+1);
+			fclose(file);
+			return true;
+		}
+	};
+};
+///////////////////////////////////////////
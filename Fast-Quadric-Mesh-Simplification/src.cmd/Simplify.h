@@ -1,3 +1,4 @@
+#pragma once
 /////////////////////////////////////////////
 //
 // Mesh Simplification Tutorial
@@ -22,8 +23,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <vector>
+#include <algorithm>
 #include <math.h>
 #include <float.h> //FLT_EPSILON, DBL_EPSILON
+#include <chrono>
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+#include "ProgressiveMesh.h"
+#include "Meshlets.h"
 
 #define loopi(start_l,end_l) for ( int i=start_l;i<end_l;++i )
 #define loopi(start_l,end_l) for ( int i=start_l;i<end_l;++i )
@@ -217,6 +227,17 @@ double min(double v1, double v2) {
 }
 
 
+// Precision of the quadrics and edge errors. Compile with -DSIMPLIFY_FLOAT
+// to store them as float, which halves Simplify::quadrics and errors (80 to
+// 40 bytes per vertex, 32 to 16 per triangle). Determinants and errors are
+// still evaluated in double.
+
+#ifdef SIMPLIFY_FLOAT
+typedef float qfloat;
+#else
+typedef double qfloat;
+#endif
+
 class SymetricMatrix {
 
 	public:
@@ -253,8 +274,9 @@ class SymetricMatrix {
 				int a21, int a22, int a23,
 				int a31, int a32, int a33)
 	{
-		double det =  m[a11]*m[a22]*m[a33] + m[a13]*m[a21]*m[a32] + m[a12]*m[a23]*m[a31]
-					- m[a13]*m[a22]*m[a31] - m[a11]*m[a23]*m[a32]- m[a12]*m[a21]*m[a33];
+		const SymetricMatrix &q = *this;
+		double det =  q[a11]*q[a22]*q[a33] + q[a13]*q[a21]*q[a32] + q[a12]*q[a23]*q[a31]
+					- q[a13]*q[a22]*q[a31] - q[a11]*q[a23]*q[a32]- q[a12]*q[a21]*q[a33];
 		return det;
 	}
 
@@ -274,29 +296,139 @@ class SymetricMatrix {
 		return *this;
 	}
 
-	double m[10];
+	qfloat m[10];
+};
+
+// Four doubles evaluated together, for the edge errors of a triangle : AVX
+// when compiled with -mavx ( /arch:AVX ), else two SSE2 pairs, else an array
+
+#if defined(__AVX__)
+struct double4
+{
+	__m256d v;
+	double4() {}
+	double4(__m256d a) : v(a) {}
+	double4(double a) : v(_mm256_set1_pd(a)) {}
+	double4(double a,double b,double c,double d) : v(_mm256_setr_pd(a,b,c,d)) {}
+	static double4 load(const double *a) { return _mm256_loadu_pd(a); }
+	void store(double *a) const { _mm256_storeu_pd(a,v); }
+	double4 operator+(const double4 &b) const { return _mm256_add_pd(v,b.v); }
+	double4 operator-(const double4 &b) const { return _mm256_sub_pd(v,b.v); }
+	double4 operator*(const double4 &b) const { return _mm256_mul_pd(v,b.v); }
+	double4 operator/(const double4 &b) const { return _mm256_div_pd(v,b.v); }
+	double4 operator-() const { return _mm256_xor_pd(v,_mm256_set1_pd(-0.0)); }
 };
+#elif defined(__SSE2__) || defined(_M_X64)
+struct double4
+{
+	__m128d lo,hi;
+	double4() {}
+	double4(__m128d a,__m128d b) : lo(a),hi(b) {}
+	double4(double a) : lo(_mm_set1_pd(a)),hi(lo) {}
+	double4(double a,double b,double c,double d) : lo(_mm_setr_pd(a,b)),hi(_mm_setr_pd(c,d)) {}
+	static double4 load(const double *a) { return double4(_mm_loadu_pd(a),_mm_loadu_pd(a+2)); }
+	void store(double *a) const { _mm_storeu_pd(a,lo); _mm_storeu_pd(a+2,hi); }
+	double4 operator+(const double4 &b) const { return double4(_mm_add_pd(lo,b.lo),_mm_add_pd(hi,b.hi)); }
+	double4 operator-(const double4 &b) const { return double4(_mm_sub_pd(lo,b.lo),_mm_sub_pd(hi,b.hi)); }
+	double4 operator*(const double4 &b) const { return double4(_mm_mul_pd(lo,b.lo),_mm_mul_pd(hi,b.hi)); }
+	double4 operator/(const double4 &b) const { return double4(_mm_div_pd(lo,b.lo),_mm_div_pd(hi,b.hi)); }
+	double4 operator-() const { __m128d s=_mm_set1_pd(-0.0); return double4(_mm_xor_pd(lo,s),_mm_xor_pd(hi,s)); }
+};
+#else
+struct double4
+{
+	double v[4];
+	double4() {}
+	double4(double a) { loopi(0,4) v[i]=a; }
+	double4(double a,double b,double c,double d) { v[0]=a; v[1]=b; v[2]=c; v[3]=d; }
+	static double4 load(const double *a) { double4 r; loopi(0,4) r.v[i]=a[i]; return r; }
+	void store(double *a) const { loopi(0,4) a[i]=v[i]; }
+	double4 operator+(const double4 &b) const { double4 r; loopi(0,4) r.v[i]=v[i]+b.v[i]; return r; }
+	double4 operator-(const double4 &b) const { double4 r; loopi(0,4) r.v[i]=v[i]-b.v[i]; return r; }
+	double4 operator*(const double4 &b) const { double4 r; loopi(0,4) r.v[i]=v[i]*b.v[i]; return r; }
+	double4 operator/(const double4 &b) const { double4 r; loopi(0,4) r.v[i]=v[i]/b.v[i]; return r; }
+	double4 operator-() const { double4 r; loopi(0,4) r.v[i]=-v[i]; return r; }
+};
+#endif
 ///////////////////////////////////////////
 
 namespace Simplify
 {
 	// Global Variables & Strctures
 
-	struct Triangle { int v[3];double err[4];int deleted,dirty;vec3f n; };
-	struct Vertex { vec3f p;int tstart,tcount;SymetricMatrix q;int border;};
+	struct Triangle { int v[3];unsigned int deleted:1,dirty:1,id:30; }; // id : index at load, for corner_wedges
+	struct Vertex { vec3f p;int tstart,tcount;unsigned int border:1,locked:1;};
 	struct Ref { int tid,tvertex; };
 	std::vector<Triangle> triangles;
 	std::vector<Vertex> vertices;
 	std::vector<Ref> refs;
 
+	// Hot and cold data : Triangle and Vertex keep what every pass reads, the
+	// quadrics, edge errors and face normals live in arrays of their own. They
+	// are indexed like vertices and triangles, built by update_mesh(0), kept in
+	// step when the triangles are compacted and released by compact_mesh()
+	std::vector<SymetricMatrix> quadrics; // per vertex
+	std::vector<qfloat> errors;           // 4 per triangle : 3 edges, then their minimum
+	std::vector<vec3f> normals;           // per triangle, for the flip test
+
+	// Per corner attributes, only allocated when the input has vt or vn.
+	// A wedge is one attribute value of one vertex, shared by all corners of
+	// the vertex on the same side of a UV or normal seam; corner j of a
+	// triangle uses wedges[corner_wedges[t.id*3+j]]
+	enum Attributes { NONE=0, TEXCOORD=1, NORMAL=2 };
+	struct Wedge { float uv[2],vn[3]; };
+	int attributes=NONE;
+	std::vector<Wedge> wedges;
+	std::vector<int> corner_wedges;
+	std::vector<int> wedge_pairs; // w1,w0,tid per edge triangle, see match_wedges
+
+	// LOD snapshot : compacted copy of the mesh taken by simplify_mesh_lods
+	struct Mesh { std::vector<Triangle> triangles; std::vector<Vertex> vertices; std::vector<Wedge> wedges; std::vector<int> corner_wedges; };
+	std::vector<Mesh> lods;
+
+	// Progressive mesh : set record_collapses before simplifying to log every
+	// edge collapse, the vertex split stream is then built into progressive
+	struct Collapse { int i0,i1; vec3f p,p0,p1; int tstart,tcount,cstart,ccount; };
+	bool record_collapses=false;
+	std::vector<Collapse> collapses;
+	std::vector<int> collapse_tris;    // triangles deleted by a collapse
+	std::vector<Ref> collapse_corners; // triangle corners moved from i1 to i0
+	Progressive::Mesh progressive;
+
+	// Phase timings in seconds of the last simplify_mesh run, for benchmarks
+	struct Stats
+	{
+		double init,compact;
+		std::vector<double> iteration_time;    // includes the periodic update_mesh
+		std::vector<int> iteration_triangles;  // triangles left after the iteration
+	};
+	Stats stats;
+
+	double seconds()
+	{
+		return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
 	// Helper functions
 
-	double vertex_error(SymetricMatrix q, double x, double y, double z);
+	double vertex_error(const SymetricMatrix &q, double x, double y, double z);
 	double calculate_error(int id_v1, int id_v2, vec3f &p_result);
+	void calculate_errors(const Triangle &t, qfloat err[4]);
+	void move_triangle(int i,int dst);
+	void resize_triangles(int count);
 	bool flipped(vec3f p,int i0,int i1,Vertex &v0,Vertex &v1,std::vector<int> &deleted);
 	void update_triangles(int i0,Vertex &v,std::vector<int> &deleted,int &deleted_triangles);
+	bool match_wedges(int i1,Vertex &v0,Vertex &v1,std::vector<int> &deleted0,std::vector<int> &deleted1);
+	void update_wedges(const vec3f &p,Vertex &v1,std::vector<int> &deleted1);
+	void build_wedges();
 	void update_mesh(int iteration);
+	void update_refs();
 	void compact_mesh();
+	void compact_mesh(std::vector<Triangle> &triangles,std::vector<Vertex> &vertices);
+	void write_obj(const char* filename,std::vector<Triangle> &triangles,std::vector<Vertex> &vertices,
+		std::vector<Wedge> &wedges,std::vector<int> &corner_wedges);
+	bool collapse_edge(int i0,int i1,std::vector<int> &deleted0,std::vector<int> &deleted1,int &deleted_triangles);
+	void build_progressive();
 	//
 	// Main simplification function
 	//
@@ -315,17 +447,25 @@ namespace Simplify
 		int deleted_triangles=0;
 		std::vector<int> deleted0,deleted1;
 		int triangle_count=triangles.size();
+		stats=Stats();
+		stats.init=0;
 		//int iteration = 0;
 		//loop(iteration,0,100)
 		for (int iteration = 0; iteration < 100; iteration ++)
 		{
 			if(triangle_count-deleted_triangles<=target_count)break;
+			double start=seconds();
 
 			// update mesh once in a while
 			if(iteration%5==0)
 			{
 				update_mesh(iteration);
 			}
+			if(iteration==0)
+			{
+				stats.init=seconds()-start;
+				start+=stats.init;
+			}
 
 			// clear dirty flag
 			loopi(0,triangles.size()) triangles[i].dirty=0;
@@ -347,145 +487,300 @@ namespace Simplify
 			loopi(0,triangles.size())
 			{
 				Triangle &t=triangles[i];
-				if(t.err[3]>threshold) continue;
+				const qfloat *err=&errors[i*4];
+				if(err[3]>threshold) continue;
 				if(t.deleted) continue;
 				if(t.dirty) continue;
 
-				loopj(0,3)if(t.err[j]<threshold)
+				loopj(0,3)if(err[j]<threshold)
 				{
-
-					int i0=t.v[ j     ]; Vertex &v0 = vertices[i0];
-					int i1=t.v[(j+1)%3]; Vertex &v1 = vertices[i1];
-					// Border check
-					if(v0.border != v1.border)  continue;
-
-					// Compute vertex to collapse to
-					vec3f p;
-					calculate_error(i0,i1,p);
-					deleted0.resize(v0.tcount); // normals temporarily
-					deleted1.resize(v1.tcount); // normals temporarily
-					// dont remove if flipped
-					if( flipped(p,i0,i1,v0,v1,deleted0) ) continue;
-
-					if( flipped(p,i1,i0,v1,v0,deleted1) ) continue;
-
-
-					// not flipped, so remove edge
-					v0.p=p;
-					v0.q=v1.q+v0.q;
-					int tstart=refs.size();
-
-					update_triangles(i0,v0,deleted0,deleted_triangles);
-					update_triangles(i0,v1,deleted1,deleted_triangles);
-
-					int tcount=refs.size()-tstart;
-
-					if(tcount<=v0.tcount)
-					{
-						// save ram
-						if(tcount)memcpy(&refs[v0.tstart],&refs[tstart],tcount*sizeof(Ref));
-					}
-					else
-						// append
-						v0.tstart=tstart;
-
-					v0.tcount=tcount;
-					break;
+					if(collapse_edge(t.v[j],t.v[(j+1)%3],deleted0,deleted1,deleted_triangles))break;
 				}
 				// done?
 				if(triangle_count-deleted_triangles<=target_count)break;
 			}
+			stats.iteration_time.push_back(seconds()-start);
+			stats.iteration_triangles.push_back(triangle_count-deleted_triangles);
 		}
 		// clean up mesh
+		double start=seconds();
 		compact_mesh();
+		stats.compact=seconds()-start;
 	} //simplify_mesh()
 
-	void simplify_mesh_lossless(bool verbose=false)
+	// Store a compacted copy of the current mesh as next LOD
+
+	void add_lod(int lod, bool verbose)
 	{
+		lods.push_back(Mesh());
+		lods.back().triangles=triangles;
+		lods.back().vertices=vertices;
+		compact_mesh(lods.back().triangles,lods.back().vertices);
+		if(!corner_wedges.empty())
+		{
+			// the wedges keep changing, so the snapshot takes its own
+			Mesh &lod=lods.back();
+			lod.wedges=wedges;
+			lod.corner_wedges.resize(lod.triangles.size()*3);
+			loopi(0,lod.triangles.size())
+			{
+				loopj(0,3) lod.corner_wedges[i*3+j]=corner_wedges[lod.triangles[i].id*3+j];
+				lod.triangles[i].id=i;
+			}
+		}
+		if (verbose) {
+			printf("lod %d - triangles %zu vertices %zu\n",lod,lods.back().triangles.size(),lods.back().vertices.size());
+		}
+	}
+
+	//
+	// LOD chain in a single run
+	//
+	// ratios        : target ratios of the input triangle count, e.g. 0.5,0.25,0.1
+	//                 one compacted snapshot per ratio is stored in lods[],
+	//                 ordered from the finest to the coarsest level
+	//
+	// The collapse continues monotonically from one level to the next, so the
+	// quadrics are only initialized once instead of once per LOD.
+	//
+
+	void simplify_mesh_lods(std::vector<double> ratios, double agressiveness=7, bool verbose=false)
+	{
+		lods.clear();
+		if(ratios.empty()) return;
+		std::sort(ratios.begin(),ratios.end());
+		std::reverse(ratios.begin(),ratios.end());
+
+		int triangle_count=triangles.size();
+		std::vector<int> target_counts(ratios.size());
+		loopi(0,ratios.size()) target_counts[i]=round(triangle_count*ratios[i]);
+
 		// init
 		loopi(0,triangles.size()) triangles[i].deleted=0;
 
 		// main iteration loop
 		int deleted_triangles=0;
 		std::vector<int> deleted0,deleted1;
-		int triangle_count=triangles.size();
-		//int iteration = 0;
-		//loop(iteration,0,100)
-		for (int iteration = 0; iteration < 9999; iteration ++)
+		int lod=0;
+		for (int iteration = 0; iteration < 100; iteration ++)
 		{
-			// update mesh constantly
-			update_mesh(iteration);
+			// target number of triangles of the last level reached ? Then break
+			while(lod<target_counts.size() && triangle_count-deleted_triangles<=target_counts[lod])
+				add_lod(lod++,verbose);
+			if(lod>=target_counts.size())break;
+
+			// update mesh once in a while
+			if(iteration%5==0)
+			{
+				update_mesh(iteration);
+			}
+
 			// clear dirty flag
 			loopi(0,triangles.size()) triangles[i].dirty=0;
-			//
-			// All triangles with edges below the threshold will be removed
-			//
-			// The following numbers works well for most models.
-			// If it does not, try to adjust the 3 parameters
-			//
-			double threshold = DBL_EPSILON; //1.0E-3 EPS;
-			if (verbose) {
-				printf("lossless iteration %d\n", iteration);
+
+			// same threshold schedule as simplify_mesh()
+			double threshold = 0.000000001*pow(double(iteration+3),agressiveness);
+
+			if ((verbose) && (iteration%5==0)) {
+				printf("iteration %d - triangles %d threshold %g\n",iteration,triangle_count-deleted_triangles, threshold);
 			}
 
 			// remove vertices & mark deleted triangles
 			loopi(0,triangles.size())
 			{
 				Triangle &t=triangles[i];
-				if(t.err[3]>threshold) continue;
+				const qfloat *err=&errors[i*4];
+				if(err[3]>threshold) continue;
 				if(t.deleted) continue;
 				if(t.dirty) continue;
 
-				loopj(0,3)if(t.err[j]<threshold)
+				loopj(0,3)if(err[j]<threshold)
 				{
-					int i0=t.v[ j     ]; Vertex &v0 = vertices[i0];
-					int i1=t.v[(j+1)%3]; Vertex &v1 = vertices[i1];
-
-					// Border check
-					if(v0.border != v1.border)  continue;
-
-					// Compute vertex to collapse to
-					vec3f p;
-					calculate_error(i0,i1,p);
+					if(collapse_edge(t.v[j],t.v[(j+1)%3],deleted0,deleted1,deleted_triangles))break;
+				}
+				// level done? snapshot and keep collapsing towards the next one
+				while(lod<target_counts.size() && triangle_count-deleted_triangles<=target_counts[lod])
+					add_lod(lod++,verbose);
+				if(lod>=target_counts.size())break;
+			}
+		}
+		// levels that could not be reached get the coarsest mesh available
+		while(lod<target_counts.size()) add_lod(lod++,verbose);
+		// clean up mesh
+		compact_mesh();
+	} //simplify_mesh_lods()
 
-					deleted0.resize(v0.tcount); // normals temporarily
-					deleted1.resize(v1.tcount); // normals temporarily
+	// Lossless mode : the reference list is rebuilt once it has grown to
+	// this many times the live references ( collapses append to refs )
 
-					// dont remove if flipped
-					if( flipped(p,i0,i1,v0,v1,deleted0) ) continue;
-					if( flipped(p,i1,i0,v1,v0,deleted1) ) continue;
+	double lossless_refs_growth=4.0;
 
-					// not flipped, so remove edge
-					v0.p=p;
-					v0.q=v1.q+v0.q;
-					int tstart=refs.size();
+	void simplify_mesh_lossless(bool verbose=false)
+	{
+		// init
+		loopi(0,triangles.size()) triangles[i].deleted=0;
+		update_mesh(0);
 
-					update_triangles(i0,v0,deleted0,deleted_triangles);
-					update_triangles(i0,v1,deleted1,deleted_triangles);
+		// main iteration loop
+		//
+		// Only the triangles touched by the previous pass are revisited,
+		// the first pass starts with all of them.
+		//
+		int deleted_triangles=0;
+		int live_triangles=triangles.size();
+		std::vector<int> deleted0,deleted1,work,touched;
+		std::vector<char> queued(triangles.size(),0);
+		work.resize(triangles.size());
+		loopi(0,work.size()) work[i]=i;
+		double threshold = DBL_EPSILON; //1.0E-3 EPS;
+		for (int iteration = 0; iteration < 9999; iteration ++)
+		{
+			if (verbose) {
+				printf("lossless iteration %d - %zu triangles queued\n", iteration, work.size());
+			}
+			// clear dirty flag, every dirty triangle is queued
+			loopi(0,work.size()) triangles[work[i]].dirty=0;
 
-					int tcount=refs.size()-tstart;
+			// remove vertices & mark deleted triangles
+			touched.clear();
+			loopi(0,work.size())
+			{
+				Triangle &t=triangles[work[i]];
+				const qfloat *err=&errors[work[i]*4];
+				if(err[3]>threshold) continue;
+				if(t.deleted) continue;
+				if(t.dirty) continue;
 
-					if(tcount<=v0.tcount)
+				loopj(0,3)if(err[j]<threshold)
+				{
+					int i0=t.v[j];
+					if(collapse_edge(i0,t.v[(j+1)%3],deleted0,deleted1,deleted_triangles))
 					{
-						// save ram
-						if(tcount)memcpy(&refs[v0.tstart],&refs[tstart],tcount*sizeof(Ref));
+						Vertex &v=vertices[i0];
+						loopk(0,v.tcount) touched.push_back(refs[v.tstart+k].tid);
+						break;
 					}
-					else
-						// append
-						v0.tstart=tstart;
-
-					v0.tcount=tcount;
-					break;
 				}
 			}
 			if(deleted_triangles<=0)break;
+			live_triangles-=deleted_triangles;
 			deleted_triangles=0;
+
+			// next pass : touched triangles and their neighbours, since the
+			// flip test of an edge depends on the one ring of both vertices
+			work.clear();
+			loopi(0,touched.size())
+			{
+				Triangle &t=triangles[touched[i]];
+				if(t.deleted) continue;
+				loopj(0,3)
+				{
+					Vertex &v=vertices[t.v[j]];
+					loopk(0,v.tcount)
+					{
+						int id=refs[v.tstart+k].tid;
+						if(triangles[id].deleted || queued[id]) continue;
+						queued[id]=1;
+						work.push_back(id);
+					}
+				}
+			}
+			loopi(0,work.size()) queued[work[i]]=0;
+			std::sort(work.begin(),work.end());
+
+			// rebuild fragmented refs, compact triangles unless recording
+			if(refs.size()>lossless_refs_growth*3*live_triangles)
+			{
+				if(!record_collapses)
+				{
+					std::vector<int> remap(triangles.size());
+					int dst=0;
+					loopi(0,triangles.size())
+					if(!triangles[i].deleted)
+					{
+						remap[i]=dst;
+						move_triangle(i,dst++);
+					}
+					resize_triangles(dst);
+					queued.resize(dst);
+					loopi(0,work.size()) work[i]=remap[work[i]];
+				}
+				update_refs();
+			}
 		} //for each iteration
 		// clean up mesh
 		compact_mesh();
 	} //simplify_mesh_lossless()
 
 
+	// Collapse edge i0-i1 into i0, returns false if the edge has to stay
+
+	bool collapse_edge(int i0,int i1,std::vector<int> &deleted0,std::vector<int> &deleted1,int &deleted_triangles)
+	{
+		Vertex &v0 = vertices[i0];
+		Vertex &v1 = vertices[i1];
+
+		// Border check
+		if(v0.border != v1.border) return false;
+
+		// Locked vertices keep their position, e.g. block seams out-of-core
+		if(v0.locked || v1.locked) return false;
+
+		// Compute vertex to collapse to
+		vec3f p;
+		calculate_error(i0,i1,p);
+
+		deleted0.resize(v0.tcount); // normals temporarily
+		deleted1.resize(v1.tcount); // normals temporarily
+
+		// dont remove if flipped
+		if( flipped(p,i0,i1,v0,v1,deleted0) ) return false;
+		if( flipped(p,i1,i0,v1,v0,deleted1) ) return false;
+
+		// dont move a vertex across a UV or normal seam
+		if( !corner_wedges.empty() && !match_wedges(i1,v0,v1,deleted0,deleted1) ) return false;
+
+		// not flipped, so remove edge
+		if(record_collapses)
+		{
+			Collapse c;
+			c.i0=i0; c.i1=i1; c.p=p; c.p0=v0.p; c.p1=v1.p;
+			c.tstart=collapse_tris.size();
+			c.cstart=collapse_corners.size();
+			loopk(0,v1.tcount)
+			{
+				Ref &r=refs[v1.tstart+k];
+				if(triangles[r.tid].deleted)continue;
+				if(deleted1[k]) collapse_tris.push_back(r.tid);
+				else collapse_corners.push_back(r);
+			}
+			c.tcount=collapse_tris.size()-c.tstart;
+			c.ccount=collapse_corners.size()-c.cstart;
+			collapses.push_back(c);
+		}
+		if(!corner_wedges.empty()) update_wedges(p,v1,deleted1);
+		v0.p=p;
+		quadrics[i0]=quadrics[i1]+quadrics[i0];
+		int tstart=refs.size();
+
+		update_triangles(i0,v0,deleted0,deleted_triangles);
+		update_triangles(i0,v1,deleted1,deleted_triangles);
+
+		int tcount=refs.size()-tstart;
+
+		if(tcount<=v0.tcount)
+		{
+			// save ram
+			if(tcount)memcpy(&refs[v0.tstart],&refs[tstart],tcount*sizeof(Ref));
+		}
+		else
+			// append
+			v0.tstart=tstart;
+
+		v0.tcount=tcount;
+		return true;
+	}
+
 	// Check if a triangle flips when this edge is removed
 
 	bool flipped(vec3f p,int i0,int i1,Vertex &v0,Vertex &v1,std::vector<int> &deleted)
@@ -513,16 +808,132 @@ namespace Simplify
 			n.cross(d1,d2);
 			n.normalize();
 			deleted[k]=0;
-			if(n.dot(t.n)<0.2) return true;
+			if(n.dot(normals[refs[v0.tstart+k].tid])<0.2) return true;
 		}
 		return false;
 	}
 
+	// Pair the wedges of v1 with those of v0 through the triangles on the
+	// edge i0-i1, into wedge_pairs. Fails if the edge crosses a seam : a
+	// wedge of v0 or v1 is on none of these triangles, or pairs with two.
+	// Seam vertices can therefore only collapse along their seam
+
+	bool match_wedges(int i1,Vertex &v0,Vertex &v1,std::vector<int> &deleted0,std::vector<int> &deleted1)
+	{
+		wedge_pairs.clear();
+		loopk(0,v0.tcount)
+		{
+			Ref &r=refs[v0.tstart+k];
+			Triangle &t=triangles[r.tid];
+			if(t.deleted || !deleted0[k]) continue;
+			int s=t.v[(r.tvertex+1)%3]==i1 ? (r.tvertex+1)%3 : (r.tvertex+2)%3;
+			int w0=corner_wedges[t.id*3+r.tvertex], w1=corner_wedges[t.id*3+s];
+			bool found=false;
+			for(int j=0;j<(int)wedge_pairs.size();j+=3)
+			{
+				if((wedge_pairs[j]==w1) != (wedge_pairs[j+1]==w0)) return false;
+				if(wedge_pairs[j]==w1) found=true;
+			}
+			if(found) continue;
+			wedge_pairs.push_back(w1);
+			wedge_pairs.push_back(w0);
+			wedge_pairs.push_back(r.tid);
+		}
+		loopk(0,2)
+		{
+			Vertex &v=k ? v1 : v0;
+			loopj(0,v.tcount)
+			{
+				Ref &r=refs[v.tstart+j];
+				Triangle &t=triangles[r.tid];
+				if(t.deleted || (k ? deleted1[j] : deleted0[j])) continue;
+				int w=corner_wedges[t.id*3+r.tvertex];
+				bool found=false;
+				for(int i=0;i<(int)wedge_pairs.size() && !found;i+=3) found=wedge_pairs[i+1-k]==w;
+				if(!found) return false;
+			}
+		}
+		return true;
+	}
+
+	// Interpolate each wedge pair once at the collapse position p, within its
+	// edge triangle and before the vertex positions are updated, then move
+	// the remaining corners of v1 onto the wedges of v0
+
+	void update_wedges(const vec3f &p,Vertex &v1,std::vector<int> &deleted1)
+	{
+		for(int j=0;j<(int)wedge_pairs.size();j+=3)
+		{
+			Triangle &t=triangles[wedge_pairs[j+2]];
+			int w0=wedge_pairs[j+1];
+
+			// barycentric coordinates of p projected into the triangle plane,
+			// not clamped so p outside the triangle extrapolates
+			vec3f &a=vertices[t.v[0]].p;
+			vec3f e0=vertices[t.v[1]].p-a, e1=vertices[t.v[2]].p-a, e2=p-a;
+			double d00=e0.dot(e0), d01=e0.dot(e1), d11=e1.dot(e1);
+			double d20=e2.dot(e0), d21=e2.dot(e1);
+			double denom=d00*d11-d01*d01;
+			if(fabs(denom)<1e-30) continue;
+			double b[3];
+			b[1]=(d11*d20-d01*d21)/denom;
+			b[2]=(d00*d21-d01*d20)/denom;
+			b[0]=1.0-b[1]-b[2];
+
+			Wedge w;
+			const Wedge *c[3];
+			loopk(0,3) c[k]=&wedges[corner_wedges[t.id*3+k]];
+			loopk(0,2) w.uv[k]=b[0]*c[0]->uv[k]+b[1]*c[1]->uv[k]+b[2]*c[2]->uv[k];
+			vec3f n(0,0,0);
+			loopk(0,3) n=n+vec3f(c[k]->vn[0],c[k]->vn[1],c[k]->vn[2])*b[k];
+			if(n.dot(n)>0) n.normalize();
+			w.vn[0]=n.x; w.vn[1]=n.y; w.vn[2]=n.z;
+			wedges[w0]=w;
+		}
+		loopk(0,v1.tcount)
+		{
+			Ref &r=refs[v1.tstart+k];
+			if(triangles[r.tid].deleted || deleted1[k]) continue;
+			int &w=corner_wedges[triangles[r.tid].id*3+r.tvertex];
+			for(int j=0;j<(int)wedge_pairs.size();j+=3)
+				if(wedge_pairs[j]==w) { w=wedge_pairs[j+1]; break; }
+		}
+	}
+
+	// One wedge per vertex and attribute value : corners of a vertex with
+	// equal attributes share a wedge, unused wedges are dropped
+
+	void build_wedges()
+	{
+		std::vector<Wedge> built;
+		std::vector<int> ids;
+		loopi(0,vertices.size())
+		{
+			Vertex &v=vertices[i];
+			ids.clear();
+			loopj(0,v.tcount)
+			{
+				Ref &r=refs[v.tstart+j];
+				Triangle &t=triangles[r.tid];
+				if(t.deleted) continue;
+				int &w=corner_wedges[t.id*3+r.tvertex];
+				int k=0;
+				while(k<(int)ids.size() && memcmp(&built[ids[k]],&wedges[w],sizeof(Wedge))!=0) k++;
+				if(k==(int)ids.size())
+				{
+					ids.push_back(built.size());
+					built.push_back(wedges[w]);
+				}
+				w=ids[k];
+			}
+		}
+		wedges.swap(built);
+	}
+
 	// Update triangle connections and edge error after a edge is collapsed
 
 	void update_triangles(int i0,Vertex &v,std::vector<int> &deleted,int &deleted_triangles)
 	{
-		vec3f p;
 		loopk(0,v.tcount)
 		{
 			Ref &r=refs[v.tstart+k];
@@ -536,70 +947,27 @@ namespace Simplify
 			}
 			t.v[r.tvertex]=i0;
 			t.dirty=1;
-			t.err[0]=calculate_error(t.v[0],t.v[1],p);
-			t.err[1]=calculate_error(t.v[1],t.v[2],p);
-			t.err[2]=calculate_error(t.v[2],t.v[0],p);
-			t.err[3]=min(t.err[0],min(t.err[1],t.err[2]));
+			calculate_errors(t,&errors[r.tid*4]);
 			refs.push_back(r);
 		}
 	}
 
-	// compact triangles, compute edge error and build reference list
+	// Build the reference list from scratch, deleted triangles are left out
 
-	void update_mesh(int iteration)
+	void update_refs()
 	{
-		if(iteration>0) // compact triangles
-		{
-			int dst=0;
-			loopi(0,triangles.size())
-			if(!triangles[i].deleted)
-			{
-				triangles[dst++]=triangles[i];
-			}
-			triangles.resize(dst);
-		}
-		//
-		// Init Quadrics by Plane & Edge Errors
-		//
-		// required at the beginning ( iteration == 0 )
-		// recomputing during the simplification is not required,
-		// but mostly improves the result for closed meshes
-		//
-		if( iteration == 0 )
-		{
-			loopi(0,vertices.size())
-			vertices[i].q=SymetricMatrix(0.0);
-
-			loopi(0,triangles.size())
-			{
-				Triangle &t=triangles[i];
-				vec3f n,p[3];
-				loopj(0,3) p[j]=vertices[t.v[j]].p;
-				n.cross(p[1]-p[0],p[2]-p[0]);
-				n.normalize();
-				t.n=n;
-				loopj(0,3) vertices[t.v[j]].q =
-					vertices[t.v[j]].q+SymetricMatrix(n.x,n.y,n.z,-n.dot(p[0]));
-			}
-			loopi(0,triangles.size())
-			{
-				// Calc Edge Error
-				Triangle &t=triangles[i];vec3f p;
-				loopj(0,3) t.err[j]=calculate_error(t.v[j],t.v[(j+1)%3],p);
-				t.err[3]=min(t.err[0],min(t.err[1],t.err[2]));
-			}
-		}
-
 		// Init Reference ID list
 		loopi(0,vertices.size())
 		{
 			vertices[i].tstart=0;
 			vertices[i].tcount=0;
 		}
-		loopi(0,triangles.size())
+		int live=0;
+		loopi(0,triangles.size()) if(!triangles[i].deleted)
 		{
 			Triangle &t=triangles[i];
 			loopj(0,3) vertices[t.v[j]].tcount++;
+			live++;
 		}
 		int tstart=0;
 		loopi(0,vertices.size())
@@ -611,8 +979,8 @@ namespace Simplify
 		}
 
 		// Write References
-		refs.resize(triangles.size()*3);
-		loopi(0,triangles.size())
+		refs.resize(live*3);
+		loopi(0,triangles.size()) if(!triangles[i].deleted)
 		{
 			Triangle &t=triangles[i];
 			loopj(0,3)
@@ -623,6 +991,54 @@ namespace Simplify
 				v.tcount++;
 			}
 		}
+	}
+
+	// compact triangles, compute edge error and build reference list
+
+	void update_mesh(int iteration)
+	{
+		// compact triangles ( not while recording, the collapse log uses the triangle ids )
+		if(iteration>0 && !record_collapses)
+		{
+			int dst=0;
+			loopi(0,triangles.size())
+			if(!triangles[i].deleted)
+			{
+				move_triangle(i,dst++);
+			}
+			resize_triangles(dst);
+		}
+		//
+		// Init Quadrics by Plane & Edge Errors
+		//
+		// required at the beginning ( iteration == 0 )
+		// recomputing during the simplification is not required,
+		// but mostly improves the result for closed meshes
+		//
+		if( iteration == 0 )
+		{
+			collapses.clear();
+			collapse_tris.clear();
+			collapse_corners.clear();
+
+			quadrics.assign(vertices.size(),SymetricMatrix(0.0));
+			errors.resize(triangles.size()*4);
+			normals.resize(triangles.size());
+
+			loopi(0,triangles.size())
+			{
+				Triangle &t=triangles[i];
+				vec3f n,p[3];
+				loopj(0,3) p[j]=vertices[t.v[j]].p;
+				n.cross(p[1]-p[0],p[2]-p[0]);
+				n.normalize();
+				normals[i]=n;
+				loopj(0,3) quadrics[t.v[j]] =
+					quadrics[t.v[j]]+SymetricMatrix(n.x,n.y,n.z,-n.dot(p[0]));
+			}
+		}
+
+		update_refs();
 
 		// Identify boundary : vertices[].border=0,1
 		if( iteration == 0 )
@@ -661,12 +1077,108 @@ namespace Simplify
 				loopj(0,vcount.size()) if(vcount[j]==1)
 					vertices[vids[j]].border=1;
 			}
+			if(!corner_wedges.empty()) build_wedges();
+
+			// Calc Edge Error, after the borders it depends on are known
+			loopi(0,triangles.size()) calculate_errors(triangles[i],&errors[i*4]);
 		}
 	}
 
 	// Finally compact mesh before exiting
 
 	void compact_mesh()
+	{
+		if(record_collapses) build_progressive();
+		compact_mesh(triangles,vertices);
+		std::vector<SymetricMatrix>().swap(quadrics);
+		std::vector<qfloat>().swap(errors);
+		std::vector<vec3f>().swap(normals);
+	}
+
+	// Move triangle i to dst with its cold data, for compaction ( dst <= i )
+
+	void move_triangle(int i,int dst)
+	{
+		triangles[dst]=triangles[i];
+		loopj(0,4) errors[dst*4+j]=errors[i*4+j];
+		normals[dst]=normals[i];
+	}
+
+	void resize_triangles(int count)
+	{
+		triangles.resize(count);
+		errors.resize(count*4);
+		normals.resize(count);
+	}
+
+	// Turn the collapse log into a vertex split stream, the base mesh
+	// uses the same vertex and triangle order as compact_mesh()
+
+	void build_progressive()
+	{
+		Progressive::Mesh &pm=progressive;
+		pm.clear();
+		std::vector<int> vmap(vertices.size(),-1),tmap(triangles.size(),-1);
+		std::vector<char> vbase(vertices.size(),0);
+
+		// base mesh
+		loopi(0,triangles.size()) if(!triangles[i].deleted)
+		{
+			tmap[i]=pm.base_triangles++;
+			loopj(0,3) vbase[triangles[i].v[j]]=1;
+		}
+		// vertices left without triangles but not collapsed are kept after the others
+		int ncollapses=collapses.size();
+		loopi(0,ncollapses) vbase[collapses[i].i1]=-1;
+		loopi(0,triangles.size()) loopj(0,3)
+			if(vbase[triangles[i].v[j]]==0) vbase[triangles[i].v[j]]=2;
+		loopk(1,3) loopi(0,vertices.size()) if(vbase[i]==k)
+		{
+			vmap[i]=pm.base_vertices++;
+			vec3f &p=vertices[i].p;
+			pm.positions.push_back(p.x);
+			pm.positions.push_back(p.y);
+			pm.positions.push_back(p.z);
+		}
+
+		// splits undo the collapses in reverse order
+		int tcount=pm.base_triangles;
+		loopi(0,ncollapses)
+		{
+			Collapse &c=collapses[ncollapses-1-i];
+			vmap[c.i1]=pm.base_vertices+i;
+			pm.positions.push_back(c.p1.x);
+			pm.positions.push_back(c.p1.y);
+			pm.positions.push_back(c.p1.z);
+			loopj(0,c.tcount) tmap[collapse_tris[c.tstart+j]]=tcount++;
+		}
+		loopi(0,triangles.size()) if(!triangles[i].deleted)
+			loopj(0,3) pm.indices.push_back(vmap[triangles[i].v[j]]);
+		loopi(0,ncollapses)
+		{
+			Collapse &c=collapses[ncollapses-1-i];
+			Progressive::VertexSplit s;
+			s.v=vmap[c.i0];
+			s.tri_count=c.tcount;
+			s.corner_count=c.ccount;
+			s.p[0]=c.p.x;  s.p[1]=c.p.y;  s.p[2]=c.p.z;
+			s.p0[0]=c.p0.x;s.p0[1]=c.p0.y;s.p0[2]=c.p0.z;
+			pm.splits.push_back(s);
+			loopj(0,c.tcount)
+			{
+				Triangle &t=triangles[collapse_tris[c.tstart+j]];
+				loopk(0,3) pm.indices.push_back(vmap[t.v[k]]);
+			}
+			loopj(0,c.ccount)
+			{
+				Ref &r=collapse_corners[c.cstart+j];
+				pm.corners.push_back(tmap[r.tid]*3+r.tvertex);
+			}
+		}
+		pm.reset();
+	}
+
+	void compact_mesh(std::vector<Triangle> &triangles,std::vector<Vertex> &vertices)
 	{
 		int dst=0;
 		loopi(0,vertices.size())
@@ -699,7 +1211,7 @@ namespace Simplify
 
 	// Error between vertex and Quadric
 
-	double vertex_error(SymetricMatrix q, double x, double y, double z)
+	double vertex_error(const SymetricMatrix &q, double x, double y, double z)
 	{
  		return   q[0]*x*x + 2*q[1]*x*y + 2*q[2]*x*z + 2*q[3]*x + q[4]*y*y
  		     + 2*q[5]*y*z + 2*q[6]*y + q[7]*z*z + 2*q[8]*z + q[9];
@@ -711,7 +1223,7 @@ namespace Simplify
 	{
 		// compute interpolated vertex
 
-		SymetricMatrix q = vertices[id_v1].q + vertices[id_v2].q;
+		SymetricMatrix q = quadrics[id_v1] + quadrics[id_v2];
 		bool   border = vertices[id_v1].border & vertices[id_v2].border;
 		double error=0;
 		double det = q.det(0, 1, 2, 1, 4, 5, 2, 5, 7);
@@ -742,10 +1254,95 @@ namespace Simplify
 		return error;
 	}
 
+	// SymetricMatrix::det and vertex_error on four quadrics at once, in the
+	// same order of operations so every lane matches the scalar result
+
+	double4 det4(const double4 *q, int a11, int a12, int a13,
+				int a21, int a22, int a23,
+				int a31, int a32, int a33)
+	{
+		return q[a11]*q[a22]*q[a33] + q[a13]*q[a21]*q[a32] + q[a12]*q[a23]*q[a31]
+			- q[a13]*q[a22]*q[a31] - q[a11]*q[a23]*q[a32]- q[a12]*q[a21]*q[a33];
+	}
+
+	double4 vertex_error4(const double4 *q, const double4 &x, const double4 &y, const double4 &z)
+	{
+		double4 two(2.0);
+		return   q[0]*x*x + two*q[1]*x*y + two*q[2]*x*z + two*q[3]*x + q[4]*y*y
+		     + two*q[5]*y*z + two*q[6]*y + q[7]*z*z + two*q[8]*z + q[9];
+	}
+
+	// Errors of the edges v0-v1, v1-v2, v2-v0 of t and their minimum, as
+	// calculate_error() with the three edges in the lanes of one double4.
+	// Singular and border edges take the scalar path
+
+	void calculate_errors(const Triangle &t, qfloat err[4])
+	{
+		const SymetricMatrix &a=quadrics[t.v[0]], &b=quadrics[t.v[1]], &c=quadrics[t.v[2]];
+		double4 q[10];
+		loopi(0,10)
+		{
+			qfloat ab=a[i]+b[i];
+			q[i]=double4(ab,(qfloat)(b[i]+c[i]),(qfloat)(c[i]+a[i]),ab);
+		}
+
+		// -1/det*d == -(1/det*d) exactly, so one division serves x, y and z
+		double4 det=det4(q, 0, 1, 2, 1, 4, 5, 2, 5, 7);
+		double4 inv=double4(1.0)/det;
+		double4 x=-(inv*det4(q, 1, 2, 3, 4, 5, 6, 5, 7, 8));
+		double4 y=   inv*det4(q, 0, 2, 3, 1, 5, 6, 2, 7, 8);
+		double4 z=-(inv*det4(q, 0, 1, 3, 1, 4, 6, 2, 5, 8));
+		double d[4],e[4];
+		det.store(d);
+		vertex_error4(q,x,y,z).store(e);
+		loopj(0,3)
+		{
+			int i0=t.v[j],i1=t.v[(j+1)%3];
+			if(d[j]==0 || (vertices[i0].border & vertices[i1].border))
+			{
+				vec3f p;
+				e[j]=calculate_error(i0,i1,p);
+			}
+			err[j]=e[j];
+		}
+		err[3]=min(err[0],min(err[1],err[2]));
+	}
+
+	// Parse an OBJ face line : integers[0..2] vertex, [3..5] normal, [6..8] uv index
+
+	bool read_obj_face(const char* line,int integers[9])
+	{
+		if(sscanf(line,"f %d %d %d",
+			&integers[0],&integers[1],&integers[2])==3)
+			return true;
+		if(sscanf(line,"f %d// %d// %d//",
+			&integers[0],&integers[1],&integers[2])==3)
+			return true;
+		if(sscanf(line,"f %d//%d %d//%d %d//%d",
+			&integers[0],&integers[3],
+			&integers[1],&integers[4],
+			&integers[2],&integers[5])==6)
+			return true;
+		if(sscanf(line,"f %d/%d/%d %d/%d/%d %d/%d/%d",
+			&integers[0],&integers[6],&integers[3],
+			&integers[1],&integers[7],&integers[4],
+			&integers[2],&integers[8],&integers[5])==9)
+			return true;
+		if(sscanf(line,"f %d/%d %d/%d %d/%d",
+			&integers[0],&integers[6],
+			&integers[1],&integers[7],
+			&integers[2],&integers[8])==6)
+			return true;
+		return false;
+	}
+
 	//Option : Load OBJ
 	void load_obj(const char* filename){
 		vertices.clear();
 		triangles.clear();
+		wedges.clear();
+		corner_wedges.clear();
+		attributes=NONE;
 		//printf ( "Loading Objects %s ... \n",filename);
 		FILE* fn;
 		if(filename==NULL)		return ;
@@ -758,9 +1355,12 @@ namespace Simplify
 		char line[1000];
 		memset ( line,0,1000 );
 		int vertex_cnt = 0;
+		std::vector<float> uvs,normals;
 		while(fgets( line, 1000, fn ) != NULL)
 		{
 			Vertex v;
+			v.border=0;
+			v.locked=0;
 			if ( line[0] == 'v' )
 			{
 				if ( line[1] == ' ' )
@@ -769,38 +1369,25 @@ namespace Simplify
 				{
 					vertices.push_back(v);
 				}
+				float a[3];
+				if ( line[1] == 't' )
+				if(sscanf(line,"vt %f %f",&a[0],&a[1])==2)
+					uvs.insert(uvs.end(),a,a+2);
+				if ( line[1] == 'n' )
+				if(sscanf(line,"vn %f %f %f",&a[0],&a[1],&a[2])==3)
+					normals.insert(normals.end(),a,a+3);
 			}
 			int integers[9];
 			if ( line[0] == 'f' )
 			{
 				Triangle t;
-				bool tri_ok = false;
+				t.deleted=0;
+				t.dirty=0;
+				t.id=triangles.size();
+				memset(integers,0,sizeof(integers));
+				bool tri_ok = read_obj_face(line,integers);
 
-				if(sscanf(line,"f %d %d %d",
-					&integers[0],&integers[1],&integers[2])==3)
-				{
-					tri_ok = true;
-				}else
-				if(sscanf(line,"f %d// %d// %d//",
-					&integers[0],&integers[1],&integers[2])==3)
-				{
-					tri_ok = true;
-				}else
-				if(sscanf(line,"f %d//%d %d//%d %d//%d",
-					&integers[0],&integers[3],
-					&integers[1],&integers[4],
-					&integers[2],&integers[5])==6)
-				{
-					tri_ok = true;
-				}else
-				if(sscanf(line,"f %d/%d/%d %d/%d/%d %d/%d/%d",
-					&integers[0],&integers[6],&integers[3],
-					&integers[1],&integers[7],&integers[4],
-					&integers[2],&integers[8],&integers[5])==9)
-				{
-					tri_ok = true;
-				}
-				else
+				if ( !tri_ok )
 				{
 					printf("unrecognized sequence\n");
 					printf("%s\n",line);
@@ -812,6 +1399,38 @@ namespace Simplify
 					t.v[1] = integers[1]-1-vertex_cnt;
 					t.v[2] = integers[2]-1-vertex_cnt;
 
+					// attribute index 0 = not present, corners without one get
+					// uv 0,0 and, after loading, the face normal
+					int attr=NONE;
+					if(integers[6]>0 && integers[7]>0 && integers[8]>0)
+					{
+						attr|=TEXCOORD;
+						loopj(0,3) if((integers[6+j]-1)*2+1>=(int)uvs.size()) attr&=~TEXCOORD;
+					}
+					if(integers[3]>0 && integers[4]>0 && integers[5]>0)
+					{
+						attr|=NORMAL;
+						loopj(0,3) if((integers[3+j]-1)*3+2>=(int)normals.size()) attr&=~NORMAL;
+					}
+					if(attr && !attributes)
+					{
+						// first face with attributes, earlier corners get defaults
+						Wedge w;
+						memset(&w,0,sizeof(w));
+						wedges.assign(triangles.size()*3,w);
+						loopi(0,wedges.size()) corner_wedges.push_back(i);
+					}
+					attributes|=attr;
+					if(attributes) loopj(0,3)
+					{
+						Wedge w;
+						memset(&w,0,sizeof(w));
+						if(attr&TEXCOORD) loopk(0,2) w.uv[k]=uvs[(integers[6+j]-1)*2+k];
+						if(attr&NORMAL) loopk(0,3) w.vn[k]=normals[(integers[3+j]-1)*3+k];
+						corner_wedges.push_back(wedges.size());
+						wedges.push_back(w);
+					}
+
 					//tri.material = material;
 					//geo.triangles.push_back ( tri );
 					triangles.push_back(t);
@@ -821,12 +1440,122 @@ namespace Simplify
 			}
 		}
 		fclose(fn);
+		if(attributes&NORMAL) loopi(0,triangles.size())
+		{
+			Triangle &t=triangles[i];
+			loopj(0,3)
+			{
+				Wedge &w=wedges[corner_wedges[i*3+j]];
+				if(w.vn[0]!=0 || w.vn[1]!=0 || w.vn[2]!=0) continue;
+				vec3f n;
+				n.cross(vertices[t.v[1]].p-vertices[t.v[0]].p,vertices[t.v[2]].p-vertices[t.v[0]].p);
+				if(n.dot(n)>0) n.normalize();
+				w.vn[0]=n.x; w.vn[1]=n.y; w.vn[2]=n.z;
+			}
+		}
 		//printf("load_obj: vertices = %lu, triangles = %lu\n", vertices.size(), triangles.size() );
 	} // load_obj()
 
+	// Optional : Weld coincident vertices after load_obj
+	//
+	// epsilon : max distance of vertices that are merged, 0 = exact duplicates
+	//
+	// OBJs exported per face or per UV seam repeat positions, which update_mesh
+	// would treat as borders. Vertices are binned into a spatial hash with a
+	// cell size >= epsilon, every vertex then looks for the lowest index within
+	// epsilon in the 27 neighbouring cells. Both passes run in parallel when
+	// compiled with -fopenmp and the result does not depend on the thread count.
+	// Returns the number of removed vertices.
+
+	int weld_vertices(double epsilon=0)
+	{
+		int count=vertices.size();
+		if(count<2) return 0;
+		vec3f bmin=vertices[0].p,bmax=vertices[0].p;
+		loopi(1,count)
+		{
+			vec3f &p=vertices[i].p;
+			bmin=vec3f(fmin(bmin.x,p.x),fmin(bmin.y,p.y),fmin(bmin.z,p.z));
+			bmax=vec3f(fmax(bmax.x,p.x),fmax(bmax.y,p.y),fmax(bmax.z,p.z));
+		}
+		vec3f extent=bmax-bmin;
+		double cell=fmax(fmax(extent.x,extent.y),extent.z)/1024;
+		if(cell<epsilon) cell=epsilon;
+		if(cell<=0) cell=1;
+
+		// hash table of cells, vertices of a bucket are stored in index order
+		int buckets=1;
+		while(buckets<count) buckets<<=1;
+		std::vector<int> bucket(count),bucket_start(buckets+1,0),order(count),remap(count);
+		#ifdef _OPENMP
+		#pragma omp parallel for
+		#endif
+		loopi(0,count)
+		{
+			vec3f &p=vertices[i].p;
+			long long x=(long long)floor((p.x-bmin.x)/cell), y=(long long)floor((p.y-bmin.y)/cell), z=(long long)floor((p.z-bmin.z)/cell);
+			bucket[i]=(int)((x*73856093LL ^ y*19349663LL ^ z*83492791LL)&(buckets-1));
+		}
+		loopi(0,count) bucket_start[bucket[i]+1]++;
+		loopi(0,buckets) bucket_start[i+1]+=bucket_start[i];
+		{
+			std::vector<int> fill(bucket_start.begin(),bucket_start.end()-1);
+			loopi(0,count) order[fill[bucket[i]]++]=i;
+		}
+
+		// lowest vertex index within epsilon
+		#ifdef _OPENMP
+		#pragma omp parallel for schedule(dynamic,1024)
+		#endif
+		loopi(0,count)
+		{
+			vec3f &p=vertices[i].p;
+			long long c[3]={(long long)floor((p.x-bmin.x)/cell),(long long)floor((p.y-bmin.y)/cell),(long long)floor((p.z-bmin.z)/cell)};
+			int best=i;
+			loopk(0,27)
+			{
+				long long x=c[0]+k%3-1, y=c[1]+(k/3)%3-1, z=c[2]+k/9-1;
+				int b=(int)((x*73856093LL ^ y*19349663LL ^ z*83492791LL)&(buckets-1));
+				for(int n=bucket_start[b];n<bucket_start[b+1] && order[n]<best;n++)
+				{
+					vec3f d=vertices[order[n]].p-p;
+					if(d.dot(d)<=epsilon*epsilon) { best=order[n]; break; }
+				}
+			}
+			remap[i]=best;
+		}
+
+		// chains resolve in index order since remap[i]<=i
+		int dst=0;
+		loopi(0,count)
+		{
+			if(remap[i]==i) { remap[i]=dst; vertices[dst++]=vertices[i]; }
+			else remap[i]=remap[remap[i]];
+		}
+		vertices.resize(dst);
+
+		// remap triangles, drop those that became degenerate
+		int tdst=0;
+		loopi(0,triangles.size())
+		{
+			Triangle t=triangles[i];
+			loopj(0,3) t.v[j]=remap[t.v[j]];
+			if(t.v[0]==t.v[1] || t.v[1]==t.v[2] || t.v[2]==t.v[0]) continue;
+			triangles[tdst++]=t;
+		}
+		triangles.resize(tdst);
+		return count-dst;
+	}
+
 	// Optional : Store as OBJ
 
 	void write_obj(const char* filename)
+	{
+		write_obj(filename,triangles,vertices,wedges,corner_wedges);
+	}
+
+	void write_obj(const char* filename,std::vector<Triangle> &triangles,std::vector<Vertex> &vertices,
+		std::vector<Wedge> &wedges,std::vector<int> &corner_wedges)
 	{
 		FILE *file=fopen(filename, "w");
 		if (!file)
@@ -839,12 +1568,74 @@ namespace Simplify
 			//fprintf(file, "v %lf %lf %lf\n", vertices[i].p.x,vertices[i].p.y,vertices[i].p.z);
 			fprintf(file, "v %g %g %g\n", vertices[i].p.x,vertices[i].p.y,vertices[i].p.z); //more compact: remove trailing zeros
 		}
+		// one vt / vn per wedge in use, numbered in order of first use
+		int attr=corner_wedges.empty() ? NONE : attributes;
+		std::vector<int> index(attr ? wedges.size() : 0,0),used;
+		if(attr) loopi(0,triangles.size()) if(!triangles[i].deleted) loopj(0,3)
+		{
+			int w=corner_wedges[triangles[i].id*3+j];
+			if(!index[w]) { used.push_back(w); index[w]=used.size(); }
+		}
+		if(attr&TEXCOORD) loopi(0,used.size())
+			fprintf(file, "vt %g %g\n", wedges[used[i]].uv[0], wedges[used[i]].uv[1]);
+		if(attr&NORMAL) loopi(0,used.size())
+			fprintf(file, "vn %g %g %g\n", wedges[used[i]].vn[0], wedges[used[i]].vn[1], wedges[used[i]].vn[2]);
 		loopi(0,triangles.size()) if(!triangles[i].deleted)
 		{
-			fprintf(file, "f %d %d %d\n", triangles[i].v[0]+1, triangles[i].v[1]+1, triangles[i].v[2]+1);
+			Triangle &t=triangles[i];
+			int c[3]={0,0,0};
+			if(attr) loopj(0,3) c[j]=index[corner_wedges[t.id*3+j]];
+			if(attr==(TEXCOORD|NORMAL))
+				fprintf(file, "f %d/%d/%d %d/%d/%d %d/%d/%d\n", t.v[0]+1, c[0], c[0], t.v[1]+1, c[1], c[1], t.v[2]+1, c[2], c[2]);
+			else if(attr==TEXCOORD)
+				fprintf(file, "f %d/%d %d/%d %d/%d\n", t.v[0]+1, c[0], t.v[1]+1, c[1], t.v[2]+1, c[2]);
+			else if(attr==NORMAL)
+				fprintf(file, "f %d//%d %d//%d %d//%d\n", t.v[0]+1, c[0], t.v[1]+1, c[1], t.v[2]+1, c[2]);
+			else
+				fprintf(file, "f %d %d %d\n", t.v[0]+1, t.v[1]+1, t.v[2]+1);
 			//fprintf(file, "f %d// %d// %d//\n", triangles[i].v[0]+1, triangles[i].v[1]+1, triangles[i].v[2]+1); //more compact: remove trailing zeros
 		}
 		fclose(file);
 	}
+
+	// Optional : Store the compacted mesh as meshlets, see Meshlets.h
+
+	bool write_meshlets(const char* filename,int max_vertices=64,int max_triangles=124)
+	{
+		std::vector<float> positions(vertices.size()*3);
+		std::vector<int> indices;
+		indices.reserve(triangles.size()*3);
+		loopi(0,vertices.size())
+		{
+			positions[i*3+0]=vertices[i].p.x;
+			positions[i*3+1]=vertices[i].p.y;
+			positions[i*3+2]=vertices[i].p.z;
+		}
+		loopi(0,triangles.size()) if(!triangles[i].deleted)
+			loopj(0,3) indices.push_back(triangles[i].v[j]);
+		Meshlets::Mesh mesh;
+		Meshlets::build(positions.empty()?0:&positions[0],vertices.size(),
+			indices.empty()?0:&indices[0],indices.size()/3,mesh,max_vertices,max_triangles);
+		return Meshlets::save(filename,mesh);
+	}
+
+	// Optional : Store the progressive mesh built by the last recorded run
+
+	bool write_progressive(const char* filename)
+	{
+		return progressive.save(filename);
+	}
+
+	// Optional : Store all LOD snapshots, pattern contains one %d for the level
+
+	void write_lods(const char* pattern)
+	{
+		char filename[1024];
+		loopi(0,lods.size())
+		{
+			snprintf(filename,sizeof(filename),pattern,i);
+			write_obj(filename,lods[i].triangles,lods[i].vertices,lods[i].wedges,lods[i].corner_wedges);
+		}
+	}
 };
 ///////////////////////////////////////////
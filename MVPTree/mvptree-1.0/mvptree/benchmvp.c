@@ -0,0 +1,516 @@
+/*
+
+    MVPTree c library
+    Copyright (C) 2008-2009 Aetilius, Inc.
+    All rights reserved.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    D Grant Starkweather - dstarkweather@phash.org
+
+*/
+
+/* Build time and query cost of the tree for different vantage point sample
+   sizes, build time for different numbers of threads, write time, load and
+   query time of a tree read from a file against the same file mapped, a
+   hamming distance callback against the built-in one, build and clear time
+   of trees with and without their memory pool, build and query time of
+   sharded trees, and build time, query time and the work counted by the
+   searches for each branch factor, path length and leaf capacity, on synthetic
+   64-bit perceptual hashes in clusters of near duplicates, compared by hamming
+   distance. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <float.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "mvptree.h"
+
+#define MVP_BRANCHFACTOR 2
+#define MVP_PATHLENGTH   5
+#define MVP_LEAFCAP     25
+
+/* above this many points the all pairs selection is too slow to bother */
+#define MAX_ALLPAIRS 20000
+
+/* per thread, so that the distance function is thread safe for parallel builds */
+static __thread unsigned long long nbcalcs = 0;
+
+float hamming_distance(MVPDP *pointA, MVPDP *pointB){
+    if (!pointA || !pointB || pointA->datalen != pointB->datalen) return -1.0f;
+    uint64_t *a = (uint64_t*)pointA->data;
+    uint64_t *b = (uint64_t*)pointB->data;
+    unsigned int i, d = 0;
+    for (i = 0; i < pointA->datalen; i++){
+	d += __builtin_popcountll(a[i] ^ b[i]);
+    }
+    nbcalcs++;
+    return (float)d;
+}
+
+static uint64_t random_hash(void){
+    return ((uint64_t)rand() << 62) ^ ((uint64_t)rand() << 31) ^ (uint64_t)rand();
+}
+
+/* flip up to maxflips random bits of a hash */
+static uint64_t perturb_hash(uint64_t hash, int maxflips){
+    int i, nbflips = rand() % (maxflips+1);
+    for (i = 0; i < nbflips; i++){
+	hash ^= (uint64_t)1 << (rand() % 64);
+    }
+    return hash;
+}
+
+static MVPDP* hash_point(uint64_t hash, unsigned int n){
+    char scratch[32];
+    MVPDP *dp = dp_alloc(MVP_UINT64ARRAY);
+    if (!dp) return NULL;
+    dp->data = malloc(sizeof(uint64_t));
+    if (!dp->data){
+	free(dp);
+	return NULL;
+    }
+    memcpy(dp->data, &hash, sizeof(uint64_t));
+    dp->datalen = 1;
+    snprintf(scratch, 32, "hash%u", n);
+    dp->id = strdup(scratch);
+    return dp;
+}
+
+/* clusters of near duplicates - each hash is a copy of one of nbpoints/clustersize */
+/* originals with up to maxflips bits flipped                                       */
+static uint64_t* generate_hashes(unsigned int nbpoints, unsigned int clustersize,\
+                                 int maxflips){
+    uint64_t *hashes = (uint64_t*)malloc(nbpoints*sizeof(uint64_t));
+    if (!hashes) return NULL;
+    unsigned int i, nbclusters = nbpoints/(clustersize ? clustersize : 1) + 1;
+    for (i = 0; i < nbclusters && i < nbpoints; i++){
+	hashes[i] = random_hash();
+    }
+    for (; i < nbpoints; i++){
+	hashes[i] = perturb_hash(hashes[rand() % nbclusters], maxflips);
+    }
+    return hashes;
+}
+
+/* the trees are the same if they have the same vantage points and leaves */
+static int same_tree(MVPTree *tree, Node *a, Node *b){
+    if (!a || !b) return (a == b);
+    if (a->leaf.type != b->leaf.type) return 0;
+    if (a->leaf.type == LEAF_NODE){
+	unsigned int i;
+	if (a->leaf.nbpoints != b->leaf.nbpoints) return 0;
+	if (strcmp(a->leaf.sv1->id, b->leaf.sv1->id)) return 0;
+	if (!a->leaf.sv2 || !b->leaf.sv2) return (a->leaf.sv2 == b->leaf.sv2);
+	if (strcmp(a->leaf.sv2->id, b->leaf.sv2->id)) return 0;
+	for (i = 0; i < a->leaf.nbpoints; i++){
+	    if (strcmp(a->leaf.points[i]->id, b->leaf.points[i]->id)) return 0;
+	}
+	return 1;
+    }
+    int i, bf = tree->branchfactor;
+    if (strcmp(a->internal.sv1->id, b->internal.sv1->id)) return 0;
+    if (strcmp(a->internal.sv2->id, b->internal.sv2->id)) return 0;
+    for (i = 0; i < bf*bf; i++){
+	if (!same_tree(tree, (Node*)a->internal.child_nodes[i], (Node*)b->internal.child_nodes[i])){
+	    return 0;
+	}
+    }
+    return 1;
+}
+
+static void add_stats(MVPStats *sum, const MVPStats *stats){
+    sum->nbdistances += stats->nbdistances;
+    sum->nbinternals += stats->nbinternals;
+    sum->nbleaves += stats->nbleaves;
+    sum->nbleafpoints += stats->nbleafpoints;
+    sum->nbfiltered_vp += stats->nbfiltered_vp;
+    sum->nbfiltered_path += stats->nbfiltered_path;
+    sum->nbcompared += stats->nbcompared;
+}
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+int main(int argc, char **argv){
+    const unsigned int nbpoints = (argc > 1) ? atoi(argv[1]) : 100000;
+    const unsigned int nbqueries = (argc > 2) ? atoi(argv[2]) : 1000;
+    const unsigned int clustersize = (argc > 3) ? atoi(argv[3]) : 10;
+    const int maxflips = (argc > 4) ? atoi(argv[4]) : 6;
+    const unsigned int knearest = 10;
+    const float radius = 6.0f;
+    const int samples[] = { 0, 8, 16, 32, 64, 128 };
+    const int nbsamples = sizeof(samples)/sizeof(samples[0]);
+
+    srand(98293928);
+    uint64_t *hashes = generate_hashes(nbpoints, clustersize, maxflips);
+    MVPDP **points = (MVPDP**)malloc(nbpoints*sizeof(MVPDP*));
+    MVPDP **queries = (MVPDP**)malloc(nbqueries*sizeof(MVPDP*));
+    if (!hashes || !points || !queries){
+	fprintf(stdout,"out of memory\n");
+	return 1;
+    }
+    unsigned int i;
+    for (i = 0; i < nbqueries; i++){
+	queries[i] = hash_point(perturb_hash(hashes[rand() % nbpoints], 4), i);
+    }
+
+    fprintf(stdout,"%u points in clusters of %u with up to %d bits flipped, %u queries,"\
+	    " knearest %u, radius %.0f\n\n", nbpoints, clustersize, maxflips, nbqueries,\
+	    knearest, radius);
+    fprintf(stdout,"%8s %10s %14s %14s %14s\n",\
+	    "vpsample", "build(s)", "build calcs", "knn calcs/q", "range calcs/q");
+
+    int s;
+    for (s = 0; s < nbsamples; s++){
+	if (samples[s] == 0 && nbpoints > MAX_ALLPAIRS){
+	    fprintf(stdout,"%8s %10s\n", "all", "skipped");
+	    continue;
+	}
+	for (i = 0; i < nbpoints; i++){
+	    points[i] = hash_point(hashes[i], i);
+	}
+
+	MVPTree *tree = mvptree_alloc(NULL, hamming_distance,\
+				      MVP_BRANCHFACTOR, MVP_PATHLENGTH, MVP_LEAFCAP);
+	tree->vpsample = samples[s];
+
+	nbcalcs = 0;
+	double start = now();
+	MVPError err = mvptree_add(tree, points, nbpoints);
+	double build_time = now() - start;
+	unsigned long long build_calcs = nbcalcs;
+	if (err != MVP_SUCCESS){
+	    fprintf(stdout,"Unable to add to tree - %s\n", mvp_errstr(err));
+	    return 1;
+	}
+
+	unsigned int nbresults;
+	MVPDP **results;
+	nbcalcs = 0;
+	for (i = 0; i < nbqueries; i++){
+	    results = mvptree_retrieve_knearest(tree, queries[i], knearest, FLT_MAX,\
+						&nbresults, &err);
+	    free(results);
+	}
+	unsigned long long knn_calcs = nbcalcs;
+
+	nbcalcs = 0;
+	for (i = 0; i < nbqueries; i++){
+	    results = mvptree_retrieve(tree, queries[i], nbpoints, radius, &nbresults, &err);
+	    free(results);
+	}
+	unsigned long long range_calcs = nbcalcs;
+
+	char label[16];
+	snprintf(label, 16, "%d", samples[s]);
+	fprintf(stdout,"%8s %10.3f %14llu %14.1f %14.1f\n", samples[s] ? label : "all",\
+		build_time, build_calcs, (double)knn_calcs/nbqueries,\
+		(double)range_calcs/nbqueries);
+
+	mvptree_clear(tree, free);
+	free(tree);
+    }
+
+    /* parallel builds, checked against the serial one */
+    const int threads[] = { 1, 2, 4, 8, 0 };
+    const int nbthreads = sizeof(threads)/sizeof(threads[0]);
+    long nbcpus = sysconf(_SC_NPROCESSORS_ONLN);
+    MVPTree *serial = NULL;
+
+    fprintf(stdout,"\n%8s %10s %8s   (%ld cpus)\n", "threads", "build(s)", "same", nbcpus);
+    for (s = 0; s < nbthreads; s++){
+	for (i = 0; i < nbpoints; i++){
+	    points[i] = hash_point(hashes[i], i);
+	}
+	MVPTree *tree = mvptree_alloc(NULL, hamming_distance,\
+				      MVP_BRANCHFACTOR, MVP_PATHLENGTH, MVP_LEAFCAP);
+	tree->nbthreads = threads[s];
+
+	double start = now();
+	MVPError err = mvptree_add(tree, points, nbpoints);
+	double build_time = now() - start;
+	if (err != MVP_SUCCESS){
+	    fprintf(stdout,"Unable to add to tree - %s\n", mvp_errstr(err));
+	    return 1;
+	}
+
+	char label[16];
+	snprintf(label, 16, "%d", threads[s]);
+	fprintf(stdout,"%8s %10.3f %8s\n", threads[s] ? label : "all", build_time,\
+		(serial == NULL) ? "-" : same_tree(tree, serial->node, tree->node) ? "yes" : "NO");
+
+	if (serial == NULL){
+	    serial = tree;
+	} else {
+	    mvptree_clear(tree, free);
+	    free(tree);
+	}
+    }
+
+    /* load the tree from a file, copied into memory and mapped in place */
+    const char *filename = "benchmvp.mvp";
+    double start = now();
+    MVPError err = mvptree_write(serial, filename, 00644);
+    double write_time = now() - start;
+    mvptree_clear(serial, free);
+    free(serial);
+    if (err != MVP_SUCCESS){
+	fprintf(stdout,"Unable to write tree - %s\n", mvp_errstr(err));
+	return 1;
+    }
+    struct stat file_info;
+    if (stat(filename, &file_info) == 0){
+	fprintf(stdout,"\nwrite %.3f s, %lld bytes\n", write_time, (long long)file_info.st_size);
+    }
+
+    fprintf(stdout,"\n%8s %10s %14s\n", "load", "load(s)", "knn ms/q");
+    for (s = 0; s < 2; s++){
+	start = now();
+	MVPTree *tree = (s == 0) ?\
+	    mvptree_read(filename, hamming_distance, 0, 0, 0, &err) :\
+	    mvptree_map(filename, hamming_distance, &err);
+	double load_time = now() - start;
+	if (!tree || err != MVP_SUCCESS){
+	    fprintf(stdout,"Unable to load tree - %s\n", mvp_errstr(err));
+	    return 1;
+	}
+
+	unsigned int nbresults;
+	start = now();
+	for (i = 0; i < nbqueries; i++){
+	    MVPDP **results = mvptree_retrieve_knearest(tree, queries[i], knearest, FLT_MAX,\
+							&nbresults, &err);
+	    free(results);
+	}
+	double query_time = now() - start;
+
+	fprintf(stdout,"%8s %10.3f %14.3f\n", (s == 0) ? "read" : "map", load_time,\
+		1000.0*query_time/nbqueries);
+	mvptree_clear(tree, (s == 0) ? free : NULL);
+	free(tree);
+    }
+    unlink(filename);
+
+    /* the hamming distance callback against the built-in one */
+    const CmpFunc funcs[] = { hamming_distance, mvp_hamming_distance };
+    fprintf(stdout,"\n%8s %10s %14s\n", "distance", "build(s)", "knn ms/q");
+    for (s = 0; s < 2; s++){
+	for (i = 0; i < nbpoints; i++){
+	    points[i] = hash_point(hashes[i], i);
+	}
+	MVPTree *tree = mvptree_alloc(NULL, funcs[s],\
+				      MVP_BRANCHFACTOR, MVP_PATHLENGTH, MVP_LEAFCAP);
+	start = now();
+	err = mvptree_add(tree, points, nbpoints);
+	double build_time = now() - start;
+	if (err != MVP_SUCCESS){
+	    fprintf(stdout,"Unable to add to tree - %s\n", mvp_errstr(err));
+	    return 1;
+	}
+
+	unsigned int nbresults;
+	start = now();
+	for (i = 0; i < nbqueries; i++){
+	    MVPDP **results = mvptree_retrieve_knearest(tree, queries[i], knearest, FLT_MAX,\
+							&nbresults, &err);
+	    free(results);
+	}
+	double query_time = now() - start;
+
+	fprintf(stdout,"%8s %10.3f %14.3f\n", (s == 0) ? "callback" : "built-in", build_time,\
+		1000.0*query_time/nbqueries);
+	mvptree_clear(tree, free);
+	free(tree);
+    }
+
+    /* nodes and datapoints from malloc, nodes from the pool, and both from the pool */
+    const char *allocs[] = { "malloc", "pool", "pool+dp" };
+    fprintf(stdout,"\n%8s %10s %10s %10s %14s\n", "memory", "points(s)", "build(s)",\
+	    "clear(s)", "knn ms/q");
+    for (s = 0; s < 3; s++){
+	MVPTree *tree = mvptree_alloc(NULL, mvp_hamming_distance,\
+				      MVP_BRANCHFACTOR, MVP_PATHLENGTH, MVP_LEAFCAP);
+	tree->pooled = (s > 0);
+	start = now();
+	for (i = 0; i < nbpoints; i++){
+	    if (s < 2){
+		points[i] = hash_point(hashes[i], i);
+	    } else {
+		char scratch[32];
+		snprintf(scratch, 32, "hash%u", i);
+		points[i] = mvptree_dp_alloc(tree, MVP_UINT64ARRAY, 1, scratch);
+		if (points[i]) memcpy(points[i]->data, &hashes[i], sizeof(uint64_t));
+	    }
+	    if (!points[i]){
+		fprintf(stdout,"out of memory\n");
+		return 1;
+	    }
+	}
+	double points_time = now() - start;
+	start = now();
+	err = mvptree_add(tree, points, nbpoints);
+	double build_time = now() - start;
+	if (err != MVP_SUCCESS){
+	    fprintf(stdout,"Unable to add to tree - %s\n", mvp_errstr(err));
+	    return 1;
+	}
+
+	unsigned int nbresults;
+	start = now();
+	for (i = 0; i < nbqueries; i++){
+	    MVPDP **results = mvptree_retrieve_knearest(tree, queries[i], knearest, FLT_MAX,\
+							&nbresults, &err);
+	    free(results);
+	}
+	double query_time = now() - start;
+
+	start = now();
+	mvptree_clear(tree, free);
+	double clear_time = now() - start;
+	fprintf(stdout,"%8s %10.3f %10.3f %10.3f %14.3f\n", allocs[s], points_time, build_time,\
+		clear_time, 1000.0*query_time/nbqueries);
+	free(tree);
+    }
+
+    /* shards by hash and by vantage rings, one thread per cpu */
+    const unsigned int nbshards[] = { 1, 2, 4, 8 };
+    const int nbsizes = sizeof(nbshards)/sizeof(nbshards[0]);
+    const MVPShardMode modes[] = { MVP_SHARD_HASH, MVP_SHARD_VANTAGE };
+    fprintf(stdout,"\n%8s %8s %10s %14s %14s\n", "shards", "mode", "build(s)", "knn ms/q",\
+	    "range calcs/q");
+    int m;
+    for (m = 0; m < 2; m++){
+	for (s = 0; s < nbsizes; s++){
+	    for (i = 0; i < nbpoints; i++){
+		points[i] = hash_point(hashes[i], i);
+	    }
+	    MVPShards *shards = mvpshards_alloc(NULL, mvp_hamming_distance, nbshards[s], modes[m],\
+						MVP_BRANCHFACTOR, MVP_PATHLENGTH, MVP_LEAFCAP);
+	    start = now();
+	    err = mvpshards_add(shards, points, nbpoints);
+	    double build_time = now() - start;
+	    if (err != MVP_SUCCESS){
+		fprintf(stdout,"Unable to add to shards - %s\n", mvp_errstr(err));
+		return 1;
+	    }
+
+	    unsigned int nbresults;
+	    start = now();
+	    for (i = 0; i < nbqueries; i++){
+		MVPDP **results = mvpshards_retrieve_knearest(shards, queries[i], knearest,\
+							      FLT_MAX, &nbresults, &err);
+		free(results);
+	    }
+	    double query_time = now() - start;
+
+	    /* count the range calcs with the callback, on one thread as the count is per thread */
+	    int t;
+	    for (t = 0; t < nbshards[s]; t++) shards->trees[t]->dist = hamming_distance;
+	    shards->nbthreads = 1;
+	    nbcalcs = 0;
+	    for (i = 0; i < nbqueries; i++){
+		MVPDP **results = mvpshards_retrieve(shards, queries[i], nbpoints, radius,\
+						     &nbresults, &err);
+		free(results);
+	    }
+	    unsigned long long range_calcs = nbcalcs;
+
+	    fprintf(stdout,"%8u %8s %10.3f %14.3f %14.1f\n", nbshards[s],\
+		    (modes[m] == MVP_SHARD_HASH) ? "hash" : "vantage", build_time,\
+		    1000.0*query_time/nbqueries, (double)range_calcs/nbqueries);
+	    mvpshards_clear(shards, free);
+	    free(shards);
+	}
+    }
+
+    /* branch factor, path length and leaf capacity, with the counts of the searches */
+    const int bfs[] = { 2, 3, 4 }, pls[] = { 0, 2, 5, 8 }, lcs[] = { 10, 25, 50, 100 };
+    int b, p, l;
+    fprintf(stdout,"\n%3s %3s %4s %9s | %8s %8s %8s | %8s %8s %8s %8s %8s %8s\n",\
+	    "bf", "pl", "lc", "build(s)", "knn ms/q", "dist/q", "nodes/q", "rng ms/q", "dist/q",\
+	    "nodes/q", "d1d2 out", "path out", "compared");
+    for (b = 0; b < sizeof(bfs)/sizeof(bfs[0]); b++){
+	for (p = 0; p < sizeof(pls)/sizeof(pls[0]); p++){
+	    for (l = 0; l < sizeof(lcs)/sizeof(lcs[0]); l++){
+		MVPTree *tree = mvptree_alloc(NULL, mvp_hamming_distance, bfs[b], pls[p], lcs[l]);
+		MVPQuery query;
+		for (i = 0; i < nbpoints; i++){
+		    char scratch[32];
+		    snprintf(scratch, 32, "hash%u", i);
+		    points[i] = mvptree_dp_alloc(tree, MVP_UINT64ARRAY, 1, scratch);
+		    if (!points[i]){
+			fprintf(stdout,"out of memory\n");
+			return 1;
+		    }
+		    memcpy(points[i]->data, &hashes[i], sizeof(uint64_t));
+		}
+		start = now();
+		err = mvptree_add(tree, points, nbpoints);
+		double build_time = now() - start;
+		if (err != MVP_SUCCESS || !mvpquery_alloc(&query, tree)){
+		    fprintf(stdout,"Unable to add to tree - %s\n", mvp_errstr(err));
+		    return 1;
+		}
+
+		MVPStats knn, range;
+		memset(&knn, 0, sizeof(MVPStats));
+		memset(&range, 0, sizeof(MVPStats));
+		unsigned int nbresults;
+		start = now();
+		for (i = 0; i < nbqueries; i++){
+		    MVPDP **results = mvptree_retrieve_knearest_r(tree, &query, queries[i], knearest,\
+								  FLT_MAX, &nbresults, &err);
+		    free(results);
+		    add_stats(&knn, &query.stats);
+		}
+		double knn_time = now() - start;
+		start = now();
+		for (i = 0; i < nbqueries; i++){
+		    MVPDP **results = mvptree_retrieve_r(tree, &query, queries[i], nbpoints, radius,\
+							 &nbresults, &err);
+		    free(results);
+		    add_stats(&range, &query.stats);
+		}
+		double range_time = now() - start;
+
+		double nbq = (nbqueries > 0) ? nbqueries : 1;
+		fprintf(stdout,"%3d %3d %4d %9.3f | %8.3f %8.1f %8.1f | %8.3f %8.1f %8.1f %8.1f %8.1f"\
+			" %8.1f\n", bfs[b], pls[p], lcs[l], build_time, 1000.0*knn_time/nbq,\
+			knn.nbdistances/nbq, (knn.nbinternals + knn.nbleaves)/nbq,\
+			1000.0*range_time/nbq, range.nbdistances/nbq,\
+			(range.nbinternals + range.nbleaves)/nbq, range.nbfiltered_vp/nbq,\
+			range.nbfiltered_path/nbq, range.nbcompared/nbq);
+		mvpquery_clear(&query);
+		mvptree_clear(tree, NULL);
+		free(tree);
+	    }
+	}
+    }
+
+    for (i = 0; i < nbqueries; i++){
+	dp_free(queries[i], free);
+    }
+    free(queries);
+    free(points);
+    free(hashes);
+    return 0;
+}
@@ -31,16 +31,20 @@
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
 #include "mvptree.h"
 
 #define HEADER_SIZE 32
+#define MVP_WRITEBUF (1 << 20)  /* output buffer of mvptree_write() */
 
 
 #define _FILE_OFFSET_BITS 64
 #define _LARGEFILE64_SOURCE
 
 const char *tag = "phashmvp2010";
-const int version = 0x01000000;
+const int version = 0x02000000;
+const int version1 = 0x01000000;
 
 const char *error_msgs[] = {
     "no error",
@@ -65,9 +69,13 @@ const char *error_msgs[] = {
     "datatypes in conflict",
     "no. retrieved exceeds k",
     "empty tree",
+    "could not calculate split points",
     "distance value either NaN or less than zero",
     "could not open file",
-    "unrecognized node" };
+    "unrecognized node",
+    "could not create thread lock",
+    "unrecognized file format or version",
+    "id not found" };
 
 
 const char* mvp_errstr(MVPError err){
@@ -81,11 +89,13 @@ MVPDP* dp_alloc(MVPDataType type){
     newdp->datalen = 0;
     newdp->type = type;
     newdp->path = NULL;
+    newdp->deleted = 0;
+    newdp->pooled = 0;
     return newdp;
 }
 
 void dp_free(MVPDP *dp, MVPFreeFunc free_func){
-    if (dp){
+    if (dp && !dp->pooled){
 	if (dp->path) free(dp->path);
 	if (free_func){
 	    if (dp->id)	free_func(dp->id);
@@ -113,14 +123,21 @@ MVPTree* mvptree_alloc(MVPTree *tree, CmpFunc distance,unsigned int bf,unsigned
     retTree->pathlength   = p;
     retTree->leafcap      = k;
     retTree->dist         = distance;
+    retTree->vpsample     = MVP_VPSAMPLE;
+    retTree->seed         = 0;
+    retTree->nbthreads    = 1;
+    retTree->syncwrite    = 1;
     retTree->datatype     = 0;
     retTree->node         = NULL;
     retTree->fd           = 0;
-    retTree->k            = 0;
     retTree->size         = 0;
     retTree->pos          = 0;
     retTree->buf          = NULL;
     retTree->pgsize       = sysconf(_SC_PAGESIZE);
+    retTree->mapped       = 0;
+    retTree->root         = 0;
+    retTree->pooled       = 1;
+    retTree->pool         = NULL;
 
     return retTree;
 }
@@ -131,47 +148,414 @@ static int is_nan(float x){
     return (var != var) ? 1 : 0;
 }
 
-static Node* create_leaf(unsigned int leafcap){
-    Node *node = (Node*)malloc(sizeof(Node));
-    node->leaf.sv1 = NULL;
-    node->leaf.sv2 = NULL;
-    node->leaf.points = (MVPDP**)calloc(leafcap,sizeof(MVPDP*));
-    node->leaf.d1 = (float*)calloc(leafcap,sizeof(float));
-    node->leaf.d2 = (float*)calloc(leafcap,sizeof(float));
-    node->leaf.nbpoints = 0;
-    node->leaf.type = LEAF_NODE;
+/* Built-in distance functions. Each data type has its own kernel, written as
+   plain loops and compiled for both baseline x86-64 and AVX2; the dynamic
+   loader picks the version for the cpu. Long hamming distances use an AVX2
+   popcount (a nibble lookup table with vpshufb). */
+
+#if defined(__GNUC__) && defined(__x86_64__) && defined(__linux__)
+#include <immintrin.h>
+#define MVP_X86_64 1
+#define MVP_CLONES   __attribute__((target_clones("avx2","default")))
+#define MVP_POPCNT   __attribute__((target_clones("popcnt","default")))
+#else
+#define MVP_CLONES
+#define MVP_POPCNT
+#endif
+
+static uint64_t load64(const unsigned char *p){
+    uint64_t x;
+    memcpy(&x, p, sizeof(uint64_t));
+    return x;
+}
 
-    return node;
+MVP_POPCNT
+static uint64_t hamming_words(const unsigned char *a, const unsigned char *b, size_t n){
+    uint64_t d = 0, x = 0;
+    size_t i;
+    for (i = 0; i + 8 <= n; i += 8){
+	d += __builtin_popcountll(load64(a+i) ^ load64(b+i));
+    }
+    for (; i < n; i++){
+	x = (x << 8) | (a[i] ^ b[i]);
+    }
+    return d + __builtin_popcountll(x);
 }
 
-static Node* create_internal(unsigned int bf){
-    Node *node = (Node*)malloc(sizeof(Node));
-    node->internal.sv1 = NULL;
-    node->internal.sv2 = NULL;
-    node->internal.M1 = (float*)calloc((bf-1),sizeof(float));
-    node->internal.M2 = (float*)calloc(bf,sizeof(float));
-    node->internal.child_nodes = calloc(bf*bf,sizeof(Node*));
-    node->internal.type = INTERNAL_NODE;
+#ifdef MVP_X86_64
+__attribute__((target("avx2")))
+static uint64_t hamming_avx2(const unsigned char *a, const unsigned char *b, size_t n){
+    const __m256i lut = _mm256_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,\
+                                         0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc = zero;
+    size_t i = 0;
+    while (i + 32 <= n){
+	/* byte counters hold up to 8 bits for 31 rounds before they are summed */
+	size_t end = (n - i > 31*32) ? i + 31*32 : n;
+	__m256i counts = zero;
+	for (; i + 32 <= end; i += 32){
+	    __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(a+i)),\
+                                         _mm256_loadu_si256((const __m256i*)(b+i)));
+	    __m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(x, low));
+	    __m256i hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(x, 4), low));
+	    counts = _mm256_add_epi8(counts, _mm256_add_epi8(lo, hi));
+	}
+	acc = _mm256_add_epi64(acc, _mm256_sad_epu8(counts, zero));
+    }
+    uint64_t d = (uint64_t)_mm256_extract_epi64(acc, 0) + (uint64_t)_mm256_extract_epi64(acc, 1) +\
+                 (uint64_t)_mm256_extract_epi64(acc, 2) + (uint64_t)_mm256_extract_epi64(acc, 3);
+    return d + hamming_words(a+i, b+i, n-i);
+}
+#endif
 
-    return node;
+static uint64_t hamming_bytes(const unsigned char *a, const unsigned char *b, size_t n){
+#ifdef MVP_X86_64
+    if (n >= 128 && __builtin_cpu_supports("avx2")){
+	return hamming_avx2(a, b, n);
+    }
+#endif
+    return hamming_words(a, b, n);
+}
+
+/* sums of absolute and squared differences, for each element type */
+#define MVP_L1_KERNEL(name, T, S)                                         \
+MVP_CLONES                                                                \
+static S name(const void *pa, const void *pb, size_t n){                  \
+    const T *a = (const T*)pa, *b = (const T*)pb;                         \
+    S sum = 0;                                                            \
+    size_t i;                                                             \
+    for (i = 0; i < n; i++){                                              \
+	sum += (a[i] > b[i]) ? (S)(a[i] - b[i]) : (S)(b[i] - a[i]);       \
+    }                                                                     \
+    return sum;                                                           \
+}
+
+#define MVP_L2_KERNEL(name, T, S)                                         \
+MVP_CLONES                                                                \
+static S name(const void *pa, const void *pb, size_t n){                  \
+    const T *a = (const T*)pa, *b = (const T*)pb;                         \
+    S sum = 0;                                                            \
+    size_t i;                                                             \
+    for (i = 0; i < n; i++){                                              \
+	S diff = (a[i] > b[i]) ? (S)(a[i] - b[i]) : (S)(b[i] - a[i]);     \
+	sum += diff*diff;                                                 \
+    }                                                                     \
+    return sum;                                                           \
+}
+
+MVP_L1_KERNEL(l1_uint8 , uint8_t , uint32_t)
+MVP_L1_KERNEL(l1_uint16, uint16_t, uint64_t)
+MVP_L1_KERNEL(l1_uint32, uint32_t, uint64_t)
+MVP_L1_KERNEL(l1_uint64, uint64_t, double)
+MVP_L2_KERNEL(l2_uint8 , uint8_t , uint32_t)
+MVP_L2_KERNEL(l2_uint16, uint16_t, uint64_t)
+MVP_L2_KERNEL(l2_uint32, uint32_t, double)
+MVP_L2_KERNEL(l2_uint64, uint64_t, double)
+
+/* 8 bit sums are done in blocks, so that 32 bit counters do not overflow */
+#define MVP_UINT8_BLOCK 65536
+
+static int same_shape(MVPDP *pointA, MVPDP *pointB){
+    return (pointA && pointB && pointA->type == pointB->type &&\
+            pointA->datalen == pointB->datalen);
+}
+
+float mvp_hamming_distance(MVPDP *pointA, MVPDP *pointB){
+    if (!same_shape(pointA, pointB)) return -1.0f;
+    return (float)hamming_bytes((const unsigned char*)pointA->data,\
+                                (const unsigned char*)pointB->data,\
+                                (size_t)pointA->datalen*pointA->type);
+}
+
+float mvp_l1_distance(MVPDP *pointA, MVPDP *pointB){
+    if (!same_shape(pointA, pointB)) return -1.0f;
+    const unsigned char *a = (const unsigned char*)pointA->data;
+    const unsigned char *b = (const unsigned char*)pointB->data;
+    size_t i, n = pointA->datalen;
+    double sum = 0.0;
+    switch (pointA->type){
+    case MVP_BYTEARRAY:
+	for (i = 0; i < n; i += MVP_UINT8_BLOCK){
+	    sum += l1_uint8(a+i, b+i, (n - i < MVP_UINT8_BLOCK) ? n - i : MVP_UINT8_BLOCK);
+	}
+	break;
+    case MVP_UINT16ARRAY:
+	sum = (double)l1_uint16(a, b, n);
+	break;
+    case MVP_UINT32ARRAY:
+	sum = (double)l1_uint32(a, b, n);
+	break;
+    case MVP_UINT64ARRAY:
+	sum = l1_uint64(a, b, n);
+	break;
+    default:
+	return -1.0f;
+    }
+    return (float)sum;
+}
+
+float mvp_l2_distance(MVPDP *pointA, MVPDP *pointB){
+    if (!same_shape(pointA, pointB)) return -1.0f;
+    const unsigned char *a = (const unsigned char*)pointA->data;
+    const unsigned char *b = (const unsigned char*)pointB->data;
+    size_t i, n = pointA->datalen;
+    double sum = 0.0;
+    switch (pointA->type){
+    case MVP_BYTEARRAY:
+	for (i = 0; i < n; i += MVP_UINT8_BLOCK){
+	    sum += l2_uint8(a+i, b+i, (n - i < MVP_UINT8_BLOCK) ? n - i : MVP_UINT8_BLOCK);
+	}
+	break;
+    case MVP_UINT16ARRAY:
+	sum = (double)l2_uint16(a, b, n);
+	break;
+    case MVP_UINT32ARRAY:
+	sum = l2_uint32(a, b, n);
+	break;
+    case MVP_UINT64ARRAY:
+	sum = l2_uint64(a, b, n);
+	break;
+    default:
+	return -1.0f;
+    }
+    return (float)sqrt(sum);
+}
+
+/* hamming distances of single 64 bit hashes, e.g. perceptual hashes */
+MVP_POPCNT
+static void hamming64_batch(MVPDP *target, MVPDP **points, unsigned int nbpoints, float *dist){
+    uint64_t t = load64((const unsigned char*)target->data);
+    unsigned int i;
+    for (i = 0; i < nbpoints; i++){
+	if (same_shape(target, points[i])){
+	    dist[i] = (float)__builtin_popcountll(t ^ load64((const unsigned char*)points[i]->data));
+	} else {
+	    dist[i] = -1.0f;
+	}
+    }
+}
+
+void mvp_batch_distance(CmpFunc distance, MVPDP *target, MVPDP **points,\
+                        unsigned int nbpoints, float *dist){
+    unsigned int i;
+    if (distance == mvp_hamming_distance && target &&\
+        (size_t)target->datalen*target->type == sizeof(uint64_t)){
+	hamming64_batch(target, points, nbpoints, dist);
+	return;
+    }
+    for (i = 0; i < nbpoints; i++){
+	dist[i] = distance(target, points[i]);
+    }
 }
 
+/* Pool of memory for a tree. Nodes, paths and the datapoints the tree allocates
+   itself are cut from chunks of MVP_POOLCHUNK bytes, and the nodes and paths given
+   back go on free lists to be used again, so a build calls malloc() about once a
+   chunk and mvptree_clear() frees the chunks without visiting the blocks. */
+
+#define MVP_POOLCHUNK (1 << 20)
+#define ALIGN16(x)    (((x) + 15) & ~(size_t)15)
+
+typedef struct mvp_pool_t {
+    void *chunks;          /* chunks, linked through their first word                 */
+    char *next;            /* free space at the end of the newest chunk               */
+    size_t left;
+    void *free_leaves;     /* blocks given back, linked through their first word      */
+    void *free_internals;
+    void *free_paths;
+    unsigned int nbforeign;/* datapoints added to the tree that are not from the pool */
+    pthread_mutex_t lock;  /* nodes are allocated by the threads of a parallel build  */
+} MVPPool;
+
+/* the pool of a tree - made for an empty tree with pooled set, NULL if it has none */
+static MVPPool* tree_pool(MVPTree *tree){
+    if (tree->pool || !tree->pooled || tree->node || tree->mapped) return tree->pool;
+    MVPPool *pool = (MVPPool*)calloc(1, sizeof(MVPPool));
+    if (pool && pthread_mutex_init(&pool->lock, NULL) != 0){
+	free(pool);
+	pool = NULL;
+    }
+    tree->pool = pool;
+    return pool;
+}
 
-static void free_node(Node *node){
-    if (node) { 
-	if (node->leaf.type == LEAF_NODE){
-	    free(node->leaf.points);
-	    free(node->leaf.d1);
-	    free(node->leaf.d2);
-	} else if (node->internal.type == INTERNAL_NODE){
-	    free(node->internal.M1);
-	    free(node->internal.M2);
-	    free(node->internal.child_nodes);
+/* a block of size bytes, off freelist if it has one - NULL on error */
+static void* pool_alloc(MVPPool *pool, void **freelist, size_t size){
+    void *block = NULL;
+    size = ALIGN16(size + (size == 0));
+    pthread_mutex_lock(&pool->lock);
+    if (freelist && *freelist){
+	block = *freelist;
+	*freelist = *(void**)block;
+    } else {
+	if (size > pool->left){
+	    size_t chunksize = (size + 16 > MVP_POOLCHUNK) ? size + 16 : MVP_POOLCHUNK;
+	    char *chunk = (char*)malloc(chunksize);
+	    if (chunk){
+		*(void**)chunk = pool->chunks;
+		pool->chunks = chunk;
+		pool->next = chunk + 16;
+		pool->left = chunksize - 16;
+	    }
 	}
+	if (size <= pool->left){
+	    block = pool->next;
+	    pool->next += size;
+	    pool->left -= size;
+	}
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return block;
+}
+
+static void pool_release(MVPPool *pool, void **freelist, void *block){
+    pthread_mutex_lock(&pool->lock);
+    *(void**)block = *freelist;
+    *freelist = block;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void pool_free(MVPPool *pool){
+    void *chunk = pool->chunks;
+    while (chunk){
+	void *next = *(void**)chunk;
+	free(chunk);
+	chunk = next;
+    }
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+/* a node and its arrays are one block */
+static size_t node_size(MVPTree *tree, NodeType type){
+    size_t bf = tree->branchfactor, leafcap = tree->leafcap;
+    if (type == LEAF_NODE){
+	return ALIGN16(sizeof(Node)) + leafcap*sizeof(MVPDP*) +\
+	    ((2 + tree->pathlength)*leafcap + 1)*sizeof(float);
+    }
+    return ALIGN16(sizeof(Node)) + bf*bf*sizeof(void*) + (bf-1)*(bf+1)*sizeof(float);
+}
+
+static Node* create_node(MVPTree *tree, NodeType type){
+    size_t size = node_size(tree, type);
+    char *block;
+    if (tree->pool){
+	block = (char*)pool_alloc(tree->pool, (type == LEAF_NODE) ? &tree->pool->free_leaves :\
+                                  &tree->pool->free_internals, size);
+    } else {
+	block = (char*)malloc(size);
+    }
+    if (!block) return NULL;
+    memset(block, 0, size);
+
+    Node *node = (Node*)block;
+    char *arrays = block + ALIGN16(sizeof(Node));
+    if (type == LEAF_NODE){
+	node->leaf.points = (MVPDP**)arrays;
+	node->leaf.d1 = (float*)(arrays + tree->leafcap*sizeof(MVPDP*));
+	node->leaf.d2 = node->leaf.d1 + tree->leafcap;
+	node->leaf.paths = node->leaf.d2 + tree->leafcap;
+	node->leaf.type = LEAF_NODE;
+    } else {
+	int bf = tree->branchfactor;
+	node->internal.child_nodes = (void**)arrays;
+	node->internal.M1 = (float*)(arrays + bf*bf*sizeof(void*));
+	node->internal.M2 = node->internal.M1 + (bf-1);
+	node->internal.type = INTERNAL_NODE;
+    }
+    return node;
+}
+
+static Node* create_leaf(MVPTree *tree){
+    return create_node(tree, LEAF_NODE);
+}
+
+static Node* create_internal(MVPTree *tree){
+    return create_node(tree, INTERNAL_NODE);
+}
+
+static void free_node(MVPTree *tree, Node *node){
+    if (node == NULL) return;
+    if (tree->pool){
+	pool_release(tree->pool, (node->leaf.type == LEAF_NODE) ? &tree->pool->free_leaves :\
+                     &tree->pool->free_internals, node);
+    } else {
 	free(node);
     }
 }
 
+/* path array for a datapoint added to the tree */
+static float* path_alloc(MVPTree *tree){
+    size_t size = tree->pathlength*sizeof(float);
+    float *path = (tree->pool) ? (float*)pool_alloc(tree->pool, &tree->pool->free_paths, size) :\
+                                 (float*)malloc(size);
+    if (path) memset(path, 0, size);
+    return path;
+}
+
+/* free a datapoint of the tree - one from its pool goes with the pool */
+static void tree_dp_free(MVPTree *tree, MVPDP *dp, MVPFreeFunc free_func){
+    if (dp == NULL || dp->pooled) return;
+    if (tree->pool){
+	if (dp->path) pool_release(tree->pool, &tree->pool->free_paths, dp->path);
+	dp->path = NULL;
+	tree->pool->nbforeign--;
+    }
+    dp_free(dp, free_func);
+}
+
+/* a datapoint with its data, id and path - see mvptree_dp_alloc() */
+static MVPDP* tree_dp_alloc(MVPTree *tree, MVPDataType type, unsigned int datalen,\
+                            const char *id, size_t idlen){
+    size_t datasize = (size_t)datalen*type;
+    MVPPool *pool = tree_pool(tree);
+    MVPDP *dp;
+    if (pool == NULL){
+	dp = dp_alloc(type);
+	if (!dp) return NULL;
+	dp->datalen = datalen;
+	dp->data = calloc(datasize + (datasize == 0), 1);
+	dp->id = (id) ? (char*)malloc(idlen+1) : NULL;
+	if (!dp->data || (id && !dp->id)){
+	    dp_free(dp, free);
+	    return NULL;
+	}
+	if (id){
+	    memcpy(dp->id, id, idlen);
+	    dp->id[idlen] = '\0';
+	}
+	return dp;
+    }
+
+    size_t pathsize = ALIGN16(tree->pathlength*sizeof(float));
+    size_t size = ALIGN16(sizeof(MVPDP)) + pathsize + ALIGN16(datasize) + idlen+1;
+    char *block = (char*)pool_alloc(pool, NULL, size);
+    if (!block) return NULL;
+    memset(block, 0, size);
+    dp = (MVPDP*)block;
+    dp->path = (float*)(block + ALIGN16(sizeof(MVPDP)));
+    dp->data = block + ALIGN16(sizeof(MVPDP)) + pathsize;
+    dp->id = (id) ? (char*)dp->data + ALIGN16(datasize) : NULL;
+    if (id) memcpy(dp->id, id, idlen);
+    dp->datalen = datalen;
+    dp->type = type;
+    dp->pooled = 1;
+    return dp;
+}
+
+MVPDP* mvptree_dp_alloc(MVPTree *tree, MVPDataType type, unsigned int datalen, const char *id){
+    if (!tree || tree->mapped) return NULL;
+    return tree_dp_alloc(tree, type, datalen, id, (id) ? strlen(id) : 0);
+}
+
+/* free a datapoint of a tree being cleared - the paths go with the pool */
+static void clear_dp(MVPTree *tree, MVPDP *dp, MVPFreeFunc free_func){
+    if (dp && tree->pool && !dp->pooled) dp->path = NULL;
+    dp_free(dp, free_func);
+}
+
 static void _mvptree_clear(MVPTree *tree, Node *node, MVPFreeFunc free_func, int lvl){
     if (!node) 	return;
     if (node->internal.type == INTERNAL_NODE){
@@ -179,22 +563,51 @@ static void _mvptree_clear(MVPTree *tree, Node *node, MVPFreeFunc free_func, int
 	for (i = 0;i < fanout;i++){
 	    _mvptree_clear(tree, node->internal.child_nodes[i], free_func, lvl+1);
 	}
-	dp_free(node->internal.sv1, free_func);
-	dp_free(node->internal.sv2, free_func);
+	clear_dp(tree, node->internal.sv1, free_func);
+	clear_dp(tree, node->internal.sv2, free_func);
     } else {
-	dp_free(node->leaf.sv1, free_func);
-	dp_free(node->leaf.sv2, free_func);
+	clear_dp(tree, node->leaf.sv1, free_func);
+	clear_dp(tree, node->leaf.sv2, free_func);
 	int i;
 	for (i=0;i<node->leaf.nbpoints;i++){
-	    dp_free(node->leaf.points[i], free_func);
+	    clear_dp(tree, node->leaf.points[i], free_func);
 	}
     }
-    free_node(node);
+    /* the nodes of a pooled tree go with the pool */
+    if (!tree->pool) free_node(tree, node);
 }
 
 void mvptree_clear(MVPTree *tree, MVPFreeFunc free_func){
-    if (!tree || !tree->node) return;
-    _mvptree_clear(tree, tree->node, free_func, 0);
+    if (tree && tree->mapped){
+	munmap(tree->buf, tree->size);
+	close(tree->fd);
+	tree->buf = NULL;
+	tree->size = 0;
+	tree->mapped = 0;
+	tree->root = 0;
+	return;
+    }
+    if (!tree) return;
+    if (tree->pool){
+	/* only datapoints from outside the pool need to be visited */
+	if (tree->node && tree->pool->nbforeign > 0){
+	    _mvptree_clear(tree, tree->node, free_func, 0);
+	}
+	pool_free(tree->pool);
+	tree->pool = NULL;
+    } else if (tree->node){
+	_mvptree_clear(tree, tree->node, free_func, 0);
+    }
+    tree->node = NULL;
+}
+
+/* splitmix64 - a small generator with its state on the stack, so that builds
+   are repeatable and do not touch the rand() state of the caller */
+static uint64_t next_random(uint64_t *state){
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
 }
 
 /* 
@@ -203,12 +616,11 @@ void mvptree_clear(MVPTree *tree, MVPFreeFunc free_func){
    
 */
 
-static int select_vantage_points(MVPDP **points, unsigned int nb,int *sv1_pos, int *sv2_pos,\
+static int select_all_pairs(MVPDP **points, unsigned int nb,int *sv1_pos, int *sv2_pos,\
                                                       CmpFunc dist){
-    if (!points || !sv1_pos || !sv2_pos || !dist || nb == 0) return -1;
-
+    /* if all points are equal, any two will do */
     *sv1_pos = (nb >= 1) ? 0 : -1;
-    *sv2_pos = -1;
+    *sv2_pos = (nb >= 2) ? 1 : -1;
     
     float max_dist = 0.0f,d;
     int i, j;
@@ -229,58 +641,300 @@ static int select_vantage_points(MVPDP **points, unsigned int nb,int *sv1_pos, i
     return 0;
 }
 
+/*
+   Select sv1 out of a random sample of vpsample candidates, as the one with the
+   largest variance of distances to a second random sample of the points. sv2 is
+   the candidate farthest from sv1. This costs about vpsample^2 distance calculations
+   instead of nb^2/2. The samples are drawn from a generator seeded from the tree's
+   seed, the level and the number of points, so the same input builds the same tree.
+*/
+
+static int select_sampled(MVPDP **points, unsigned int nb, int *sv1_pos, int *sv2_pos,\
+                                                      MVPTree *tree, int lvl){
+    CmpFunc dist = tree->dist;
+    unsigned int nbsample = tree->vpsample;
+    uint64_t state = ((uint64_t)tree->seed << 32) ^ ((uint64_t)lvl << 24) ^ nb;
+
+    unsigned int *candidates = (unsigned int*)malloc(2*nbsample*sizeof(unsigned int));
+    if (!candidates) return -1;
+    unsigned int *sample = candidates + nbsample;
+
+    unsigned int i, j;
+    for (i = 0; i < nbsample; i++){
+	candidates[i] = (unsigned int)(next_random(&state) % nb);
+	sample[i] = (unsigned int)(next_random(&state) % nb);
+    }
+
+    double max_var = -1.0;
+    for (i = 0; i < nbsample; i++){
+	double sum = 0.0, sumsq = 0.0;
+	for (j = 0; j < nbsample; j++){
+	    float d = dist(points[candidates[i]], points[sample[j]]);
+	    if (is_nan(d) || d < 0.0f){
+		free(candidates);
+		return -2;
+	    }
+	    sum += d;
+	    sumsq += (double)d*d;
+	}
+	double mean = sum/nbsample;
+	double var = sumsq/nbsample - mean*mean;
+	if (var > max_var){
+	    max_var = var;
+	    *sv1_pos = candidates[i];
+	}
+    }
+
+    float max_dist = -1.0f;
+    for (i = 0; i < nbsample; i++){
+	if (candidates[i] == *sv1_pos) continue;
+	float d = dist(points[*sv1_pos], points[candidates[i]]);
+	if (is_nan(d) || d < 0.0f){
+	    free(candidates);
+	    return -2;
+	}
+	if (d > max_dist){
+	    max_dist = d;
+	    *sv2_pos = candidates[i];
+	}
+    }
+    if (max_dist < 0.0f){
+	/* every candidate was sv1 */
+	*sv2_pos = (*sv1_pos + 1) % nb;
+    }
+
+    free(candidates);
+    return 0;
+}
+
+static int select_vantage_points(MVPDP **points, unsigned int nb,int *sv1_pos, int *sv2_pos,\
+                                                      MVPTree *tree, int lvl){
+    if (!points || !sv1_pos || !sv2_pos || !tree || !tree->dist || nb == 0) return -1;
 
-static int find_splits(MVPDP **points,unsigned int nb,MVPDP *vp,MVPTree *tree,\
-                                                     float *M,unsigned int lengthM){
-    if (!points || nb == 0 || !M || lengthM == 0) return -1;
+    uint64_t nbsample = (tree->vpsample > 0) ? tree->vpsample : 0;
+    if (nbsample > 0 && (uint64_t)nb*(nb-1)/2 > nbsample*nbsample){
+	return select_sampled(points, nb, sv1_pos, sv2_pos, tree, lvl);
+    }
+    return select_all_pairs(points, nb, sv1_pos, sv2_pos, tree->dist);
+}
 
-    CmpFunc distfunc = tree->dist;
-    float *dist = (float*)malloc(nb*sizeof(float));
+static int compare_floats(const void *a, const void *b){
+    float x = *(const float*)a, y = *(const float*)b;
+    return (x < y) ? -1 : (x > y);
+}
 
-    int i, j, error = 0;
-    for (i = 0;i < nb; i++){
-	dist[i] = distfunc(points[i], vp);
+/* Parallel build. The distances of a large node's points from its vantage points
+   are computed in chunks, and large subtrees are built as tasks of their own, by
+   a pool of threads taking tasks off a shared stack. A task only writes to its own
+   points and nodes, and vantage point selection depends only on the seed, level
+   and size of a node, so the tree is the same whatever order the tasks run in. */
+
+#define MIN_PARALLEL_DISTANCES 4096  /* points in a node worth splitting its distances */
+#define MIN_PARALLEL_SUBTREE   1024  /* points in a subtree worth a task of its own    */
+#define MIN_DISTANCE_CHUNK     1024
+
+typedef enum build_task_type_t {
+    DISTANCE_TASK,
+    SUBTREE_TASK
+} BuildTaskType;
+
+typedef struct build_task_t {
+    BuildTaskType type;
+    struct build_task_t *next;
+    int *remaining;          /* tasks left in the group this task belongs to       */
+    MVPDP **points;          /* points of the subtree or chunk (owned by subtree)  */
+    unsigned int nbpoints;
+    MVPDP *vp;               /* distance task - vantage point and output array     */
+    float *dist;
+    int result;
+    Node *node;              /* subtree task - existing node, slot for the result */
+    void **slot;
+    int lvl;
+} BuildTask;
+
+typedef struct build_pool_t {
+    MVPTree *tree;
+    unsigned int nbthreads;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    BuildTask *tasks;        /* stack of tasks waiting to run   */
+    int subtrees;            /* subtree tasks not yet finished  */
+    int stop;
+    MVPError error;          /* first error from a subtree task */
+} BuildPool;
+
+static Node* _mvptree_add(MVPTree *tree, BuildPool *pool, Node *node, MVPDP **points,\
+                          unsigned int nbpoints, MVPError *error, int lvl);
+
+static int distance_chunk(CmpFunc func, MVPDP **points, unsigned int nbpoints, MVPDP *vp,\
+                                                                               float *dist){
+    unsigned int i;
+    mvp_batch_distance(func, vp, points, nbpoints, dist);
+    for (i = 0; i < nbpoints; i++){
 	if (is_nan(dist[i]) || dist[i] < 0.0f){
-	    free(dist);
 	    return -2;
 	}
     }
+    return 0;
+}
 
-    int min_pos;
-    for (i = 0;i < nb-1;i++){
-	min_pos = i;
-	for (j = i+1;j < nb;j++){
-	    if (dist[j] < dist[min_pos]){
-		min_pos = j;
-	    }
+static void run_task(BuildPool *pool, BuildTask *task){
+    MVPError err = MVP_SUCCESS;
+    BuildTaskType type = task->type;
+    if (type == DISTANCE_TASK){
+	task->result = distance_chunk(pool->tree->dist, task->points, task->nbpoints,\
+                                      task->vp, task->dist);
+    } else {
+	*task->slot = _mvptree_add(pool->tree, pool, task->node, task->points,\
+                                   task->nbpoints, &err, task->lvl);
+	free(task->points);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (err != MVP_SUCCESS && pool->error == MVP_SUCCESS) pool->error = err;
+    (*task->remaining)--;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    /* a distance task may be gone once its group is done */
+    if (type == SUBTREE_TASK) free(task);
+}
+
+static void push_task(BuildPool *pool, BuildTask *task){
+    pthread_mutex_lock(&pool->lock);
+    task->next = pool->tasks;
+    pool->tasks = task;
+    (*task->remaining)++;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* wait for a group of tasks to finish, running waiting tasks in the meantime */
+static void wait_tasks(BuildPool *pool, int *remaining){
+    pthread_mutex_lock(&pool->lock);
+    while (*remaining > 0){
+	BuildTask *task = pool->tasks;
+	if (task){
+	    pool->tasks = task->next;
+	    pthread_mutex_unlock(&pool->lock);
+	    run_task(pool, task);
+	    pthread_mutex_lock(&pool->lock);
+	} else {
+	    pthread_cond_wait(&pool->cond, &pool->lock);
+	}
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void* build_worker(void *arg){
+    BuildPool *pool = (BuildPool*)arg;
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->stop){
+	BuildTask *task = pool->tasks;
+	if (task){
+	    pool->tasks = task->next;
+	    pthread_mutex_unlock(&pool->lock);
+	    run_task(pool, task);
+	    pthread_mutex_lock(&pool->lock);
+	} else {
+	    pthread_cond_wait(&pool->cond, &pool->lock);
 	}
-	if (min_pos != i){
-	    float tmp = dist[min_pos];
-	    dist[min_pos] = dist[i];
-	    dist[i] = tmp;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/* distances of all points from vp into dist[], in parallel for large lists */
+static int compute_distances(MVPTree *tree, BuildPool *pool, MVPDP **points,\
+                             unsigned int nbpoints, MVPDP *vp, float *dist){
+    if (!points || nbpoints == 0 || !vp || !tree->dist) return -1;
+    if (!pool || nbpoints < MIN_PARALLEL_DISTANCES){
+	return distance_chunk(tree->dist, points, nbpoints, vp, dist);
+    }
+
+    unsigned int nbchunks = 2*pool->nbthreads;
+    if (nbchunks > nbpoints/MIN_DISTANCE_CHUNK) nbchunks = nbpoints/MIN_DISTANCE_CHUNK;
+    BuildTask *chunks = (BuildTask*)calloc(nbchunks, sizeof(BuildTask));
+    if (!chunks){
+	return distance_chunk(tree->dist, points, nbpoints, vp, dist);
+    }
+
+    int remaining = 0, result = 0;
+    unsigned int i;
+    for (i = 0; i < nbchunks; i++){
+	unsigned int start = (unsigned int)((uint64_t)i*nbpoints/nbchunks);
+	unsigned int end = (unsigned int)((uint64_t)(i+1)*nbpoints/nbchunks);
+	chunks[i].type = DISTANCE_TASK;
+	chunks[i].remaining = &remaining;
+	chunks[i].points = points + start;
+	chunks[i].nbpoints = end - start;
+	chunks[i].vp = vp;
+	chunks[i].dist = dist + start;
+	if (i > 0) push_task(pool, &chunks[i]);
+    }
+    chunks[0].result = distance_chunk(tree->dist, chunks[0].points, chunks[0].nbpoints,\
+                                      vp, chunks[0].dist);
+    wait_tasks(pool, &remaining);
+
+    for (i = 0; i < nbchunks; i++){
+	if (chunks[i].result < 0) result = chunks[i].result;
+    }
+    free(chunks);
+    return result;
+}
+
+/* build a child subtree, as a task of its own if it is large enough. A task */
+/* takes over the points array, and sets points to NULL                      */
+static void add_subtree(MVPTree *tree, BuildPool *pool, void **slot, MVPDP ***points,\
+                        unsigned int nbpoints, MVPError *error, int lvl){
+    if (pool && nbpoints >= MIN_PARALLEL_SUBTREE){
+	BuildTask *task = (BuildTask*)calloc(1, sizeof(BuildTask));
+	if (task){
+	    task->type = SUBTREE_TASK;
+	    task->remaining = &pool->subtrees;
+	    task->points = *points;
+	    task->nbpoints = nbpoints;
+	    task->node = (Node*)*slot;
+	    task->slot = slot;
+	    task->lvl = lvl;
+	    *points = NULL;
+	    push_task(pool, task);
+	    return;
 	}
     }
+    *slot = _mvptree_add(tree, pool, (Node*)*slot, *points, nbpoints, error, lvl);
+}
 
+/* the nb/(lengthM+1) quantiles of the distances in dist[] */
+
+static int find_splits(float *dist,unsigned int nb,float *M,unsigned int lengthM){
+    if (!dist || nb == 0 || !M || lengthM == 0) return -1;
+
+    float *sorted = (float*)malloc(nb*sizeof(float));
+    if (!sorted) return -1;
+    memcpy(sorted, dist, nb*sizeof(float));
+    qsort(sorted, nb, sizeof(float), compare_floats);
+
+    int i;
     for (i = 0;i < lengthM;i++){
 	int index = (i+1)*nb/(lengthM+1);
 	if (index <= 0) index = 0;
 	if (index >= nb) index = nb-1;
-	M[i] = dist[index];
+	M[i] = sorted[index];
     }
 
-    free(dist);
+    free(sorted);
     return 0;
 }
-/* Sort points into bins by distance(points[i], dp) for each i in list, skipping */
-/* points[sv1_pos] and points[sv2_pos]. Use pivot[LengthM1] array as pivot points */
-/* to determine which bins.  */
+/* Sort points into bins by their distances, dist[i], skipping points[sv1_pos] */
+/* and points[sv2_pos]. Use pivot[LengthM1] array as pivot points to determine */
+/* which bins.  */
 
 static MVPDP*** sort_points(MVPDP **points, unsigned int nbpoints, int sv1_pos, int sv2_pos,\
-                         MVPDP *vp, MVPTree *tree, int **counts, float *pivots){
+                         float *dist, MVPTree *tree, int **counts, float *pivots){
 
-    if (!points || !vp || !tree || !counts || !pivots || nbpoints == 0) return NULL;
+    if (!points || !dist || !tree || !counts || !pivots || nbpoints == 0) return NULL;
 
-    CmpFunc distfunc = tree->dist;
     int bf = tree->branchfactor;
     int lengthM1 = bf-1;
     
@@ -301,12 +955,7 @@ static MVPDP*** sort_points(MVPDP **points, unsigned int nbpoints, int sv1_pos,
 
     for (i=0;i<nbpoints;i++){
 	if (i == sv1_pos || i == sv2_pos) continue;
-	float d = distfunc(vp, points[i]);
-	if (is_nan(d) || d < 0.0f){
-	    free(counts);
-	    free(bins);
-	    return NULL;
-	}
+	float d = dist[i];
 	for (k = 0;k < lengthM1;k++){
 	    if (d <= pivots[k]){
 		bins[k][(*counts)[k]] = points[i];
@@ -323,160 +972,184 @@ static MVPDP*** sort_points(MVPDP **points, unsigned int nbpoints, int sv1_pos,
     return bins;
 }
 
-/* calculate distances for all points from given vantage point, vp, and 
-   assign that distance into each points path using the lvl parameter */
-
-static int find_distance_range_for_vp(MVPDP **points, unsigned int nbpoints, MVPDP *vp,\
-                                      MVPTree *tree, int lvl){
-    if (!points || nbpoints == 0 || !vp || !tree || !tree->dist){
-	return -1;
+/* put a point into slot i of a leaf, with a copy of its path for the filters */
+static void leaf_set_point(MVPTree *tree, Node *node, unsigned int i, MVPDP *dp,\
+                                                             float d1, float d2){
+    int j;
+    node->leaf.points[i] = dp;
+    node->leaf.d1[i] = d1;
+    node->leaf.d2[i] = d2;
+    for (j = 0; j < tree->pathlength; j++){
+	node->leaf.paths[j*tree->leafcap + i] = dp->path[j];
     }
-    CmpFunc func = tree->dist;
-    int i,j, error = 0;
+}
+
+/* assign the distances of points from a vantage point into each point's path */
+/* using the lvl parameter */
+
+static void set_path(MVPDP **points, unsigned int nbpoints, float *dist, MVPTree *tree, int lvl){
+    unsigned int i;
+    if (lvl >= tree->pathlength) return;
     for (i = 0; i < nbpoints; i++){
-	float d = func(vp, points[i]);
-	if (is_nan(d) || d < 0.0f){
-	    return -2;
-	}
-	if (lvl < tree->pathlength){
-	    points[i]->path[lvl] = d;
-	}
+	points[i]->path[lvl] = dist[i];
     }
-
-    return error;
 }
 
-static Node* _mvptree_add(MVPTree *tree, Node *node, MVPDP **points, unsigned int nbpoints,\
-                                                               MVPError *error, int lvl){
+static Node* _mvptree_add(MVPTree *tree, BuildPool *pool, Node *node, MVPDP **points,\
+                          unsigned int nbpoints, MVPError *error, int lvl){
     Node *new_node = node;
     if (nbpoints == 0) return new_node;
     if (!tree || lvl < 0 || !points) {
 	*error = MVP_ARGERR;
 	return NULL;
     }
-    CmpFunc dist_fnc = tree->dist;
     int bf = tree->branchfactor, lengthM1 = bf-1;
-    float max_distance, min_distance;
 
     if (new_node == NULL){ /* create new node */
 	int sv1_pos, sv2_pos;
 	if (nbpoints <= tree->leafcap + 2){
 	    /* create leaf node */
-	    new_node = create_leaf(tree->leafcap);
+	    new_node = create_leaf(tree);
 	    if (!new_node) {
 		*error = MVP_NOLEAF;
 		return NULL;
 	    }
 
-	    if (select_vantage_points(points, nbpoints, &sv1_pos, &sv2_pos, tree->dist) < 0){
+	    if (select_vantage_points(points, nbpoints, &sv1_pos, &sv2_pos, tree, lvl) < 0){
 		*error = MVP_VPNOSELECT;
-		free_node(new_node);
+		free_node(tree, new_node);
 		return NULL;
 	    }
 
 	    new_node->leaf.sv1 = (sv1_pos >= 0) ? points[sv1_pos] : NULL;
 	    new_node->leaf.sv2 = (sv2_pos >= 0) ? points[sv2_pos] : NULL;
 
-	    if (find_distance_range_for_vp(points, nbpoints, new_node->leaf.sv1,tree,lvl)<0){
+	    float *d1 = (float*)calloc(2*nbpoints, sizeof(float));
+	    float *d2 = d1 + nbpoints;
+	    if (!d1){
+		*error = MVP_MEMALLOC;
+		free_node(tree, new_node);
+		return NULL;
+	    }
+	    if (compute_distances(tree, pool, points, nbpoints, new_node->leaf.sv1, d1) < 0){
 		*error = MVP_NOSV1RANGE;
-		free_node(new_node);
+		free(d1);
+		free_node(tree, new_node);
 		return NULL;
 	    }
+	    set_path(points, nbpoints, d1, tree, lvl);
 	    
 	    if (new_node->leaf.sv2){
-                if (find_distance_range_for_vp(points,nbpoints,new_node->leaf.sv2,tree,lvl+1)<0){
+		if (compute_distances(tree, pool, points, nbpoints, new_node->leaf.sv2, d2) < 0){
 		    *error = MVP_NOSV2RANGE;
-		    free_node(new_node);
+		    free(d1);
+		    free_node(tree, new_node);
 		    return NULL;
 		}
+		set_path(points, nbpoints, d2, tree, lvl+1);
 	    }
 
 	    /* add remaining points to leaf */
 	    int i, count = 0;
 	    for (i=0;i<nbpoints;i++){
 		if (i == sv1_pos || i == sv2_pos) continue;
-		new_node->leaf.d1[count] = dist_fnc(points[i], new_node->leaf.sv1);
-		new_node->leaf.d2[count] = dist_fnc(points[i], new_node->leaf.sv2);
-		new_node->leaf.points[count++] = points[i];
+		leaf_set_point(tree, new_node, count++, points[i], d1[i], d2[i]);
 	    }
 	    new_node->leaf.nbpoints = count;
+	    free(d1);
 	    
 	} else { /* create internal node */
-	    new_node = create_internal(tree->branchfactor);
+	    new_node = create_internal(tree);
 	    if (!new_node){
 		*error = MVP_NOINTERNAL;
 		return NULL;
 	    }
-	    if (select_vantage_points(points, nbpoints, &sv1_pos, &sv2_pos, tree->dist) < 0){
+	    if (select_vantage_points(points, nbpoints, &sv1_pos, &sv2_pos, tree, lvl) < 0){
 		*error = MVP_VPNOSELECT;
-		free_node(new_node);
+		free_node(tree, new_node);
 		return NULL;
 	    }
 
 	    new_node->internal.sv1 = points[sv1_pos];
 	    new_node->internal.sv2 = points[sv2_pos];
 
-	    if (find_distance_range_for_vp(points,nbpoints,new_node->internal.sv1,tree,lvl)<0){
+	    float *dist = (float*)malloc(nbpoints*sizeof(float));
+	    if (!dist){
+		*error = MVP_MEMALLOC;
+		free_node(tree, new_node);
+		return NULL;
+	    }
+	    if (compute_distances(tree, pool, points, nbpoints, new_node->internal.sv1, dist) < 0){
 		*error = MVP_NOSV1RANGE;
-		free_node(new_node);
+		free(dist);
+		free_node(tree, new_node);
 		return NULL;
 	    }
+	    set_path(points, nbpoints, dist, tree, lvl);
 
-	    if (find_splits(points, nbpoints, new_node->internal.sv1, tree,\
-			    new_node->internal.M1,lengthM1) < 0){
+	    if (find_splits(dist, nbpoints, new_node->internal.M1, lengthM1) < 0){
 		*error = MVP_NOSPLITS;
-		free_node(new_node);
+		free(dist);
+		free_node(tree, new_node);
 		return NULL;
 	    }
 
 	    int i, j;
 	    int *binlengths = NULL;
 	    MVPDP ***bins = sort_points(points, nbpoints, sv1_pos, sv2_pos,\
-                                 new_node->internal.sv1, tree, &binlengths, new_node->internal.M1);
+                                 dist, tree, &binlengths, new_node->internal.M1);
+	    free(dist);
 	    if (!bins){
 		*error = MVP_NOSORT;
-	        free_node(new_node);
+	        free_node(tree, new_node);
 		return NULL;
 	    }
 
 	    for (i=0 ;i < tree->branchfactor; i++){
-		/* for each bin */
-		if (find_distance_range_for_vp(bins[i], binlengths[i], new_node->internal.sv2,\
-					       tree, lvl+1) < 0){
-		    *error = MVP_NOSV2RANGE;
-		    free_node(new_node);
+		/* for each bin - with many equal distances some bins can be empty */
+		if (binlengths[i] <= 0){
+		    continue;
+		}
+		float *dist2 = (float*)malloc(binlengths[i]*sizeof(float));
+		if (!dist2 || compute_distances(tree, pool, bins[i], binlengths[i],\
+                                                new_node->internal.sv2, dist2) < 0){
+		    *error = (dist2) ? MVP_NOSV2RANGE : MVP_MEMALLOC;
+		    free(dist2);
+		    free_node(tree, new_node);
 		    for (j=0;j<tree->branchfactor;j++){free(bins[j]);}
 		    free(bins);
 		    return NULL;
 		}
+		set_path(bins[i], binlengths[i], dist2, tree, lvl+1);
 
-		if (find_splits(bins[i], binlengths[i], new_node->internal.sv2, tree,\
-				new_node->internal.M2 + i*lengthM1,lengthM1) < 0){
+		if (find_splits(dist2, binlengths[i], new_node->internal.M2 + i*lengthM1,\
+                                lengthM1) < 0){
 		    *error = MVP_NOSPLITS;
-		    free_node(new_node);
+		    free(dist2);
+		    free_node(tree, new_node);
 		    for (j=0;j<tree->branchfactor;j++){free(bins[j]);}
 		    free(bins);
 		    return NULL;
 		}
 
 		int *bin2lengths = NULL;
-		MVPDP ***bins2 = sort_points(bins[i],binlengths[i],-1,-1,new_node->internal.sv2,\
+		MVPDP ***bins2 = sort_points(bins[i],binlengths[i],-1,-1,dist2,\
                                       tree, &bin2lengths, new_node->internal.M2 + i*lengthM1);
+		free(dist2);
 
 		if (!bins2){
 		    *error = MVP_NOSORT;
 		    for (j=0;j<tree->branchfactor;j++){free(bins[j]);}
 		    free(bins);
-		    free_node(new_node);
+		    free_node(tree, new_node);
 		    return NULL;
 		}
 
-		int j;
 		for (j=0;j<tree->branchfactor;j++){
 		    /* for each row of 2nd tier bins */
 		    /* index into child node = i*branchfactor + j      */
-		    Node *child = _mvptree_add(tree,NULL,bins2[j],bin2lengths[j],error, lvl+2);
-		    new_node->internal.child_nodes[i*tree->branchfactor+j] = child;
+		    add_subtree(tree, pool, &new_node->internal.child_nodes[i*tree->branchfactor+j],\
+                                &bins2[j], bin2lengths[j], error, lvl+2);
 		}
 		free(bin2lengths);
 		for (j = 0; j < tree->branchfactor;j++){ free(bins2[j]); }
@@ -493,26 +1166,35 @@ static Node* _mvptree_add(MVPTree *tree, Node *node, MVPDP **points, unsigned in
 	    if (new_node->leaf.nbpoints + nbpoints <= tree->leafcap){
 		
 		/* add points into leaf - plenty of room */
- 	        if (find_distance_range_for_vp(points,nbpoints,new_node->leaf.sv1,tree,lvl)<0){
+		float *d1 = (float*)malloc(2*nbpoints*sizeof(float));
+		float *d2 = d1 + nbpoints;
+		if (!d1){
+		    *error = MVP_MEMALLOC;
+		    return new_node;
+		}
+		if (compute_distances(tree, pool, points, nbpoints, new_node->leaf.sv1, d1) < 0){
 		    *error = MVP_NOSV1RANGE;
+		    free(d1);
 		    return new_node;
 		}
+		set_path(points, nbpoints, d1, tree, lvl);
 		int pos = 0;
 		if (new_node->leaf.sv2 == NULL){
 		    new_node->leaf.sv2 = points[0];
 		    pos = 1;
 		}
-		if (find_distance_range_for_vp(points,nbpoints,new_node->leaf.sv2,tree,lvl+1)<0){
+		if (compute_distances(tree, pool, points, nbpoints, new_node->leaf.sv2, d2) < 0){
 		    *error = MVP_NOSV2RANGE;
+		    free(d1);
 		    return new_node;
 		}    
+		set_path(points, nbpoints, d2, tree, lvl+1);
 		int count = new_node->leaf.nbpoints;
 		for (; pos < nbpoints;pos++){
-		    new_node->leaf.d1[count] = tree->dist(points[pos], new_node->leaf.sv1);
-		    new_node->leaf.d2[count] = tree->dist(points[pos], new_node->leaf.sv2);
-		    new_node->leaf.points[count++] = points[pos];
+		    leaf_set_point(tree, new_node, count++, points[pos], d1[pos], d2[pos]);
 		}
 		new_node->leaf.nbpoints = count;
+		free(d1);
 	    } else {
 
 		/* not enough room in current leaf - create new node */
@@ -535,21 +1217,29 @@ static Node* _mvptree_add(MVPTree *tree, Node *node, MVPDP **points, unsigned in
 		    tmp_pts[index++] = points[i];
 		}
 		Node *old_node = new_node;
-		free_node(old_node);
-		new_node = _mvptree_add(tree, NULL, tmp_pts, new_nb, error, lvl);
+		free_node(tree, old_node);
+		new_node = _mvptree_add(tree, pool, NULL, tmp_pts, new_nb, error, lvl);
 
 		free(tmp_pts);
 	    }
 	} else { /* node is internal - must recurse on subnodes */
 	    
-	    if (find_distance_range_for_vp(points, nbpoints, new_node->internal.sv1,tree,lvl)<0){
+	    float *dist = (float*)malloc(nbpoints*sizeof(float));
+	    if (!dist){
+		*error = MVP_MEMALLOC;
+		return new_node;
+	    }
+	    if (compute_distances(tree, pool, points, nbpoints, new_node->internal.sv1, dist) < 0){
 		*error = MVP_NOSV1RANGE;
+		free(dist);
 		return new_node;
 	    }
+	    set_path(points, nbpoints, dist, tree, lvl);
 	    
 	    int *binlengths = NULL;
-	    MVPDP ***bins = sort_points(points, nbpoints, -1, -1, new_node->internal.sv1,\
+	    MVPDP ***bins = sort_points(points, nbpoints, -1, -1, dist,\
                                                   tree, &binlengths, new_node->internal.M1);
+	    free(dist);
 	    int i;
 	    if (!bins){
 		*error = MVP_NOSORT;
@@ -562,17 +1252,21 @@ static Node* _mvptree_add(MVPTree *tree, Node *node, MVPDP **points, unsigned in
 		    continue;
 		}
 		int j;
-		if (find_distance_range_for_vp(bins[i], binlengths[i],\
-                                        new_node->internal.sv2, tree, lvl+1) < 0){
-		    *error = MVP_NOSV2RANGE;
+		float *dist2 = (float*)malloc(binlengths[i]*sizeof(float));
+		if (!dist2 || compute_distances(tree, pool, bins[i], binlengths[i],\
+                                                new_node->internal.sv2, dist2) < 0){
+		    *error = (dist2) ? MVP_NOSV2RANGE : MVP_MEMALLOC;
+		    free(dist2);
 		    for (j=0;j<tree->branchfactor;j++){free(bins[j]);}
 		    free(bins);
 		    return new_node;
 		}
+		set_path(bins[i], binlengths[i], dist2, tree, lvl+1);
 
 		int *bin2lengths = NULL;
-		MVPDP ***bins2 = sort_points(bins[i], binlengths[i], -1, -1,new_node->internal.sv2,\
+		MVPDP ***bins2 = sort_points(bins[i], binlengths[i], -1, -1, dist2,\
           		 tree, &bin2lengths, new_node->internal.M2 + i*lengthM1);
+		free(dist2);
 
 		if (!bins2){
 		    *error = MVP_NOSORT;
@@ -583,11 +1277,8 @@ static Node* _mvptree_add(MVPTree *tree, Node *node, MVPDP **points, unsigned in
 		for (j=0;j<tree->branchfactor;j++){
 		    /* for each row of 2nd tier bins */
 		    /* index into child node = i*branchfactor + j      */
-		    Node *child;
-		    child = _mvptree_add(tree,\
-                                  new_node->internal.child_nodes[i*tree->branchfactor + j],\
-                                  bins2[j],  bin2lengths[j],error, lvl+2);
-		    new_node->internal.child_nodes[i*tree->branchfactor+j] = child;
+		    add_subtree(tree, pool, &new_node->internal.child_nodes[i*tree->branchfactor+j],\
+                                &bins2[j], bin2lengths[j], error, lvl+2);
 		    if (*error != MVP_SUCCESS) break;
 		}
 		free(bin2lengths);
@@ -605,6 +1296,7 @@ static Node* _mvptree_add(MVPTree *tree, Node *node, MVPDP **points, unsigned in
 MVPError mvptree_add(MVPTree *tree, MVPDP **points, unsigned int nbpoints) {
     MVPError err = MVP_SUCCESS;
     if (nbpoints == 0) return err;
+    if (tree && tree->mapped) return MVP_ARGERR;
     if (tree && points){
 	if (tree->datatype == 0){
 	    tree->datatype = points[0]->type;
@@ -614,346 +1306,1673 @@ MVPError mvptree_add(MVPTree *tree, MVPDP **points, unsigned int nbpoints) {
 	}
 
 	unsigned int i;
+	tree_pool(tree);
 	for (i=0;i<nbpoints;i++){
-	    points[i]->path = (float*)malloc(tree->pathlength*sizeof(float));
+	    if (points[i]->pooled){
+		memset(points[i]->path, 0, tree->pathlength*sizeof(float));
+		continue;
+	    }
+	    points[i]->path = path_alloc(tree);
 	    if (points[i]->path == NULL){
 		return MVP_PATHALLOC;
 	    }
-	    memset(points[i]->path, 0, tree->pathlength*sizeof(float));
+	    if (tree->pool) tree->pool->nbforeign++;
+	}
+
+	unsigned int nbthreads = (tree->nbthreads >= 0) ? tree->nbthreads : 1;
+	if (nbthreads == 0){
+	    long nbcpus = sysconf(_SC_NPROCESSORS_ONLN);
+	    nbthreads = (nbcpus > 0) ? (unsigned int)nbcpus : 1;
+	}
+	if (nbthreads <= 1 || nbpoints < MIN_PARALLEL_SUBTREE){
+	    tree->node = _mvptree_add(tree, NULL, tree->node, points, nbpoints, &err, 0);
+	    return err;
 	}
-	tree->node = _mvptree_add(tree, tree->node, points, nbpoints, &err, 0);
+
+	BuildPool pool;
+	memset(&pool, 0, sizeof(BuildPool));
+	pool.tree = tree;
+	pool.nbthreads = nbthreads;
+	pool.error = MVP_SUCCESS;
+	if (pthread_mutex_init(&pool.lock, NULL) != 0) return MVP_THREAD;
+	if (pthread_cond_init(&pool.cond, NULL) != 0){
+	    pthread_mutex_destroy(&pool.lock);
+	    return MVP_THREAD;
+	}
+	pthread_t *threads = (pthread_t*)malloc(nbthreads*sizeof(pthread_t));
+	unsigned int nbstarted = 0;
+	while (threads && nbstarted < nbthreads-1){
+	    if (pthread_create(&threads[nbstarted], NULL, build_worker, &pool) != 0) break;
+	    nbstarted++;
+	}
+
+	/* the calling thread builds the top of the tree, then helps with the rest */
+	tree->node = _mvptree_add(tree, &pool, tree->node, points, nbpoints, &err, 0);
+	wait_tasks(&pool, &pool.subtrees);
+
+	pthread_mutex_lock(&pool.lock);
+	pool.stop = 1;
+	pthread_cond_broadcast(&pool.cond);
+	pthread_mutex_unlock(&pool.lock);
+	for (i=0;i<nbstarted;i++){
+	    pthread_join(threads[i], NULL);
+	}
+	free(threads);
+	pthread_cond_destroy(&pool.cond);
+	pthread_mutex_destroy(&pool.lock);
+	if (err == MVP_SUCCESS) err = pool.error;
     }else {
 	err = MVP_ARGERR;
     }
     return err;
 }
 
-
-static 
-MVPError _mvptree_retrieve(MVPTree *tree,Node *node,MVPDP *target, float radius, MVPDP** results,\
-                                                          unsigned int *nbresults, int lvl){
-    MVPError err = MVP_SUCCESS;
-    int bf = tree->branchfactor;
-    int lengthM1 = bf - 1;
-    float d1, d2;
-    if (node == NULL) return err;
-
-    CmpFunc distance = tree->dist;
-    unsigned int i, j;
-
+/* mark the datapoints with the id as deleted - returns the number marked */
+static unsigned int _mvptree_delete(MVPTree *tree, Node *node, const char *id){
+    unsigned int count = 0;
+    if (node == NULL) return count;
+    MVPDP *sv[2] = { node->leaf.sv1, node->leaf.sv2 };
+    int i;
+    for (i = 0;i < 2;i++){
+	if (sv[i] && !sv[i]->deleted && sv[i]->id && !strcmp(sv[i]->id, id)){
+	    sv[i]->deleted = 1;
+	    count++;
+	}
+    }
     if (node->leaf.type == LEAF_NODE){
-	d1 = distance(target, node->leaf.sv1);
-	if (is_nan(d1) || d1 < 0.0f){
-	    return MVP_BADDISTVAL;
+	for (i = 0;i < node->leaf.nbpoints;i++){
+	    MVPDP *dp = node->leaf.points[i];
+	    if (!dp->deleted && dp->id && !strcmp(dp->id, id)){
+		dp->deleted = 1;
+		count++;
+	    }
 	}
-
-	if (lvl < tree->pathlength) target->path[lvl] = d1;
-	if (d1 <= radius){
-	    results[(*nbresults)++] = node->leaf.sv1;
-	    if (*nbresults >= tree->k) return MVP_KNEARESTCAP;
+    } else {
+	int fanout = tree->branchfactor*tree->branchfactor;
+	for (i = 0;i < fanout;i++){
+	    count += _mvptree_delete(tree, node->internal.child_nodes[i], id);
 	}
-	if (tree->node->leaf.sv2){
-	    d2 = distance(target, node->leaf.sv2);
+    }
+    return count;
+}
 
-	    if (is_nan(d2) || d2 < 0.0f){
-		return MVP_BADDISTVAL;
-	    }
-	    if (d2 <= radius){
-		results[(*nbresults)++] = node->leaf.sv2;
-		if (*nbresults >= tree->k) return MVP_KNEARESTCAP;
-	    }
-	    if (lvl+1 < tree->pathlength) target->path[lvl+1] = d2;
-	    for (i=0;i<node->leaf.nbpoints;i++){
-
-		/* check all points 
-		float d = distance(target,node->leaf.points[i]);
-		fprintf(stdout,"pnt%d distance(Q,%s)=%f\n",i,node->leaf.points[i]->id,d);
-		if (d <= radius){
-		    results[(*nbresults)++] = node->leaf.points[i];
-		    if (*nbresults >= tree->k){
-			return MVP_KNEARESTCAP;
-		    }
-		}
-		*/
-
-		/* filter points before checking */
-		if (d1 - radius <= node->leaf.d1[i] && d1 + radius >= node->leaf.d1[i]){
-		    if (d2 - radius <= node->leaf.d2[i] && d2 + radius >= node->leaf.d2[i]){
-			int endpath = (lvl+1 < tree->pathlength) ? lvl+1 : tree->pathlength;
-			int skip = 0;
-			for (j=0;j < endpath;j++){
-			    if (target->path[j] - radius <= node->leaf.points[i]->path[j] &&\
-				target->path[j] + radius >= node->leaf.points[i]->path[j]){
-				continue;
-			    } else {
-				skip = 1;
-				break;
-			    }
-			}
-			if (!skip){
-
-			    float d = distance(target, node->leaf.points[i]);
-			    if (is_nan(d) || d < 0.0){
-				return MVP_BADDISTVAL;
-			    }
-			    if (d <= radius){
-				results[(*nbresults)++] = node->leaf.points[i];
-				if (*nbresults >= tree->k){
-				    return MVP_KNEARESTCAP;
-				}
-			    }
-			}
-		    }
-		}
+MVPError mvptree_delete(MVPTree *tree, const char *id){
+    if (!tree || !id || tree->mapped) return MVP_ARGERR;
+    if (_mvptree_delete(tree, tree->node, id) == 0) return MVP_IDNOTFOUND;
+    return MVP_SUCCESS;
+}
 
-	    }
+/* number of datapoints in a subtree, and how many of them are deleted */
+static void subtree_count(MVPTree *tree, Node *node, unsigned int *total, unsigned int *dead){
+    if (node == NULL) return;
+    MVPDP *sv[2] = { node->leaf.sv1, node->leaf.sv2 };
+    int i;
+    for (i = 0;i < 2;i++){
+	if (sv[i]){
+	    (*total)++;
+	    if (sv[i]->deleted) (*dead)++;
 	}
-    } else if (node->internal.type == INTERNAL_NODE){
-	d1 = distance(target, node->internal.sv1);
-	if (is_nan(d1) || d1 < 0.0f){
-	    return MVP_BADDISTVAL;
+    }
+    if (node->leaf.type == LEAF_NODE){
+	*total += node->leaf.nbpoints;
+	for (i = 0;i < node->leaf.nbpoints;i++){
+	    if (node->leaf.points[i]->deleted) (*dead)++;
 	}
-	if (d1 <= radius){
-	    results[(*nbresults)++] = node->internal.sv1;
-	    if (*nbresults >= tree->k) return MVP_KNEARESTCAP;
+    } else {
+	int fanout = tree->branchfactor*tree->branchfactor;
+	for (i = 0;i < fanout;i++){
+	    subtree_count(tree, node->internal.child_nodes[i], total, dead);
 	}
-	if (lvl < tree->pathlength) target->path[lvl] = d1;
-	d2 = distance(target, node->internal.sv2);
-	if (is_nan(d2) || d2 < 0.0f){
-	    return MVP_BADDISTVAL;
+    }
+}
+
+/* move the live datapoints of a subtree into points, freeing the deleted */
+/* datapoints and the nodes                                                */
+static void subtree_collect(MVPTree *tree, Node *node, MVPDP **points, unsigned int *nbpoints,\
+                                                                    MVPFreeFunc free_func){
+    if (node == NULL) return;
+    MVPDP *sv[2] = { node->leaf.sv1, node->leaf.sv2 };
+    int i;
+    for (i = 0;i < 2;i++){
+	if (sv[i] && sv[i]->deleted){
+	    tree_dp_free(tree, sv[i], free_func);
+	} else if (sv[i]){
+	    points[(*nbpoints)++] = sv[i];
 	}
-	if (d2 <= radius){
-	    results[(*nbresults)++] = node->internal.sv2;
-	    if (*nbresults >= tree->k) return MVP_KNEARESTCAP;
+    }
+    if (node->leaf.type == LEAF_NODE){
+	for (i = 0;i < node->leaf.nbpoints;i++){
+	    MVPDP *dp = node->leaf.points[i];
+	    if (dp->deleted){
+		tree_dp_free(tree, dp, free_func);
+	    } else {
+		points[(*nbpoints)++] = dp;
+	    }
 	}
-	if (lvl+1 < tree->pathlength) target->path[lvl+1] = d2;
-	/* check <= each 1st level bins */
-	for (i=0;i<lengthM1;i++){
-
-	    if (d1 - radius <= node->internal.M1[i]){
+    } else {
+	int fanout = tree->branchfactor*tree->branchfactor;
+	for (i = 0;i < fanout;i++){
+	    subtree_collect(tree, node->internal.child_nodes[i], points, nbpoints, free_func);
+	}
+    }
+    free_node(tree, node);
+}
 
-		/* check <= each 2nd level bins */
-		for (j=0;j<lengthM1;j++){
-		    if (d2 - radius <= node->internal.M2[i*lengthM1+j]){
-			
-			err = _mvptree_retrieve(tree,node->internal.child_nodes[i*bf+j],target,\
-                                                            radius, results, nbresults, lvl+2);
+/* Rebuild the highest subtrees whose fraction of live points is below threshold. */
+/* The points keep the distances in their paths from the vantage points above     */
+/* lvl, so a subtree is rebuilt in place from its live points alone.              */
+static Node* _mvptree_compact(MVPTree *tree, Node *node, float threshold,\
+                              MVPFreeFunc free_func, MVPError *error, int lvl){
+    unsigned int total = 0, dead = 0;
+    subtree_count(tree, node, &total, &dead);
+    if (dead == 0) return node;
+
+    if ((float)(total - dead) < threshold*(float)total){
+	MVPDP **points = (MVPDP**)malloc((total - dead + 1)*sizeof(MVPDP*));
+	if (points == NULL){
+	    *error = MVP_MEMALLOC;
+	    return node;
+	}
+	unsigned int nbpoints = 0;
+	subtree_collect(tree, node, points, &nbpoints, free_func);
+	node = _mvptree_add(tree, NULL, NULL, points, nbpoints, error, lvl);
+	free(points);
+	return node;
+    }
+    if (node->internal.type == INTERNAL_NODE){
+	int i, fanout = tree->branchfactor*tree->branchfactor;
+	for (i = 0;i < fanout && *error == MVP_SUCCESS;i++){
+	    node->internal.child_nodes[i] = _mvptree_compact(tree, node->internal.child_nodes[i],\
+                                                             threshold, free_func, error, lvl+2);
+	}
+    }
+    return node;
+}
+
+MVPError mvptree_compact(MVPTree *tree, float threshold, MVPFreeFunc free_func){
+    MVPError err = MVP_SUCCESS;
+    if (!tree || tree->mapped || is_nan(threshold)) return MVP_ARGERR;
+    tree->node = _mvptree_compact(tree, tree->node, threshold, free_func, &err, 0);
+    return err;
+}
+
+/* Layout of a version 2 file. Records are 8 byte aligned and refer to each other
+   by offsets relative to the start of the referring record, 0 for none, so that
+   a tree can be searched in place in a mapped file (see mvptree_map).
+
+   header:    char tag[13], int32 version, uint8 bf, pl, lc, datatype, (pad),
+              int64 offset of the top node
+   leaf:      uint32 type, uint32 nbpoints, int64 sv1, int64 sv2,
+              float d1[nbpoints], float d2[nbpoints],
+              float paths[pathlength][nbpoints], (pad), int64 points[nbpoints]
+   internal:  uint32 type, uint32 0, int64 sv1, int64 sv2,
+              float M1[bf-1], float M2[bf*(bf-1)], (pad), int64 child_nodes[bf*bf]
+   datapoint: uint32 bytelength, uint32 datalen, uint8 active, uint8 type,
+              uint16 idlen, uint32 0, float path[pathlength], (pad), data, (pad),
+              null-terminated id, (pad)
+
+   active is 0 for a datapoint deleted with mvptree_delete().
+*/
+
+#define ALIGN8(x)     (((x) + 7) & ~(off_t)7)
+#define NODE_HEADER   24
+#define DP_HEADER     16
+#define ROOT_OFFSET   24
+
+static const char* map_ref(const char *record, off_t pos){
+    int64_t rel = *(const int64_t*)(record + pos);
+    return (rel) ? record + rel : NULL;
+}
+
+/* Queries read nodes and datapoints through these functions, so the same code
+   searches a tree in memory and a tree mapped from a file. A node or datapoint
+   handle is a Node* or MVPDP* in memory, and a pointer to its record in a mapped
+   file. */
+
+static const void* tree_top(const MVPTree *tree){
+    return (tree->mapped) ? (const void*)(tree->buf + tree->root) : (const void*)tree->node;
+}
+
+static NodeType node_type(const MVPTree *tree, const void *node){
+    if (tree->mapped) return (NodeType)*(const uint32_t*)node;
+    return ((const Node*)node)->leaf.type;
+}
+
+static const void* node_sv1(const MVPTree *tree, const void *node){
+    if (tree->mapped) return map_ref((const char*)node, 8);
+    return ((const Node*)node)->leaf.sv1;
+}
+
+static const void* node_sv2(const MVPTree *tree, const void *node){
+    if (tree->mapped) return map_ref((const char*)node, 16);
+    return ((const Node*)node)->leaf.sv2;
+}
+
+static unsigned int leaf_nbpoints(const MVPTree *tree, const void *node){
+    if (tree->mapped) return *(const uint32_t*)((const char*)node + 4);
+    return ((const Node*)node)->leaf.nbpoints;
+}
+
+static const float* leaf_d1(const MVPTree *tree, const void *node){
+    if (tree->mapped) return (const float*)((const char*)node + NODE_HEADER);
+    return ((const Node*)node)->leaf.d1;
+}
+
+static const float* leaf_d2(const MVPTree *tree, const void *node){
+    if (tree->mapped) return leaf_d1(tree, node) + leaf_nbpoints(tree, node);
+    return ((const Node*)node)->leaf.d2;
+}
+
+/* path distances of the points of a leaf, path[j] of point i at paths[j*stride + i] */
+static const float* leaf_paths(const MVPTree *tree, const void *node, unsigned int *stride){
+    if (tree->mapped){
+	*stride = leaf_nbpoints(tree, node);
+	return leaf_d2(tree, node) + *stride;
+    }
+    *stride = tree->leafcap;
+    return ((const Node*)node)->leaf.paths;
+}
+
+/* offset of the point references in a mapped leaf record */
+static off_t leaf_refs(const MVPTree *tree, off_t nbpoints){
+    return NODE_HEADER + ALIGN8((2 + tree->pathlength)*nbpoints*sizeof(float));
+}
+
+static const void* leaf_point(const MVPTree *tree, const void *node, unsigned int i){
+    if (tree->mapped){
+	off_t nbpoints = leaf_nbpoints(tree, node);
+	return map_ref((const char*)node, leaf_refs(tree, nbpoints) + i*sizeof(int64_t));
+    }
+    return ((const Node*)node)->leaf.points[i];
+}
+
+static const float* internal_M1(const MVPTree *tree, const void *node){
+    if (tree->mapped) return (const float*)((const char*)node + NODE_HEADER);
+    return ((const Node*)node)->internal.M1;
+}
+
+static const float* internal_M2(const MVPTree *tree, const void *node){
+    if (tree->mapped) return internal_M1(tree, node) + tree->branchfactor - 1;
+    return ((const Node*)node)->internal.M2;
+}
+
+static const void* internal_child(const MVPTree *tree, const void *node, int i){
+    if (tree->mapped){
+	off_t bf = tree->branchfactor;
+	return map_ref((const char*)node, NODE_HEADER + ALIGN8((bf-1)*(bf+1)*sizeof(float)) +\
+                                          i*sizeof(int64_t));
+    }
+    return ((const Node*)node)->internal.child_nodes[i];
+}
+
+/* the datapoint for a handle - for a mapped tree, view is filled in with */
+/* pointers into the file                                                 */
+static MVPDP* dp_view(const MVPTree *tree, const void *dp, MVPDP *view){
+    if (!tree->mapped || dp == NULL) return (MVPDP*)dp;
+    const char *record = (const char*)dp;
+    view->datalen = *(const uint32_t*)(record + 4);
+    view->type = (MVPDataType)(uint8_t)record[9];
+    view->deleted = (record[8] == 0);
+    view->path = (float*)(record + DP_HEADER);
+    view->data = (void*)(record + DP_HEADER + ALIGN8(tree->pathlength*sizeof(float)));
+    view->id = (char*)view->data + ALIGN8((off_t)view->datalen*view->type);
+    return view;
+}
+
+/* whether a datapoint has not been deleted with mvptree_delete() */
+static int dp_live(const MVPTree *tree, const void *dp){
+    if (tree->mapped) return ((const char*)dp)[8] != 0;
+    return !((const MVPDP*)dp)->deleted;
+}
+
+/* Results are collected as handles. For a mapped tree the results array has room */
+/* for a view of each result after the pointers, so the user frees it all at once. */
+static MVPDP** alloc_results(const MVPTree *tree, unsigned int knearest){
+    size_t size = knearest*sizeof(MVPDP*);
+    if (tree->mapped) size += knearest*sizeof(MVPDP);
+    return (MVPDP**)malloc(size);
+}
+
+static void view_results(const MVPTree *tree, MVPDP **results, unsigned int knearest,\
+                                                            unsigned int nbresults){
+    unsigned int i;
+    if (!tree->mapped) return;
+    MVPDP *views = (MVPDP*)(results + knearest);
+    for (i = 0; i < nbresults; i++){
+	results[i] = dp_view(tree, results[i], &views[i]);
+    }
+}
+
+/* Marks in keep[] the points of a leaf whose distances from the two vantage points and
+   first nbpaths vantage points down the tree are all within radius of the target's.
+   Each distance is a separate array, so the tests are vector compares. nbvp gets the
+   number that pass the first two. */
+MVP_CLONES
+static unsigned int leaf_filter(const float *pd1, const float *pd2, const float *paths,\
+                                unsigned int stride, const float *tpath, int nbpaths,\
+                                unsigned int nbpoints, float d1, float d2, float radius,\
+                                unsigned char *restrict keep, unsigned int *nbvp){
+    float lo1 = d1 - radius, hi1 = d1 + radius;
+    float lo2 = d2 - radius, hi2 = d2 + radius;
+    unsigned int i, count = 0;
+    int j;
+    for (i = 0; i < nbpoints; i++){
+	keep[i] = (pd1[i] >= lo1) & (pd1[i] <= hi1) & (pd2[i] >= lo2) & (pd2[i] <= hi2);
+	count += keep[i];
+    }
+    *nbvp = count;
+    if (count == 0 || nbpaths == 0) return count;
+    count = 0;
+    for (j = 0; j < nbpaths; j++){
+	const float *col = paths + (size_t)j*stride;
+	float lo = tpath[j] - radius, hi = tpath[j] + radius;
+	for (i = 0; i < nbpoints; i++){
+	    keep[i] &= (col[i] >= lo) & (col[i] <= hi);
+	}
+    }
+    for (i = 0; i < nbpoints; i++){
+	count += keep[i];
+    }
+    return count;
+}
+
+/* collect into the query's candidates the points first to first+n-1 of a leaf   */
+/* that pass leaf_filter - n is at most query->ccap. Returns number of candidates */
+static unsigned int leaf_candidates(const MVPTree *tree, MVPQuery *query, const void *node,\
+                                    unsigned int first, unsigned int n, float d1, float d2,\
+                                    int nbpaths, float radius){
+    unsigned int i, stride, nbvp, nbkeep, nbcand = 0;
+    const float *paths = leaf_paths(tree, node, &stride);
+    nbkeep = leaf_filter(leaf_d1(tree, node) + first, leaf_d2(tree, node) + first,\
+                         paths + first, stride, query->path, nbpaths, n, d1, d2, radius,\
+                         query->ckeep, &nbvp);
+    query->stats.nbleafpoints += n;
+    query->stats.nbfiltered_vp += n - nbvp;
+    query->stats.nbfiltered_path += nbvp - nbkeep;
+    if (nbkeep == 0) return 0;
+    for (i = 0; i < n; i++){
+	if (!query->ckeep[i]) continue;
+	const void *dp = leaf_point(tree, node, first + i);
+	if (!dp_live(tree, dp)) continue;
+	query->candidates[nbcand] = dp;
+	query->cpoints[nbcand] = dp_view(tree, dp, &query->cviews[nbcand]);
+	nbcand++;
+    }
+    query->stats.nbcompared += nbcand;
+    query->stats.nbdistances += nbcand;
+    return nbcand;
+}
+
+/* Range search. Each point found is handed to hit() with its distance from the
+   target, and the search stops with MVP_KNEARESTCAP when hit() returns 0. */
+
+typedef int (*HitFunc)(const MVPTree *tree, const void *dp, float d, void *arg);
+
+/* collects the points found into an array of up to cap of them */
+typedef struct hits_t {
+    MVPDP **results;
+    unsigned int nb, cap;
+} Hits;
+
+static int collect_hit(const MVPTree *tree, const void *dp, float d, void *arg){
+    Hits *hits = (Hits*)arg;
+    (void)tree;
+    (void)d;
+    hits->results[hits->nb++] = (MVPDP*)dp;
+    return (hits->nb < hits->cap);
+}
+
+/* distances from the target to the candidate points of a leaf, in one batch */
+static MVPError range_candidates(const MVPTree *tree, MVPQuery *query, MVPDP *target,\
+                                 float radius, HitFunc hit, void *arg, unsigned int nbcand){
+    unsigned int i;
+    mvp_batch_distance(tree->dist, target, query->cpoints, nbcand, query->cdist);
+    for (i = 0; i < nbcand; i++){
+	float d = query->cdist[i];
+	if (is_nan(d) || d < 0.0f){
+	    return MVP_BADDISTVAL;
+	}
+	if (d <= radius && !hit(tree, query->candidates[i], d, arg)){
+	    return MVP_KNEARESTCAP;
+	}
+    }
+    return MVP_SUCCESS;
+}
+
+static 
+MVPError _mvptree_retrieve(const MVPTree *tree,MVPQuery *query,const void *node,MVPDP *target,\
+                           float radius, HitFunc hit, void *arg, int lvl){
+    MVPError err = MVP_SUCCESS;
+    int bf = tree->branchfactor;
+    int lengthM1 = bf - 1;
+    float d1, d2;
+    MVPDP view;
+    if (node == NULL) return err;
+
+    CmpFunc distance = tree->dist;
+    unsigned int i, j;
+    const void *sv1 = node_sv1(tree, node);
+    const void *sv2 = node_sv2(tree, node);
+
+    if (node_type(tree, node) == LEAF_NODE){
+	query->stats.nbleaves++;
+	d1 = distance(target, dp_view(tree, sv1, &view));
+	query->stats.nbdistances++;
+	if (is_nan(d1) || d1 < 0.0f){
+	    return MVP_BADDISTVAL;
+	}
+
+	if (lvl < tree->pathlength) query->path[lvl] = d1;
+	if (d1 <= radius && dp_live(tree, sv1) && !hit(tree, sv1, d1, arg)){
+	    return MVP_KNEARESTCAP;
+	}
+	if (sv2){
+	    d2 = distance(target, dp_view(tree, sv2, &view));
+	    query->stats.nbdistances++;
+
+	    if (is_nan(d2) || d2 < 0.0f){
+		return MVP_BADDISTVAL;
+	    }
+	    if (d2 <= radius && dp_live(tree, sv2) && !hit(tree, sv2, d2, arg)){
+		return MVP_KNEARESTCAP;
+	    }
+	    if (lvl+1 < tree->pathlength) query->path[lvl+1] = d2;
+
+	    unsigned int nbpoints = leaf_nbpoints(tree, node), nbcand, n;
+	    int endpath = (lvl+1 < tree->pathlength) ? lvl+1 : tree->pathlength;
+
+	    /* filter points before checking, a chunk of candidates at a time */
+	    for (i=0;i<nbpoints;i+=n){
+		n = (nbpoints - i < query->ccap) ? nbpoints - i : query->ccap;
+		nbcand = leaf_candidates(tree, query, node, i, n, d1, d2, endpath, radius);
+		if (nbcand > 0){
+		    err = range_candidates(tree, query, target, radius, hit, arg, nbcand);
+		    if (err != MVP_SUCCESS) return err;
+		}
+	    }
+	}
+    } else if (node_type(tree, node) == INTERNAL_NODE){
+	const float *M1 = internal_M1(tree, node), *M2 = internal_M2(tree, node);
+	query->stats.nbinternals++;
+
+	d1 = distance(target, dp_view(tree, sv1, &view));
+	query->stats.nbdistances++;
+	if (is_nan(d1) || d1 < 0.0f){
+	    return MVP_BADDISTVAL;
+	}
+	if (d1 <= radius && dp_live(tree, sv1) && !hit(tree, sv1, d1, arg)){
+	    return MVP_KNEARESTCAP;
+	}
+	if (lvl < tree->pathlength) query->path[lvl] = d1;
+	d2 = distance(target, dp_view(tree, sv2, &view));
+	query->stats.nbdistances++;
+	if (is_nan(d2) || d2 < 0.0f){
+	    return MVP_BADDISTVAL;
+	}
+	if (d2 <= radius && dp_live(tree, sv2) && !hit(tree, sv2, d2, arg)){
+	    return MVP_KNEARESTCAP;
+	}
+	if (lvl+1 < tree->pathlength) query->path[lvl+1] = d2;
+	/* check <= each 1st level bins */
+	for (i=0;i<lengthM1;i++){
+
+	    if (d1 - radius <= M1[i]){
+
+		/* check <= each 2nd level bins */
+		for (j=0;j<lengthM1;j++){
+		    if (d2 - radius <= M2[i*lengthM1+j]){
+			
+			err = _mvptree_retrieve(tree,query,internal_child(tree,node,i*bf+j),target,\
+                                                            radius, hit, arg, lvl+2);
 
 			if (err != MVP_SUCCESS) return err;
 		    }
 		}
 		/* check >= last 2nd level bin  */
-		if (d2 + radius >= node->internal.M2[i*lengthM1+lengthM1-1]){
+		if (d2 + radius >= M2[i*lengthM1+lengthM1-1]){
+
+		    err = _mvptree_retrieve(tree,query,internal_child(tree,node,i*bf+lengthM1),\
+                                        target, radius, hit, arg, lvl+2);
+		    if (err != MVP_SUCCESS) return err;
+		}
+	    }
+	}
+
+	/* check >= last 1st level bin */
+        if (d1 + radius >= M1[lengthM1-1]){
+
+	    /* check <= each 2nd level bins */
+	    for (j=0;j<lengthM1;j++){
+		if (d2 - radius <= M2[lengthM1*lengthM1+j]){
+
+		    err = _mvptree_retrieve(tree,query,internal_child(tree,node,bf*lengthM1+j),\
+                                            target, radius, hit, arg, lvl+2);
+		    if (err != MVP_SUCCESS) return err;
+		}
+	    }
+	    /* check >= last 2nd level bin  */
+
+	    if (d2 + radius >= M2[lengthM1*lengthM1+lengthM1-1]){
+
+		err = _mvptree_retrieve(tree,query,internal_child(tree,node,bf*lengthM1+lengthM1),\
+                                         target, radius, hit, arg, lvl+2);
+		if (err != MVP_SUCCESS) return err;
+	    }
+	}
+    } else {
+	err = MVP_UNRECOGNIZED;
+    }
+    return err;
+}
+
+MVPQuery* mvpquery_alloc(MVPQuery *query, const MVPTree *tree){
+    if (tree == NULL || tree->pathlength < 0) return NULL;
+
+    MVPQuery *retQuery;
+    if (query == NULL){
+	retQuery = (MVPQuery*)malloc(sizeof(MVPQuery));
+	if (retQuery == NULL) return NULL;
+    } else {
+	retQuery = query;
+    }
+    memset(retQuery, 0, sizeof(MVPQuery));
+
+    retQuery->pathlength = tree->pathlength;
+    retQuery->path = (float*)calloc(tree->pathlength+1, sizeof(float));
+    retQuery->ccap = (tree->leafcap > 0) ? tree->leafcap : 1;
+    retQuery->candidates = (const void**)malloc(retQuery->ccap*sizeof(void*));
+    retQuery->cpoints = (MVPDP**)malloc(retQuery->ccap*sizeof(MVPDP*));
+    retQuery->cviews = (MVPDP*)malloc(retQuery->ccap*sizeof(MVPDP));
+    retQuery->cdist = (float*)malloc(retQuery->ccap*sizeof(float));
+    retQuery->ckeep = (unsigned char*)malloc(retQuery->ccap);
+    if (!retQuery->path || !retQuery->candidates || !retQuery->cpoints ||\
+        !retQuery->cviews || !retQuery->cdist || !retQuery->ckeep){
+	mvpquery_clear(retQuery);
+	if (query == NULL) free(retQuery);
+	return NULL;
+    }
+
+    return retQuery;
+}
+
+void mvpquery_clear(MVPQuery *query){
+    if (query){
+	free(query->path);
+	free(query->results);
+	free(query->queue);
+	free(query->paths);
+	free(query->candidates);
+	free(query->cpoints);
+	free(query->cviews);
+	free(query->cdist);
+	free(query->ckeep);
+	memset(query, 0, sizeof(MVPQuery));
+    }
+}
+
+static MVPError check_query(const MVPTree *tree, MVPQuery *query, MVPDP *target,\
+                            unsigned int knearest, float radius, unsigned int *nbresults){
+    if (!tree || !query || !target || !nbresults || knearest == 0 || radius < 0){
+	return MVP_ARGERR;
+    }
+    if (!query->path || query->pathlength < tree->pathlength){
+	return MVP_ARGERR;
+    }
+    if (!tree->dist){
+	return MVP_NODISTANCEFUNC;
+    }
+    *nbresults = 0;
+    memset(&query->stats, 0, sizeof(MVPStats));
+    if (!tree->node && !tree->mapped){
+	return MVP_EMPTYTREE;
+    }
+    return MVP_SUCCESS;
+}
+
+MVPDP** mvptree_retrieve_r(const MVPTree *tree, MVPQuery *query, MVPDP *target,\
+                           unsigned int knearest, float radius, unsigned int *nbresults,\
+                           MVPError *error){
+    *error = check_query(tree, query, target, knearest, radius, nbresults);
+    if (*error != MVP_SUCCESS) return NULL;
+
+    MVPDP **results = alloc_results(tree, knearest);
+    if (!results) {
+	*error = MVP_MEMALLOC;
+	return NULL;
+    }
+    Hits hits = { results, 0, knearest };
+    *error = _mvptree_retrieve(tree, query, tree_top(tree), target, radius, collect_hit, &hits, 0);
+    *nbresults = hits.nb;
+    view_results(tree, results, knearest, *nbresults);
+
+    return results;
+}
+
+/* hands the points found to the caller's callback as views */
+typedef struct visit_t {
+    MVPVisitFunc visit;
+    void *arg;
+} Visit;
+
+static int visit_hit(const MVPTree *tree, const void *dp, float d, void *arg){
+    Visit *visit = (Visit*)arg;
+    MVPDP view;
+    return visit->visit(dp_view(tree, dp, &view), d, visit->arg);
+}
+
+MVPError mvptree_retrieve_visit(const MVPTree *tree, MVPQuery *query, MVPDP *target,\
+                                float radius, MVPVisitFunc visit, void *arg){
+    unsigned int nbresults;
+    if (!visit) return MVP_ARGERR;
+    MVPError err = check_query(tree, query, target, 1, radius, &nbresults);
+    if (err != MVP_SUCCESS) return err;
+
+    Visit v = { visit, arg };
+    err = _mvptree_retrieve(tree, query, tree_top(tree), target, radius, visit_hit, &v, 0);
+    return (err == MVP_KNEARESTCAP) ? MVP_SUCCESS : err;
+}
+
+MVPDP** mvptree_retrieve(MVPTree *tree, MVPDP *target, unsigned int knearest, float radius,\
+                                                 unsigned int *nbresults,MVPError *error){
+    MVPQuery query;
+    if (!tree || !target || !nbresults || knearest == 0 || radius < 0) {
+	*error = MVP_ARGERR;
+	return NULL;
+    }
+    if (!mvpquery_alloc(&query, tree)){
+	*error = MVP_MEMALLOC;
+	return NULL;
+    }
+    MVPDP **results = mvptree_retrieve_r(tree, &query, target, knearest, radius, nbresults, error);
+    mvpquery_clear(&query);
+
+    return results;
+}
+
+/* k-nearest neighbor search. Nodes are visited best first, in order of a lower
+   bound on the distance from the target to anything below them. The k best
+   results so far are kept in a max heap, and once it is full the search radius
+   shrinks to the distance of the farthest of them. */
+
+static void knn_add_result(MVPQuery *q, const void *dp, float d){
+    KnnResult *heap = q->results;
+    unsigned int i, child;
+
+    if (d > q->radius) return;
+    if (q->nbresults < q->k){
+	i = q->nbresults++;
+	while (i > 0 && heap[(i-1)/2].d < d){
+	    heap[i] = heap[(i-1)/2];
+	    i = (i-1)/2;
+	}
+    } else {
+	if (d >= heap[0].d) return;
+	i = 0;
+	while ((child = 2*i+1) < q->nbresults){
+	    if (child+1 < q->nbresults && heap[child+1].d > heap[child].d) child++;
+	    if (heap[child].d <= d) break;
+	    heap[i] = heap[child];
+	    i = child;
+	}
+    }
+    heap[i].d = d;
+    heap[i].dp = dp;
+
+    if (q->nbresults == q->k) q->radius = heap[0].d;
+}
+
+static int knn_push_node(MVPQuery *q, const void *node, float bound, int lvl, int path){
+    if (node == NULL || bound > q->radius) return 0;
+    if (q->qlen == q->qcap){
+	unsigned int cap = (q->qcap) ? 2*q->qcap : 64;
+	KnnNode *tmp = (KnnNode*)realloc(q->queue, cap*sizeof(KnnNode));
+	if (!tmp) return -1;
+	q->queue = tmp;
+	q->qcap = cap;
+    }
+    unsigned int i = q->qlen++;
+    while (i > 0 && q->queue[(i-1)/2].bound > bound){
+	q->queue[i] = q->queue[(i-1)/2];
+	i = (i-1)/2;
+    }
+    q->queue[i].bound = bound;
+    q->queue[i].node = node;
+    q->queue[i].lvl = lvl;
+    q->queue[i].path = path;
+    return 0;
+}
+
+static KnnNode knn_pop_node(MVPQuery *q){
+    KnnNode top = q->queue[0];
+    KnnNode last = q->queue[--q->qlen];
+    unsigned int i = 0, child;
+    while ((child = 2*i+1) < q->qlen){
+	if (child+1 < q->qlen && q->queue[child+1].bound < q->queue[child].bound) child++;
+	if (q->queue[child].bound >= last.bound) break;
+	q->queue[i] = q->queue[child];
+	i = child;
+    }
+    if (q->qlen > 0) q->queue[i] = last;
+    return top;
+}
+
+static int knn_push_path(MVPQuery *q, float d1, float d2, int parent){
+    if (q->plen == q->pcap){
+	unsigned int cap = (q->pcap) ? 2*q->pcap : 64;
+	KnnPath *tmp = (KnnPath*)realloc(q->paths, cap*sizeof(KnnPath));
+	if (!tmp) return -1;
+	q->paths = tmp;
+	q->pcap = cap;
+    }
+    q->paths[q->plen].d1 = d1;
+    q->paths[q->plen].d2 = d2;
+    q->paths[q->plen].parent = parent;
+    return q->plen++;
+}
+
+/* lower bound on |d - x| for x in bin i, bin i holds M[i-1] < x <= M[i] */
+static float bin_bound(float d, const float *M, int lengthM, int i){
+    float lo = (i > 0) ? M[i-1] : 0.0f;
+    if (d < lo) return lo - d;
+    if (i < lengthM && d > M[i]) return d - M[i];
+    return 0.0f;
+}
+
+/* distances from the target to the candidate points of a leaf, in one batch */
+static MVPError knn_candidates(const MVPTree *tree, MVPQuery *q, MVPDP *target,\
+                                                            unsigned int nbcand){
+    unsigned int i;
+    mvp_batch_distance(tree->dist, target, q->cpoints, nbcand, q->cdist);
+    for (i = 0; i < nbcand; i++){
+	float d = q->cdist[i];
+	if (is_nan(d) || d < 0.0f){
+	    return MVP_BADDISTVAL;
+	}
+	knn_add_result(q, q->candidates[i], d);
+    }
+    return MVP_SUCCESS;
+}
+
+static MVPError _mvptree_knearest(const MVPTree *tree, MVPQuery *q, KnnNode *entry, MVPDP *target){
+    const void *node = entry->node;
+    CmpFunc distance = tree->dist;
+    int bf = tree->branchfactor;
+    int lengthM1 = bf - 1;
+    int lvl = entry->lvl;
+    float d1, d2 = 0.0f;
+    int i, j;
+    MVPDP view;
+    const void *sv1 = node_sv1(tree, node);
+    const void *sv2 = node_sv2(tree, node);
+
+    if (node_type(tree, node) == LEAF_NODE){
+	q->stats.nbleaves++;
+	d1 = distance(target, dp_view(tree, sv1, &view));
+	q->stats.nbdistances++;
+	if (is_nan(d1) || d1 < 0.0f){
+	    return MVP_BADDISTVAL;
+	}
+	if (dp_live(tree, sv1)) knn_add_result(q, sv1, d1);
+	if (sv2 == NULL) return MVP_SUCCESS;
+
+	d2 = distance(target, dp_view(tree, sv2, &view));
+	q->stats.nbdistances++;
+	if (is_nan(d2) || d2 < 0.0f){
+	    return MVP_BADDISTVAL;
+	}
+	if (dp_live(tree, sv2)) knn_add_result(q, sv2, d2);
+
+	/* restore the target's path of distances down to this leaf */
+	int endpath = (lvl < tree->pathlength) ? lvl : tree->pathlength;
+	int index = entry->path, pos = lvl - 2;
+	while (index >= 0){
+	    if (pos < tree->pathlength) q->path[pos] = q->paths[index].d1;
+	    if (pos+1 < tree->pathlength) q->path[pos+1] = q->paths[index].d2;
+	    index = q->paths[index].parent;
+	    pos -= 2;
+	}
+
+	unsigned int nbpoints = leaf_nbpoints(tree, node), first, nbcand, n;
+
+	/* filter points before checking, against the radius as it stands for each chunk */
+	for (first=0;first<nbpoints;first+=n){
+	    n = (nbpoints - first < q->ccap) ? nbpoints - first : q->ccap;
+	    nbcand = leaf_candidates(tree, q, node, first, n, d1, d2, endpath, q->radius);
+	    if (nbcand > 0){
+		MVPError err = knn_candidates(tree, q, target, nbcand);
+		if (err != MVP_SUCCESS) return err;
+	    }
+	}
+    } else if (node_type(tree, node) == INTERNAL_NODE){
+	const float *M1 = internal_M1(tree, node), *M2 = internal_M2(tree, node);
+	q->stats.nbinternals++;
+
+	d1 = distance(target, dp_view(tree, sv1, &view));
+	q->stats.nbdistances++;
+	if (is_nan(d1) || d1 < 0.0f){
+	    return MVP_BADDISTVAL;
+	}
+	if (dp_live(tree, sv1)) knn_add_result(q, sv1, d1);
+	d2 = distance(target, dp_view(tree, sv2, &view));
+	q->stats.nbdistances++;
+	if (is_nan(d2) || d2 < 0.0f){
+	    return MVP_BADDISTVAL;
+	}
+	if (dp_live(tree, sv2)) knn_add_result(q, sv2, d2);
+
+	int path = knn_push_path(q, d1, d2, entry->path);
+	if (path < 0) return MVP_MEMALLOC;
+
+	for (i=0;i<bf;i++){
+	    float b1 = bin_bound(d1, M1, lengthM1, i);
+	    if (b1 < entry->bound) b1 = entry->bound;
+	    if (b1 > q->radius) continue;
+	    for (j=0;j<bf;j++){
+		float b2 = bin_bound(d2, M2 + i*lengthM1, lengthM1, j);
+		if (b2 < b1) b2 = b1;
+		if (knn_push_node(q, internal_child(tree, node, i*bf+j), b2, lvl+2, path) < 0){
+		    return MVP_MEMALLOC;
+		}
+	    }
+	}
+    } else {
+	return MVP_UNRECOGNIZED;
+    }
+    return MVP_SUCCESS;
+}
+
+/* k nearest search - leaves the results in the query's max heap */
+static MVPError knn_search(const MVPTree *tree, MVPQuery *q, MVPDP *target,\
+                           unsigned int knearest, float radius){
+    MVPError error = MVP_SUCCESS;
+    q->nbresults = 0;
+    if (q->rcap < knearest){
+	KnnResult *tmp = (KnnResult*)realloc(q->results, knearest*sizeof(KnnResult));
+	if (!tmp) return MVP_MEMALLOC;
+	q->results = tmp;
+	q->rcap = knearest;
+    }
+    q->k = knearest;
+    q->radius = radius;
+    q->qlen = 0;
+    q->plen = 0;
+
+    if (knn_push_node(q, tree_top(tree), 0.0f, 0, -1) < 0){
+	return MVP_MEMALLOC;
+    }
+    while (error == MVP_SUCCESS && q->qlen > 0){
+	KnnNode entry = knn_pop_node(q);
+	if (entry.bound > q->radius) break;
+	error = _mvptree_knearest(tree, q, &entry, target);
+    }
+    return error;
+}
+
+MVPDP** mvptree_retrieve_knearest_r(const MVPTree *tree, MVPQuery *query, MVPDP *target,\
+                                    unsigned int knearest, float radius,\
+                                    unsigned int *nbresults, MVPError *error){
+    *error = check_query(tree, query, target, knearest, radius, nbresults);
+    if (*error != MVP_SUCCESS) return NULL;
+
+    MVPDP **results = alloc_results(tree, knearest);
+    if (!results){
+	*error = MVP_MEMALLOC;
+	return NULL;
+    }
+
+    MVPQuery *q = query;
+    *error = knn_search(tree, q, target, knearest, radius);
+
+    /* unwind the heap into ascending order of distance */
+    *nbresults = q->nbresults;
+    while (q->nbresults > 0){
+	results[q->nbresults-1] = (MVPDP*)q->results[0].dp;
+	KnnResult last = q->results[--q->nbresults];
+	unsigned int i = 0, child;
+	while ((child = 2*i+1) < q->nbresults){
+	    if (child+1 < q->nbresults && q->results[child+1].d > q->results[child].d) child++;
+	    if (q->results[child].d <= last.d) break;
+	    q->results[i] = q->results[child];
+	    i = child;
+	}
+	q->results[i] = last;
+    }
+    view_results(tree, results, knearest, *nbresults);
+
+    return results;
+}
+
+MVPDP** mvptree_retrieve_knearest(MVPTree *tree, MVPDP *target, unsigned int knearest,\
+                                  float radius, unsigned int *nbresults, MVPError *error){
+    MVPQuery query;
+    if (!tree || !target || !nbresults || knearest == 0 || radius < 0) {
+	*error = MVP_ARGERR;
+	return NULL;
+    }
+    if (!mvpquery_alloc(&query, tree)){
+	*error = MVP_MEMALLOC;
+	return NULL;
+    }
+    MVPDP **results = mvptree_retrieve_knearest_r(tree, &query, target, knearest, radius,\
+                                                  nbresults, error);
+    mvpquery_clear(&query);
+
+    return results;
+}
+
+/* batch retrieval - each worker thread owns a query struct and takes the next
+   target off a shared counter until all targets are done */
+
+typedef struct batch_t {
+    const MVPTree *tree;
+    MVPDP **targets;
+    unsigned int nbtargets;
+    unsigned int knearest;
+    float radius;
+    MVPDP ***results;
+    unsigned int *nbresults;
+    MVPError *errors;
+    unsigned int next;
+    pthread_mutex_t lock;
+} Batch;
+
+static void* batch_worker(void *arg){
+    Batch *batch = (Batch*)arg;
+    MVPQuery query;
+    int ready = (mvpquery_alloc(&query, batch->tree) != NULL);
+
+    while (1){
+	pthread_mutex_lock(&batch->lock);
+	unsigned int i = batch->next++;
+	pthread_mutex_unlock(&batch->lock);
+	if (i >= batch->nbtargets) break;
+
+	batch->nbresults[i] = 0;
+	if (!ready){
+	    batch->results[i] = NULL;
+	    batch->errors[i] = MVP_MEMALLOC;
+	    continue;
+	}
+	batch->results[i] = mvptree_retrieve_knearest_r(batch->tree, &query, batch->targets[i],\
+                                 batch->knearest, batch->radius, &batch->nbresults[i],\
+                                 &batch->errors[i]);
+    }
+    if (ready) mvpquery_clear(&query);
+    return NULL;
+}
+
+MVPError mvptree_retrieve_batch(const MVPTree *tree, MVPDP **targets, unsigned int nbtargets,\
+                                unsigned int knearest, float radius, unsigned int nbthreads,\
+                                MVPDP ***results, unsigned int *nbresults, MVPError *errors){
+    if (!tree || !targets || !results || !nbresults || !errors || knearest == 0 || radius < 0){
+	return MVP_ARGERR;
+    }
+    if (nbtargets == 0) return MVP_SUCCESS;
+
+    if (nbthreads == 0){
+	long nbcpus = sysconf(_SC_NPROCESSORS_ONLN);
+	nbthreads = (nbcpus > 0) ? (unsigned int)nbcpus : 1;
+    }
+    if (nbthreads > nbtargets) nbthreads = nbtargets;
+
+    Batch batch;
+    batch.tree = tree;
+    batch.targets = targets;
+    batch.nbtargets = nbtargets;
+    batch.knearest = knearest;
+    batch.radius = radius;
+    batch.results = results;
+    batch.nbresults = nbresults;
+    batch.errors = errors;
+    batch.next = 0;
+    if (pthread_mutex_init(&batch.lock, NULL) != 0) return MVP_THREAD;
+
+    pthread_t *threads = (pthread_t*)malloc(nbthreads*sizeof(pthread_t));
+    if (!threads){
+	pthread_mutex_destroy(&batch.lock);
+	return MVP_MEMALLOC;
+    }
+
+    /* the calling thread is one of the workers */
+    unsigned int i, nbstarted = 0;
+    for (i=1;i<nbthreads;i++){
+	if (pthread_create(&threads[nbstarted], NULL, batch_worker, &batch) != 0) break;
+	nbstarted++;
+    }
+    batch_worker(&batch);
+    for (i=0;i<nbstarted;i++){
+	pthread_join(threads[i], NULL);
+    }
+
+    free(threads);
+    pthread_mutex_destroy(&batch.lock);
+    return MVP_SUCCESS;
+}
+
+/* Shards - datapoints divided between a set of trees. Adding to and searching
+   the set runs a pool of threads that take the next shard off a shared counter,
+   as with the batch retrieval above, and the results of the shards are merged. */
+
+MVPShards* mvpshards_alloc(MVPShards *shards, CmpFunc distance, unsigned int nbshards,\
+                           MVPShardMode mode, unsigned int bf, unsigned int p, unsigned int k){
+    if (distance == NULL || nbshards == 0) return NULL;
+    if (mode != MVP_SHARD_HASH && mode != MVP_SHARD_VANTAGE) return NULL;
+
+    MVPShards *retShards = shards;
+    if (retShards == NULL){
+	retShards = (MVPShards*)malloc(sizeof(MVPShards));
+	if (retShards == NULL) return NULL;
+    }
+    memset(retShards, 0, sizeof(MVPShards));
+    retShards->nbshards = nbshards;
+    retShards->mode = mode;
+    retShards->nbthreads = 0;
+    retShards->trees = (MVPTree**)calloc(nbshards, sizeof(MVPTree*));
+    retShards->splits = (float*)calloc(nbshards, sizeof(float));
+
+    unsigned int i = 0;
+    if (retShards->trees){
+	for (i = 0;i < nbshards;i++){
+	    retShards->trees[i] = mvptree_alloc(NULL, distance, bf, p, k);
+	    if (retShards->trees[i] == NULL) break;
+	}
+    }
+    if (!retShards->trees || !retShards->splits || i < nbshards){
+	mvpshards_clear(retShards, NULL);
+	if (shards == NULL) free(retShards);
+	return NULL;
+    }
+    return retShards;
+}
+
+void mvpshards_clear(MVPShards *shards, MVPFreeFunc free_func){
+    if (shards == NULL) return;
+    unsigned int i;
+    if (shards->trees){
+	for (i = 0;i < shards->nbshards;i++){
+	    if (shards->trees[i] == NULL) continue;
+	    mvptree_clear(shards->trees[i], free_func);
+	    free(shards->trees[i]);
+	}
+    }
+    free(shards->trees);
+    free(shards->splits);
+    dp_free(shards->vp, free);
+    shards->trees = NULL;
+    shards->splits = NULL;
+    shards->vp = NULL;
+    shards->nbshards = 0;
+}
+
+/* FNV-1a */
+static uint32_t shard_hash(const unsigned char *bytes, size_t n){
+    uint32_t h = 2166136261u;
+    size_t i;
+    for (i = 0;i < n;i++){
+	h ^= bytes[i];
+	h *= 16777619u;
+    }
+    return h;
+}
+
+static unsigned int hash_shard(const MVPShards *shards, MVPDP *dp){
+    if (dp->id) return shard_hash((const unsigned char*)dp->id, strlen(dp->id)) % shards->nbshards;
+    return shard_hash((const unsigned char*)dp->data, (size_t)dp->datalen*dp->type) %\
+                                                                          shards->nbshards;
+}
+
+/* shard of a point at distance d from the vantage point */
+static unsigned int ring_shard(const MVPShards *shards, float d){
+    unsigned int i;
+    for (i = 0;i + 1 < shards->nbshards;i++){
+	if (d <= shards->splits[i]) break;
+    }
+    return i;
+}
+
+static int compare_floats_asc(const void *a, const void *b){
+    float x = *(const float*)a, y = *(const float*)b;
+    return (x > y) - (x < y);
+}
+
+/* distances of the points from a vantage point, checked for bad values */
+static MVPError vantage_distances(CmpFunc distance, MVPDP *vp, MVPDP **points,\
+                                  unsigned int nbpoints, float *dist){
+    unsigned int i;
+    mvp_batch_distance(distance, vp, points, nbpoints, dist);
+    for (i = 0;i < nbpoints;i++){
+	if (is_nan(dist[i]) || dist[i] < 0.0f) return MVP_BADDISTVAL;
+    }
+    return MVP_SUCCESS;
+}
+
+/* Pick the vantage point for MVP_SHARD_VANTAGE - the point farthest from the first
+   one, which lies out at the edge of the data - and split the distances of the
+   points from it into rings holding equal numbers of points. dist receives the
+   distances. The shards keep a copy of the vantage point. */
+static MVPError pick_vantage(MVPShards *shards, CmpFunc distance, MVPDP **points,\
+                             unsigned int nbpoints, float *dist){
+    unsigned int i, far = 0;
+    MVPError err = vantage_distances(distance, points[0], points, nbpoints, dist);
+    if (err != MVP_SUCCESS) return err;
+    for (i = 1;i < nbpoints;i++){
+	if (dist[i] > dist[far]) far = i;
+    }
+    err = vantage_distances(distance, points[far], points, nbpoints, dist);
+    if (err != MVP_SUCCESS) return err;
+
+    float *sorted = (float*)malloc(nbpoints*sizeof(float));
+    MVPDP *vp = dp_alloc(points[far]->type);
+    size_t datasize = (size_t)points[far]->datalen*points[far]->type;
+    if (vp){
+	vp->datalen = points[far]->datalen;
+	vp->data = malloc(datasize + 1);
+	if (points[far]->id) vp->id = strdup(points[far]->id);
+    }
+    if (!sorted || !vp || !vp->data || (points[far]->id && !vp->id)){
+	free(sorted);
+	dp_free(vp, free);
+	return MVP_MEMALLOC;
+    }
+    memcpy(vp->data, points[far]->data, datasize);
+
+    memcpy(sorted, dist, nbpoints*sizeof(float));
+    qsort(sorted, nbpoints, sizeof(float), compare_floats_asc);
+    for (i = 0;i + 1 < shards->nbshards;i++){
+	unsigned int pos = (unsigned int)(((uint64_t)(i+1)*nbpoints)/shards->nbshards);
+	shards->splits[i] = sorted[(pos > 0) ? pos-1 : 0];
+    }
+    shards->splits[shards->nbshards-1] = INFINITY;
+    shards->vp = vp;
+    free(sorted);
+    return MVP_SUCCESS;
+}
 
-		    err = _mvptree_retrieve(tree,node->internal.child_nodes[i*bf+lengthM1],\
-                                        target, radius, results, nbresults, lvl+2);
-		    if (err != MVP_SUCCESS) return err;
-		}
-	    }
+typedef struct shard_result_t {
+    float d;
+    const void *dp;
+    unsigned int shard;
+} ShardResult;
+
+typedef struct shard_job_t {
+    const MVPShards *shards;
+    int build;                  /* add points to the shards, or search them          */
+    MVPDP **points;             /* build - shard i adds points offsets[i] to         */
+    unsigned int *offsets;      /* offsets[i+1]-1                                    */
+    MVPDP *target;              /* search                                            */
+    unsigned int knearest;
+    float radius;
+    int knn;                    /* k nearest search, or range search                 */
+    unsigned char *skip;        /* shards that cannot hold a point within radius     */
+    ShardResult *found;         /* up to knearest results of each shard              */
+    unsigned int *nbfound;
+    MVPError *errors;           /* error of each shard                               */
+    unsigned int next;
+    pthread_mutex_t lock;
+} ShardJob;
+
+/* collects the points a shard finds in a range search */
+typedef struct shard_hits_t {
+    ShardResult *found;
+    unsigned int nb, cap, shard;
+} ShardHits;
+
+static int shard_hit(const MVPTree *tree, const void *dp, float d, void *arg){
+    ShardHits *hits = (ShardHits*)arg;
+    (void)tree;
+    hits->found[hits->nb].d = d;
+    hits->found[hits->nb].dp = dp;
+    hits->found[hits->nb].shard = hits->shard;
+    return (++hits->nb < hits->cap);
+}
+
+static MVPError shard_search(ShardJob *job, unsigned int shard){
+    const MVPTree *tree = job->shards->trees[shard];
+    ShardResult *found = job->found + (size_t)shard*job->knearest;
+    unsigned int i, nb = 0;
+    MVPError err;
+    MVPQuery query;
+
+    job->nbfound[shard] = 0;
+    if (job->skip[shard]) return MVP_SUCCESS;
+    if (mvpquery_alloc(&query, tree) == NULL) return MVP_MEMALLOC;
+    err = check_query(tree, &query, job->target, job->knearest, job->radius, &nb);
+    if (err == MVP_SUCCESS && job->knn){
+	err = knn_search(tree, &query, job->target, job->knearest, job->radius);
+	for (i = 0;i < query.nbresults;i++){
+	    found[i].d = query.results[i].d;
+	    found[i].dp = query.results[i].dp;
+	    found[i].shard = shard;
 	}
+	nb = query.nbresults;
+    } else if (err == MVP_SUCCESS){
+	ShardHits hits = { found, 0, job->knearest, shard };
+	err = _mvptree_retrieve(tree, &query, tree_top(tree), job->target, job->radius,\
+                                shard_hit, &hits, 0);
+	nb = hits.nb;
+    }
+    mvpquery_clear(&query);
+    job->nbfound[shard] = nb;
+    return err;
+}
 
-	/* check >= last 1st level bin */
-        if (d1 + radius >= node->internal.M1[lengthM1-1]){
+static void* shard_worker(void *arg){
+    ShardJob *job = (ShardJob*)arg;
+    const MVPShards *shards = job->shards;
+    while (1){
+	pthread_mutex_lock(&job->lock);
+	unsigned int shard = job->next++;
+	pthread_mutex_unlock(&job->lock);
+	if (shard >= shards->nbshards) break;
+
+	if (job->build){
+	    unsigned int first = job->offsets[shard];
+	    job->errors[shard] = mvptree_add(shards->trees[shard], job->points + first,\
+                                             job->offsets[shard+1] - first);
+	} else {
+	    job->errors[shard] = shard_search(job, shard);
+	}
+    }
+    return NULL;
+}
 
-	    /* check <= each 2nd level bins */
-	    for (j=0;j<lengthM1;j++){
-		if (d2 - radius <= node->internal.M2[lengthM1*lengthM1+j]){
+static unsigned int shard_threads(const MVPShards *shards){
+    unsigned int nbthreads = (shards->nbthreads >= 0) ? shards->nbthreads : 1;
+    if (nbthreads == 0){
+	long nbcpus = sysconf(_SC_NPROCESSORS_ONLN);
+	nbthreads = (nbcpus > 0) ? (unsigned int)nbcpus : 1;
+    }
+    return nbthreads;
+}
 
-		    err = _mvptree_retrieve(tree,node->internal.child_nodes[bf*lengthM1+j],\
-                                            target, radius, results, nbresults, lvl+2);
-		    if (err != MVP_SUCCESS) return err;
-		}
-	    }
-	    /* check >= last 2nd level bin  */
+/* run a job over all the shards, the calling thread being one of the workers */
+static MVPError run_shards(ShardJob *job){
+    unsigned int i, nbstarted = 0, nbthreads = shard_threads(job->shards);
+    if (nbthreads > job->shards->nbshards) nbthreads = job->shards->nbshards;
+
+    job->next = 0;
+    if (pthread_mutex_init(&job->lock, NULL) != 0) return MVP_THREAD;
+    pthread_t *threads = (pthread_t*)malloc(nbthreads*sizeof(pthread_t));
+    if (!threads){
+	pthread_mutex_destroy(&job->lock);
+	return MVP_MEMALLOC;
+    }
+    for (i=1;i<nbthreads;i++){
+	if (pthread_create(&threads[nbstarted], NULL, shard_worker, job) != 0) break;
+	nbstarted++;
+    }
+    shard_worker(job);
+    for (i=0;i<nbstarted;i++){
+	pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    pthread_mutex_destroy(&job->lock);
+    return MVP_SUCCESS;
+}
 
-	    if (d2 + radius >= node->internal.M2[lengthM1*lengthM1+lengthM1-1]){
+MVPError mvpshards_add(MVPShards *shards, MVPDP **points, unsigned int nbpoints){
+    if (!shards || !shards->trees || !points) return MVP_ARGERR;
+    if (nbpoints == 0) return MVP_SUCCESS;
+    CmpFunc distance = shards->trees[0]->dist;
+    if (!distance) return MVP_NODISTANCEFUNC;
 
-		err = _mvptree_retrieve(tree,node->internal.child_nodes[bf*lengthM1+lengthM1],\
-                                         target, radius, results, nbresults, lvl+2);
-		if (err != MVP_SUCCESS) return err;
-	    }
+    MVPError err = MVP_SUCCESS;
+    unsigned int i, nbshards = shards->nbshards;
+    unsigned int *shard = (unsigned int*)malloc(nbpoints*sizeof(unsigned int));
+    unsigned int *offsets = (unsigned int*)calloc(nbshards+1, sizeof(unsigned int));
+    MVPDP **sorted = (MVPDP**)malloc(nbpoints*sizeof(MVPDP*));
+    MVPError *errors = (MVPError*)malloc(nbshards*sizeof(MVPError));
+    float *dist = NULL;
+    if (shards->mode == MVP_SHARD_VANTAGE){
+	dist = (float*)malloc(nbpoints*sizeof(float));
+	if (!dist) err = MVP_MEMALLOC;
+    }
+    if (!shard || !offsets || !sorted || !errors) err = MVP_MEMALLOC;
+
+    if (err == MVP_SUCCESS && shards->mode == MVP_SHARD_VANTAGE){
+	if (shards->vp == NULL){
+	    err = pick_vantage(shards, distance, points, nbpoints, dist);
+	} else {
+	    err = vantage_distances(distance, shards->vp, points, nbpoints, dist);
+	}
+    }
+    if (err == MVP_SUCCESS){
+	for (i = 0;i < nbpoints;i++){
+	    shard[i] = (dist) ? ring_shard(shards, dist[i]) : hash_shard(shards, points[i]);
+	    offsets[shard[i]+1]++;
+	}
+	for (i = 0;i < nbshards;i++){
+	    offsets[i+1] += offsets[i];
+	}
+	for (i = 0;i < nbpoints;i++){
+	    sorted[offsets[shard[i]]++] = points[i];
+	}
+	for (i = nbshards;i > 0;i--){
+	    offsets[i] = offsets[i-1];
+	}
+	offsets[0] = 0;
+
+	/* the threads left over from one per shard build within the trees */
+	unsigned int nbthreads = shard_threads(shards);
+	for (i = 0;i < nbshards;i++){
+	    shards->trees[i]->nbthreads = (nbthreads > nbshards) ? nbthreads/nbshards : 1;
+	}
+
+	ShardJob job;
+	memset(&job, 0, sizeof(ShardJob));
+	job.shards = shards;
+	job.build = 1;
+	job.points = sorted;
+	job.offsets = offsets;
+	job.errors = errors;
+	err = run_shards(&job);
+	for (i = 0;i < nbshards && err == MVP_SUCCESS;i++){
+	    err = errors[i];
 	}
-    } else {
-	err = MVP_UNRECOGNIZED;
     }
+
+    free(shard);
+    free(offsets);
+    free(sorted);
+    free(errors);
+    free(dist);
     return err;
 }
 
-MVPDP** mvptree_retrieve(MVPTree *tree, MVPDP *target, unsigned int knearest, float radius,\
-                                                 unsigned int *nbresults,MVPError *error){
-    if (!tree || !target || !nbresults || knearest == 0 || radius < 0) {
-	*error = MVP_ARGERR;
-	return NULL;
+MVPError mvpshards_delete(MVPShards *shards, const char *id){
+    if (!shards || !shards->trees || !id) return MVP_ARGERR;
+    if (shards->mode == MVP_SHARD_HASH){
+	unsigned int i = shard_hash((const unsigned char*)id, strlen(id)) % shards->nbshards;
+	return mvptree_delete(shards->trees[i], id);
+    }
+    MVPError err = MVP_IDNOTFOUND;
+    unsigned int i;
+    for (i = 0;i < shards->nbshards;i++){
+	MVPError e = mvptree_delete(shards->trees[i], id);
+	if (e == MVP_SUCCESS && err == MVP_IDNOTFOUND) err = MVP_SUCCESS;
+	if (e != MVP_SUCCESS && e != MVP_IDNOTFOUND) err = e;
     }
+    return err;
+}
 
-    if (!tree->dist){
-	*error = MVP_NODISTANCEFUNC;
+static int compare_shard_results(const void *a, const void *b){
+    float x = ((const ShardResult*)a)->d, y = ((const ShardResult*)b)->d;
+    return (x > y) - (x < y);
+}
+
+/* search all the shards and merge their results - the knearest nearest of all  */
+/* for a k nearest search, or up to knearest points within radius               */
+static MVPDP** search_shards(const MVPShards *shards, MVPDP *target, unsigned int knearest,\
+                             float radius, int knn, unsigned int *nbresults, MVPError *error){
+    if (!shards || !shards->trees || !target || !nbresults || knearest == 0 || radius < 0){
+	*error = MVP_ARGERR;
 	return NULL;
     }
-
     *nbresults = 0;
+    unsigned int i, nbshards = shards->nbshards, nbfound = 0, nbempty = 0, mapped = 0;
+    ShardJob job;
+    memset(&job, 0, sizeof(ShardJob));
+    job.shards = shards;
+    job.target = target;
+    job.knearest = knearest;
+    job.radius = radius;
+    job.knn = knn;
+    job.skip = (unsigned char*)calloc(nbshards, sizeof(unsigned char));
+    job.found = (ShardResult*)malloc((size_t)nbshards*knearest*sizeof(ShardResult));
+    job.nbfound = (unsigned int*)calloc(nbshards, sizeof(unsigned int));
+    job.errors = (MVPError*)malloc(nbshards*sizeof(MVPError));
     *error = MVP_SUCCESS;
+    if (!job.skip || !job.found || !job.nbfound || !job.errors) *error = MVP_MEMALLOC;
+
+    /* rings of a vantage split that lie wholly outside the radius */
+    if (*error == MVP_SUCCESS && shards->mode == MVP_SHARD_VANTAGE && shards->vp){
+	float d = shards->trees[0]->dist(target, shards->vp);
+	if (is_nan(d) || d < 0.0f) *error = MVP_BADDISTVAL;
+	for (i = 0;i < nbshards && *error == MVP_SUCCESS;i++){
+	    float lo = (i > 0) ? shards->splits[i-1] : -INFINITY;
+	    job.skip[i] = (d + radius <= lo || d - radius > shards->splits[i]);
+	}
+    }
+    if (*error == MVP_SUCCESS) *error = run_shards(&job);
 
-    if (!tree->node){
-	*error = MVP_EMPTYTREE;
-	return NULL;
+    for (i = 0;i < nbshards && *error == MVP_SUCCESS;i++){
+	if (job.errors[i] == MVP_EMPTYTREE){
+	    nbempty++;
+	} else if (job.errors[i] != MVP_SUCCESS && job.errors[i] != MVP_KNEARESTCAP){
+	    *error = job.errors[i];
+	}
+	if (shards->trees[i]->mapped) mapped = 1;
+    }
+    if (*error == MVP_SUCCESS && nbempty == nbshards) *error = MVP_EMPTYTREE;
+
+    MVPDP **results = NULL;
+    if (*error == MVP_SUCCESS){
+	for (i = 0;i < nbshards;i++){
+	    memmove(&job.found[nbfound], &job.found[(size_t)i*knearest],\
+                    job.nbfound[i]*sizeof(ShardResult));
+	    nbfound += job.nbfound[i];
+	}
+	if (knn){
+	    qsort(job.found, nbfound, sizeof(ShardResult), compare_shard_results);
+	    if (nbfound > knearest) nbfound = knearest;
+	} else if (nbfound >= knearest){
+	    nbfound = knearest;
+	    *error = MVP_KNEARESTCAP;
+	}
+
+	/* as with a mapped tree, views of points in mapped shards follow the pointers */
+	size_t size = knearest*sizeof(MVPDP*);
+	if (mapped) size += knearest*sizeof(MVPDP);
+	results = (MVPDP**)malloc(size);
+	if (results){
+	    MVPDP *views = (mapped) ? (MVPDP*)(results + knearest) : NULL;
+	    for (i = 0;i < nbfound;i++){
+		results[i] = dp_view(shards->trees[job.found[i].shard], job.found[i].dp,\
+                                     (views) ? &views[i] : NULL);
+	    }
+	    *nbresults = nbfound;
+	} else {
+	    *error = MVP_MEMALLOC;
+	}
     }
 
-    MVPDP **results = (MVPDP**)malloc(knearest*sizeof(MVPDP*));
-    if (!results) {
-	*error = MVP_MEMALLOC;
-	return NULL;
+    free(job.skip);
+    free(job.found);
+    free(job.nbfound);
+    free(job.errors);
+    return results;
+}
+
+MVPDP** mvpshards_retrieve(const MVPShards *shards, MVPDP *target, unsigned int knearest,\
+                           float radius, unsigned int *nbresults, MVPError *error){
+    return search_shards(shards, target, knearest, radius, 0, nbresults, error);
+}
+
+MVPDP** mvpshards_retrieve_knearest(const MVPShards *shards, MVPDP *target,\
+                                    unsigned int knearest, float radius,\
+                                    unsigned int *nbresults, MVPError *error){
+    return search_shards(shards, target, knearest, radius, 1, nbresults, error);
+}
+
+/* Buffered output for mvptree_write(). The file is written front to back in one
+   pass: a leaf record comes before its datapoints, whose offsets follow from
+   their sizes, and an internal record comes after its datapoints and children,
+   which it refers to with negative offsets. Only the offset of the top node in
+   the header is written out of order, at the end. */
+
+typedef struct mvp_writer_t {
+    int fd;
+    char *buf;
+    size_t len, cap;
+    off_t pos;             /* file offset of the next record */
+    MVPError error;
+} MVPWriter;
+
+static void writer_flush(MVPWriter *w){
+    size_t done = 0;
+    while (w->error == MVP_SUCCESS && done < w->len){
+	ssize_t n = write(w->fd, w->buf + done, w->len - done);
+	if (n < 0){
+	    if (errno == EINTR) continue;
+	    w->error = MVP_NOWRITE;
+	}
+	done += (n > 0) ? n : 0;
     }
+    w->len = 0;
+}
 
-    target->path = (float*)malloc(tree->pathlength*sizeof(float));
-    if (target->path == NULL){
-	*error = MVP_MEMALLOC;
-	free(results);
-	return NULL;
+/* room for a record of nbytes, zeroed - NULL on error */
+static char* writer_reserve(MVPWriter *w, size_t nbytes){
+    if (w->error != MVP_SUCCESS) return NULL;
+    if (w->len + nbytes > w->cap){
+	writer_flush(w);
+	if (nbytes > w->cap){
+	    char *tmp = (char*)realloc(w->buf, nbytes);
+	    if (!tmp){
+		w->error = MVP_MEMALLOC;
+		return NULL;
+	    }
+	    w->buf = tmp;
+	    w->cap = nbytes;
+	}
+	if (w->error != MVP_SUCCESS) return NULL;
     }
-    tree->k = knearest;
+    char *record = &w->buf[w->len];
+    memset(record, 0, nbytes);
+    w->len += nbytes;
+    w->pos += nbytes;
+    return record;
+}
 
-    *error = _mvptree_retrieve(tree, tree->node, target, radius, results, nbresults, 0);
+/* store a reference from the record at start to the record at target */
+static void set_ref(char *record, off_t pos, off_t start, off_t target){
+    int64_t rel = (target) ? target - start : 0;
+    memcpy(&record[pos], &rel, sizeof(int64_t));
+}
 
-    free(target->path);
-    target->path = NULL;
+static size_t dp_idlen(MVPDP *dp){
+    size_t idlen = (dp->id) ? strlen(dp->id) : 0;
+    return (idlen > UINT16_MAX) ? UINT16_MAX : idlen;
+}
 
-    return results;
+static off_t dp_record_size(MVPTree *tree, MVPDP *dp){
+    if (dp == NULL) return 0;
+    return DP_HEADER + ALIGN8(tree->pathlength*sizeof(float)) +\
+	ALIGN8((off_t)dp->datalen*dp->type) + ALIGN8(dp_idlen(dp)+1);
 }
 
-static off_t write_datapoint(MVPDP *dp, MVPTree *tree){
-    off_t start = tree->pos;
-    off_t pos = tree->pos;
-    uint8_t active = 0;
-    uint32_t bytelength = 0;
-    char *buf = tree->buf;
-   
-    if (dp == NULL){
-	memcpy(&buf[pos++], &active, 1);
-	memcpy(&buf[pos], &bytelength, sizeof(uint32_t));
-	pos += sizeof(uint32_t);
-	tree->pos = pos;
-	return start;
-    }
-    active = 1;
-    uint8_t idlen = strlen(dp->id);
+/* write a datapoint record, returns its offset in the file, 0 for none */
+static off_t write_datapoint(MVPDP *dp, MVPTree *tree, MVPWriter *w){
+    if (dp == NULL) return 0;
+
+    size_t idlen = dp_idlen(dp);
+    off_t pathsize = ALIGN8(tree->pathlength*sizeof(float));
+    off_t datasize = ALIGN8((off_t)dp->datalen*dp->type);
+    off_t bytelength = dp_record_size(tree, dp);
+    off_t start = w->pos;
+    char *buf = writer_reserve(w, bytelength);
+    if (!buf) return 0;
+
+    uint32_t length = bytelength;
     uint32_t datalength = dp->datalen;
+    uint8_t active = !dp->deleted;
     uint8_t type = dp->type;
-    bytelength = sizeof(uint8_t) + idlen + sizeof(uint32_t) +\
-                            datalength*type + (tree->pathlength)*sizeof(float);
-
-    memcpy(&buf[pos++], &active    , 1);
-    memcpy(&buf[pos]  , &bytelength, sizeof(uint32_t));
-    pos += sizeof(uint32_t);
-    memcpy(&buf[pos++], &idlen     , 1);
-    memcpy(&buf[pos]  , dp->id     , idlen);
-    pos += idlen;
-    memcpy(&buf[pos]  , &datalength, sizeof(uint32_t));
-    pos += sizeof(uint32_t);
-    memcpy(&buf[pos]  , dp->data   , datalength*type);
-    pos += datalength*type;
-    memcpy(&buf[pos]  , dp->path   , (tree->pathlength)*sizeof(float));
-    pos += (tree->pathlength)*sizeof(float);
-
-    tree->pos = pos;
-    return start;
-}
-static int extend_mvpfile(MVPTree *tree){
-    if (munmap(tree->buf, tree->size) < 0){
-	return -1;
-    }
-    if (ftruncate(tree->fd, tree->size + tree->pgsize) < 0){
-	return -2;
-    }
-    tree->size += tree->pgsize;
-    char *buf = (char*)mmap(NULL, tree->size, PROT_READ|PROT_WRITE, MAP_SHARED, tree->fd, 0);
-    if (buf == NULL){
-	return -3;
-    }
-    tree->buf = buf;
+    uint16_t idlength = idlen;
 
-    return 0;
+    memcpy(&buf[0] , &length    , sizeof(uint32_t));
+    memcpy(&buf[4] , &datalength, sizeof(uint32_t));
+    memcpy(&buf[8] , &active    , 1);
+    memcpy(&buf[9] , &type      , 1);
+    memcpy(&buf[10], &idlength  , sizeof(uint16_t));
+    memcpy(&buf[DP_HEADER], dp->path, tree->pathlength*sizeof(float));
+    memcpy(&buf[DP_HEADER + pathsize], dp->data, (size_t)datalength*type);
+    memcpy(&buf[DP_HEADER + pathsize + datasize], dp->id, idlen);
+
+    return start;
 }
 
-static off_t _mvptree_write(MVPTree *tree,Node *node,MVPError *error,int lvl){
-    off_t start_pos = tree->pos;
+/* write a node and everything below it - returns the offset of its record */
+static off_t _mvptree_write(MVPTree *tree,Node *node,MVPWriter *w,int lvl){
     if (node == NULL) return 0;
 
-    uint8_t node_type = (uint8_t)node->leaf.type;
+    uint32_t node_type = (uint32_t)node->leaf.type;
+    off_t start, size, refs;
+    char *record;
+    int i;
     if (node->leaf.type == LEAF_NODE){
 	uint32_t nbpoints = node->leaf.nbpoints;
-	if (tree->pos >= tree->size - tree->pgsize/2){
-	    if (extend_mvpfile(tree) < 0){
-		*error = MVP_FILETRUNCATE;
-		return start_pos;
-	    }
+	refs = leaf_refs(tree, nbpoints);
+	size = refs + nbpoints*sizeof(int64_t);
+	start = w->pos;
+	record = writer_reserve(w, size);
+	if (!record) return 0;
+
+	memcpy(&record[0], &node_type, sizeof(uint32_t));
+	memcpy(&record[4], &nbpoints, sizeof(uint32_t));
+	memcpy(&record[NODE_HEADER], node->leaf.d1, nbpoints*sizeof(float));
+	memcpy(&record[NODE_HEADER+nbpoints*sizeof(float)], node->leaf.d2,\
+                                                                 nbpoints*sizeof(float));
+	for (i=0;i<tree->pathlength;i++){
+	    memcpy(&record[NODE_HEADER+(2+i)*nbpoints*sizeof(float)],\
+                   &node->leaf.paths[i*tree->leafcap], nbpoints*sizeof(float));
 	}
 
-	/* save node */
-	memcpy(&tree->buf[tree->pos++], &node_type, 1);
-	write_datapoint(node->leaf.sv1, tree);
-	write_datapoint(node->leaf.sv2, tree);
-	memcpy(&tree->buf[tree->pos], &nbpoints, sizeof(uint32_t));
-	tree->pos += sizeof(uint32_t);
-	
-	/* write points */
-	int i;
-	off_t saved_pos = tree->pos;
-	tree->pos += (tree->leafcap)*(2*sizeof(float)+sizeof(off_t));
+	/* the datapoints follow the record */
+	off_t next = start + size;
+	set_ref(record, 8, start, (node->leaf.sv1) ? next : 0);
+	next += dp_record_size(tree, node->leaf.sv1);
+	set_ref(record, 16, start, (node->leaf.sv2) ? next : 0);
+	next += dp_record_size(tree, node->leaf.sv2);
 	for (i=0;i<nbpoints;i++){
-	    if (tree->pos >= tree->size - tree->pgsize/2){
-		if (extend_mvpfile(tree) < 0){
-		    *error = MVP_FILETRUNCATE;
-		    break;
-		}
-	    }
-
-	    memcpy(&tree->buf[saved_pos], &(node->leaf.d1[i]), sizeof(float));
-	    saved_pos += sizeof(float);
-	    memcpy(&tree->buf[saved_pos], &(node->leaf.d2[i]), sizeof(float));
-	    saved_pos += sizeof(float);
+	    set_ref(record, refs + i*sizeof(int64_t), start, next);
+	    next += dp_record_size(tree, node->leaf.points[i]);
+	}
 
-	    off_t offset = write_datapoint(node->leaf.points[i], tree);
-	    memcpy(&tree->buf[saved_pos], &offset, sizeof(off_t));
-	    saved_pos += sizeof(off_t);
+	write_datapoint(node->leaf.sv1, tree, w);
+	write_datapoint(node->leaf.sv2, tree, w);
+	for (i=0;i<nbpoints;i++){
+	    write_datapoint(node->leaf.points[i], tree, w);
 	}
     } else if (node->internal.type == INTERNAL_NODE){
-	const uint8_t fileno = 0;
 	int bf = tree->branchfactor;
 	int lengthM1 = bf - 1;
 	int lengthM2 = (bf - 1)*bf;
 	int fanout   = bf*bf;
 
-	memcpy(&tree->buf[tree->pos++], &node_type, 1);
-	write_datapoint(node->internal.sv1, tree);
-	write_datapoint(node->internal.sv2, tree);
-	memcpy(&tree->buf[tree->pos], node->internal.M1, lengthM1*sizeof(float));
-	tree->pos += lengthM1*sizeof(float);
-	memcpy(&tree->buf[tree->pos], node->internal.M2, lengthM2*sizeof(float));
-	tree->pos += lengthM2*sizeof(float);
-	
-	off_t saved_pos = tree->pos;
-	tree->pos += fanout*(sizeof(uint8_t) + sizeof(off_t));
-	int i;
+	off_t *child = (off_t*)malloc(fanout*sizeof(off_t));
+	if (!child){
+	    w->error = MVP_MEMALLOC;
+	    return 0;
+	}
+	off_t sv1 = write_datapoint(node->internal.sv1, tree, w);
+	off_t sv2 = write_datapoint(node->internal.sv2, tree, w);
 	for (i=0;i<fanout;i++){
-	    if (tree->pos >= tree->size - tree->pgsize/2){
-		if (extend_mvpfile(tree) < 0){
-		    *error = MVP_FILETRUNCATE;
-		    break;
-		}
+	    child[i] = _mvptree_write(tree, node->internal.child_nodes[i], w, lvl+2);
+	}
+
+	/* the record follows the subtree */
+	refs = NODE_HEADER + ALIGN8((lengthM1 + lengthM2)*sizeof(float));
+	size = refs + fanout*sizeof(int64_t);
+	start = w->pos;
+	record = writer_reserve(w, size);
+	if (record){
+	    memcpy(&record[0], &node_type, sizeof(uint32_t));
+	    memcpy(&record[NODE_HEADER], node->internal.M1, lengthM1*sizeof(float));
+	    memcpy(&record[NODE_HEADER+lengthM1*sizeof(float)], node->internal.M2,\
+                                                                 lengthM2*sizeof(float));
+	    set_ref(record, 8 , start, sv1);
+	    set_ref(record, 16, start, sv2);
+	    for (i=0;i<fanout;i++){
+		set_ref(record, refs + i*sizeof(int64_t), start, child[i]);
 	    }
-	    off_t offset = _mvptree_write(tree, node->internal.child_nodes[i], error, lvl+2);
-	    memcpy(&tree->buf[saved_pos++], &fileno, 1);
-	    memcpy(&tree->buf[saved_pos]  , &offset, sizeof(off_t));
-	    saved_pos += sizeof(off_t);
 	}
+	free(child);
     } else {
-	*error = MVP_UNRECOGNIZED;
+	w->error = MVP_UNRECOGNIZED;
+	return 0;
     }
 
-    /*    msync(tree->buf, tree->size, MS_ASYNC);   */
-
-    return start_pos;
+    return start;
 }
 
 
@@ -962,29 +2981,29 @@ MVPError mvptree_write(MVPTree *tree, const char *filename, int mode){
 	return MVP_ARGERR;
     }
 
-    tree->fd = open(filename, O_CREAT|O_RDWR|O_TRUNC, mode);
-    if (tree->fd < 0){
+    MVPWriter w;
+    w.fd = open(filename, O_CREAT|O_WRONLY|O_TRUNC, mode);
+    if (w.fd < 0){
 	return MVP_FILEOPEN;
     }
-    tree->pgsize = sysconf(_SC_PAGESIZE);
-    if (ftruncate(tree->fd, tree->pgsize) < 0){
-	close(tree->fd);
-	return MVP_FILETRUNCATE;
-    }
-    tree->size = tree->pgsize;
-    char *buf  = (char*)mmap(NULL, tree->size, PROT_READ|PROT_WRITE, MAP_SHARED, tree->fd, 0);
-    if (buf == NULL){
-	close(tree->fd);
-	return MVP_MEMMAP;
+    w.buf = (char*)malloc(MVP_WRITEBUF);
+    if (!w.buf){
+	close(w.fd);
+	return MVP_MEMALLOC;
     }
-    off_t pos = 0;
+    w.cap = MVP_WRITEBUF;
+    w.len = 0;
+    w.pos = 0;
+    w.error = MVP_SUCCESS;
 
     uint8_t bf = tree->branchfactor;
     uint8_t pl = tree->pathlength;
     uint8_t lc = tree->leafcap;
     uint8_t ht = (uint8_t)tree->node->internal.sv1->type;
 
-    /* write header */
+    /* write header - the offset of the top node is filled in at the end */
+    char *buf = writer_reserve(&w, HEADER_SIZE);
+    off_t pos = 0;
     memcpy(&buf[pos], tag, strlen(tag)+1);
     pos += strlen(tag)+1;
     memcpy(&buf[pos], &version, sizeof(version));
@@ -994,32 +3013,50 @@ MVPError mvptree_write(MVPTree *tree, const char *filename, int mode){
     memcpy(&buf[pos++], &lc, 1);
     memcpy(&buf[pos++], &ht, 1);
 
-    tree->buf = buf;
-    pos = HEADER_SIZE;
-    tree->pos = pos;
-
     /* write nodes */
-    MVPError error = MVP_SUCCESS;
-    _mvptree_write(tree, tree->node, &error, 0);
+    int64_t root = _mvptree_write(tree, tree->node, &w, 0);
+    writer_flush(&w);
 
     /* cleanup */
-    if (msync(tree->buf, tree->size, MS_SYNC) < 0){
-	error = MVP_MEMMAP;
+    if (w.error == MVP_SUCCESS){
+	if (pwrite(w.fd, &root, sizeof(int64_t), ROOT_OFFSET) != sizeof(int64_t)){
+	    w.error = MVP_NOWRITE;
+	}
     }
-
-    if (munmap(tree->buf, tree->size) < 0){
-	error = MVP_MUNMAP;
+    if (w.error == MVP_SUCCESS && tree->syncwrite){
+	if (fsync(w.fd) < 0){
+	    w.error = MVP_NOWRITE;
+	}
     }
-    tree->buf = NULL;
+    free(w.buf);
 
-    if (close(tree->fd) < 0){
-	error = MVP_FILECLOSE;
+    if (close(w.fd) < 0 && w.error == MVP_SUCCESS){
+	w.error = MVP_FILECLOSE;
     }
 
-    return error;
+    return w.error;
 }
 
-static MVPDP* read_datapoint(MVPTree *tree){
+/* check the header of a tree file, returns the file format version, 0 if not a tree */
+static int read_header(const char *buf, off_t size, uint8_t *bf, uint8_t *pl,\
+                                                    uint8_t *lc, uint8_t *ht){
+    off_t pos = strlen(tag)+1;
+    int v;
+    if (size < HEADER_SIZE || memcmp(buf, tag, pos)) return 0;
+
+    memcpy(&v, &buf[pos], sizeof(int));
+    pos += sizeof(int);
+    memcpy(bf, &buf[pos++], 1);
+    memcpy(pl, &buf[pos++], 1);
+    memcpy(lc, &buf[pos++], 1);
+    memcpy(ht, &buf[pos++], 1);
+    if (v != version && v != version1) return 0;
+    if (*bf < 2 || *lc < 1) return 0;
+    return v;
+}
+
+/* version 1 files - datapoints are inlined and offsets are absolute */
+static MVPDP* read_datapoint_v1(MVPTree *tree){
     uint8_t active, idlen;
     uint32_t bytelength, datalength;
 
@@ -1030,23 +3067,20 @@ static MVPDP* read_datapoint(MVPTree *tree){
 
     if (active == 0 && bytelength == 0) return NULL;
 
-    MVPDP *dp = dp_alloc(tree->datatype);
-    if (!dp) return NULL;
-    
-    dp->path = (float*)malloc(tree->pathlength*sizeof(float));
-    if (!dp->path) return NULL;
-    
     memcpy(&idlen, &tree->buf[tree->pos], sizeof(uint8_t));
     tree->pos += sizeof(uint8_t);
-    dp->id = malloc(idlen+1);
-    memcpy(dp->id, &tree->buf[tree->pos], idlen);
+    const char *id = &tree->buf[tree->pos];
     tree->pos += idlen;
-    dp->id[idlen] = '\0';
     memcpy(&datalength, &tree->buf[tree->pos], sizeof(uint32_t));
     tree->pos += sizeof(uint32_t);
 
-    dp->datalen = datalength;
-    dp->data = malloc(datalength*tree->datatype);
+    MVPDP *dp = tree_dp_alloc(tree, tree->datatype, datalength, id, idlen);
+    if (!dp) return NULL;
+    if (!dp->path && !(dp->path = path_alloc(tree))){
+	dp_free(dp, free);
+	return NULL;
+    }
+
     memcpy(dp->data, &tree->buf[tree->pos], datalength*tree->datatype);
     tree->pos += datalength*tree->datatype;
     memcpy(dp->path, &tree->buf[tree->pos], tree->pathlength*sizeof(float));
@@ -1055,20 +3089,20 @@ static MVPDP* read_datapoint(MVPTree *tree){
     return dp;
 }
 
-static Node* _mvptree_read_node(MVPTree *tree, MVPError *error, int lvl){
+static Node* _mvptree_read_node_v1(MVPTree *tree, MVPError *error, int lvl){
     uint8_t node_type;
     Node *node = NULL;
     memcpy(&node_type, &tree->buf[tree->pos++], sizeof(uint8_t));
 
     if (node_type == LEAF_NODE){
 	uint32_t nbpoints;
-	node = create_leaf(tree->leafcap);
+	node = create_leaf(tree);
 	if (!node){
 	    *error = MVP_NOLEAF;
 	    return node;
 	}
-	node->leaf.sv1 = read_datapoint(tree);
-	node->leaf.sv2 = read_datapoint(tree);
+	node->leaf.sv1 = read_datapoint_v1(tree);
+	node->leaf.sv2 = read_datapoint_v1(tree);
 
 	memcpy(&nbpoints,&tree->buf[tree->pos], sizeof(uint32_t));
 	tree->pos += sizeof(uint32_t);
@@ -1086,7 +3120,11 @@ static Node* _mvptree_read_node(MVPTree *tree, MVPError *error, int lvl){
 	    saved_pos += sizeof(off_t);
 
 	    tree->pos = offset;
-	    node->leaf.points[i] = read_datapoint(tree);
+	    node->leaf.points[i] = read_datapoint_v1(tree);
+	    if (node->leaf.points[i]){
+		leaf_set_point(tree, node, i, node->leaf.points[i], node->leaf.d1[i],\
+                                                                  node->leaf.d2[i]);
+	    }
 	}
     } else if (node_type == INTERNAL_NODE){
 	int bf = tree->branchfactor;
@@ -1095,13 +3133,13 @@ static Node* _mvptree_read_node(MVPTree *tree, MVPError *error, int lvl){
 	int fanout   = bf*bf;
 	uint8_t fileno;
 
-	node = create_internal(bf);
+	node = create_internal(tree);
 	if (node == NULL){
 	    *error = MVP_NOINTERNAL;
 	    return node;
 	}
-	node->internal.sv1 = read_datapoint(tree);
-	node->internal.sv2 = read_datapoint(tree);
+	node->internal.sv1 = read_datapoint_v1(tree);
+	node->internal.sv2 = read_datapoint_v1(tree);
 
 	memcpy(node->internal.M1, &tree->buf[tree->pos], lengthM1*sizeof(float));
 	tree->pos += lengthM1*sizeof(float);
@@ -1116,8 +3154,10 @@ static Node* _mvptree_read_node(MVPTree *tree, MVPError *error, int lvl){
 	    memcpy(&offset, &tree->buf[saved_pos], sizeof(offset));
 	    saved_pos += sizeof(offset);
 
+	    /* empty bins were written with offset 0 */
+	    if (offset == 0) continue;
 	    tree->pos = offset;
-	    node->internal.child_nodes[i] = _mvptree_read_node(tree, error, lvl+2);
+	    node->internal.child_nodes[i] = _mvptree_read_node_v1(tree, error, lvl+2);
 	    if (*error != MVP_SUCCESS) break;
 	}
 
@@ -1127,6 +3167,77 @@ static Node* _mvptree_read_node(MVPTree *tree, MVPError *error, int lvl){
     return node;
 }
 
+/* copy of a datapoint record of a mapped tree */
+static MVPDP* copy_datapoint(MVPTree *tree, const void *record, MVPError *error){
+    MVPDP view;
+    MVPDP *src = dp_view(tree, record, &view);
+    if (src == NULL) return NULL;
+
+    MVPDP *dp = tree_dp_alloc(tree, src->type, src->datalen, src->id, strlen(src->id));
+    if (dp && !dp->path && !(dp->path = path_alloc(tree))){
+	dp_free(dp, free);
+	dp = NULL;
+    }
+    if (!dp){
+	*error = MVP_MEMALLOC;
+	return NULL;
+    }
+    memcpy(dp->data, src->data, (size_t)src->datalen*src->type);
+    memcpy(dp->path, src->path, tree->pathlength*sizeof(float));
+    dp->deleted = src->deleted;
+    return dp;
+}
+
+/* copy of a node record of a mapped tree and everything below it */
+static Node* copy_node(MVPTree *tree, const void *record, MVPError *error){
+    Node *node = NULL;
+    int i;
+
+    if (node_type(tree, record) == LEAF_NODE){
+	unsigned int nbpoints = leaf_nbpoints(tree, record);
+	if (nbpoints > tree->leafcap){
+	    *error = MVP_BADFORMAT;
+	    return NULL;
+	}
+	node = create_leaf(tree);
+	if (!node){
+	    *error = MVP_NOLEAF;
+	    return node;
+	}
+	node->leaf.sv1 = copy_datapoint(tree, node_sv1(tree, record), error);
+	node->leaf.sv2 = copy_datapoint(tree, node_sv2(tree, record), error);
+	node->leaf.nbpoints = nbpoints;
+	memcpy(node->leaf.d1, leaf_d1(tree, record), nbpoints*sizeof(float));
+	memcpy(node->leaf.d2, leaf_d2(tree, record), nbpoints*sizeof(float));
+	unsigned int stride;
+	const float *paths = leaf_paths(tree, record, &stride);
+	for (i = 0;i < tree->pathlength;i++){
+	    memcpy(&node->leaf.paths[i*tree->leafcap], &paths[i*stride], nbpoints*sizeof(float));
+	}
+	for (i = 0;i < nbpoints;i++){
+	    node->leaf.points[i] = copy_datapoint(tree, leaf_point(tree, record, i), error);
+	}
+    } else if (node_type(tree, record) == INTERNAL_NODE){
+	int bf = tree->branchfactor;
+	node = create_internal(tree);
+	if (node == NULL){
+	    *error = MVP_NOINTERNAL;
+	    return node;
+	}
+	node->internal.sv1 = copy_datapoint(tree, node_sv1(tree, record), error);
+	node->internal.sv2 = copy_datapoint(tree, node_sv2(tree, record), error);
+	memcpy(node->internal.M1, internal_M1(tree, record), (bf-1)*sizeof(float));
+	memcpy(node->internal.M2, internal_M2(tree, record), bf*(bf-1)*sizeof(float));
+	for (i = 0;i < bf*bf && *error == MVP_SUCCESS;i++){
+	    const void *child = internal_child(tree, record, i);
+	    if (child) node->internal.child_nodes[i] = copy_node(tree, child, error);
+	}
+    } else {
+	*error = MVP_UNRECOGNIZED;
+    }
+    return node;
+}
+
 MVPTree* mvptree_read(const char *filename, CmpFunc fnc, int branchfactor, int pathlength,\
                                int leafcapacity,MVPError *error){
     if (!error) return NULL;
@@ -1147,43 +3258,60 @@ MVPTree* mvptree_read(const char *filename, CmpFunc fnc, int branchfactor, int p
     struct stat file_info;
     if (fstat(fd, &file_info) < 0){
 	*error = MVP_FILEOPEN;
+	close(fd);
 	return NULL;
     }
     off_t size = file_info.st_size;
+    if (size < HEADER_SIZE){
+	*error = MVP_BADFORMAT;
+	close(fd);
+	return NULL;
+    }
 
     char *buf = (char*)mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
-    if (buf == NULL){
+    if (buf == MAP_FAILED){
 	*error = MVP_MEMMAP;
 	close(fd);
 	return NULL;
     }
-    off_t pos = 0;
-    char line[16];
-    int v;
     uint8_t bf, pl, lc, ht;
-
-    memcpy(line, &buf[pos], strlen(tag)+1);
-    pos += strlen(tag)+1;
-    memcpy(&v, &buf[pos], sizeof(int));
-    pos += sizeof(int);
-    memcpy(&bf, &buf[pos++], 1);
-    memcpy(&pl, &buf[pos++], 1);
-    memcpy(&lc, &buf[pos++], 1);
-    memcpy(&ht, &buf[pos++], 1);
+    int v = read_header(buf, size, &bf, &pl, &lc, &ht);
+    if (v == 0){
+	*error = MVP_BADFORMAT;
+	munmap(buf, size);
+	close(fd);
+	return NULL;
+    }
 
     tree = mvptree_alloc(NULL, fnc, bf, pl, lc);
     if (!tree){
 	*error = MVP_MEMALLOC;
+	munmap(buf, size);
+	close(fd);
 	return NULL;
     }
     tree->pgsize = sysconf(_SC_PAGESIZE);
     tree->size = size;
     tree->buf = buf;
-    tree->pos = HEADER_SIZE;
     tree->fd = fd;
     tree->datatype = (MVPDataType)ht;
     tree->dist = fnc;
-    tree->node = _mvptree_read_node(tree, error, 0);
+    tree_pool(tree);
+    if (v == version1){
+	tree->pos = HEADER_SIZE;
+	tree->node = _mvptree_read_node_v1(tree, error, 0);
+    } else {
+	/* copy out of the file through the accessors of a mapped tree */
+	memcpy(&tree->root, &buf[ROOT_OFFSET], sizeof(int64_t));
+	tree->mapped = 1;
+	if (tree->root < HEADER_SIZE || tree->root >= size){
+	    *error = MVP_BADFORMAT;
+	} else {
+	    tree->node = copy_node(tree, tree_top(tree), error);
+	}
+	tree->mapped = 0;
+	tree->root = 0;
+    }
 
     if (munmap(buf, size) < 0){
 	*error = MVP_MUNMAP;
@@ -1194,42 +3322,107 @@ MVPTree* mvptree_read(const char *filename, CmpFunc fnc, int branchfactor, int p
 	*error = MVP_FILECLOSE;
     }
     tree->buf = NULL;
+    tree->size = 0;
     tree->pos = 0;
     tree->fd  = 0;
 
     return tree;
 }
 
-static MVPError _mvptree_print(FILE *stream, MVPTree *tree, Node *node, int lvl){
+MVPTree* mvptree_map(const char *filename, CmpFunc fnc, MVPError *error){
+    if (!error) return NULL;
+    *error = MVP_SUCCESS;
+    if (!filename || !fnc) {
+	*error = MVP_ARGERR;
+	return NULL;
+    }
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0){
+	*error = MVP_FILENOTFOUND;
+	return NULL;
+    }
+    struct stat file_info;
+    if (fstat(fd, &file_info) < 0){
+	*error = MVP_FILEOPEN;
+	close(fd);
+	return NULL;
+    }
+    off_t size = file_info.st_size;
+    if (size < HEADER_SIZE){
+	*error = MVP_BADFORMAT;
+	close(fd);
+	return NULL;
+    }
+
+    char *buf = (char*)mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (buf == MAP_FAILED){
+	*error = MVP_MEMMAP;
+	close(fd);
+	return NULL;
+    }
+    uint8_t bf, pl, lc, ht;
+    int64_t root;
+    memcpy(&root, &buf[ROOT_OFFSET], sizeof(int64_t));
+    if (read_header(buf, size, &bf, &pl, &lc, &ht) != version ||\
+        root < HEADER_SIZE || root >= size){
+	*error = MVP_BADFORMAT;
+	munmap(buf, size);
+	close(fd);
+	return NULL;
+    }
+
+    MVPTree *tree = mvptree_alloc(NULL, fnc, bf, pl, lc);
+    if (!tree){
+	*error = MVP_MEMALLOC;
+	munmap(buf, size);
+	close(fd);
+	return NULL;
+    }
+    tree->size = size;
+    tree->buf = buf;
+    tree->fd = fd;
+    tree->datatype = (MVPDataType)ht;
+    tree->mapped = 1;
+    tree->root = root;
+
+    return tree;
+}
+
+static MVPError _mvptree_print(FILE *stream, MVPTree *tree, const void *node, int lvl){
     MVPError error = MVP_SUCCESS;
-    Node *next_node = node;
     int bf = tree->branchfactor, lengthM1 = bf-1, lengthM2 = bf, fanout = bf*bf;    
-
-    if (next_node){
-	if (next_node->leaf.type == LEAF_NODE){
-	    fprintf(stream, "LEAF%d  (%d points)\n", lvl, next_node->leaf.nbpoints);
-	    if (next_node->leaf.sv1)
-		fprintf(stream, "    sv1: %s\n", next_node->leaf.sv1->id);
-	    if (next_node->leaf.sv2)
-		fprintf(stream, "    sv2: %s\n", next_node->leaf.sv2->id);
+    MVPDP view;
+
+    if (node){
+	const void *sv1 = node_sv1(tree, node), *sv2 = node_sv2(tree, node);
+	if (node_type(tree, node) == LEAF_NODE){
+	    unsigned int nbpoints = leaf_nbpoints(tree, node);
+	    fprintf(stream, "LEAF%d  (%d points)\n", lvl, nbpoints);
+	    if (sv1)
+		fprintf(stream, "    sv1: %s\n", dp_view(tree, sv1, &view)->id);
+	    if (sv2)
+		fprintf(stream, "    sv2: %s\n", dp_view(tree, sv2, &view)->id);
 	    int i;
-	    for (i = 0;i < next_node->leaf.nbpoints;i++){
-		fprintf(stream, "        point[%d]: %s\n", i, next_node->leaf.points[i]->id);
+	    for (i = 0;i < nbpoints;i++){
+		fprintf(stream, "        point[%d]: %s\n", i,\
+                                         dp_view(tree, leaf_point(tree, node, i), &view)->id);
 	    }
-	} else if (next_node->internal.type == INTERNAL_NODE){
+	} else if (node_type(tree, node) == INTERNAL_NODE){
+	    const float *M1 = internal_M1(tree, node), *M2 = internal_M2(tree, node);
 	    fprintf(stream, "INTERNAL%d\n", lvl);
-	    fprintf(stream, "  sv1: %s\n", next_node->internal.sv1->id);
-	    fprintf(stream, "  sv2: %s\n", next_node->internal.sv2->id);
+	    fprintf(stream, "  sv1: %s\n", dp_view(tree, sv1, &view)->id);
+	    fprintf(stream, "  sv2: %s\n", dp_view(tree, sv2, &view)->id);
 	    int i;
 	    for (i=0;i<lengthM1;i++){
-		fprintf(stream,"  M1[%d] = %.4f;", i, next_node->internal.M1[i]);
+		fprintf(stream,"  M1[%d] = %.4f;", i, M1[i]);
 	    }
 	    for (i=0;i<lengthM2;i++){
-		fprintf(stream,"  M2[%d] = %.4f;", i, next_node->internal.M2[i]);
+		fprintf(stream,"  M2[%d] = %.4f;", i, M2[i]);
 	    }
 	    fprintf(stream,"\n");
 	    for (i=0;i<fanout;i++){
-		error = _mvptree_print(stream, tree, node->internal.child_nodes[i], lvl+2);
+		error = _mvptree_print(stream, tree, internal_child(tree, node, i), lvl+2);
 		if (error != MVP_SUCCESS) break;
 	    }
 	} else {
@@ -1241,12 +3434,11 @@ static MVPError _mvptree_print(FILE *stream, MVPTree *tree, Node *node, int lvl)
 
     return error;
 }
-
 MVPError mvptree_print(FILE *stream, MVPTree *tree){
     if (stream == NULL || tree == NULL){
 	return MVP_ARGERR;
     }
-    MVPError err = _mvptree_print(stream, tree, tree->node, 0);
+    MVPError err = _mvptree_print(stream, tree, tree_top(tree), 0);
     if (err != MVP_SUCCESS){
 	fprintf(stream,"malformed tree: %s\n", mvp_errstr(err));
     }
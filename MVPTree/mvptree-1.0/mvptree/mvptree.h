@@ -24,6 +24,9 @@
 #ifndef _MVPTREE_H
 #define _MVPTREE_H
 
+/* default number of candidate vantage points sampled for each node */
+#define MVP_VPSAMPLE 32
+
 /*data type for a datapoint - refers to the bitwidth of each element */
 typedef enum mvp_datatype_t { 
     MVP_BYTEARRAY = 1, 
@@ -66,6 +69,9 @@ typedef enum mvp_error_t {
     MVP_BADDISTVAL,         /* val from distance function either NaN or less than 0 */
     MVP_FILENOTFOUND,       /* file not found */
     MVP_UNRECOGNIZED,       /* unrecognized node */
+    MVP_THREAD,             /* could not create thread lock for batch retrieve */
+    MVP_BADFORMAT,          /* file is not a tree or has an unsupported version */
+    MVP_IDNOTFOUND,         /* no datapoint with the id in the tree */
 } MVPError;
 
 typedef struct mvp_datapoint_t {
@@ -74,6 +80,8 @@ typedef struct mvp_datapoint_t {
     float *path;            /* path of distances of data point from all vantage points down tree*/
     unsigned int datalen;   /* length of data in the type designated */    
     MVPDataType type;       /* type of data (the bitwidth of each data element) */
+    int deleted;            /* set by mvptree_delete(), skipped by the retrieve functions */
+    int pooled;             /* allocated by mvptree_dp_alloc() from the pool of a tree */
 } MVPDP;
 
 
@@ -81,6 +89,10 @@ typedef struct mvp_datapoint_t {
 /* call back function for mvp tree functions - to performa distance calc.'s*/
 typedef float (*CmpFunc)(MVPDP *pointA, MVPDP *pointB);
 
+/* Callback function for mvptree_retrieve_visit(), called with each datapoint found and */
+/* its distance from the target. Return 0 to stop the search, nonzero to go on.         */
+typedef int (*MVPVisitFunc)(MVPDP *point, float distance, void *arg);
+
 /* Callback function to pass to mvp_clear() to free id and data members of the datapoints, */
 /* since the id and data arrays are allocated by user, not by dp_alloc() function. */
 typedef void  (*MVPFreeFunc)(void *ptr);
@@ -97,6 +109,7 @@ typedef struct node_leaf_t {
     MVPDP *sv1, *sv2;
     MVPDP **points;
     float *d1, *d2;
+    float *paths;          /* path of points[i] - paths[j*leafcap + i] holds path[j] */
     unsigned int nbpoints;
 } LeafNode;
    
@@ -114,7 +127,6 @@ typedef struct mvptree_t {
                            /* Refers to the array of float's stored in each datapoint.*/
     int leafcap;           /* capacity of leaf nodes  (number datapoints)             */
     int fd;                /* internal use                                            */
-    int k;                 /* internal use for retrieve function (knearest)           */
     MVPDataType datatype;     /* internal use                                            */  
     off_t pos;             /* internal use for mvp_read() and mvp_write()             */
     off_t size;            /* internal use for mvp_read() and mvp_write()             */
@@ -122,8 +134,90 @@ typedef struct mvptree_t {
     char *buf;             /* internal use                                            */
     Node *node;            /* reference to top of tree                                */
     CmpFunc dist;          /* distance function - e.g. L1 or L2                       */
+    int vpsample;          /* number of candidates sampled to select vantage points,   */
+                           /* 0 to compare all pairs of points (quadratic)             */
+    unsigned int seed;     /* seed for the vantage point samples                       */
+    int nbthreads;         /* threads used by mvptree_add(), 0 for one per cpu. The    */
+                           /* distance function must be thread safe if this is not 1.  */
+    int syncwrite;         /* mvptree_write() syncs the file to disk before returning, */
+                           /* 1 by default                                             */
+    int mapped;            /* tree is searched in place in a file, see mvptree_map()   */
+    off_t root;            /* offset of the top node in a mapped file                  */
+    int pooled;            /* nodes and paths are cut from large chunks of memory that */
+                           /* mvptree_clear() frees at once, 1 by default. Set it      */
+                           /* before the first points are added.                       */
+    struct mvp_pool_t *pool; /* internal use - the chunks of a pooled tree              */
 } MVPTree;
 
+typedef struct knn_result_t {
+    float d;
+    const void *dp;        /* datapoint, or its record in a mapped file               */
+} KnnResult;
+
+typedef struct knn_node_t {
+    float bound;           /* lower bound on distance from target to the node's points */
+    const void *node;      /* node, or its record in a mapped file                    */
+    int lvl;
+    int path;              /* index into paths[] for the parent node, -1 for top      */
+} KnnNode;
+
+typedef struct knn_path_t {
+    float d1, d2;          /* distance of target from sv1 and sv2 of an internal node */
+    int parent;
+} KnnPath;
+
+/* work done by a search, counted in its MVPQuery. Every point of a leaf visited is */
+/* ruled out by its d1/d2 distances, ruled out by its path, skipped as deleted, or  */
+/* compared with the target.                                                        */
+typedef struct mvp_stats_t {
+    unsigned long nbdistances;     /* calls of the distance function                 */
+    unsigned long nbinternals;     /* internal nodes visited                         */
+    unsigned long nbleaves;        /* leaves visited                                 */
+    unsigned long nbleafpoints;    /* points in the leaves visited                   */
+    unsigned long nbfiltered_vp;   /* leaf points ruled out by d1/d2                 */
+    unsigned long nbfiltered_path; /* leaf points ruled out by their path            */
+    unsigned long nbcompared;      /* leaf points compared with the target           */
+} MVPStats;
+
+/* per query state. The retrieve functions only read the tree, so any number of */
+/* threads can search the same tree at once, each with its own MVPQuery.        */
+typedef struct mvp_query_t {
+    float *path;           /* target's distances from the vantage points down the tree */
+    int pathlength;        /* length of path array                                     */
+    unsigned int k;        /* knearest limit                                           */
+    float radius;          /* search radius, shrinks during a knearest search          */
+    KnnResult *results;    /* internal use - max heap of the best results so far      */
+    unsigned int nbresults, rcap;
+    KnnNode *queue;        /* internal use - nodes to visit, min heap on lower bound  */
+    unsigned int qlen, qcap;
+    KnnPath *paths;        /* internal use - target's distances from visited nodes    */
+    unsigned int plen, pcap;
+    const void **candidates; /* internal use - points of a leaf that pass the filters, */
+    MVPDP **cpoints;       /* their datapoints and distances from the target, so that */
+    MVPDP *cviews;         /* the distances are computed in one batch                 */
+    float *cdist;
+    unsigned char *ckeep;
+    unsigned int ccap;
+    MVPStats stats;        /* work done by the last search with this query, reset by */
+                           /* each call of the _r retrieve functions and _visit()    */
+} MVPQuery;
+
+/* how the datapoints of a set of shards are divided between the trees */
+typedef enum mvp_shardmode_t {
+    MVP_SHARD_HASH = 1,     /* by a hash of the id, or of the data for points without one */
+    MVP_SHARD_VANTAGE       /* by distance from a vantage point, in rings of equal size  */
+} MVPShardMode;
+
+typedef struct mvp_shards_t {
+    MVPTree **trees;       /* one tree per shard                                       */
+    unsigned int nbshards;
+    MVPShardMode mode;
+    MVPDP *vp;             /* MVP_SHARD_VANTAGE - copy of the vantage point, chosen by */
+    float *splits;         /* the first add. Shard i holds the points within           */
+                           /* splits[i-1] < d <= splits[i] of the vantage point        */
+    int nbthreads;         /* threads to build and search the shards, 0 for one per cpu */
+} MVPShards;
+
 
 /*   DP* dp_alloc
  *
@@ -161,6 +255,88 @@ MVPDP* dp_alloc(MVPDataType type);
 
 void dp_free(MVPDP *dp, MVPFreeFunc free_func);
 
+/*   mvptree_dp_alloc
+ *
+ *   DESCRIPTION:
+ *
+ *   allocate a datapoint for a tree, with room for its data and a copy of its id.
+ *   For a tree with pooled set, the datapoint, its data, id and path are one block
+ *   of the tree's pool. They are freed with the tree by mvptree_clear(), which need
+ *   not visit them, and must not be freed any other way. Otherwise the datapoint
+ *   is allocated with dp_alloc() and its data and id with malloc().
+ *
+ *   ARGUMENTS:
+ *
+ *   tree    - ptr to MVPTree the datapoint will be added to
+ *
+ *   type    - DataType value to indicate the type of data the datapoint represents.
+ *
+ *   datalen - length of the data in elements of type, the data is zeroed
+ *
+ *   id      - null-terminated id to copy, or NULL
+ *
+ *   RETURN:
+ *
+ *   pointer to DP structure, NULL for error.
+ */
+
+MVPDP* mvptree_dp_alloc(MVPTree *tree, MVPDataType type, unsigned int datalen, const char *id);
+
+/*   mvp_hamming_distance, mvp_l1_distance, mvp_l2_distance
+ *
+ *   DESCRIPTION:
+ *
+ *   built-in distance functions to pass to mvptree_alloc(), for datapoints of
+ *   any MVPDataType. The hamming distance counts the differing bits of the data,
+ *   the L1 and L2 distances compare it element by element. They use the vector
+ *   instructions of the cpu (AVX2 and POPCNT on x86-64) and are thread safe.
+ *   A tree built with mvp_hamming_distance on single 64 bit hashes (datalen 1,
+ *   MVP_UINT64ARRAY) computes the distances to the points of a leaf in a tight
+ *   loop without calling the function for each point.
+ *
+ *   ARGUMENTS:
+ *
+ *   pointA, pointB - datapoints to compare
+ *
+ *   RETURN:
+ *
+ *   distance, or -1.0 if the datapoints differ in type or length
+ */
+
+float mvp_hamming_distance(MVPDP *pointA, MVPDP *pointB);
+
+float mvp_l1_distance(MVPDP *pointA, MVPDP *pointB);
+
+float mvp_l2_distance(MVPDP *pointA, MVPDP *pointB);
+
+/*   mvp_batch_distance
+ *
+ *   DESCRIPTION:
+ *
+ *   distances from a target to many datapoints at once - dist[i] is the
+ *   distance from target to points[i]. The tree uses it for the points of
+ *   a leaf and when building. With the built-in distance functions the
+ *   distances are computed in one batch, any other function is called once
+ *   for each point.
+ *
+ *   ARGUMENTS:
+ *
+ *   distance - distance function
+ *
+ *   target - datapoint to compare against
+ *
+ *   points - array of nbpoints datapoints
+ *
+ *   dist - array of nbpoints floats for the results
+ *
+ *   RETURN:
+ *
+ *   void
+ */
+
+void mvp_batch_distance(CmpFunc distance, MVPDP *target, MVPDP **points,\
+                        unsigned int nbpoints, float *dist);
+
 /*   mvptree_alloc
  * 
  *   DESCRIPTION:
@@ -194,7 +370,10 @@ MVPTree* mvptree_alloc(MVPTree *tree,CmpFunc distance,\
  *  Clear out the tree. All the datapoints that have been added to the tree
  *  are also free'd with dp_free(). You can specify a free function to free
  *  the portions of the DP struct which are user allocated (e.g. the id and 
- *  data fields).
+ *  data fields). For a tree from mvptree_map() the file is unmapped instead.
+ *  For a pooled tree the nodes, paths and the datapoints from mvptree_dp_alloc()
+ *  or mvptree_read() go with the pool's chunks, and the tree is only walked if
+ *  it holds datapoints allocated some other way.
  *
  *  ARGUMENTS:
  *
@@ -234,6 +413,58 @@ void mvptree_clear(MVPTree *tree, MVPFreeFunc free_func);
 
 MVPError mvptree_add(MVPTree *tree, MVPDP **points, unsigned int nbpoints);
 
+/*
+ *   mvptree_delete
+ *
+ *   DESCRIPTION:
+ *
+ *   Delete the datapoints with the given id from the tree. They are marked as
+ *   deleted, and are no longer returned by the retrieve functions, but stay in
+ *   the tree to direct searches until mvptree_compact() rebuilds the part of the
+ *   tree they are in. mvptree_write() keeps the marks, so a tree read back from
+ *   the file still leaves them out. A tree from mvptree_map() cannot be deleted from.
+ *
+ *   ARGUMENTS:
+ *
+ *   tree - ptr to MVPTree
+ *
+ *   id   - null-terminated id of the datapoints to delete
+ *
+ *   RETURN
+ *
+ *   MVPError error code, MVP_IDNOTFOUND if no datapoint in the tree has the id
+ */
+
+MVPError mvptree_delete(MVPTree *tree, const char *id);
+
+/*
+ *   mvptree_compact
+ *
+ *   DESCRIPTION:
+ *
+ *   Free the datapoints deleted with mvptree_delete() by rebuilding the parts of
+ *   the tree where they are. Going down from the top, the first subtree on each
+ *   path whose fraction of datapoints that are not deleted is below threshold is
+ *   rebuilt from its remaining datapoints. The rest of the tree is left as is,
+ *   deleted vantage points included. A threshold of 1.0 removes every deleted
+ *   datapoint; 0.5 rebuilds only where more than half of the datapoints are gone.
+ *
+ *   ARGUMENTS:
+ *
+ *   tree      - ptr to MVPTree
+ *
+ *   threshold - float fraction of datapoints in a subtree, 0.0 to 1.0
+ *
+ *   free_func - ptr to function to free the id and data fields of the datapoints
+ *               removed from the tree (see mvptree_clear())
+ *
+ *   RETURN
+ *
+ *   MVPError error code
+ */
+
+MVPError mvptree_compact(MVPTree *tree, float threshold, MVPFreeFunc free_func);
+
 /*
  *   mvptree_retrieve
  *  
@@ -265,12 +496,317 @@ MVPError mvptree_add(MVPTree *tree, MVPDP **points, unsigned int nbpoints);
 MVPDP** mvptree_retrieve(MVPTree *tree, MVPDP *target, unsigned int knearest, float radius,\
                                        unsigned int *nbresults, MVPError *error);
 
+/*
+ *   mvptree_retrieve_knearest
+ *
+ *   DESCRIPTION:
+ *
+ *   retrieve the knearest closest datapoints to the target within radius. Unlike
+ *   mvptree_retrieve(), which returns the first knearest points found inside radius,
+ *   the tree is searched best first and the radius shrinks as closer points are found.
+ *   Pass a large radius (e.g. FLT_MAX) for a plain k-nearest neighbor search.
+ *
+ *   ARGUMENTS:
+ *
+ *   tree - ptr to the MVPTree
+ *
+ *   target - target datapoint
+ *
+ *   knearest - number of datapoints to return
+ *
+ *   radius   - maximum distance from the target to include in returned list.
+ *
+ *   nbresults - ptr to int to contain the number of results returned to user.
+ *
+ *   error - ptr to error value to return error to user
+ *
+ *   RETURN:
+ *
+ *   MVPDP** array of ptrs to datapoints, in ascending order of distance from the target.
+ *           (The user must free the array, but not the datapoints.)
+ *
+ */
+
+MVPDP** mvptree_retrieve_knearest(MVPTree *tree, MVPDP *target, unsigned int knearest,\
+                                  float radius, unsigned int *nbresults, MVPError *error);
+
+/*
+ *   mvpquery_alloc
+ *
+ *   DESCRIPTION:
+ *
+ *   initialize a query struct for use with the _r retrieve functions. The buffers
+ *   it holds are reused from one query to the next.
+ *
+ *   ARGUMENTS:
+ *
+ *   query - ptr to MVPQuery to initialize (NULL to allocate one on the heap)
+ *
+ *   tree - ptr to the MVPTree the query will be used with
+ *
+ *   RETURN:
+ *
+ *   MVPQuery* ptr, NULL for error
+ *
+ */
+
+MVPQuery* mvpquery_alloc(MVPQuery *query, const MVPTree *tree);
+
+/*
+ *   mvpquery_clear
+ *
+ *   DESCRIPTION:
+ *
+ *   free the buffers held by a query struct, but not the struct itself.
+ *
+ *   ARGUMENTS:
+ *
+ *   query - ptr to MVPQuery
+ *
+ *   RETURN:
+ *
+ *   void
+ *
+ */
+
+void mvpquery_clear(MVPQuery *query);
+
+/*
+ *   mvptree_retrieve_r, mvptree_retrieve_knearest_r
+ *
+ *   DESCRIPTION:
+ *
+ *   reentrant versions of mvptree_retrieve() and mvptree_retrieve_knearest().
+ *   The tree and target are not modified, all state is kept in the query struct,
+ *   so threads sharing a tree can search it concurrently with one query each.
+ *   Afterwards query->stats holds the counts of the work done by the search.
+ *
+ *   ARGUMENTS:
+ *
+ *   query - ptr to MVPQuery initialized with mvpquery_alloc() for this tree
+ *
+ *   (the others as for mvptree_retrieve())
+ *
+ *   RETURN:
+ *
+ *   MVPDP** array of ptrs to datapoints. (The user must free the array.)
+ *
+ */
+
+MVPDP** mvptree_retrieve_r(const MVPTree *tree, MVPQuery *query, MVPDP *target,\
+                           unsigned int knearest, float radius, unsigned int *nbresults,\
+                           MVPError *error);
+
+MVPDP** mvptree_retrieve_knearest_r(const MVPTree *tree, MVPQuery *query, MVPDP *target,\
+                                    unsigned int knearest, float radius,\
+                                    unsigned int *nbresults, MVPError *error);
+
+/*
+ *   mvptree_retrieve_visit
+ *
+ *   DESCRIPTION:
+ *
+ *   range search that hands each datapoint within radius of the target to a
+ *   callback, with its distance, as it is found, instead of collecting them in an
+ *   array. There is no limit on the number of results and nothing is allocated,
+ *   so a query struct can be reused for any number of searches. The points come
+ *   in the order of the tree, not of distance. For a mapped tree the datapoint
+ *   passed to the callback is only valid until it returns. The callback stops the
+ *   search by returning 0.
+ *
+ *   ARGUMENTS:
+ *
+ *   tree - ptr to the MVPTree
+ *
+ *   query - ptr to MVPQuery initialized with mvpquery_alloc() for this tree
+ *
+ *   target - target datapoint
+ *
+ *   radius - maximum distance from the target of the datapoints to visit
+ *
+ *   visit - callback function
+ *
+ *   arg - passed to each call of visit
+ *
+ *   RETURN:
+ *
+ *   MVPError code, MVP_SUCCESS if the callback stopped the search
+ *
+ */
+
+MVPError mvptree_retrieve_visit(const MVPTree *tree, MVPQuery *query, MVPDP *target,\
+                                float radius, MVPVisitFunc visit, void *arg);
+
+/*
+ *   mvptree_retrieve_batch
+ *
+ *   DESCRIPTION:
+ *
+ *   run mvptree_retrieve_knearest() for a list of targets over a pool of threads.
+ *
+ *   ARGUMENTS:
+ *
+ *   tree - ptr to the MVPTree
+ *
+ *   targets - array of target datapoints
+ *
+ *   nbtargets - number of targets
+ *
+ *   knearest - number of datapoints to return for each target
+ *
+ *   radius - maximum distance from a target to include in its results
+ *
+ *   nbthreads - number of threads to use, 0 for one per cpu
+ *
+ *   results - array of nbtargets MVPDP** ptrs, receives the results for each target.
+ *             (The user must free each array.)
+ *
+ *   nbresults - array of nbtargets ints, receives the number of results for each target
+ *
+ *   errors - array of nbtargets MVPError codes, receives the error for each target
+ *
+ *   RETURN:
+ *
+ *   MVPError code
+ *
+ */
+
+MVPError mvptree_retrieve_batch(const MVPTree *tree, MVPDP **targets, unsigned int nbtargets,\
+                                unsigned int knearest, float radius, unsigned int nbthreads,\
+                                MVPDP ***results, unsigned int *nbresults, MVPError *errors);
+
+/*
+ *   mvpshards_alloc
+ *
+ *   DESCRIPTION:
+ *
+ *   allocate a set of nbshards trees, each as with mvptree_alloc(). Datapoints
+ *   added to the set are divided between the trees, which are built at the same
+ *   time, and each search runs on all of the trees at once. The trees can also be
+ *   used on their own, e.g. to write each one to a file or to compact it.
+ *
+ *   ARGUMENTS:
+ *
+ *   shards   - ptr to MVPShards to fill in, NULL to allocate one
+ *
+ *   distance - distance function for the trees
+ *
+ *   nbshards - number of trees
+ *
+ *   mode     - MVP_SHARD_HASH or MVP_SHARD_VANTAGE
+ *
+ *   bf, p, k - branchfactor, pathlength and leaf capacity of each tree
+ *
+ *   RETURN
+ *
+ *   ptr to MVPShards, NULL on error
+ */
+
+MVPShards* mvpshards_alloc(MVPShards *shards, CmpFunc distance, unsigned int nbshards,\
+                           MVPShardMode mode, unsigned int bf, unsigned int p, unsigned int k);
+
+/*
+ *   mvpshards_clear
+ *
+ *   DESCRIPTION:
+ *
+ *   clear out and free each tree, as with mvptree_clear(). The MVPShards struct
+ *   itself is not free'd.
+ *
+ *   ARGUMENTS:
+ *
+ *   shards    - ptr to MVPShards
+ *
+ *   free_func - ptr to function to free the datapoint's id and data fields
+ *
+ *   RETURN
+ *
+ *   void
+ */
+
+void mvpshards_clear(MVPShards *shards, MVPFreeFunc free_func);
+
+/*
+ *   mvpshards_add
+ *
+ *   DESCRIPTION:
+ *
+ *   add datapoints to the shards, as with mvptree_add(). For MVP_SHARD_VANTAGE the
+ *   first call picks the vantage point and the rings from the points it is given,
+ *   and later points are put into the same rings, so the first batch should be
+ *   representative of the data.
+ *
+ *   ARGUMENTS:
+ *
+ *   shards   - ptr to MVPShards
+ *
+ *   points   - array of DP ptrs to add
+ *
+ *   nbpoints - number of points
+ *
+ *   RETURN
+ *
+ *   MVPError code
+ */
+
+MVPError mvpshards_add(MVPShards *shards, MVPDP **points, unsigned int nbpoints);
+
+/*
+ *   mvpshards_delete
+ *
+ *   DESCRIPTION:
+ *
+ *   delete the datapoints with an id from the shards, as with mvptree_delete().
+ *
+ *   RETURN
+ *
+ *   MVPError code, MVP_IDNOTFOUND if no shard has a datapoint with the id
+ */
+
+MVPError mvpshards_delete(MVPShards *shards, const char *id);
+
+/*
+ *   mvpshards_retrieve
+ *
+ *   DESCRIPTION:
+ *
+ *   retrieve the points within radius of the target from all of the shards, as
+ *   with mvptree_retrieve(). At most knearest points are returned, with error
+ *   MVP_KNEARESTCAP if there were more.
+ *
+ *   RETURN
+ *
+ *   array of MVPDP ptrs, to be free'd by the user with one call to free()
+ */
+
+MVPDP** mvpshards_retrieve(const MVPShards *shards, MVPDP *target, unsigned int knearest,\
+                           float radius, unsigned int *nbresults, MVPError *error);
+
+/*
+ *   mvpshards_retrieve_knearest
+ *
+ *   DESCRIPTION:
+ *
+ *   retrieve the knearest points to the target within radius over all of the
+ *   shards, nearest first, as with mvptree_retrieve_knearest().
+ *
+ *   RETURN
+ *
+ *   array of MVPDP ptrs, to be free'd by the user with one call to free()
+ */
+
+MVPDP** mvpshards_retrieve_knearest(const MVPShards *shards, MVPDP *target,\
+                                    unsigned int knearest, float radius,\
+                                    unsigned int *nbresults, MVPError *error);
+
 /*
  *   mvptree_write
  *
  *   DESCRIPTION:
  *
- *   write out a tree to a file
+ *   write out a tree to a file. The file is written in one pass through a
+ *   buffer and, unless the syncwrite field of the tree is 0, synced to disk
+ *   once at the end.
  *
  *   ARGUMENTS:
  *
@@ -312,6 +848,39 @@ MVPError mvptree_write(MVPTree *tree, const char *filename, int mode);
 MVPTree* mvptree_read(const char *filename, CmpFunc fnc, int branchfactor, int pathlength,\
                                                   int leafcapacity, MVPError *error);
 
+/*   mvptree_map
+ *
+ *   DESCRIPTION:
+ *
+ *   map a file written by mvptree_write() read-only into memory and search it
+ *   in place, without reading the nodes and datapoints into the heap. Pages of
+ *   the file are only read as queries touch them, and processes that map the
+ *   same file share them.
+ *
+ *   The retrieve functions work on the mapped tree as usual, except that the
+ *   datapoints they return point into the file: their id, data and path
+ *   fields must not be written or freed, and they are only valid until
+ *   mvptree_clear() unmaps the file. The results array is still free'd with
+ *   one call to free(). A mapped tree cannot be added to.
+ *
+ *   ARGUMENTS:
+ *
+ *   filename - null-terminated char array
+ *
+ *   fnc - callback function for distance function to use
+ *
+ *   error - pointer to MVPError code enum
+ *
+ *   RETURN
+ *
+ *   MVPTree ptr, or NULL on error (and error is set to error code)
+ *   MVP_BADFORMAT for files written before version 2 of the file format,
+ *   which can only be read with mvptree_read().
+ *
+ */
+
+MVPTree* mvptree_map(const char *filename, CmpFunc fnc, MVPError *error);
+
 /*   mvptree_print
  *
  *   DESCRIPTION:
@@ -0,0 +1,1250 @@
+/*
+
+    MVPTree c library
+    Copyright (C) 2008-2009 Aetilius, Inc.
+    All rights reserved.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    D Grant Starkweather - dstarkweather@phash.org
+
+*/
+
+/* C++ front-end of the library, header only.
+
+   mvp::Tree<Point, Distance, BF, PathLen> builds and searches the same tree as
+   mvptree.c, with the same vantage points, splits and file format, so a file
+   written by one can be read by the other. The points are stored by value and
+   the distance is a functor, so the compiler can inline it into the searches,
+   and the branch factor and path length are constants. Point is a trivially
+   copyable type whose bytes are the data of a datapoint, described by
+   mvp::point_traits - integers and std::array's of integers are built in. */
+
+#ifndef _MVPTREE_HPP
+#define _MVPTREE_HPP
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+#include <algorithm>
+#include <array>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+extern "C" {
+#include "mvptree.h"
+}
+
+namespace mvp {
+
+/* element type and number of elements of a point, as stored in a tree file -
+   specialize it for other point types */
+template <class T, class Enable = void>
+struct point_traits;
+
+template <class T>
+struct point_traits<T, typename std::enable_if<std::is_integral<T>::value>::type> {
+    static const MVPDataType type = (MVPDataType)sizeof(T);
+    static const unsigned int datalen = 1;
+};
+
+template <class T, size_t N>
+struct point_traits<std::array<T, N>, typename std::enable_if<std::is_integral<T>::value>::type> {
+    static const MVPDataType type = (MVPDataType)sizeof(T);
+    static const unsigned int datalen = N;
+};
+
+namespace detail {
+
+/* sums of N absolute or squared differences of T's, in the types of mvptree.c -
+   integers where they cannot overflow, so that the loops vectorize */
+template <class T, size_t N, bool Squares>
+struct diff_sum {
+    typedef typename std::conditional<sizeof(T) == 1 && N <= 65536, uint32_t,\
+	typename std::conditional<(sizeof(T) == 2 || (sizeof(T) == 4 && !Squares)), uint64_t,\
+	double>::type>::type type;
+};
+
+} /* namespace detail */
+
+/* the distances of mvp_hamming_distance, mvp_l1_distance and mvp_l2_distance */
+
+struct Hamming {
+    template <class T>
+    typename std::enable_if<std::is_integral<T>::value, float>::type
+    operator()(T a, T b) const {
+	typedef typename std::make_unsigned<T>::type U;
+	return (float)__builtin_popcountll((U)a ^ (U)b);
+    }
+    template <class T, size_t N>
+    float operator()(const std::array<T, N> &a, const std::array<T, N> &b) const {
+	typedef typename std::make_unsigned<T>::type U;
+	uint64_t d = 0;
+	for (size_t i = 0; i < N; i++){
+	    d += __builtin_popcountll((U)a[i] ^ (U)b[i]);
+	}
+	return (float)d;
+    }
+};
+
+struct L1 {
+    template <class T>
+    typename std::enable_if<std::is_integral<T>::value, float>::type
+    operator()(T a, T b) const {
+	return (float)((a > b) ? (double)(a - b) : (double)(b - a));
+    }
+    template <class T, size_t N>
+    float operator()(const std::array<T, N> &a, const std::array<T, N> &b) const {
+	typedef typename detail::diff_sum<T, N, false>::type S;
+	S sum = 0;
+	for (size_t i = 0; i < N; i++){
+	    sum += (a[i] > b[i]) ? (S)(a[i] - b[i]) : (S)(b[i] - a[i]);
+	}
+	return (float)sum;
+    }
+};
+
+struct L2 {
+    template <class T>
+    typename std::enable_if<std::is_integral<T>::value, float>::type
+    operator()(T a, T b) const {
+	return (float)((a > b) ? (double)(a - b) : (double)(b - a));
+    }
+    template <class T, size_t N>
+    float operator()(const std::array<T, N> &a, const std::array<T, N> &b) const {
+	typedef typename detail::diff_sum<T, N, true>::type S;
+	S sum = 0;
+	for (size_t i = 0; i < N; i++){
+	    S diff = (a[i] > b[i]) ? (S)(a[i] - b[i]) : (S)(b[i] - a[i]);
+	    sum += diff*diff;
+	}
+	return (float)sqrt((double)sum);
+    }
+};
+
+namespace detail {
+
+/* layout of a version 2 tree file, see mvptree.c */
+static const char    tag[]       = "phashmvp2010";
+static const int     version     = 0x02000000;
+static const int64_t HEADER_SIZE = 32;
+static const int64_t ROOT_OFFSET = 24;
+static const int64_t NODE_HEADER = 24;
+static const int64_t DP_HEADER   = 16;
+
+inline int64_t align8(int64_t x){
+    return (x + 7) & ~(int64_t)7;
+}
+
+inline bool bad_distance(float d){
+    return d != d || d < 0.0f;
+}
+
+/* the generator of the vantage point samples in mvptree.c */
+inline uint64_t next_random(uint64_t &state){
+    uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/* marks in keep[] the points of a leaf within radius of the target on every
+   distance, as leaf_filter() in mvptree.c */
+inline unsigned int leaf_filter(const float *pd1, const float *pd2, const float *paths,\
+                                size_t stride, const float *tpath, int nbpaths,\
+                                unsigned int nbpoints, float d1, float d2, float radius,\
+                                unsigned char *keep){
+    float lo1 = d1 - radius, hi1 = d1 + radius;
+    float lo2 = d2 - radius, hi2 = d2 + radius;
+    unsigned int i, count = 0;
+    for (i = 0; i < nbpoints; i++){
+	keep[i] = (pd1[i] >= lo1) & (pd1[i] <= hi1) & (pd2[i] >= lo2) & (pd2[i] <= hi2);
+    }
+    for (int j = 0; j < nbpaths; j++){
+	const float *col = paths + (size_t)j*stride;
+	float lo = tpath[j] - radius, hi = tpath[j] + radius;
+	for (i = 0; i < nbpoints; i++){
+	    keep[i] &= (col[i] >= lo) & (col[i] <= hi);
+	}
+    }
+    for (i = 0; i < nbpoints; i++){
+	count += keep[i];
+    }
+    return count;
+}
+
+} /* namespace detail */
+
+template <class Point, class Distance, int BF = 2, int PathLen = 5>
+class Tree {
+    static_assert(BF >= 2 && BF <= 255, "branch factor must be from 2 to 255");
+    static_assert(PathLen >= 0 && PathLen <= 255, "path length must be from 0 to 255");
+    static_assert(std::is_trivially_copyable<Point>::value, "points are stored as bytes");
+    static_assert(sizeof(Point) == point_traits<Point>::datalen*point_traits<Point>::type,\
+                  "point_traits must describe all the bytes of a point");
+
+public:
+    struct Result {
+	const Point *point;
+	const std::string *id;
+	float distance;
+    };
+
+    int vpsample;          /* as in MVPTree - candidates sampled for vantage points, */
+                           /* 0 to compare all pairs                                 */
+    unsigned int seed;     /* seed for the vantage point samples                     */
+
+    explicit Tree(unsigned int leafcap = 25, const Distance &distance = Distance())
+	: vpsample(MVP_VPSAMPLE), seed(0), leafcap_(leafcap ? leafcap : 1), dist_(distance),\
+	  root_(0) {}
+
+    unsigned int leafcap() const { return leafcap_; }
+
+    /* number of points added, deleted ones included */
+    size_t size() const { return ids_.size(); }
+
+    void clear(){
+	internals_.clear();
+	leaves_.clear();
+	free_leaves_.clear();
+	points_.clear();
+	pids_.clear();
+	d1_.clear();
+	d2_.clear();
+	paths_.clear();
+	ids_.clear();
+	active_.clear();
+	root_ = 0;
+    }
+
+    /* add points with ids[i] the id of points[i], as mvptree_add() */
+    MVPError add(const Point *points, const std::string *ids, size_t nbpoints){
+	if (nbpoints == 0) return MVP_SUCCESS;
+	if (!points || !ids || ids_.size() + nbpoints > UINT32_MAX) return MVP_ARGERR;
+
+	std::vector<Entry> work(nbpoints);
+	std::vector<uint32_t> list(nbpoints);
+	for (size_t i = 0; i < nbpoints; i++){
+	    work[i].point = points[i];
+	    work[i].id = (uint32_t)ids_.size();
+	    work[i].path.fill(0.0f);
+	    ids_.push_back(ids[i]);
+	    active_.push_back(1);
+	    list[i] = (uint32_t)i;
+	}
+	MVPError err = MVP_SUCCESS;
+	root_ = add_node(work, root_, list, err, 0);
+	return err;
+    }
+
+    MVPError add(const std::vector<Point> &points, const std::vector<std::string> &ids){
+	if (points.size() != ids.size()) return MVP_ARGERR;
+	return add(points.data(), ids.data(), points.size());
+    }
+
+    /* mark the points with the id as deleted, as mvptree_delete() */
+    MVPError erase(const std::string &id){
+	bool found = false;
+	for (size_t i = 0; i < ids_.size(); i++){
+	    if (active_[i] && ids_[i] == id){
+		active_[i] = 0;
+		found = true;
+	    }
+	}
+	return (found) ? MVP_SUCCESS : MVP_IDNOTFOUND;
+    }
+
+    /* the points within radius of target, at most knearest of them, as
+       mvptree_retrieve(). The results point into the tree, and are valid until
+       it is next changed. */
+    MVPError retrieve(const Point &target, float radius, std::vector<Result> &results,\
+                      size_t knearest = SIZE_MAX) const {
+	results.clear();
+	if (knearest == 0 || !(radius >= 0.0f)) return MVP_ARGERR;
+	if (root_ == 0) return MVP_EMPTYTREE;
+	float path[PathLen + 1];
+	Collect collect = { results, knearest };
+	return retrieve_node(root_, target, radius, collect, path, 0);
+    }
+
+    /* range search that calls f(const Result&) with each point within radius of
+       target as it is found, as mvptree_retrieve_visit(). f returns false to stop
+       the search, which is not an error. */
+    template <class Visit>
+    MVPError visit(const Point &target, float radius, Visit f) const {
+	if (!(radius >= 0.0f)) return MVP_ARGERR;
+	if (root_ == 0) return MVP_EMPTYTREE;
+	float path[PathLen + 1];
+	MVPError err = retrieve_node(root_, target, radius, f, path, 0);
+	return (err == MVP_KNEARESTCAP) ? MVP_SUCCESS : err;
+    }
+
+    /* the k nearest points to target within radius, nearest first, as
+       mvptree_retrieve_knearest() */
+    MVPError knearest(const Point &target, size_t k, std::vector<Result> &results,\
+                      float radius = FLT_MAX) const {
+	results.clear();
+	if (k == 0 || !(radius >= 0.0f)) return MVP_ARGERR;
+	if (root_ == 0) return MVP_EMPTYTREE;
+
+	Knn q(results, k, radius);
+	q.queue.push_back(KnnNode(0.0f, root_, 0, -1));
+	MVPError err = MVP_SUCCESS;
+	while (err == MVP_SUCCESS && !q.queue.empty()){
+	    std::pop_heap(q.queue.begin(), q.queue.end(), farther_node);
+	    KnnNode entry = q.queue.back();
+	    q.queue.pop_back();
+	    if (entry.bound > q.radius) break;
+	    err = knearest_node(q, entry, target);
+	}
+	std::sort_heap(results.begin(), results.end(), nearer_result);
+	return err;
+    }
+
+    /* write the tree to a file mvptree_read() and mvptree_map() can load */
+    MVPError write(const char *filename) const {
+	if (!filename || root_ == 0) return MVP_ARGERR;
+	Writer w;
+	w.file = fopen(filename, "wb");
+	if (!w.file) return MVP_FILEOPEN;
+
+	char *buf = w.reserve(detail::HEADER_SIZE);
+	size_t pos = sizeof(detail::tag);
+	uint8_t shape[4] = { (uint8_t)BF, (uint8_t)PathLen, (uint8_t)leafcap_,\
+                             (uint8_t)point_traits<Point>::type };
+	memcpy(&buf[0], detail::tag, pos);
+	memcpy(&buf[pos], &detail::version, sizeof(int));
+	memcpy(&buf[pos + sizeof(int)], shape, sizeof(shape));
+
+	int64_t root = write_node(w, root_);
+	w.flush();
+	if (w.error == MVP_SUCCESS){
+	    if (fseek(w.file, detail::ROOT_OFFSET, SEEK_SET) != 0 ||\
+		fwrite(&root, sizeof(int64_t), 1, w.file) != 1){
+		w.error = MVP_NOWRITE;
+	    }
+	}
+	if (fclose(w.file) != 0 && w.error == MVP_SUCCESS){
+	    w.error = MVP_FILECLOSE;
+	}
+	return w.error;
+    }
+
+    /* replace the tree with the one in a file. Only version 2 files can be read,
+       with the branch factor, path length and point type of this tree. */
+    MVPError read(const char *filename){
+	if (!filename) return MVP_ARGERR;
+	clear();
+	FILE *file = fopen(filename, "rb");
+	if (!file) return MVP_FILENOTFOUND;
+
+	std::vector<char> buf;
+	long size = (fseek(file, 0, SEEK_END) == 0) ? ftell(file) : -1;
+	if (size >= 0 && fseek(file, 0, SEEK_SET) == 0){
+	    buf.resize(size);
+	    if (size > 0 && fread(&buf[0], size, 1, file) != 1) size = -1;
+	}
+	fclose(file);
+	if (size < 0) return MVP_FILEOPEN;
+
+	Reader r(buf);
+	int v;
+	int64_t root;
+	if (!r.fits(0, detail::HEADER_SIZE) || memcmp(&buf[0], detail::tag, sizeof(detail::tag))){
+	    return MVP_BADFORMAT;
+	}
+	memcpy(&v, &buf[sizeof(detail::tag)], sizeof(int));
+	const uint8_t *shape = (const uint8_t*)&buf[sizeof(detail::tag) + sizeof(int)];
+	if (v != detail::version || shape[0] != BF || shape[1] != PathLen || shape[2] == 0){
+	    return MVP_BADFORMAT;
+	}
+	if (shape[3] != point_traits<Point>::type) return MVP_TYPEMISMATCH;
+	leafcap_ = shape[2];
+
+	memcpy(&root, &buf[detail::ROOT_OFFSET], sizeof(int64_t));
+	if (root < detail::HEADER_SIZE || !r.fits(root, detail::NODE_HEADER)){
+	    return MVP_BADFORMAT;
+	}
+	root_ = read_node(r, root);
+	if (r.error != MVP_SUCCESS) clear();
+	return r.error;
+    }
+
+private:
+    /* a point being added, or a vantage point */
+    struct Entry {
+	Point point;
+	uint32_t id;                          /* index into ids_ */
+	std::array<float, PathLen> path;
+    };
+
+    /* nodes are referred to by index - i+1 for internals_[i], -(i+1) for
+       leaves_[i] and 0 for none */
+    struct Internal {
+	Entry sv1, sv2;
+	float M1[BF-1];
+	float M2[BF*(BF-1)];
+	int32_t child[BF*BF];
+    };
+
+    /* the points of leaves_[i] are in slots i*leafcap_ to (i+1)*leafcap_-1 of the
+       point, id and distance arrays, and path j of slot s in paths_[(i*PathLen +
+       j)*leafcap_ + s], so that a leaf's distances are columns for leaf_filter */
+    struct Leaf {
+	Entry sv1, sv2;
+	bool has_sv2;
+	uint32_t nbpoints;
+    };
+
+    unsigned int leafcap_;
+    Distance dist_;
+    int32_t root_;
+    std::vector<Internal> internals_;
+    std::vector<Leaf> leaves_;
+    std::vector<int32_t> free_leaves_;
+    std::vector<Point> points_;
+    std::vector<uint32_t> pids_;
+    std::vector<float> d1_, d2_, paths_;
+    std::vector<std::string> ids_;
+    std::vector<unsigned char> active_;
+
+    static bool is_leaf(int32_t ref){ return ref < 0; }
+    static size_t node_index(int32_t ref){ return (ref < 0) ? -(ref+1) : ref-1; }
+
+    size_t slot(int32_t leaf, unsigned int i) const { return (size_t)leaf*leafcap_ + i; }
+    const float* leaf_paths(int32_t leaf) const {
+	return (PathLen > 0) ? &paths_[(size_t)leaf*PathLen*leafcap_] : NULL;
+    }
+
+    int32_t new_leaf(){
+	int32_t leaf;
+	if (!free_leaves_.empty()){
+	    leaf = free_leaves_.back();
+	    free_leaves_.pop_back();
+	} else {
+	    leaf = (int32_t)leaves_.size();
+	    leaves_.push_back(Leaf());
+	    points_.resize(points_.size() + leafcap_);
+	    pids_.resize(pids_.size() + leafcap_);
+	    d1_.resize(d1_.size() + leafcap_);
+	    d2_.resize(d2_.size() + leafcap_);
+	    paths_.resize(paths_.size() + (size_t)PathLen*leafcap_);
+	}
+	leaves_[leaf].has_sv2 = false;
+	leaves_[leaf].nbpoints = 0;
+	return leaf;
+    }
+
+    void leaf_set_point(int32_t leaf, unsigned int i, const Entry &e, float d1, float d2){
+	size_t s = slot(leaf, i);
+	points_[s] = e.point;
+	pids_[s] = e.id;
+	d1_[s] = d1;
+	d2_[s] = d2;
+	for (int j = 0; j < PathLen; j++){
+	    paths_[((size_t)leaf*PathLen + j)*leafcap_ + i] = e.path[j];
+	}
+    }
+
+    Entry leaf_entry(int32_t leaf, unsigned int i) const {
+	Entry e;
+	size_t s = slot(leaf, i);
+	e.point = points_[s];
+	e.id = pids_[s];
+	for (int j = 0; j < PathLen; j++){
+	    e.path[j] = paths_[((size_t)leaf*PathLen + j)*leafcap_ + i];
+	}
+	return e;
+    }
+
+    /* build - mirrors _mvptree_add(), with points given as indices into work[] */
+
+    bool distances(const std::vector<Entry> &work, const std::vector<uint32_t> &list,\
+                   const Point &vp, std::vector<float> &dist) const {
+	dist.resize(list.size());
+	for (size_t i = 0; i < list.size(); i++){
+	    dist[i] = dist_(work[list[i]].point, vp);
+	    if (detail::bad_distance(dist[i])) return false;
+	}
+	return true;
+    }
+
+    static void set_path(std::vector<Entry> &work, const std::vector<uint32_t> &list,\
+                         const std::vector<float> &dist, int lvl){
+	if (lvl >= PathLen) return;
+	for (size_t i = 0; i < list.size(); i++){
+	    work[list[i]].path[lvl] = dist[i];
+	}
+    }
+
+    bool select_all_pairs(const std::vector<Entry> &work, const std::vector<uint32_t> &list,\
+                          int &sv1_pos, int &sv2_pos) const {
+	unsigned int nb = (unsigned int)list.size();
+	sv1_pos = (nb >= 1) ? 0 : -1;
+	sv2_pos = (nb >= 2) ? 1 : -1;
+	float max_dist = 0.0f;
+	for (unsigned int i = 0; i < nb; i++){
+	    for (unsigned int j = i+1; j < nb; j++){
+		float d = dist_(work[list[i]].point, work[list[j]].point);
+		if (detail::bad_distance(d)) return false;
+		if (d > max_dist){
+		    max_dist = d;
+		    sv1_pos = i;
+		    sv2_pos = j;
+		}
+	    }
+	}
+	return true;
+    }
+
+    bool select_sampled(const std::vector<Entry> &work, const std::vector<uint32_t> &list,\
+                        int &sv1_pos, int &sv2_pos, int lvl) const {
+	unsigned int nb = (unsigned int)list.size();
+	unsigned int nbsample = vpsample;
+	uint64_t state = ((uint64_t)seed << 32) ^ ((uint64_t)lvl << 24) ^ nb;
+	std::vector<unsigned int> candidates(nbsample), sample(nbsample);
+	for (unsigned int i = 0; i < nbsample; i++){
+	    candidates[i] = (unsigned int)(detail::next_random(state) % nb);
+	    sample[i] = (unsigned int)(detail::next_random(state) % nb);
+	}
+
+	double max_var = -1.0;
+	for (unsigned int i = 0; i < nbsample; i++){
+	    const Point &c = work[list[candidates[i]]].point;
+	    double sum = 0.0, sumsq = 0.0;
+	    for (unsigned int j = 0; j < nbsample; j++){
+		float d = dist_(c, work[list[sample[j]]].point);
+		if (detail::bad_distance(d)) return false;
+		sum += d;
+		sumsq += (double)d*d;
+	    }
+	    double mean = sum/nbsample;
+	    double var = sumsq/nbsample - mean*mean;
+	    if (var > max_var){
+		max_var = var;
+		sv1_pos = candidates[i];
+	    }
+	}
+
+	float max_dist = -1.0f;
+	for (unsigned int i = 0; i < nbsample; i++){
+	    if ((int)candidates[i] == sv1_pos) continue;
+	    float d = dist_(work[list[sv1_pos]].point, work[list[candidates[i]]].point);
+	    if (detail::bad_distance(d)) return false;
+	    if (d > max_dist){
+		max_dist = d;
+		sv2_pos = candidates[i];
+	    }
+	}
+	if (max_dist < 0.0f){
+	    sv2_pos = (sv1_pos + 1) % nb;
+	}
+	return true;
+    }
+
+    bool select_vantage_points(const std::vector<Entry> &work, const std::vector<uint32_t> &list,\
+                               int &sv1_pos, int &sv2_pos, int lvl) const {
+	uint64_t nb = list.size();
+	uint64_t nbsample = (vpsample > 0) ? vpsample : 0;
+	if (nbsample > 0 && nb*(nb-1)/2 > nbsample*nbsample){
+	    return select_sampled(work, list, sv1_pos, sv2_pos, lvl);
+	}
+	return select_all_pairs(work, list, sv1_pos, sv2_pos);
+    }
+
+    static void find_splits(const std::vector<float> &dist, float *M){
+	std::vector<float> sorted(dist);
+	std::sort(sorted.begin(), sorted.end());
+	int nb = (int)sorted.size();
+	for (int i = 0; i < BF-1; i++){
+	    int index = (i+1)*nb/BF;
+	    if (index >= nb) index = nb-1;
+	    M[i] = sorted[index];
+	}
+    }
+
+    /* sort the points of list into bins by dist[] and the pivots, skipping the
+       vantage points at sv1_pos and sv2_pos */
+    static void sort_points(const std::vector<uint32_t> &list, int sv1_pos, int sv2_pos,\
+                            const std::vector<float> &dist, const float *pivots,\
+                            std::vector<uint32_t> *bins){
+	for (int k = 0; k < BF; k++){
+	    bins[k].clear();
+	}
+	for (int i = 0; i < (int)list.size(); i++){
+	    if (i == sv1_pos || i == sv2_pos) continue;
+	    float d = dist[i];
+	    int k = 0;
+	    while (k < BF-1 && d > pivots[k]) k++;
+	    bins[k].push_back(list[i]);
+	}
+    }
+
+    /* sorts the points of a bin of an internal node by sv2 into its children */
+    void add_bin(std::vector<Entry> &work, size_t n, int i, std::vector<uint32_t> &bin,\
+                 bool split, MVPError &error, int lvl){
+	std::vector<float> dist2;
+	if (!distances(work, bin, internals_[n].sv2.point, dist2)){
+	    error = MVP_NOSV2RANGE;
+	    return;
+	}
+	set_path(work, bin, dist2, lvl+1);
+	if (split) find_splits(dist2, internals_[n].M2 + i*(BF-1));
+
+	std::vector<uint32_t> bins2[BF];
+	sort_points(bin, -1, -1, dist2, internals_[n].M2 + i*(BF-1), bins2);
+	for (int j = 0; j < BF && error == MVP_SUCCESS; j++){
+	    int32_t child = add_node(work, internals_[n].child[i*BF+j], bins2[j], error, lvl+2);
+	    internals_[n].child[i*BF+j] = child;
+	}
+    }
+
+    int32_t add_node(std::vector<Entry> &work, int32_t node, std::vector<uint32_t> &list,\
+                     MVPError &error, int lvl){
+	if (list.empty()) return node;
+	int sv1_pos, sv2_pos;
+
+	if (node == 0 && list.size() <= leafcap_ + 2){
+	    /* new leaf */
+	    if (!select_vantage_points(work, list, sv1_pos, sv2_pos, lvl)){
+		error = MVP_VPNOSELECT;
+		return 0;
+	    }
+	    std::vector<float> d1, d2(list.size(), 0.0f);
+	    if (!distances(work, list, work[list[sv1_pos]].point, d1)){
+		error = MVP_NOSV1RANGE;
+		return 0;
+	    }
+	    set_path(work, list, d1, lvl);
+	    if (sv2_pos >= 0){
+		if (!distances(work, list, work[list[sv2_pos]].point, d2)){
+		    error = MVP_NOSV2RANGE;
+		    return 0;
+		}
+		set_path(work, list, d2, lvl+1);
+	    }
+
+	    int32_t leaf = new_leaf();
+	    Leaf &l = leaves_[leaf];
+	    l.sv1 = work[list[sv1_pos]];
+	    l.has_sv2 = (sv2_pos >= 0);
+	    if (l.has_sv2) l.sv2 = work[list[sv2_pos]];
+	    unsigned int count = 0;
+	    for (int i = 0; i < (int)list.size(); i++){
+		if (i == sv1_pos || i == sv2_pos) continue;
+		leaf_set_point(leaf, count++, work[list[i]], d1[i], d2[i]);
+	    }
+	    l.nbpoints = count;
+	    return -(leaf+1);
+	}
+
+	if (node == 0){
+	    /* new internal node */
+	    if (!select_vantage_points(work, list, sv1_pos, sv2_pos, lvl)){
+		error = MVP_VPNOSELECT;
+		return 0;
+	    }
+	    std::vector<float> dist;
+	    if (!distances(work, list, work[list[sv1_pos]].point, dist)){
+		error = MVP_NOSV1RANGE;
+		return 0;
+	    }
+	    set_path(work, list, dist, lvl);
+
+	    size_t n = internals_.size();
+	    internals_.push_back(Internal());
+	    Internal &in = internals_[n];
+	    in.sv1 = work[list[sv1_pos]];
+	    in.sv2 = work[list[sv2_pos]];
+	    std::fill(in.M2, in.M2 + BF*(BF-1), 0.0f);
+	    std::fill(in.child, in.child + BF*BF, 0);
+	    find_splits(dist, in.M1);
+
+	    std::vector<uint32_t> bins[BF];
+	    sort_points(list, sv1_pos, sv2_pos, dist, in.M1, bins);
+	    for (int i = 0; i < BF; i++){
+		/* with many equal distances some bins can be empty */
+		if (!bins[i].empty()) add_bin(work, n, i, bins[i], true, error, lvl);
+	    }
+	    return (int32_t)n + 1;
+	}
+
+	if (is_leaf(node)){
+	    int32_t leaf = (int32_t)node_index(node);
+	    if (leaves_[leaf].nbpoints + list.size() <= leafcap_){
+		/* add points into leaf - plenty of room */
+		std::vector<float> d1, d2;
+		if (!distances(work, list, leaves_[leaf].sv1.point, d1)){
+		    error = MVP_NOSV1RANGE;
+		    return node;
+		}
+		set_path(work, list, d1, lvl);
+		bool new_sv2 = !leaves_[leaf].has_sv2;
+		const Point &sv2 = (new_sv2) ? work[list[0]].point : leaves_[leaf].sv2.point;
+		if (!distances(work, list, sv2, d2)){
+		    error = MVP_NOSV2RANGE;
+		    return node;
+		}
+		set_path(work, list, d2, lvl+1);
+
+		Leaf &l = leaves_[leaf];
+		size_t pos = 0;
+		if (new_sv2){
+		    l.sv2 = work[list[0]];
+		    l.has_sv2 = true;
+		    pos = 1;
+		}
+		for (; pos < list.size(); pos++){
+		    leaf_set_point(leaf, l.nbpoints++, work[list[pos]], d1[pos], d2[pos]);
+		}
+		return node;
+	    }
+
+	    /* not enough room in the leaf - build a node from all its points */
+	    const Leaf &l = leaves_[leaf];
+	    std::vector<uint32_t> all;
+	    all.reserve(l.nbpoints + list.size() + 2);
+	    all.push_back((uint32_t)work.size());
+	    work.push_back(l.sv1);
+	    if (l.has_sv2){
+		all.push_back((uint32_t)work.size());
+		work.push_back(l.sv2);
+	    }
+	    for (unsigned int i = 0; i < l.nbpoints; i++){
+		all.push_back((uint32_t)work.size());
+		work.push_back(leaf_entry(leaf, i));
+	    }
+	    all.insert(all.end(), list.begin(), list.end());
+	    free_leaves_.push_back(leaf);
+	    return add_node(work, 0, all, error, lvl);
+	}
+
+	/* internal node - route the points down to its children */
+	size_t n = node_index(node);
+	std::vector<float> dist;
+	if (!distances(work, list, internals_[n].sv1.point, dist)){
+	    error = MVP_NOSV1RANGE;
+	    return node;
+	}
+	set_path(work, list, dist, lvl);
+
+	std::vector<uint32_t> bins[BF];
+	sort_points(list, -1, -1, dist, internals_[n].M1, bins);
+	for (int i = 0; i < BF && error == MVP_SUCCESS; i++){
+	    if (!bins[i].empty()) add_bin(work, n, i, bins[i], false, error, lvl);
+	}
+	return node;
+    }
+
+    /* range search - mirrors _mvptree_retrieve() */
+
+    static const unsigned int CHUNK = 256;    /* leaf points filtered at a time */
+
+    /* gathers the results of retrieve(), up to knearest of them */
+    struct Collect {
+	std::vector<Result> &results;
+	size_t knearest;
+	bool operator()(const Result &r){
+	    results.push_back(r);
+	    return results.size() < knearest;
+	}
+    };
+
+    /* hands a point found to hit - MVP_KNEARESTCAP if it stops the search */
+    template <class Hit>
+    MVPError add_result(Hit &hit, const Point *point, uint32_t id, float d) const {
+	Result r = { point, &ids_[id], d };
+	return hit(r) ? MVP_SUCCESS : MVP_KNEARESTCAP;
+    }
+
+    template <class Hit>
+    MVPError retrieve_node(int32_t node, const Point &target, float radius, Hit &hit,\
+                           float *path, int lvl) const {
+	MVPError err = MVP_SUCCESS;
+	if (node == 0) return err;
+
+	if (is_leaf(node)){
+	    int32_t leaf = (int32_t)node_index(node);
+	    const Leaf &l = leaves_[leaf];
+	    float d1 = dist_(target, l.sv1.point);
+	    if (detail::bad_distance(d1)) return MVP_BADDISTVAL;
+	    if (lvl < PathLen) path[lvl] = d1;
+	    if (d1 <= radius && active_[l.sv1.id]){
+		err = add_result(hit, &l.sv1.point, l.sv1.id, d1);
+		if (err != MVP_SUCCESS) return err;
+	    }
+	    if (!l.has_sv2) return err;
+
+	    float d2 = dist_(target, l.sv2.point);
+	    if (detail::bad_distance(d2)) return MVP_BADDISTVAL;
+	    if (d2 <= radius && active_[l.sv2.id]){
+		err = add_result(hit, &l.sv2.point, l.sv2.id, d2);
+		if (err != MVP_SUCCESS) return err;
+	    }
+	    if (lvl+1 < PathLen) path[lvl+1] = d2;
+	    int endpath = (lvl+1 < PathLen) ? lvl+1 : PathLen;
+
+	    /* filter points before checking, a chunk at a time */
+	    unsigned char keep[CHUNK];
+	    const float *paths = leaf_paths(leaf);
+	    size_t base = slot(leaf, 0);
+	    for (unsigned int first = 0, n; first < l.nbpoints; first += n){
+		n = (l.nbpoints - first < CHUNK) ? l.nbpoints - first : CHUNK;
+		if (detail::leaf_filter(&d1_[base + first], &d2_[base + first],\
+                                        (paths) ? paths + first : NULL, leafcap_, path,\
+                                        endpath, n, d1, d2, radius, keep) == 0){
+		    continue;
+		}
+		for (unsigned int i = 0; i < n; i++){
+		    size_t s = base + first + i;
+		    if (!keep[i] || !active_[pids_[s]]) continue;
+		    float d = dist_(target, points_[s]);
+		    if (detail::bad_distance(d)) return MVP_BADDISTVAL;
+		    if (d <= radius){
+			err = add_result(hit, &points_[s], pids_[s], d);
+			if (err != MVP_SUCCESS) return err;
+		    }
+		}
+	    }
+	    return err;
+	}
+
+	const Internal &in = internals_[node_index(node)];
+	const int lengthM1 = BF-1;
+	float d1 = dist_(target, in.sv1.point);
+	if (detail::bad_distance(d1)) return MVP_BADDISTVAL;
+	if (d1 <= radius && active_[in.sv1.id]){
+	    err = add_result(hit, &in.sv1.point, in.sv1.id, d1);
+	    if (err != MVP_SUCCESS) return err;
+	}
+	if (lvl < PathLen) path[lvl] = d1;
+	float d2 = dist_(target, in.sv2.point);
+	if (detail::bad_distance(d2)) return MVP_BADDISTVAL;
+	if (d2 <= radius && active_[in.sv2.id]){
+	    err = add_result(hit, &in.sv2.point, in.sv2.id, d2);
+	    if (err != MVP_SUCCESS) return err;
+	}
+	if (lvl+1 < PathLen) path[lvl+1] = d2;
+
+	/* bin i holds M1[i-1] < d <= M1[i], the last bin d > M1[lengthM1-1] */
+	for (int i = 0; i < BF; i++){
+	    if (i < lengthM1 && !(d1 - radius <= in.M1[i])) continue;
+	    if (i == lengthM1 && !(d1 + radius >= in.M1[lengthM1-1])) continue;
+	    const float *M2 = in.M2 + i*lengthM1;
+	    for (int j = 0; j < BF; j++){
+		if (j < lengthM1 && !(d2 - radius <= M2[j])) continue;
+		if (j == lengthM1 && !(d2 + radius >= M2[lengthM1-1])) continue;
+		err = retrieve_node(in.child[i*BF+j], target, radius, hit, path, lvl+2);
+		if (err != MVP_SUCCESS) return err;
+	    }
+	}
+	return err;
+    }
+
+    /* k nearest search - mirrors _mvptree_knearest(). The results are a max heap
+       on distance until the search is done. */
+
+    struct KnnNode {
+	float bound;
+	int32_t node;
+	int lvl;
+	int path;
+	KnnNode(float b, int32_t n, int l, int p) : bound(b), node(n), lvl(l), path(p) {}
+    };
+
+    struct KnnPath {
+	float d1, d2;
+	int parent;
+    };
+
+    struct Knn {
+	std::vector<Result> &results;
+	size_t k;
+	float radius;
+	std::vector<KnnNode> queue;
+	std::vector<KnnPath> paths;
+	float path[PathLen + 1];
+	Knn(std::vector<Result> &r, size_t knearest, float rad) : results(r), k(knearest), radius(rad) {}
+    };
+
+    static bool farther_node(const KnnNode &a, const KnnNode &b){ return a.bound > b.bound; }
+    static bool nearer_result(const Result &a, const Result &b){ return a.distance < b.distance; }
+
+    void knn_add_result(Knn &q, const Point *point, uint32_t id, float d) const {
+	if (d > q.radius) return;
+	if (q.results.size() == q.k){
+	    if (d >= q.results.front().distance) return;
+	    std::pop_heap(q.results.begin(), q.results.end(), nearer_result);
+	    q.results.pop_back();
+	}
+	Result r = { point, &ids_[id], d };
+	q.results.push_back(r);
+	std::push_heap(q.results.begin(), q.results.end(), nearer_result);
+	if (q.results.size() == q.k) q.radius = q.results.front().distance;
+    }
+
+    static void knn_push_node(Knn &q, int32_t node, float bound, int lvl, int path){
+	if (node == 0 || bound > q.radius) return;
+	q.queue.push_back(KnnNode(bound, node, lvl, path));
+	std::push_heap(q.queue.begin(), q.queue.end(), farther_node);
+    }
+
+    /* lower bound on |d - x| for x in bin i, bin i holds M[i-1] < x <= M[i] */
+    static float bin_bound(float d, const float *M, int i){
+	float lo = (i > 0) ? M[i-1] : 0.0f;
+	if (d < lo) return lo - d;
+	if (i < BF-1 && d > M[i]) return d - M[i];
+	return 0.0f;
+    }
+
+    MVPError knearest_node(Knn &q, const KnnNode &entry, const Point &target) const {
+	int lvl = entry.lvl;
+
+	if (is_leaf(entry.node)){
+	    int32_t leaf = (int32_t)node_index(entry.node);
+	    const Leaf &l = leaves_[leaf];
+	    float d1 = dist_(target, l.sv1.point);
+	    if (detail::bad_distance(d1)) return MVP_BADDISTVAL;
+	    if (active_[l.sv1.id]) knn_add_result(q, &l.sv1.point, l.sv1.id, d1);
+	    if (!l.has_sv2) return MVP_SUCCESS;
+
+	    float d2 = dist_(target, l.sv2.point);
+	    if (detail::bad_distance(d2)) return MVP_BADDISTVAL;
+	    if (active_[l.sv2.id]) knn_add_result(q, &l.sv2.point, l.sv2.id, d2);
+
+	    /* restore the target's path of distances down to this leaf */
+	    int endpath = (lvl < PathLen) ? lvl : PathLen;
+	    for (int index = entry.path, pos = lvl - 2; index >= 0; pos -= 2){
+		if (pos < PathLen) q.path[pos] = q.paths[index].d1;
+		if (pos+1 < PathLen) q.path[pos+1] = q.paths[index].d2;
+		index = q.paths[index].parent;
+	    }
+
+	    /* filter points against the radius as it stands for each chunk */
+	    unsigned char keep[CHUNK];
+	    const float *paths = leaf_paths(leaf);
+	    size_t base = slot(leaf, 0);
+	    for (unsigned int first = 0, n; first < l.nbpoints; first += n){
+		n = (l.nbpoints - first < CHUNK) ? l.nbpoints - first : CHUNK;
+		if (detail::leaf_filter(&d1_[base + first], &d2_[base + first],\
+                                        (paths) ? paths + first : NULL, leafcap_, q.path,\
+                                        endpath, n, d1, d2, q.radius, keep) == 0){
+		    continue;
+		}
+		for (unsigned int i = 0; i < n; i++){
+		    size_t s = base + first + i;
+		    if (!keep[i] || !active_[pids_[s]]) continue;
+		    float d = dist_(target, points_[s]);
+		    if (detail::bad_distance(d)) return MVP_BADDISTVAL;
+		    knn_add_result(q, &points_[s], pids_[s], d);
+		}
+	    }
+	    return MVP_SUCCESS;
+	}
+
+	const Internal &in = internals_[node_index(entry.node)];
+	float d1 = dist_(target, in.sv1.point);
+	if (detail::bad_distance(d1)) return MVP_BADDISTVAL;
+	if (active_[in.sv1.id]) knn_add_result(q, &in.sv1.point, in.sv1.id, d1);
+	float d2 = dist_(target, in.sv2.point);
+	if (detail::bad_distance(d2)) return MVP_BADDISTVAL;
+	if (active_[in.sv2.id]) knn_add_result(q, &in.sv2.point, in.sv2.id, d2);
+
+	KnnPath p = { d1, d2, entry.path };
+	int path = (int)q.paths.size();
+	q.paths.push_back(p);
+
+	for (int i = 0; i < BF; i++){
+	    float b1 = bin_bound(d1, in.M1, i);
+	    if (b1 < entry.bound) b1 = entry.bound;
+	    if (b1 > q.radius) continue;
+	    for (int j = 0; j < BF; j++){
+		float b2 = bin_bound(d2, in.M2 + i*(BF-1), j);
+		if (b2 < b1) b2 = b1;
+		knn_push_node(q, in.child[i*BF+j], b2, lvl+2, path);
+	    }
+	}
+	return MVP_SUCCESS;
+    }
+
+    /* file output - mirrors mvptree_write(), one buffered pass front to back */
+
+    struct Writer {
+	FILE *file;
+	std::vector<char> buf;
+	size_t len;
+	int64_t pos;           /* file offset of the next record */
+	MVPError error;
+
+	Writer() : file(NULL), buf(1 << 20), len(0), pos(0), error(MVP_SUCCESS) {}
+
+	void flush(){
+	    if (error == MVP_SUCCESS && len > 0 && fwrite(&buf[0], len, 1, file) != 1){
+		error = MVP_NOWRITE;
+	    }
+	    len = 0;
+	}
+
+	/* room for a record of nbytes, zeroed - NULL on error */
+	char* reserve(size_t nbytes){
+	    if (error != MVP_SUCCESS) return NULL;
+	    if (len + nbytes > buf.size()){
+		flush();
+		if (nbytes > buf.size()) buf.resize(nbytes);
+		if (error != MVP_SUCCESS) return NULL;
+	    }
+	    char *record = &buf[len];
+	    memset(record, 0, nbytes);
+	    len += nbytes;
+	    pos += nbytes;
+	    return record;
+	}
+    };
+
+    static void set_ref(char *record, int64_t pos, int64_t start, int64_t target){
+	int64_t rel = (target) ? target - start : 0;
+	memcpy(&record[pos], &rel, sizeof(int64_t));
+    }
+
+    size_t idlen(uint32_t id) const {
+	size_t n = strlen(ids_[id].c_str());
+	return (n > UINT16_MAX) ? UINT16_MAX : n;
+    }
+
+    int64_t dp_record_size(uint32_t id) const {
+	return detail::DP_HEADER + detail::align8(PathLen*sizeof(float)) +\
+	    detail::align8(sizeof(Point)) + detail::align8(idlen(id) + 1);
+    }
+
+    /* write a datapoint record, whose path[j] is path[j*stride] - returns its offset */
+    int64_t write_datapoint(Writer &w, const Point &point, uint32_t id, const float *path,\
+                            size_t stride) const {
+	int64_t pathsize = detail::align8(PathLen*sizeof(float));
+	int64_t datasize = detail::align8(sizeof(Point));
+	int64_t start = w.pos;
+	char *buf = w.reserve(dp_record_size(id));
+	if (!buf) return 0;
+
+	uint32_t header[2] = { (uint32_t)dp_record_size(id), point_traits<Point>::datalen };
+	uint8_t active = active_[id];
+	uint8_t type = point_traits<Point>::type;
+	uint16_t idlength = (uint16_t)idlen(id);
+	memcpy(&buf[0] , header   , sizeof(header));
+	memcpy(&buf[8] , &active  , 1);
+	memcpy(&buf[9] , &type    , 1);
+	memcpy(&buf[10], &idlength, sizeof(uint16_t));
+	for (int j = 0; j < PathLen; j++){
+	    memcpy(&buf[detail::DP_HEADER + j*sizeof(float)], &path[j*stride], sizeof(float));
+	}
+	memcpy(&buf[detail::DP_HEADER + pathsize], &point, sizeof(Point));
+	memcpy(&buf[detail::DP_HEADER + pathsize + datasize], ids_[id].data(), idlength);
+	return start;
+    }
+
+    int64_t write_node(Writer &w, int32_t node) const {
+	if (node == 0) return 0;
+	int64_t start;
+
+	if (is_leaf(node)){
+	    int32_t leaf = (int32_t)node_index(node);
+	    const Leaf &l = leaves_[leaf];
+	    uint32_t header[2] = { LEAF_NODE, l.nbpoints };
+	    size_t base = slot(leaf, 0), colsize = l.nbpoints*sizeof(float);
+	    int64_t refs = detail::NODE_HEADER + detail::align8((2 + PathLen)*colsize);
+	    int64_t size = refs + l.nbpoints*sizeof(int64_t);
+	    start = w.pos;
+	    char *record = w.reserve(size);
+	    if (!record) return 0;
+
+	    memcpy(&record[0], header, sizeof(header));
+	    memcpy(&record[detail::NODE_HEADER], &d1_[base], colsize);
+	    memcpy(&record[detail::NODE_HEADER + colsize], &d2_[base], colsize);
+	    for (int j = 0; j < PathLen; j++){
+		memcpy(&record[detail::NODE_HEADER + (2+j)*colsize], leaf_paths(leaf) + j*leafcap_,\
+                       colsize);
+	    }
+
+	    /* the datapoints follow the record */
+	    int64_t next = start + size;
+	    set_ref(record, 8, start, next);
+	    next += dp_record_size(l.sv1.id);
+	    set_ref(record, 16, start, (l.has_sv2) ? next : 0);
+	    if (l.has_sv2) next += dp_record_size(l.sv2.id);
+	    for (unsigned int i = 0; i < l.nbpoints; i++){
+		set_ref(record, refs + i*sizeof(int64_t), start, next);
+		next += dp_record_size(pids_[base + i]);
+	    }
+
+	    write_datapoint(w, l.sv1.point, l.sv1.id, l.sv1.path.data(), 1);
+	    if (l.has_sv2) write_datapoint(w, l.sv2.point, l.sv2.id, l.sv2.path.data(), 1);
+	    for (unsigned int i = 0; i < l.nbpoints; i++){
+		write_datapoint(w, points_[base + i], pids_[base + i],\
+                                (PathLen > 0) ? leaf_paths(leaf) + i : NULL, leafcap_);
+	    }
+	    return start;
+	}
+
+	const Internal &in = internals_[node_index(node)];
+	const int lengthM1 = BF-1, lengthM2 = BF*(BF-1), fanout = BF*BF;
+	int64_t child[BF*BF];
+	int64_t sv1 = write_datapoint(w, in.sv1.point, in.sv1.id, in.sv1.path.data(), 1);
+	int64_t sv2 = write_datapoint(w, in.sv2.point, in.sv2.id, in.sv2.path.data(), 1);
+	for (int i = 0; i < fanout; i++){
+	    child[i] = write_node(w, in.child[i]);
+	}
+
+	/* the record follows the subtree */
+	uint32_t header[2] = { INTERNAL_NODE, 0 };
+	int64_t refs = detail::NODE_HEADER + detail::align8((lengthM1 + lengthM2)*sizeof(float));
+	start = w.pos;
+	char *record = w.reserve(refs + fanout*sizeof(int64_t));
+	if (!record) return 0;
+	memcpy(&record[0], header, sizeof(header));
+	memcpy(&record[detail::NODE_HEADER], in.M1, sizeof(in.M1));
+	memcpy(&record[detail::NODE_HEADER + sizeof(in.M1)], in.M2, sizeof(in.M2));
+	set_ref(record, 8 , start, sv1);
+	set_ref(record, 16, start, sv2);
+	for (int i = 0; i < fanout; i++){
+	    set_ref(record, refs + i*sizeof(int64_t), start, child[i]);
+	}
+	return start;
+    }
+
+    /* file input - a tree file read into memory and copied out record by record */
+
+    struct Reader {
+	const std::vector<char> &buf;
+	MVPError error;
+
+	explicit Reader(const std::vector<char> &b) : buf(b), error(MVP_SUCCESS) {}
+
+	bool fits(int64_t pos, int64_t nbytes) const {
+	    return pos >= 0 && nbytes >= 0 && pos <= (int64_t)buf.size() &&\
+		nbytes <= (int64_t)buf.size() - pos;
+	}
+
+	/* the record a reference at pos in the record at start refers to, 0 for none */
+	int64_t ref(int64_t start, int64_t pos){
+	    int64_t rel;
+	    memcpy(&rel, &buf[start + pos], sizeof(int64_t));
+	    if (rel == 0) return 0;
+	    if (!fits(start + rel, detail::NODE_HEADER)){
+		error = MVP_BADFORMAT;
+		return 0;
+	    }
+	    return start + rel;
+	}
+    };
+
+    bool read_datapoint(Reader &r, int64_t pos, Entry &e){
+	int64_t pathsize = detail::align8(PathLen*sizeof(float));
+	int64_t datasize = detail::align8(sizeof(Point));
+	uint32_t header[2];
+	uint16_t idlength;
+	if (pos == 0 || !r.fits(pos, detail::DP_HEADER)){
+	    r.error = MVP_BADFORMAT;
+	    return false;
+	}
+	const char *record = &r.buf[pos];
+	memcpy(header, &record[0], sizeof(header));
+	memcpy(&idlength, &record[10], sizeof(uint16_t));
+	if ((uint8_t)record[9] != point_traits<Point>::type ||\
+	    header[1] != point_traits<Point>::datalen){
+	    r.error = MVP_TYPEMISMATCH;
+	    return false;
+	}
+	if (header[0] < detail::DP_HEADER + pathsize + datasize + idlength || !r.fits(pos, header[0])){
+	    r.error = MVP_BADFORMAT;
+	    return false;
+	}
+	for (int j = 0; j < PathLen; j++){
+	    memcpy(&e.path[j], &record[detail::DP_HEADER + j*sizeof(float)], sizeof(float));
+	}
+	memcpy(&e.point, &record[detail::DP_HEADER + pathsize], sizeof(Point));
+	e.id = (uint32_t)ids_.size();
+	ids_.push_back(std::string(&record[detail::DP_HEADER + pathsize + datasize], idlength));
+	active_.push_back(record[8] != 0);
+	return true;
+    }
+
+    int32_t read_node(Reader &r, int64_t pos){
+	if (pos == 0 || r.error != MVP_SUCCESS) return 0;
+	uint32_t header[2];
+	memcpy(header, &r.buf[pos], sizeof(header));
+
+	if (header[0] == LEAF_NODE){
+	    uint32_t nbpoints = header[1];
+	    size_t colsize = nbpoints*sizeof(float);
+	    int64_t refs = detail::NODE_HEADER + detail::align8((2 + PathLen)*colsize);
+	    if (nbpoints > leafcap_ || !r.fits(pos, refs + nbpoints*sizeof(int64_t))){
+		r.error = MVP_BADFORMAT;
+		return 0;
+	    }
+	    int32_t leaf = new_leaf();
+	    Entry e;
+	    if (!read_datapoint(r, r.ref(pos, 8), e)) return 0;
+	    leaves_[leaf].sv1 = e;
+	    int64_t sv2 = r.ref(pos, 16);
+	    if (sv2){
+		if (!read_datapoint(r, sv2, e)) return 0;
+		leaves_[leaf].sv2 = e;
+		leaves_[leaf].has_sv2 = true;
+	    }
+	    const char *record = &r.buf[pos];
+	    for (unsigned int i = 0; i < nbpoints; i++){
+		float d1, d2;
+		if (!read_datapoint(r, r.ref(pos, refs + i*sizeof(int64_t)), e)) return 0;
+		memcpy(&d1, &record[detail::NODE_HEADER + i*sizeof(float)], sizeof(float));
+		memcpy(&d2, &record[detail::NODE_HEADER + colsize + i*sizeof(float)], sizeof(float));
+		for (int j = 0; j < PathLen; j++){
+		    memcpy(&e.path[j], &record[detail::NODE_HEADER + (2+j)*colsize + i*sizeof(float)],\
+                           sizeof(float));
+		}
+		leaf_set_point(leaf, i, e, d1, d2);
+	    }
+	    leaves_[leaf].nbpoints = nbpoints;
+	    return -(leaf+1);
+	}
+	if (header[0] != INTERNAL_NODE){
+	    r.error = MVP_UNRECOGNIZED;
+	    return 0;
+	}
+
+	int64_t refs = detail::NODE_HEADER + detail::align8((BF-1)*(BF+1)*sizeof(float));
+	if (!r.fits(pos, refs + BF*BF*sizeof(int64_t))){
+	    r.error = MVP_BADFORMAT;
+	    return 0;
+	}
+	Internal in;
+	if (!read_datapoint(r, r.ref(pos, 8), in.sv1) || !read_datapoint(r, r.ref(pos, 16), in.sv2)){
+	    return 0;
+	}
+	memcpy(in.M1, &r.buf[pos + detail::NODE_HEADER], sizeof(in.M1));
+	memcpy(in.M2, &r.buf[pos + detail::NODE_HEADER + sizeof(in.M1)], sizeof(in.M2));
+	size_t n = internals_.size();
+	internals_.push_back(in);
+	for (int i = 0; i < BF*BF; i++){
+	    int32_t child = read_node(r, r.ref(pos, refs + i*sizeof(int64_t)));
+	    internals_[n].child[i] = child;
+	}
+	return (int32_t)n + 1;
+    }
+};
+
+} /* namespace mvp */
+
+#endif /* _MVPTREE_HPP */
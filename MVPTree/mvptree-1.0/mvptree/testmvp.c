@@ -28,6 +28,8 @@
 #include <math.h>
 #include <time.h>
 #include <assert.h>
+#include <float.h>
+#include <limits.h>
 #include "mvptree.h"
 
 #define MVP_BRANCHFACTOR 2
@@ -186,6 +188,43 @@ MVPDP** generate_cluster(unsigned int nbpoints, unsigned int dplength, int var,
     return points;
 }
 
+/* number of points found by range and k nearest searches for every point in the tree, */
+/* checking that the two agree and that none of them has the id                        */
+static unsigned int retrieve_all(MVPTree *tree, MVPDP *target, unsigned int nbpoints,\
+                                                                  const char *id){
+    MVPError err;
+    unsigned int i, nbresults, nbknearest;
+    MVPDP **results = mvptree_retrieve(tree, target, nbpoints+1, FLT_MAX, &nbresults, &err);
+    assert(results && err == MVP_SUCCESS);
+    for (i = 0;i < nbresults;i++){
+	assert(strcmp(results[i]->id, id));
+    }
+    free(results);
+    results = mvptree_retrieve_knearest(tree, target, nbpoints+1, FLT_MAX, &nbknearest, &err);
+    assert(results && err == MVP_SUCCESS && nbknearest == nbresults);
+    for (i = 0;i < nbknearest;i++){
+	assert(strcmp(results[i]->id, id));
+    }
+    free(results);
+    return nbresults;
+}
+
+/* counts the points a range search visits, checking their distances, */
+/* and stops the search after max of them                             */
+typedef struct visited_t {
+    MVPDP *target;
+    CmpFunc distance;
+    float radius;
+    unsigned int nb, max;
+} Visited;
+
+static int count_visit(MVPDP *point, float distance, void *arg){
+    Visited *visited = (Visited*)arg;
+    assert(distance <= visited->radius);
+    assert(distance == visited->distance(visited->target, point));
+    return (++visited->nb < visited->max);
+}
+
 int main(int argc, char **argv){
 
     const unsigned int nbpoints = 100;
@@ -247,6 +286,196 @@ int main(int argc, char **argv){
     fprintf(stdout,"------------------------------------------------\n\n");
     free(results);
 
+    /* k nearest, checked against a linear scan of all points */
+    const unsigned int k = 5;
+    float *all = (float*)malloc((nbpoints+nbcluster1)*sizeof(float));
+    assert(all);
+    for (i=0;i<nbpoints;i++) all[i] = distance_func(cluster1[0], pointlist[i]);
+    for (i=0;i<nbcluster1;i++) all[nbpoints+i] = distance_func(cluster1[0], cluster1[i]);
+    unsigned int j;
+    for (i=0;i<k;i++){
+	for (j=i+1;j<nbpoints+nbcluster1;j++){
+	    if (all[j] < all[i]){
+		float tmp = all[i];
+		all[i] = all[j];
+		all[j] = tmp;
+	    }
+	}
+    }
+
+    nbcalcs = 0;
+    results = mvptree_retrieve_knearest(tree, cluster1[0], k, FLT_MAX, &nbresults, &err);
+    assert(results && err == MVP_SUCCESS && nbresults == k);
+    fprintf(stdout,"------------------%u nearest (%llu calcs)---------\n",k,nbcalcs);
+    for (i = 0;i < nbresults;i++){
+	float d = distance_func(cluster1[0], results[i]);
+	fprintf(stdout,"(%d) %s %f\n", i, results[i]->id, d);
+	assert(d == all[i]);
+    }
+    fprintf(stdout,"------------------------------------------------\n\n");
+    free(results);
+    free(all);
+
+    /* the counts of a query agree with the calls of the distance function */
+    MVPQuery query;
+    if (!mvpquery_alloc(&query, tree)){
+	fprintf(stdout,"Unable to allocate query.\n");
+	return 1;
+    }
+    for (i = 0;i < 2;i++){
+	nbcalcs = 0;
+	results = (i == 0) ? mvptree_retrieve_r(tree, &query, cluster1[0], knearest, radius,\
+                                                &nbresults, &err) :\
+	    mvptree_retrieve_knearest_r(tree, &query, cluster1[0], k, FLT_MAX, &nbresults, &err);
+	assert(results && err == MVP_SUCCESS);
+	free(results);
+	assert(query.stats.nbdistances == nbcalcs);
+	assert(query.stats.nbleaves > 0);
+	assert(query.stats.nbfiltered_vp + query.stats.nbfiltered_path +\
+	       query.stats.nbcompared <= query.stats.nbleafpoints);
+    }
+    fprintf(stdout,"%lu distances, %lu internal nodes, %lu leaves, %lu of %lu leaf points compared\n",\
+	    query.stats.nbdistances, query.stats.nbinternals, query.stats.nbleaves,\
+	    query.stats.nbcompared, query.stats.nbleafpoints);
+
+    /* a range search streamed to a callback finds the same points, and stops when told */
+    results = mvptree_retrieve(tree, cluster1[0], nbpoints+nbcluster1, radius, &nbresults, &err);
+    assert(results && err == MVP_SUCCESS && nbresults > 1);
+    free(results);
+    Visited visited = { cluster1[0], distance_func, radius, 0, UINT_MAX };
+    err = mvptree_retrieve_visit(tree, &query, cluster1[0], radius, count_visit, &visited);
+    assert(err == MVP_SUCCESS);
+    assert(visited.nb == nbresults);
+    visited.nb = 0;
+    visited.max = 1;
+    err = mvptree_retrieve_visit(tree, &query, cluster1[0], radius, count_visit, &visited);
+    assert(err == MVP_SUCCESS);
+    assert(visited.nb == 1);
+    fprintf(stdout,"range search visits the %u points found by mvptree_retrieve.\n", nbresults);
+    mvpquery_clear(&query);
+
+    /* batch retrieve for every point of the cluster, checked against single queries */
+    MVPDP ***batch_results = (MVPDP***)malloc(nbcluster1*sizeof(MVPDP**));
+    unsigned int *batch_nbresults = (unsigned int*)malloc(nbcluster1*sizeof(unsigned int));
+    MVPError *batch_errors = (MVPError*)malloc(nbcluster1*sizeof(MVPError));
+    assert(batch_results && batch_nbresults && batch_errors);
+    err = mvptree_retrieve_batch(tree, cluster1, nbcluster1, k, radius, 4,\
+                                 batch_results, batch_nbresults, batch_errors);
+    assert(err == MVP_SUCCESS);
+    for (i = 0;i < nbcluster1;i++){
+	assert(batch_errors[i] == MVP_SUCCESS);
+	results = mvptree_retrieve_knearest(tree, cluster1[i], k, radius, &nbresults, &err);
+	assert(results && err == MVP_SUCCESS && nbresults == batch_nbresults[i]);
+	for (j = 0;j < nbresults;j++){
+	    assert(distance_func(cluster1[i], results[j]) ==\
+                   distance_func(cluster1[i], batch_results[i][j]));
+	}
+	free(results);
+	free(batch_results[i]);
+    }
+    fprintf(stdout,"batch retrieve of %u targets matches single queries.\n\n", nbcluster1);
+    free(batch_results);
+    free(batch_nbresults);
+    free(batch_errors);
+
+    /* the tree searched in place in the file finds the same points */
+    MVPTree *mapped = mvptree_map(testfile, distance_func, &err);
+    assert(mapped && err == MVP_SUCCESS);
+    for (i = 0;i < nbcluster1;i++){
+	unsigned int nbmapped;
+	MVPDP **mapped_results;
+	results = mvptree_retrieve(tree, cluster1[i], knearest, radius, &nbresults, &err);
+	assert(results && err == MVP_SUCCESS);
+	mapped_results = mvptree_retrieve(mapped, cluster1[i], knearest, radius, &nbmapped, &err);
+	assert(mapped_results && err == MVP_SUCCESS && nbmapped == nbresults);
+	for (j = 0;j < nbresults;j++){
+	    assert(!strcmp(results[j]->id, mapped_results[j]->id));
+	}
+	free(results);
+	free(mapped_results);
+
+	results = mvptree_retrieve_knearest(tree, cluster1[i], k, FLT_MAX, &nbresults, &err);
+	assert(results && err == MVP_SUCCESS);
+	mapped_results = mvptree_retrieve_knearest(mapped, cluster1[i], k, FLT_MAX, &nbmapped, &err);
+	assert(mapped_results && err == MVP_SUCCESS && nbmapped == nbresults);
+	for (j = 0;j < nbresults;j++){
+	    assert(distance_func(cluster1[i], results[j]) ==\
+                   distance_func(cluster1[i], mapped_results[j]));
+	}
+	free(results);
+	free(mapped_results);
+    }
+    fprintf(stdout,"mapped tree matches the tree read from file.\n\n");
+    mvptree_clear(mapped, NULL);
+    free(mapped);
+
+    /* deleted points are left out of searches, also after the tree is written */
+    const unsigned int nbtotal = nbpoints + nbcluster1;
+    char id[32];
+    nbresults = retrieve_all(tree, cluster1[0], nbtotal, "");
+    assert(nbresults == nbtotal);
+    err = mvptree_delete(tree, "point1");
+    assert(err == MVP_SUCCESS);
+    err = mvptree_delete(tree, "point1");
+    assert(err == MVP_IDNOTFOUND);
+    nbresults = retrieve_all(tree, cluster1[0], nbtotal, "point1");
+    assert(nbresults == nbtotal-1);
+
+    err = mvptree_write(tree, testfile, 00755);
+    assert(err == MVP_SUCCESS);
+    mapped = mvptree_map(testfile, distance_func, &err);
+    assert(mapped && err == MVP_SUCCESS);
+    nbresults = retrieve_all(mapped, cluster1[0], nbtotal, "point1");
+    assert(nbresults == nbtotal-1);
+    mvptree_clear(mapped, NULL);
+    free(mapped);
+
+    /* compacting drops the deleted points from the tree */
+    for (i = 2;i <= nbpoints/2;i++){
+	snprintf(id, sizeof(id), "point%u", i);
+	err = mvptree_delete(tree, id);
+	assert(err == MVP_SUCCESS);
+    }
+    err = mvptree_compact(tree, 0.5f, free);
+    assert(err == MVP_SUCCESS);
+    nbresults = retrieve_all(tree, cluster1[0], nbtotal, "point2");
+    assert(nbresults == nbtotal-nbpoints/2);
+    err = mvptree_compact(tree, 1.0f, free);
+    assert(err == MVP_SUCCESS);
+    for (i = 1;i <= nbpoints/2;i++){
+	snprintf(id, sizeof(id), "point%u", i);
+	err = mvptree_delete(tree, id);
+	assert(err == MVP_IDNOTFOUND);
+    }
+    nbresults = retrieve_all(tree, cluster1[0], nbtotal, "");
+    assert(nbresults == nbtotal-nbpoints/2);
+    fprintf(stdout,"deleted points are left out of searches and compacted away.\n\n");
+
+    /* the nearest points over all the shards are the nearest points of the lot */
+    MVPDP **shardpoints = generate_uniform_points(nbpoints, dplength);
+    MVPShards *shards = mvpshards_alloc(NULL, distance_func, 3, MVP_SHARD_VANTAGE,\
+                                        MVP_BRANCHFACTOR, MVP_PATHLENGTH, MVP_LEAFCAP);
+    assert(shardpoints && shards);
+    err = mvpshards_add(shards, shardpoints, nbpoints);
+    assert(err == MVP_SUCCESS);
+    for (i = 0;i < nbcluster1;i++){
+	results = mvpshards_retrieve_knearest(shards, cluster1[i], k, FLT_MAX, &nbresults, &err);
+	assert(results && err == MVP_SUCCESS && nbresults == k);
+	for (j = 0;j < nbresults;j++){
+	    float d = distance_func(cluster1[i], results[j]);
+	    unsigned int m, nbcloser = 0;
+	    for (m = 0;m < nbpoints;m++){
+		if (distance_func(cluster1[i], shardpoints[m]) < d) nbcloser++;
+	    }
+	    assert(nbcloser <= j);
+	}
+	free(results);
+    }
+    fprintf(stdout,"%u shards find the nearest points.\n\n", shards->nbshards);
+    mvpshards_clear(shards, free);
+    free(shards);
+    free(shardpoints);
+
     mvptree_clear(tree, free);
     free(tree);
     free(pointlist);
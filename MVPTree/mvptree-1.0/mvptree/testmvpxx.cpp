@@ -0,0 +1,187 @@
+/*
+
+    MVPTree c library
+    Copyright (C) 2008-2009 Aetilius, Inc.
+    All rights reserved.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    D Grant Starkweather - dstarkweather@phash.org
+
+*/
+
+/* test of the C++ front-end in mvptree.hpp against the C library: the same
+   points make the same tree file, and each can load the other's files */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "mvptree.hpp"
+
+#define MVP_BRANCHFACTOR 2
+#define MVP_PATHLENGTH   5
+#define MVP_LEAFCAP     25
+
+typedef mvp::Tree<uint64_t, mvp::Hamming, MVP_BRANCHFACTOR, MVP_PATHLENGTH> HashTree;
+
+static uint64_t random_hash(){
+    uint64_t h = 0;
+    for (int i = 0; i < 4; i++){
+	h = (h << 16) ^ (uint64_t)(rand() & 0xffff);
+    }
+    return h;
+}
+
+static std::vector<char> file_contents(const char *filename){
+    std::vector<char> buf;
+    FILE *file = fopen(filename, "rb");
+    assert(file);
+    int c;
+    while ((c = fgetc(file)) != EOF) buf.push_back((char)c);
+    fclose(file);
+    return buf;
+}
+
+int main(int argc, char **argv){
+    const unsigned int nbpoints = 2000, nbbatches = 4, nbqueries = 100;
+    const char *filename = "testfilexx.mvp", *cfilename = "testfilexx_c.mvp";
+    srand(98);
+
+    /* uniform hashes, and a cluster of near duplicates of one of them */
+    std::vector<uint64_t> points(nbpoints);
+    std::vector<std::string> ids(nbpoints);
+    for (unsigned int i = 0; i < nbpoints; i++){
+	points[i] = (i % 4 == 0) ? points[0] ^ (1ULL << (rand() % 64)) : random_hash();
+	ids[i] = "point" + std::to_string(i);
+    }
+
+    MVPError err;
+    HashTree tree(MVP_LEAFCAP);
+    MVPTree *ctree = mvptree_alloc(NULL, mvp_hamming_distance, MVP_BRANCHFACTOR,\
+                                   MVP_PATHLENGTH, MVP_LEAFCAP);
+    assert(ctree);
+    for (unsigned int b = 0; b < nbbatches; b++){
+	unsigned int first = b*nbpoints/nbbatches, last = (b+1)*nbpoints/nbbatches;
+	std::vector<MVPDP*> dps;
+	for (unsigned int i = first; i < last; i++){
+	    MVPDP *dp = dp_alloc(MVP_UINT64ARRAY);
+	    assert(dp);
+	    dp->data = malloc(sizeof(uint64_t));
+	    memcpy(dp->data, &points[i], sizeof(uint64_t));
+	    dp->datalen = 1;
+	    dp->id = strdup(ids[i].c_str());
+	    dps.push_back(dp);
+	}
+	err = mvptree_add(ctree, &dps[0], dps.size());
+	assert(err == MVP_SUCCESS);
+	err = tree.add(&points[first], &ids[first], last - first);
+	assert(err == MVP_SUCCESS);
+    }
+    err = tree.erase("point3");
+    assert(err == MVP_SUCCESS);
+    err = mvptree_delete(ctree, "point3");
+    assert(err == MVP_SUCCESS);
+    err = tree.erase("nopoint");
+    assert(err == MVP_IDNOTFOUND);
+
+    /* nearest neighbors and range queries against brute force */
+    std::vector<HashTree::Result> results;
+    for (unsigned int q = 0; q < nbqueries; q++){
+	uint64_t target = (q % 2) ? points[0] ^ (1ULL << (rand() % 64)) : random_hash();
+	std::vector<float> dist;
+	for (unsigned int i = 0; i < nbpoints; i++){
+	    if (i != 3) dist.push_back(mvp::Hamming()(target, points[i]));
+	}
+	std::sort(dist.begin(), dist.end());
+
+	unsigned int k = 1 + rand() % 20;
+	err = tree.knearest(target, k, results);
+	assert(err == MVP_SUCCESS);
+	assert(results.size() == k);
+	for (unsigned int i = 0; i < k; i++){
+	    assert(results[i].distance == dist[i]);
+	    assert(results[i].distance == mvp::Hamming()(target, *results[i].point));
+	}
+
+	float radius = (float)(rand() % 16);
+	size_t within = std::upper_bound(dist.begin(), dist.end(), radius) - dist.begin();
+	err = tree.retrieve(target, radius, results);
+	assert(err == MVP_SUCCESS);
+	assert(results.size() == within);
+	if (within > 1){
+	    err = tree.retrieve(target, radius, results, within-1);
+	    assert(err == MVP_KNEARESTCAP);
+	    assert(results.size() == within-1);
+	}
+	size_t nbvisited = 0;
+	err = tree.visit(target, radius, [&](const HashTree::Result &r){
+		assert(r.distance <= radius);
+		return ++nbvisited < within;
+	    });
+	assert(err == MVP_SUCCESS);
+	assert(nbvisited == within);
+    }
+    fprintf(stdout,"C++ tree finds the nearest points.\n");
+
+    /* both write the same file */
+    err = tree.write(filename);
+    assert(err == MVP_SUCCESS);
+    err = mvptree_write(ctree, cfilename, 00755);
+    assert(err == MVP_SUCCESS);
+    assert(file_contents(filename) == file_contents(cfilename));
+    fprintf(stdout,"C++ tree file matches the C library's.\n");
+
+    /* the C library maps the C++ file, the C++ tree reads the C file */
+    MVPTree *mapped = mvptree_map(filename, mvp_hamming_distance, &err);
+    assert(err == MVP_SUCCESS && mapped);
+    HashTree loaded;
+    err = loaded.read(cfilename);
+    assert(err == MVP_SUCCESS);
+    assert(loaded.leafcap() == MVP_LEAFCAP);
+    for (unsigned int q = 0; q < nbqueries; q++){
+	uint64_t target = points[rand() % nbpoints];
+	MVPDP *dp = dp_alloc(MVP_UINT64ARRAY);
+	dp->data = &target;
+	dp->datalen = 1;
+	unsigned int nbresults;
+	MVPDP **cresults = mvptree_retrieve(mapped, dp, nbpoints, 8.0f, &nbresults, &err);
+	assert(err == MVP_SUCCESS);
+	err = loaded.retrieve(target, 8.0f, results);
+	assert(err == MVP_SUCCESS);
+	assert(results.size() == nbresults);
+	for (unsigned int i = 0; i < nbresults; i++){
+	    assert(*results[i].id == cresults[i]->id);
+	}
+	free(cresults);
+	free(dp);
+    }
+    fprintf(stdout,"C library and C++ tree load each other's files.\n");
+
+    err = loaded.read("nofile.mvp");
+    assert(err == MVP_FILENOTFOUND && loaded.size() == 0);
+
+    mvptree_clear(mapped, NULL);
+    free(mapped);
+    mvptree_clear(ctree, free);
+    free(ctree);
+    remove(filename);
+    remove(cfilename);
+
+    return 0;
+}
@@ -60,7 +60,9 @@ void SrAlgorithmQuickHull3D::findVisibleFacet(cVertex* furPoint,cFacet* f,FacetL
 			if( neighbor->mVisitFlag==FACET_NULL )
 			{
 				neighbor->mVisitFlag = FACET_VISITED;
-				ASSERT(plane.initPlane(neighbor->mVertex[0]->mPoint,neighbor->mVertex[1]->mPoint,neighbor->mVertex[2]->mPoint));
+				bool isPlane = plane.initPlane(neighbor->mVertex[0]->mPoint,neighbor->mVertex[1]->mPoint,neighbor->mVertex[2]->mPoint);
+				ASSERT(isPlane);
+				(void)isPlane;
 				if( plane.isOnPositiveSide(furPoint->mPoint) )
 				{
 
@@ -150,7 +152,9 @@ void SrAlgorithmQuickHull3D::determineOutsideSet(FacetList& facetList, VertexLis
 	cPlane plane;
 	for( facetIter = facetList.begin(); facetIter != facetList.end(); facetIter ++ )
 	{
-		ASSERT(plane.initPlane((*facetIter)->mVertex[0]->mPoint,(*facetIter)->mVertex[1]->mPoint,(*facetIter)->mVertex[2]->mPoint));
+		bool isPlane = plane.initPlane((*facetIter)->mVertex[0]->mPoint,(*facetIter)->mVertex[1]->mPoint,(*facetIter)->mVertex[2]->mPoint);
+		ASSERT(isPlane);
+		(void)isPlane;
 		for( vertexIter = allVertex.begin() ; vertexIter!=allVertex.end() ; )
 		{
 			if( plane.isOnPositiveSide((*vertexIter)->mPoint) )
@@ -317,7 +321,9 @@ bool SrAlgorithmQuickHull3D::initTetrahedron(VertexList& vertexList,FacetList& h
 		ptIndex3 = miny;
 	}
 	cPlane plane;
-	ASSERT(plane.initPlane((*ptIndex1)->mPoint,(*ptIndex2)->mPoint,(*ptIndex3)->mPoint));
+	bool isPlane = plane.initPlane((*ptIndex1)->mPoint,(*ptIndex2)->mPoint,(*ptIndex3)->mPoint);
+	ASSERT(isPlane);
+	(void)isPlane;
 
 	//Find the vertexes that have minimum and maximum distance from the plane.
 	float minDist = plane.distance((*vertexList.begin())->mPoint);
@@ -187,7 +187,9 @@ private:
 		{
 			ASSERT(mOutsideSet!=NULL);
 			cPlane plane;
-			ASSERT(plane.initPlane(mVertex[0]->mPoint,mVertex[1]->mPoint,mVertex[2]->mPoint));
+			bool isPlane = plane.initPlane(mVertex[0]->mPoint,mVertex[1]->mPoint,mVertex[2]->mPoint);
+			ASSERT(isPlane);
+			(void)isPlane;
 			VertexIterator iter = mOutsideSet->mVertexList.begin();
 			VertexIterator iterVertex;
 			float maxDist = 0.0f , dist;
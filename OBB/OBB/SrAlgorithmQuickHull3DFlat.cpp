@@ -0,0 +1,560 @@
+/************************************************************************
+\brief	Implementation of SrAlgorithmQuickHull3DFlat, see SrAlgorithmQuickHull3DFlat.h
+****************************************************************************/
+#include "SrVector3.h"
+#include "SrDataType.h"
+#include <assert.h>
+#include "SrAlgorithmQuickHull3DFlat.h"
+
+
+bool SrAlgorithmQuickHull3DFlat::collinear(const Point&p0, const Point& p1,const Point& p2)
+{
+	Vector normal = (p1 - p0).cross(p2 - p0);
+	double eps = 0.000001;
+
+	if( normal.magnitudeSquared()<eps )
+		return true;
+	return false;
+}
+
+bool SrAlgorithmQuickHull3DFlat::coplanar(const Point&p0, const Point& p1,const Point& p2,const Point& p3)
+{
+	SrVector3 normal = (p1 - p0).cross(p2 - p0);
+	float result = normal.dot(p3 - p0);
+	double eps = 0.000001;
+	if( abs(result)<eps )
+		return true;
+	return false;
+}
+
+int SrAlgorithmQuickHull3DFlat::allocateFacet(int v0, int v1, int v2)
+{
+	int index;
+	if( !mFreeFacets.empty() )
+	{
+		index = mFreeFacets.back();
+		mFreeFacets.pop_back();
+	}
+	else
+	{
+		index = (int)mFacets.size();
+		mFacets.resize(index+1);
+	}
+	cFacet& facet = mFacets[index];
+	facet.mVertex[0]	= v0;
+	facet.mVertex[1]	= v1;
+	facet.mVertex[2]	= v2;
+	facet.mNeighbors[0] = NONE;
+	facet.mNeighbors[1] = NONE;
+	facet.mNeighbors[2] = NONE;
+	//The same plane as cPlane::initPlane() of SrAlgorithmQuickHull3D gives.
+	const Point& p0 = mPoints[v0];
+	facet.mNormal		= (mPoints[v1] - p0).cross(mPoints[v2] - p0);
+	facet.mD			= -facet.mNormal.dot(p0);
+	facet.mOutsideHead	= NONE;
+	facet.mOutsideTail	= NONE;
+	facet.mPendSlot		= NONE;
+	facet.mVisitFlag	= VISIT_NULL;
+	return index;
+}
+
+void SrAlgorithmQuickHull3DFlat::deallocate(std::vector<int>& ftList)
+{
+	mFreeFacets.insert(mFreeFacets.end(),ftList.begin(),ftList.end());
+	ftList.clear();
+}
+
+int SrAlgorithmQuickHull3DFlat::furthestVertex(cFacet& f)
+{
+	ASSERT(f.mOutsideHead!=NONE);
+	float maxDist = 0.0f , dist;
+	int furthest = NONE, furthestPrev = NONE, prev = NONE, v;
+	for( v=f.mOutsideHead ; v!=NONE ; prev=v, v=mNext[v] )
+	{
+		dist = f.mNormal.dot(mPoints[v]) + f.mD;
+		if(maxDist < dist)
+		{
+			maxDist = dist;
+			furthest = v;
+			furthestPrev = prev;
+		}
+	}
+	ASSERT(furthest!=NONE);
+
+	//Take it out of the outside set.
+	if( furthestPrev==NONE )
+		f.mOutsideHead = mNext[furthest];
+	else
+		mNext[furthestPrev] = mNext[furthest];
+	if( f.mOutsideTail==furthest )
+		f.mOutsideTail = furthestPrev;
+	return furthest;
+}
+
+void SrAlgorithmQuickHull3DFlat::findVisibleFacet(int furPoint,int f)
+{
+	const Point& point = mPoints[furPoint];
+	mFacets[f].mVisitFlag = VISIT_VISITED;
+	mVisible.push_back(f);
+	size_t k;
+	int i;
+	for( k=0 ; k<mVisible.size() ; k++ )
+	{
+		int current = mVisible[k];
+		for( i=0 ; i<3 ; i++ )
+		{
+			int neighborIndex = mFacets[current].mNeighbors[i];
+			cFacet& neighbor = mFacets[neighborIndex];
+			if( neighbor.mVisitFlag==VISIT_NULL )
+			{
+				neighbor.mVisitFlag = VISIT_VISITED;
+				if( isOnPositiveSide(neighbor,point) )
+				{
+					mVisible.push_back(neighborIndex);
+					continue;
+				}
+				neighbor.mVisitFlag = VISIT_BORDER;
+			}
+			else if( neighbor.mVisitFlag!=VISIT_BORDER )
+			{
+				continue;
+			}
+			cEdge edge;
+			edge.neighbors[0]	= current;
+			edge.neighbors[1]	= neighborIndex;
+			edge.point[0]		= mFacets[current].mVertex[i];
+			edge.point[1]		= mFacets[current].mVertex[(i+1)%3];
+			edge.removed		= false;
+			insertBoundary(edge);
+		}
+	}
+}
+
+static inline unsigned int hashVertex(int vertex)
+{
+	return (unsigned int)vertex*2654435761u;
+}
+
+void SrAlgorithmQuickHull3DFlat::insertBoundary(const cEdge& edge)
+{
+	//Keep the table at most half full.
+	if( 2*(mBoundaryCount+1)>(int)mBoundaryTable.size() )
+	{
+		size_t size = mBoundaryTable.empty() ? 64 : 2*mBoundaryTable.size();
+		mBoundaryTable.assign(size,NONE);
+		size_t e;
+		for( e=0 ; e<mBoundary.size() ; e++ )
+		{
+			size_t slot = hashVertex(mBoundary[e].point[0])&(size-1);
+			while( mBoundaryTable[slot]!=NONE )
+				slot = (slot+1)&(size-1);
+			mBoundaryTable[slot] = (int)e;
+			mBoundary[e].slot = (int)slot;
+		}
+	}
+	size_t mask = mBoundaryTable.size()-1;
+	size_t slot = hashVertex(edge.point[0])&mask;
+	while( mBoundaryTable[slot]!=NONE )
+	{
+		//As std::map::insert(), an edge from the same point as one in the table is dropped.
+		if( mBoundary[mBoundaryTable[slot]].point[0]==edge.point[0] )
+			return;
+		slot = (slot+1)&mask;
+	}
+	mBoundaryTable[slot] = (int)mBoundary.size();
+	mBoundary.push_back(edge);
+	mBoundary.back().slot = (int)slot;
+	if( mBoundaryFirst==NONE || edge.point[0]<mBoundary[mBoundaryFirst].point[0] )
+		mBoundaryFirst = (int)mBoundary.size()-1;
+	mBoundaryCount ++;
+}
+
+int SrAlgorithmQuickHull3DFlat::findBoundary(int vertex) const
+{
+	size_t mask = mBoundaryTable.size()-1;
+	size_t slot = hashVertex(vertex)&mask;
+	while( mBoundaryTable[slot]!=NONE )
+	{
+		const cEdge& edge = mBoundary[mBoundaryTable[slot]];
+		if( edge.point[0]==vertex )
+			return edge.removed ? NONE : mBoundaryTable[slot];
+		slot = (slot+1)&mask;
+	}
+	return NONE;
+}
+
+void SrAlgorithmQuickHull3DFlat::constructNewFacets(int point)
+{
+	ASSERT(mBoundaryCount>=3);
+	//The boundary edges are closed. Start from the edge with the lowest point.
+	int current = mBoundaryFirst;
+	int remaining = mBoundaryCount;
+	int i;
+	do
+	{
+		cEdge& edge = mBoundary[current];
+		int facet = allocateFacet(point,edge.point[0],edge.point[1]);
+		cFacet& border = mFacets[edge.neighbors[1]];
+		//Clear the mVisitFlag. Because it's set VISIT_BORDER in findVisibleFacet().
+		border.mVisitFlag = VISIT_NULL;
+		//Update neighbor facet of the invisible facet , at least one edge of which belong to the boundary.
+		for( i=0 ; i<3 ; i++ )
+		{
+			if( border.mNeighbors[i] == edge.neighbors[0] )
+			{
+				border.mNeighbors[i] = facet;
+				break;
+			}
+		}
+		mFacets[facet].mNeighbors[1] = edge.neighbors[1];
+		mNewFacets.push_back(facet);
+		edge.removed = true;
+		remaining --;
+		current = findBoundary(edge.point[1]);
+	} while ( remaining>0 && current!=NONE );
+	ASSERT(remaining==0);
+
+	//Update the neighbor facets of new facets.
+	int lastFacet = mNewFacets.back();
+	size_t k;
+	for( k=0 ; k<mNewFacets.size() ; k++ )
+	{
+		int curFacet = mNewFacets[k];
+		mFacets[curFacet].mNeighbors[0] = lastFacet;
+		mFacets[lastFacet].mNeighbors[2] = curFacet;
+		lastFacet = curFacet;
+	}
+
+	//Empty the table for the next horizon.
+	for( k=0 ; k<mBoundary.size() ; k++ )
+		mBoundaryTable[mBoundary[k].slot] = NONE;
+	mBoundary.clear();
+	mBoundaryCount = 0;
+	mBoundaryFirst = NONE;
+}
+
+void SrAlgorithmQuickHull3DFlat::determineOutsideSet(int vertexHead)
+{
+	//Each vertex goes to the first new facet it is outside of, in the order of the vertexes,
+	//as in SrAlgorithmQuickHull3D, which takes them out of the list facet by facet.
+	int v, next;
+	size_t k;
+	for( v=vertexHead ; v!=NONE ; v=next )
+	{
+		next = mNext[v];
+		const Point& point = mPoints[v];
+		for( k=0 ; k<mNewFacets.size() ; k++ )
+		{
+			cFacet& facet = mFacets[mNewFacets[k]];
+			if( isOnPositiveSide(facet,point) )
+			{
+				mNext[v] = NONE;
+				if( facet.mOutsideHead==NONE )
+					facet.mOutsideHead = v;
+				else
+					mNext[facet.mOutsideTail] = v;
+				facet.mOutsideTail = v;
+				break;
+			}
+		}
+	}
+}
+
+void SrAlgorithmQuickHull3DFlat::updateFacetPendList(int& head)
+{
+	//If there exist new facets with nonempty outside vertex set, push them back into the pending facet list.
+	size_t k;
+	for( k=0 ; k<mNewFacets.size() ; k++ )
+	{
+		cFacet& facet = mFacets[mNewFacets[k]];
+		if( facet.mOutsideHead!=NONE )
+		{
+			facet.mPendSlot = (int)mPending.size();
+			mPending.push_back(mNewFacets[k]);
+		}
+		else
+		{
+			head = mNewFacets[k];
+		}
+	}
+	mNewFacets.clear();
+}
+
+int SrAlgorithmQuickHull3DFlat::gatherOutsideSet()
+{
+	int head = NONE, tail = NONE;
+	size_t k;
+	for( k=0 ; k<mVisible.size() ; k++ )
+	{
+		cFacet& facet = mFacets[mVisible[k]];
+		//Chain the outside set of the visible facet onto the gathered one.
+		if( facet.mOutsideHead!=NONE )
+		{
+			if( head==NONE )
+				head = facet.mOutsideHead;
+			else
+				mNext[tail] = facet.mOutsideHead;
+			tail = facet.mOutsideTail;
+			facet.mOutsideHead = facet.mOutsideTail = NONE;
+		}
+		//If some facets in the visible set exist in the pending list, remove them.
+		if( facet.mPendSlot!=NONE )
+		{
+			mPending[facet.mPendSlot] = NONE;
+			facet.mPendSlot = NONE;
+		}
+	}
+	return head;
+}
+
+void SrAlgorithmQuickHull3DFlat::quickHullScan(int& head)
+{
+	while( true )
+	{
+		while( mPendFront<mPending.size() && mPending[mPendFront]==NONE )
+			mPendFront ++;
+		if( mPendFront==mPending.size() )
+			break;
+		//Drop the removed facets from the front of the queue once they are the larger part of it.
+		if( mPendFront>=1024 && 2*mPendFront>=mPending.size() )
+		{
+			mPending.erase(mPending.begin(),mPending.begin()+mPendFront);
+			mPendFront = 0;
+			size_t k;
+			for( k=0 ; k<mPending.size() ; k++ )
+				if( mPending[k]!=NONE )
+					mFacets[mPending[k]].mPendSlot = (int)k;
+		}
+		ASSERT(mVisible.empty());
+		ASSERT(mNewFacets.empty());
+
+		int facet = mPending[mPendFront];
+
+		//There must be at least one vertex.
+		int furVertex = furthestVertex(mFacets[facet]);
+
+		//Find the visible facet set by the furthest vertex .
+		findVisibleFacet(furVertex,facet);
+		ASSERT(mBoundaryCount>0);
+
+		int visOutsideSet = gatherOutsideSet();
+
+		constructNewFacets(furVertex);
+		ASSERT(!mNewFacets.empty());
+
+		determineOutsideSet(visOutsideSet);
+		updateFacetPendList(head);
+
+		//Free the storage of the visible facet set.
+		deallocate(mVisible);
+	}
+}
+
+bool SrAlgorithmQuickHull3DFlat::initTetrahedron(int& vertexHead)
+{
+	int numVertex = (int)mPoints.size();
+	//Check weather or not all the vertexes are collinear.
+	int ptIndex1 = 0;
+	int ptIndex2 = 1;
+	int ptIndex3 = numVertex-1;
+	while( ptIndex2 != ptIndex3 && collinear(mPoints[ptIndex1],mPoints[ptIndex2],mPoints[ptIndex3]) )
+		ptIndex2 ++;
+	//All the vertexes are collinear.
+	if( ptIndex2 == ptIndex3 )
+		return false;
+
+	// Find the vertexes that have minimum value, maximum value in the x-dimension and minimum value
+	// in the y-dimension.
+	int minx = 0, maxx = 0, miny = 0;
+	int v;
+	for( v=0 ; v<numVertex ; v++ )
+	{
+		if( mPoints[v].x < mPoints[minx].x )
+			minx = v;
+		else if( mPoints[v].x > mPoints[maxx].x )
+			maxx = v;
+		else if( mPoints[v].y < mPoints[miny].y )
+			miny = v;
+	}
+	//If the three maximum and maximum vertexes found above aren't collinear, initialize the first tetrahedron by using them.
+	if( !collinear(mPoints[minx],mPoints[maxx],mPoints[miny]) )
+	{
+		ptIndex1 = minx;
+		ptIndex2 = maxx;
+		ptIndex3 = miny;
+	}
+	const Point& p0 = mPoints[ptIndex1];
+	Vector normal	= (mPoints[ptIndex2] - p0).cross(mPoints[ptIndex3] - p0);
+	float d			= -normal.dot(p0);
+
+	//Find the vertexes that have minimum and maximum distance from the plane.
+	float minDist = normal.dot(mPoints[0]) + d;
+	float maxDist = minDist;
+	int minPtIndex = 0, maxPtIndex = 0;
+	for( v=1 ; v<numVertex ; v++ )
+	{
+		float dist = normal.dot(mPoints[v]) + d;
+		if( dist<minDist )
+		{
+			minDist = dist;
+			minPtIndex = v;
+		}
+		if( dist>maxDist )
+		{
+			maxDist = dist;
+			maxPtIndex = v;
+		}
+	}
+	int extIndex = maxPtIndex;
+	if( coplanar(mPoints[ptIndex1],mPoints[ptIndex2],mPoints[ptIndex3],mPoints[extIndex]) )
+	{
+		//swap initP0 and  initP2. It's important for the direction of normal of the constructed plane.
+		Point tmp			= mPoints[ptIndex1];
+		mPoints[ptIndex1]	= mPoints[ptIndex3];
+		mPoints[ptIndex3]	= tmp;
+		extIndex = minPtIndex;
+	}
+	if( coplanar(mPoints[ptIndex1],mPoints[ptIndex2],mPoints[ptIndex3],mPoints[extIndex]) )
+	{// All of the vertexes are on the same plane.
+		return false;
+	}
+
+	//Initialize the first tetrahedron.
+	int f0 = allocateFacet(ptIndex1,ptIndex3,ptIndex2);
+	int f1 = allocateFacet(ptIndex1,ptIndex2,extIndex);
+	int f2 = allocateFacet(ptIndex1,extIndex,ptIndex3);
+	int f3 = allocateFacet(ptIndex2,ptIndex3,extIndex);
+
+	int neighbors[4][3] = { {f2,f3,f1}, {f0,f3,f2}, {f1,f3,f0}, {f0,f2,f1} };
+	int i, j;
+	for( i=0 ; i<4 ; i++ )
+	{
+		for( j=0 ; j<3 ; j++ )
+			mFacets[f0+i].mNeighbors[j] = neighbors[i][j];
+		mNewFacets.push_back(f0+i);
+	}
+
+	//The rest of the vertexes, in order.
+	int tail = NONE;
+	vertexHead = NONE;
+	for( v=0 ; v<numVertex ; v++ )
+	{
+		if( v==ptIndex1 || v==ptIndex2 || v==ptIndex3 || v==extIndex )
+			continue;
+		if( tail==NONE )
+			vertexHead = v;
+		else
+			mNext[tail] = v;
+		mNext[v] = NONE;
+		tail = v;
+	}
+	return true;
+}
+
+void SrAlgorithmQuickHull3DFlat::exportHull(int head, tHull* hull)
+{
+	//The same depth first order as SrAlgorithmQuickHull3D::recursiveExport(), with a stack
+	//of (facet, next neighbor) pairs instead of recursion.
+	std::vector<int> vertexOrder, facetOrder;
+	mVertexId.assign(mPoints.size(),NONE);
+	mStack.clear();
+	int facet = head, i, n;
+	while( true )
+	{
+		if( facet!=NONE )
+		{
+			cFacet& f = mFacets[facet];
+			f.mVisitFlag = VISIT_VISITED;
+			facetOrder.push_back(facet);
+			for( i=0 ; i<3 ; i++ )
+			{
+				if( mVertexId[f.mVertex[i]]==NONE )
+				{
+					mVertexId[f.mVertex[i]] = (int)vertexOrder.size();
+					vertexOrder.push_back(f.mVertex[i]);
+				}
+			}
+			mStack.push_back(facet);
+			mStack.push_back(0);
+			facet = NONE;
+		}
+		if( mStack.empty() )
+			break;
+		int& next = mStack.back();
+		if( next==3 )
+		{
+			mStack.resize(mStack.size()-2);
+			continue;
+		}
+		n = mFacets[mStack[mStack.size()-2]].mNeighbors[next++];
+		if( mFacets[n].mVisitFlag != VISIT_VISITED )
+			facet = n;
+	}
+
+	hull->numVertex = (int)vertexOrder.size();
+	hull->vertex	= new SrPoint3D[hull->numVertex];
+	for( i=0 ; i<hull->numVertex ; i++ )
+	{
+		hull->vertex[i].x = mPoints[vertexOrder[i]].x;
+		hull->vertex[i].y = mPoints[vertexOrder[i]].y;
+		hull->vertex[i].z = mPoints[vertexOrder[i]].z;
+	}
+
+	hull->numFacet = (int)facetOrder.size();
+	hull->facet = new tFacet[ hull->numFacet ];
+	for( i=0 ; i<hull->numFacet ; i++ )
+	{
+		cFacet& f = mFacets[facetOrder[i]];
+		hull->facet[i].vertexIndex[0] = mVertexId[f.mVertex[0]];
+		hull->facet[i].vertexIndex[1] = mVertexId[f.mVertex[1]];
+		hull->facet[i].vertexIndex[2] = mVertexId[f.mVertex[2]];
+	}
+}
+
+
+bool SrAlgorithmQuickHull3DFlat::quickHull(SrPoint3D* points, int numPoint, tHull* resultHull)
+{
+	// If the first and last point are equal the collinearity test some lines below will always be true.
+	int i , sizePoint;
+	for( i=numPoint-1 ; i>0 ; i-- )
+		if( points[i].x!=points[0].x ||
+			points[i].y!=points[0].y ||
+			points[i].z!=points[0].z )
+			break;
+
+	sizePoint = i+1;
+	if( sizePoint <= 3 )
+		return false;
+
+	mPoints.assign(points,points+sizePoint);
+	mNext.assign(sizePoint,NONE);
+	mFacets.clear();
+	mFreeFacets.clear();
+	mPending.clear();
+	mPendFront = 0;
+	mVisible.clear();
+	mNewFacets.clear();
+	mBoundary.clear();
+	mBoundaryTable.clear();
+	mBoundaryCount = 0;
+	mBoundaryFirst = NONE;
+
+	//Initialize the first tetrahedron.
+	int vertexHead;
+	if( !initTetrahedron(vertexHead) )
+		return false;
+
+	// For each facet, look at each unassigned point and decide if it belongs to the outside set of this facet.
+	determineOutsideSet(vertexHead);
+
+	// Add all the facets with non-empty outside sets to the set of facets for further consideration
+	int head = NONE;
+	updateFacetPendList(head);
+
+	// If there exist no vertexes outside the hull, the tetrahedron is the hull.Or else, go into the if-exp.
+	quickHullScan(head);
+
+	//Export the facets and vertexes to the tHull structure.
+	exportHull(head,resultHull);
+	return true;
+}
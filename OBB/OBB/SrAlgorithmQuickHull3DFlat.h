@@ -0,0 +1,110 @@
+/************************************************************************
+\brief	SrAlgorithmQuickHull3DFlat : the QuickHull of SrAlgorithmQuickHull3D with
+	points, facets and horizon edges kept in arrays and linked by index
+****************************************************************************/
+#ifndef	SR_ALGORITHM_QUICK_HULL_3D_FLAT_H_
+#define SR_ALGORITHM_QUICK_HULL_3D_FLAT_H_
+#include <assert.h>
+#include <vector>
+#include "SrSimpleTypes.h"
+#include "SrMath.h"
+#include "SrDataType.h"
+#include "SrAlgorithmQuickHull3D.h"
+/** \addtogroup algorithms
+  @{
+*/
+
+/*
+The same algorithm as SrAlgorithmQuickHull3D, step for step, but the facets, vertexes and
+horizon edges are kept in arrays and refer to each other by index. Facets are recycled
+through a free list, an outside set is a chain through the array of vertexes, the pending
+facets are a queue, and the horizon is an open addressing hash table keyed by the vertex an
+edge starts from. Nothing is allocated per facet or per vertex, and the arrays keep their
+storage from one call of quickHull() to the next.
+The new facets are made starting from the horizon edge with the lowest point index, where
+SrAlgorithmQuickHull3D starts from the lowest vertex address. It gives the same tHull as
+SrAlgorithmQuickHull3D does when the heap hands out its vertexes in the order of the points,
+and the same tHull on every run.
+*/
+class SrAlgorithmQuickHull3DFlat
+{
+private:
+
+	typedef SrPoint3D					Point;
+	typedef SrVector3					Vector;
+
+	enum
+	{
+		NONE = -1
+	};
+
+	enum
+	{
+		VISIT_NULL		= 0x00,
+		VISIT_VISITED	= 0x01,
+		VISIT_BORDER	= 0x02
+	};
+
+	struct cFacet
+	{
+		int				mVertex[3];				//Indexes of the points of this facet.
+		int				mNeighbors[3];			//Indexes of the neighbor facets.
+		Vector			mNormal;				//Plane of the facet, as cPlane of SrAlgorithmQuickHull3D.
+		float			mD;
+		int				mOutsideHead;			//First and last vertex of the outside set, NONE if it is empty.
+		int				mOutsideTail;
+		int				mPendSlot;				//Position in the pending queue, NONE if it is not there.
+		unsigned char	mVisitFlag;				//Indicate the flag in the process of determining the visible face set.
+	};
+
+	struct cEdge
+	{
+		int				point[2];				//The points of this edge.
+		int				neighbors[2];			//The visible facet and the border facet of this edge.
+		int				slot;					//Position in the boundary hash table.
+		bool			removed;
+	};
+
+public:
+	SrAlgorithmQuickHull3DFlat(){}
+	bool quickHull(SrPoint3D* points, int numPoint, tHull* resultHull);
+
+private:
+	bool collinear(const Point&p0, const Point& p1,const Point& p2);
+	bool coplanar(const Point&p0, const Point& p1,const Point& p2,const Point& p3);
+	bool isOnPositiveSide(const cFacet& f, const Point& p) const
+	{
+		return f.mNormal.dot(p) + f.mD > 0.0f;
+	}
+	int  allocateFacet(int v0, int v1, int v2);
+	void deallocate(std::vector<int>& ftList);
+	int  furthestVertex(cFacet& f);
+	void findVisibleFacet(int furPoint, int f);
+	void insertBoundary(const cEdge& edge);
+	int  findBoundary(int vertex) const;
+	void constructNewFacets(int point);
+	void determineOutsideSet(int vertexHead);
+	void updateFacetPendList(int& head);
+	int  gatherOutsideSet();
+	void quickHullScan(int& head);
+	bool initTetrahedron(int& vertexHead);
+	void exportHull(int head, tHull* hull);
+
+	std::vector<Point>		mPoints;			//Copy of the points, in the order given.
+	std::vector<int>		mNext;				//Next vertex of the outside set (or list) a vertex is in.
+	std::vector<cFacet>		mFacets;
+	std::vector<int>		mFreeFacets;		//Facets that can be reused.
+	std::vector<int>		mPending;			//Queue of facets with outside sets, NONE for removed ones.
+	size_t					mPendFront;
+	std::vector<int>		mVisible;			//The visible facet set of the furthest vertex.
+	std::vector<int>		mNewFacets;			//The facets made from the horizon.
+	std::vector<cEdge>		mBoundary;			//Edges of the horizon.
+	std::vector<int>		mBoundaryTable;		//Hash table of the horizon edges by their first point.
+	int						mBoundaryCount;		//Edges in the table.
+	int						mBoundaryFirst;		//The edge with the lowest first point.
+	std::vector<int>		mVertexId;			//Index of each vertex in the exported hull, NONE if it is not there.
+	std::vector<int>		mStack;
+};
+
+/** @} */
+#endif
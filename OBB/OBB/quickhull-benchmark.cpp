@@ -0,0 +1,169 @@
+/************************************************************************
+\brief	Benchmark of SrAlgorithmQuickHull3D against SrAlgorithmQuickHull3DFlat
+****************************************************************************/
+/*
+Times SrAlgorithmQuickHull3D against SrAlgorithmQuickHull3DFlat on points in a cube and
+in a ball. The differ column counts the facets that are in one hull and not in the other
+over all runs, see compareHull().
+It has a main() of its own, so it is not in OBB.vcxproj; build it on its own with the
+three .cpp files, e.g.
+
+	cl /O2 /EHsc quickhull-benchmark.cpp SrAlgorithmQuickHull3D.cpp SrAlgorithmQuickHull3DFlat.cpp
+
+	quickhull-benchmark [max number of points] [runs]
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <algorithm>
+#include <iterator>
+#include <vector>
+#include "SrAlgorithmQuickHull3D.h"
+#include "SrAlgorithmQuickHull3DFlat.h"
+
+static float randomUnit()
+{
+	return 2.0f*((float)rand()/(float)RAND_MAX) - 1.0f;
+}
+
+static void generatePoints(SrPoint3D* points, int numPoint, bool ball)
+{
+	int i;
+	for( i=0 ; i<numPoint ; i++ )
+	{
+		do
+		{
+			points[i].x = randomUnit();
+			points[i].y = randomUnit();
+			points[i].z = randomUnit();
+		} while( ball && points[i].x*points[i].x+points[i].y*points[i].y+points[i].z*points[i].z>1.0f );
+	}
+}
+
+static void freeHull(tHull& hull)
+{
+	delete []hull.vertex;
+	delete []hull.facet;
+}
+
+static bool lessPoint(const SrPoint3D& a, const SrPoint3D& b)
+{
+	if( a.x!=b.x )
+		return a.x<b.x;
+	if( a.y!=b.y )
+		return a.y<b.y;
+	return a.z<b.z;
+}
+
+struct cTriangle
+{
+	SrPoint3D	p[3];
+
+	bool operator<(const cTriangle& t) const
+	{
+		int i;
+		for( i=0 ; i<3 ; i++ )
+		{
+			if( lessPoint(p[i],t.p[i]) )
+				return true;
+			if( lessPoint(t.p[i],p[i]) )
+				return false;
+		}
+		return false;
+	}
+};
+
+//The facets of a hull as triangles of points, each started from its lowest point and sorted.
+static std::vector<cTriangle> triangles(const tHull& hull)
+{
+	std::vector<cTriangle> result(hull.numFacet);
+	int i, j, first;
+	for( i=0 ; i<hull.numFacet ; i++ )
+	{
+		const int* index = hull.facet[i].vertexIndex;
+		first = 0;
+		for( j=1 ; j<3 ; j++ )
+			if( lessPoint(hull.vertex[index[j]],hull.vertex[index[first]]) )
+				first = j;
+		for( j=0 ; j<3 ; j++ )
+			result[i].p[j] = hull.vertex[index[(first+j)%3]];
+	}
+	std::sort(result.begin(),result.end());
+	return result;
+}
+
+/*
+SrAlgorithmQuickHull3D walks the horizon from the edge whose vertex has the lowest address,
+so its output follows the heap and can change from one run to the next on the same points:
+the order of the facets, the diagonal a nearly flat quad is split by, and whether a point
+nearly on the plane of a facet is a vertex or not. The facets that are not in both hulls are
+counted instead of asking for the same tHull.
+*/
+static int compareHull(const tHull& a, const tHull& b)
+{
+	std::vector<cTriangle> ta = triangles(a), tb = triangles(b), common;
+	std::set_intersection(ta.begin(),ta.end(),tb.begin(),tb.end(),std::back_inserter(common));
+	return a.numFacet + b.numFacet - 2*(int)common.size();
+}
+
+int main(int argc, char** argv)
+{
+	int maxPoint = argc>1 ? atoi(argv[1]) : 1000000;
+	int runs = argc>2 ? atoi(argv[2]) : 3;
+	if( maxPoint<4 || runs<1 )
+	{
+		printf("usage: %s [max number of points] [runs]\n",argv[0]);
+		return 1;
+	}
+
+	SrPoint3D* points = new SrPoint3D[maxPoint];
+	SrAlgorithmQuickHull3D quickHull;
+	SrAlgorithmQuickHull3DFlat quickHullFlat;
+	bool failed = false;
+
+	printf("%-5s %9s %8s %8s %12s %12s %8s %6s\n","input","points","vertex","facet","list (s)","flat (s)","speedup","differ");
+	int shape, numPoint, run;
+	for( shape=0 ; shape<2 ; shape++ )
+	{
+		for( numPoint=1000 ; numPoint<=maxPoint ; numPoint*=10 )
+		{
+			double listTime = 0.0, flatTime = 0.0;
+			int numVertex = 0, numFacet = 0, numDiffer = 0;
+			for( run=0 ; run<runs ; run++ )
+			{
+				tHull hull, hullFlat;
+				srand(run+1);
+				generatePoints(points,numPoint,shape==1);
+
+				clock_t start = clock();
+				bool ok = quickHull.quickHull(points,numPoint,&hull);
+				listTime += (double)(clock()-start)/CLOCKS_PER_SEC;
+
+				start = clock();
+				bool okFlat = quickHullFlat.quickHull(points,numPoint,&hullFlat);
+				flatTime += (double)(clock()-start)/CLOCKS_PER_SEC;
+
+				if( ok!=okFlat )
+				{
+					printf("%s, %d points, run %d: only one hull is found\n",shape?"ball":"cube",numPoint,run);
+					failed = true;
+				}
+				else if( ok )
+					numDiffer += compareHull(hull,hullFlat);
+				if( ok )
+				{
+					numVertex = hull.numVertex;
+					numFacet = hull.numFacet;
+					freeHull(hull);
+				}
+				if( okFlat )
+					freeHull(hullFlat);
+			}
+			printf("%-5s %9d %8d %8d %12.4f %12.4f %7.2fx %6d\n",shape?"ball":"cube",numPoint,
+				numVertex,numFacet,listTime/runs,flatTime/runs,
+				flatTime>0.0 ? listTime/flatTime : 0.0,numDiffer);
+		}
+	}
+	delete []points;
+	return failed ? 1 : 0;
+}